@@ -5,6 +5,119 @@
 
 #include <stdexcept>
 #include <iterator>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+// Vectorized kernels for contiguous input are compiled in for GCC and Clang on x86 (SSE4.2,
+// AVX2 and AVX-512BW), and the best one the CPU supports is selected at run time; on AArch64,
+// where NEON is always present, validation and the ASCII scan use it. Setting UTF8_CPP_SIMD
+// in the environment to "scalar", "sse4.2", "avx2", "avx512" or "neon" caps the choice; any
+// other value is ignored. Define UTF8_CPP_NO_SIMD to use the portable code only.
+#if !defined(UTF8_CPP_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+    #if defined(__x86_64__) || defined(__i386__)
+        #define UTF8_CPP_X86
+        #define UTF8_CPP_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+        #define UTF8_CPP_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+        #define UTF8_CPP_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,popcnt")))
+        #include <immintrin.h>
+    #elif defined(__aarch64__) && defined(__ARM_NEON)
+        #define UTF8_CPP_NEON
+        #include <arm_neon.h>
+    #endif
+#endif
+
+// decoding_iterator checks that the iterators it compares were made for the same range
+// only in debug builds. Define UTF8_CPP_CHECK_ITERATOR_RANGES as 0 or 1 to override.
+#ifndef UTF8_CPP_CHECK_ITERATOR_RANGES
+    #ifdef NDEBUG
+        #define UTF8_CPP_CHECK_ITERATOR_RANGES 0
+    #else
+        #define UTF8_CPP_CHECK_ITERATOR_RANGES 1
+    #endif
+#endif
+
+#ifndef UTF8_CPP_CPLUSPLUS
+    #if defined(_MSVC_LANG) && _MSVC_LANG > __cplusplus
+        #define UTF8_CPP_CPLUSPLUS _MSVC_LANG
+    #else
+        #define UTF8_CPP_CPLUSPLUS __cplusplus
+    #endif
+#endif
+
+// append, next, is_valid, distance, their try_ versions and the unchecked conversions are
+// constexpr from C++14 on. In constant evaluation the contiguous fast paths give way to the
+// generic code, which takes std::is_constant_evaluated or the compiler builtin for it (GCC 9,
+// Clang 9, MSVC 19.25); without them only the generic iterators can be used in constant
+// expressions.
+#if UTF8_CPP_CPLUSPLUS >= 201402L
+    #define UTF8_CPP_CONSTEXPR constexpr
+#else
+    #define UTF8_CPP_CONSTEXPR
+#endif
+
+// The definitions of the tables these functions read
+#if UTF8_CPP_CPLUSPLUS >= 201103L
+    #define UTF8_CPP_CONSTEXPR_TABLE constexpr
+#else
+    #define UTF8_CPP_CONSTEXPR_TABLE const
+#endif
+
+#if UTF8_CPP_CPLUSPLUS >= 201402L
+    #if defined(__has_builtin)
+        #if __has_builtin(__builtin_is_constant_evaluated)
+            #define UTF8_CPP_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+        #endif
+    #endif
+    #if !defined(UTF8_CPP_CONSTANT_EVALUATED) && ((defined(__GNUC__) && __GNUC__ >= 9) || (defined(_MSC_VER) && _MSC_VER >= 1925))
+        #define UTF8_CPP_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+    #endif
+#endif
+#if !defined(UTF8_CPP_CONSTANT_EVALUATED)
+    #define UTF8_CPP_CONSTANT_EVALUATED() false
+#endif
+
+// Define UTF8_CPP_STATS to have the checked algorithms count, per thread, the octets and
+// code points they get through, how many of them the ASCII/SIMD fast paths handle, and
+// the errors validate_next reports (see thread_stats). Without it the counting compiles
+// to nothing.
+#if defined(UTF8_CPP_STATS)
+    #if UTF8_CPP_CPLUSPLUS >= 201103L
+        #define UTF8_CPP_THREAD_LOCAL thread_local
+    #elif defined(_MSC_VER)
+        #define UTF8_CPP_THREAD_LOCAL __declspec(thread)
+    #else
+        #define UTF8_CPP_THREAD_LOCAL __thread
+    #endif
+    #define UTF8_CPP_STAT(expression) (UTF8_CPP_CONSTANT_EVALUATED() ? (void)0 : (void)(expression))
+#else
+    #define UTF8_CPP_STAT(expression) ((void)0)
+#endif
+
+// std::pmr::string for pmr_string_sink
+#if UTF8_CPP_CPLUSPLUS >= 201703L && defined(__has_include)
+    #if __has_include(<memory_resource>)
+        #include <memory_resource>
+        #include <string>
+    #endif
+#endif
+
+// Iterators of std::string, std::vector and the like take the same paths as raw pointers:
+// in C++20 any std::contiguous_iterator does, before that the libstdc++ and libc++ ones.
+#if UTF8_CPP_CPLUSPLUS >= 202002L
+    #include <version>
+    #if defined(__cpp_lib_concepts) && defined(__cpp_lib_to_address)
+        #define UTF8_CPP_CONTIGUOUS_ITERATOR_CONCEPT
+        #include <memory>
+        #include <type_traits>
+    #endif
+    #if defined(__cpp_lib_ranges)
+        #define UTF8_CPP_RANGES
+        #include <ranges>
+    #endif
+#endif
 
 namespace utf8
 {
@@ -32,214 +145,200 @@ namespace internal
     const uint32_t CODE_POINT_MAX      = 0x0010ffffu;
 
     template<typename octet_type>
-    inline uint8_t mask8(octet_type oc)
+    UTF8_CPP_CONSTEXPR inline uint8_t mask8(octet_type oc)
     {
         return static_cast<uint8_t>(0xff & oc);
     }
     template<typename u16_type>
-    inline uint16_t mask16(u16_type oc)
+    UTF8_CPP_CONSTEXPR inline uint16_t mask16(u16_type oc)
     {
         return static_cast<uint16_t>(0xffff & oc);
     }
     template<typename octet_type>
-    inline bool is_trail(octet_type oc)
+    UTF8_CPP_CONSTEXPR inline bool is_trail(octet_type oc)
     {
         return ((utf8::internal::mask8(oc) >> 6) == 0x2);
     }
 
     template <typename u16>
-    inline bool is_lead_surrogate(u16 cp)
+    UTF8_CPP_CONSTEXPR inline bool is_lead_surrogate(u16 cp)
     {
         return (cp >= LEAD_SURROGATE_MIN && cp <= LEAD_SURROGATE_MAX);
     }
 
     template <typename u16>
-    inline bool is_trail_surrogate(u16 cp)
+    UTF8_CPP_CONSTEXPR inline bool is_trail_surrogate(u16 cp)
     {
         return (cp >= TRAIL_SURROGATE_MIN && cp <= TRAIL_SURROGATE_MAX);
     }
 
     template <typename u16>
-    inline bool is_surrogate(u16 cp)
+    UTF8_CPP_CONSTEXPR inline bool is_surrogate(u16 cp)
     {
         return (cp >= LEAD_SURROGATE_MIN && cp <= TRAIL_SURROGATE_MAX);
     }
 
     template <typename u32>
-    inline bool is_code_point_valid(u32 cp)
+    UTF8_CPP_CONSTEXPR inline bool is_code_point_valid(u32 cp)
     {
         return (cp <= CODE_POINT_MAX && !utf8::internal::is_surrogate(cp));
     }
 
-    template <typename octet_iterator>
-    inline typename std::iterator_traits<octet_iterator>::difference_type
-    sequence_length(octet_iterator lead_it)
+    enum utf_error {UTF8_OK, NOT_ENOUGH_ROOM, INVALID_LEAD, INCOMPLETE_SEQUENCE, OVERLONG_SEQUENCE, INVALID_CODE_POINT};
+
+    /// Counters kept for the calling thread when UTF8_CPP_STATS is defined. octets and
+    /// code_points are the valid input of find_invalid, replace_invalid, utf8to16 and
+    /// utf8to32, and the output of utf16to8 and utf32to8; fast_path_octets is the part of
+    /// octets handled by the ASCII and vectorized kernels rather than one sequence at a time.
+    /// errors counts the failures of validate_next by utf_error (find_invalid does not
+    /// classify errors), so an invalid sequence that an algorithm decodes twice (say to
+    /// convert it and then to throw) counts twice.
+    struct stats {
+        std::size_t octets;
+        std::size_t code_points;
+        std::size_t fast_path_octets;
+        std::size_t errors[INVALID_CODE_POINT + 1];
+    };
+
+#if defined(UTF8_CPP_STATS)
+    inline stats& thread_stats_record()
     {
-        uint8_t lead = utf8::internal::mask8(*lead_it);
-        if (lead < 0x80)
-            return 1;
-        else if ((lead >> 5) == 0x6)
-            return 2;
-        else if ((lead >> 4) == 0xe)
-            return 3;
-        else if ((lead >> 3) == 0x1e)
-            return 4;
-        else
-            return 0;
+        static UTF8_CPP_THREAD_LOCAL stats record;
+        return record;
     }
 
-    template <typename octet_difference_type>
-    inline bool is_overlong_sequence(uint32_t cp, octet_difference_type length)
+    inline void count_error(utf_error err_code)
     {
-        if (cp < 0x80) {
-            if (length != 1) 
-                return true;
-        }
-        else if (cp < 0x800) {
-            if (length != 2) 
-                return true;
-        }
-        else if (cp < 0x10000) {
-            if (length != 3) 
-                return true;
-        }
-
-        return false;
+        ++thread_stats_record().errors[err_code];
     }
 
-    enum utf_error {UTF8_OK, NOT_ENOUGH_ROOM, INVALID_LEAD, INCOMPLETE_SEQUENCE, OVERLONG_SEQUENCE, INVALID_CODE_POINT};
-
-    /// Helper for get_sequence_x
-    template <typename octet_iterator>
-    utf_error increase_safely(octet_iterator& it, octet_iterator end)
+    /// A code point decoded or encoded on its own
+    inline void count_code_point(uint32_t cp)
     {
-        if (++it == end)
-            return NOT_ENOUGH_ROOM;
-
-        if (!utf8::internal::is_trail(*it))
-            return INCOMPLETE_SEQUENCE;
-        
-        return UTF8_OK;
+        stats& record = thread_stats_record();
+        record.octets += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+        ++record.code_points;
     }
 
-    #define UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(IT, END) {utf_error ret = increase_safely(IT, END); if (ret != UTF8_OK) return ret;}    
-
-    /// get_sequence_x functions decode utf-8 sequences of the length x
-    template <typename octet_iterator>
-    utf_error get_sequence_1(octet_iterator& it, octet_iterator end, uint32_t& code_point)
+    inline void count_fast_path(std::size_t octets, std::size_t code_points)
     {
-        if (it == end)
-            return NOT_ENOUGH_ROOM;
+        stats& record = thread_stats_record();
+        record.octets += octets;
+        record.fast_path_octets += octets;
+        record.code_points += code_points;
+    }
+#endif
 
-        code_point = utf8::internal::mask8(*it);
+    // The decoder is driven by a 256-entry table of lead octets. Each entry holds the
+    // sequence length (0 for octets that cannot start a sequence) in the low 3 bits and
+    // a class in the next 3 bits. The class gives the range the second octet must be in,
+    // which is all it takes to rule out overlong forms, surrogates and values above
+    // CODE_POINT_MAX, and the error to report when it is not.
+    template <typename T>
+    struct decoder_tables {
+        static const uint8_t lead[256];
+        static const uint8_t lead_mask[5];
+        static const uint8_t second_min[8];
+        static const uint8_t second_max[8];
+        static const utf_error second_error[8];
+    };
 
-        return UTF8_OK;
-    }
+    template <typename T>
+    UTF8_CPP_CONSTEXPR_TABLE uint8_t decoder_tables<T>::lead[256] = {
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x0a, 0x0a, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+        0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+        0x13, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x1b, 0x03, 0x03,
+        0x24, 0x04, 0x04, 0x04, 0x2c, 0x34, 0x34, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
 
-    template <typename octet_iterator>
-    utf_error get_sequence_2(octet_iterator& it, octet_iterator end, uint32_t& code_point)
-    {
-        if (it == end) 
-            return NOT_ENOUGH_ROOM;
-        
-        code_point = utf8::internal::mask8(*it);
+    // Payload bits of the lead octet by sequence length; invalid leads decode as themselves
+    template <typename T>
+    UTF8_CPP_CONSTEXPR_TABLE uint8_t decoder_tables<T>::lead_mask[5] = {0xff, 0x7f, 0x1f, 0x0f, 0x07};
 
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
+    // Classes: any other lead, C0-C1, E0, ED, F0, F4, F5-F7
+    template <typename T>
+    UTF8_CPP_CONSTEXPR_TABLE uint8_t decoder_tables<T>::second_min[8] = {0x80, 0xff, 0xa0, 0x80, 0x90, 0x80, 0xff, 0xff};
 
-        code_point = ((code_point << 6) & 0x7ff) + ((*it) & 0x3f);
+    template <typename T>
+    UTF8_CPP_CONSTEXPR_TABLE uint8_t decoder_tables<T>::second_max[8] = {0xbf, 0x00, 0xbf, 0x9f, 0xbf, 0x8f, 0x00, 0x00};
 
-        return UTF8_OK;
-    }
+    template <typename T>
+    UTF8_CPP_CONSTEXPR_TABLE utf_error decoder_tables<T>::second_error[8] = {
+        UTF8_OK, OVERLONG_SEQUENCE, OVERLONG_SEQUENCE, INVALID_CODE_POINT,
+        OVERLONG_SEQUENCE, INVALID_CODE_POINT, INVALID_CODE_POINT, INVALID_CODE_POINT
+    };
 
     template <typename octet_iterator>
-    utf_error get_sequence_3(octet_iterator& it, octet_iterator end, uint32_t& code_point)
+    UTF8_CPP_CONSTEXPR inline typename std::iterator_traits<octet_iterator>::difference_type
+    sequence_length(octet_iterator lead_it)
     {
-        if (it == end)
-            return NOT_ENOUGH_ROOM;
-            
-        code_point = utf8::internal::mask8(*it);
-
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
-
-        code_point = ((code_point << 12) & 0xffff) + ((utf8::internal::mask8(*it) << 6) & 0xfff);
-
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
-
-        code_point += (*it) & 0x3f;
-
-        return UTF8_OK;
+        return decoder_tables<void>::lead[utf8::internal::mask8(*lead_it)] & 0x7;
     }
 
+    /// validate_next without the error counters, for the kernels
     template <typename octet_iterator>
-    utf_error get_sequence_4(octet_iterator& it, octet_iterator end, uint32_t& code_point)
+    UTF8_CPP_CONSTEXPR utf_error decode_next(octet_iterator& it, octet_iterator end, uint32_t& code_point)
     {
         if (it == end)
-           return NOT_ENOUGH_ROOM;
-
-        code_point = utf8::internal::mask8(*it);
-
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
-
-        code_point = ((code_point << 18) & 0x1fffff) + ((utf8::internal::mask8(*it) << 12) & 0x3ffff);
-
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
-
-        code_point += (utf8::internal::mask8(*it) << 6) & 0xfff;
-
-        UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR(it, end)
-
-        code_point += (*it) & 0x3f;
+            return NOT_ENOUGH_ROOM;
 
-        return UTF8_OK;
-    }
+        const uint8_t lead = utf8::internal::mask8(*it);
+        if (lead < 0x80) {
+            code_point = lead;
+            ++it;
+            return UTF8_OK;
+        }
 
-    #undef UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR
+        const uint8_t info = decoder_tables<void>::lead[lead];
+        const int length = info & 0x7;
+        if (length == 0)
+            return INVALID_LEAD;
 
-    template <typename octet_iterator>
-    utf_error validate_next(octet_iterator& it, octet_iterator end, uint32_t& code_point)
-    {
         // Save the original value of it so we can go back in case of failure
         // Of course, it does not make much sense with i.e. stream iterators
         octet_iterator original_it = it;
 
-        uint32_t cp = 0;
-        // Determine the sequence length based on the lead octet
-        typedef typename std::iterator_traits<octet_iterator>::difference_type octet_difference_type;
-        const octet_difference_type length = utf8::internal::sequence_length(it);
-
-        // Get trail octets and calculate the code point
+        // All trail octets are checked before the value, so a sequence that is cut short
+        // is reported as such even if its second octet is already out of range
+        uint32_t cp = lead & decoder_tables<void>::lead_mask[length];
+        uint8_t second = 0;
         utf_error err = UTF8_OK;
-        switch (length) {
-            case 0: 
-                return INVALID_LEAD;
-            case 1:
-                err = utf8::internal::get_sequence_1(it, end, cp);
+        for (int i = 1; i < length; ++i) {
+            if (++it == end) {
+                err = NOT_ENOUGH_ROOM;
                 break;
-            case 2:
-                err = utf8::internal::get_sequence_2(it, end, cp);
-            break;
-            case 3:
-                err = utf8::internal::get_sequence_3(it, end, cp);
-            break;
-            case 4:
-                err = utf8::internal::get_sequence_4(it, end, cp);
-            break;
+            }
+            const uint8_t trail = utf8::internal::mask8(*it);
+            if (!utf8::internal::is_trail(trail)) {
+                err = INCOMPLETE_SEQUENCE;
+                break;
+            }
+            if (i == 1)
+                second = trail;
+            cp = (cp << 6) | (trail & 0x3f);
         }
 
         if (err == UTF8_OK) {
-            // Decoding succeeded. Now, security checks...
-            if (utf8::internal::is_code_point_valid(cp)) {
-                if (!utf8::internal::is_overlong_sequence(cp, length)){
-                    // Passed! Return here.
-                    code_point = cp;
-                    ++it;
-                    return UTF8_OK;
-                }
-                else
-                    err = OVERLONG_SEQUENCE;
+            const int lead_class = info >> 3;
+            if (second >= decoder_tables<void>::second_min[lead_class] &&
+                second <= decoder_tables<void>::second_max[lead_class]) {
+                code_point = cp;
+                ++it;
+                return UTF8_OK;
             }
-            else 
-                err = INVALID_CODE_POINT;
+            err = decoder_tables<void>::second_error[lead_class];
         }
 
         // Failure branch - restore the original value of the iterator
@@ -248,298 +347,4326 @@ namespace internal
     }
 
     template <typename octet_iterator>
-    inline utf_error validate_next(octet_iterator& it, octet_iterator end) {
-        uint32_t ignored;
+    UTF8_CPP_CONSTEXPR inline utf_error validate_next(octet_iterator& it, octet_iterator end, uint32_t& code_point)
+    {
+        const utf_error err_code = utf8::internal::decode_next(it, end, code_point);
+        if (err_code != UTF8_OK)
+            UTF8_CPP_STAT(utf8::internal::count_error(err_code));
+        return err_code;
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline utf_error validate_next(octet_iterator& it, octet_iterator end) {
+        uint32_t ignored = 0;
         return utf8::internal::validate_next(it, end, ignored);
     }
 
-} // namespace internal
+    // Octet iterator categories. The algorithms below can work directly on raw memory
+    // when the octets are stored contiguously; everything else takes the generic path.
+    struct generic_octets_tag {};
+    struct contiguous_octets_tag {};
 
-    /// The library API - functions intended to be called by the users
+    template <typename octet_iterator>
+    struct contiguous_octets {
+        typedef generic_octets_tag category;
+    };
 
-    // Byte order mark
-    const uint8_t bom[] = {0xef, 0xbb, 0xbf};
+    #define UTF8_CPP_CONTIGUOUS_POINTER(POINTER_TYPE) \
+    template <> \
+    struct contiguous_octets<POINTER_TYPE> { \
+        typedef contiguous_octets_tag category; \
+        static const uint8_t* pointer(POINTER_TYPE it) { return reinterpret_cast<const uint8_t*>(it); } \
+    };
 
-    template <typename octet_iterator>
-    octet_iterator find_invalid(octet_iterator start, octet_iterator end)
-    {
-        octet_iterator result = start;
-        while (result != end) {
-            utf8::internal::utf_error err_code = utf8::internal::validate_next(result, end);
-            if (err_code != internal::UTF8_OK)
-                return result;
-        }
-        return result;
-    }
+    UTF8_CPP_CONTIGUOUS_POINTER(char*)
+    UTF8_CPP_CONTIGUOUS_POINTER(const char*)
+    UTF8_CPP_CONTIGUOUS_POINTER(signed char*)
+    UTF8_CPP_CONTIGUOUS_POINTER(const signed char*)
+    UTF8_CPP_CONTIGUOUS_POINTER(unsigned char*)
+    UTF8_CPP_CONTIGUOUS_POINTER(const unsigned char*)
+#if defined(__cpp_char8_t)
+    UTF8_CPP_CONTIGUOUS_POINTER(char8_t*)
+    UTF8_CPP_CONTIGUOUS_POINTER(const char8_t*)
+#endif
 
-    template <typename octet_iterator>
-    inline bool is_valid(octet_iterator start, octet_iterator end)
+    #undef UTF8_CPP_CONTIGUOUS_POINTER
+
+    // Same for iterators of 16 and 32 bit code units
+    struct generic_units_tag {};
+    struct contiguous_units_tag {};
+
+    template <typename unit_iterator>
+    struct contiguous_u16 {
+        typedef generic_units_tag category;
+    };
+
+    template <typename unit_iterator>
+    struct contiguous_u32 {
+        typedef generic_units_tag category;
+    };
+
+    #define UTF8_CPP_CONTIGUOUS_UNITS(TRAIT, POINTER_TYPE, UNIT_TYPE) \
+    template <> \
+    struct TRAIT<POINTER_TYPE> { \
+        typedef contiguous_units_tag category; \
+        typedef UNIT_TYPE* unit_pointer; \
+        static UNIT_TYPE* pointer(POINTER_TYPE it) { return reinterpret_cast<UNIT_TYPE*>(it); } \
+    };
+
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u16, uint16_t*, uint16_t)
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u32, uint32_t*, uint32_t)
+    // Input of 16 and 32 bit code units
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u16, const uint16_t*, const uint16_t)
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u32, const uint32_t*, const uint32_t)
+#if UTF8_CPP_CPLUSPLUS >= 201103L
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u16, char16_t*, uint16_t)
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u32, char32_t*, uint32_t)
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u16, const char16_t*, const uint16_t)
+    UTF8_CPP_CONTIGUOUS_UNITS(contiguous_u32, const char32_t*, const uint32_t)
+#endif
+
+    #undef UTF8_CPP_CONTIGUOUS_UNITS
+
+    // Contiguous iterators that are not pointers get the traits of the pointer they wrap
+#if defined(UTF8_CPP_CONTIGUOUS_ITERATOR_CONCEPT)
+    template <typename wrapped_iterator>
+    inline auto unwrap_iterator(wrapped_iterator it) -> decltype(std::to_address(it))
     {
-        return (utf8::find_invalid(start, end) == end);
+        return std::to_address(it);
     }
-
-    template <typename octet_iterator>
-    inline bool starts_with_bom (octet_iterator it, octet_iterator end)
+#elif defined(__GLIBCXX__)
+    template <typename pointer_type, typename container>
+    inline pointer_type unwrap_iterator(__gnu_cxx::__normal_iterator<pointer_type, container> it)
     {
-        return (
-            ((it != end) && (utf8::internal::mask8(*it++)) == bom[0]) &&
-            ((it != end) && (utf8::internal::mask8(*it++)) == bom[1]) &&
-            ((it != end) && (utf8::internal::mask8(*it))   == bom[2])
-           );
+        return it.base();
     }
-    
-    //Deprecated in release 2.3 
-    template <typename octet_iterator>
-    inline bool is_bom (octet_iterator it)
+#elif defined(_LIBCPP_VERSION)
+    template <typename pointer_type>
+    inline pointer_type unwrap_iterator(std::__wrap_iter<pointer_type> it)
     {
-        return (
-            (utf8::internal::mask8(*it++)) == bom[0] &&
-            (utf8::internal::mask8(*it++)) == bom[1] &&
-            (utf8::internal::mask8(*it))   == bom[2]
-           );
+        return it.base();
     }
+#endif
 
-    //=============================================================================================
-    // checked
-    //=============================================================================================
-
-    // Base for the exceptions that may be thrown from the library
-    class exception : public ::std::exception {
+    template <typename pointer_trait, typename wrapped_iterator, typename result_pointer,
+              typename category_type = typename pointer_trait::category>
+    struct wrapped_pointer {
+        typedef category_type category;
     };
 
-    // Exceptions that may be thrown from the library functions.
-    class invalid_code_point : public exception {
-        uint32_t cp;
-    public:
-        invalid_code_point(uint32_t cp) : cp(cp) {}
-        virtual const char* what() const throw() { return "Invalid code point"; }
-        uint32_t code_point() const {return cp;}
+    template <typename pointer_trait, typename wrapped_iterator, typename result_pointer>
+    struct wrapped_pointer<pointer_trait, wrapped_iterator, result_pointer, contiguous_octets_tag> {
+        typedef contiguous_octets_tag category;
+        static result_pointer pointer(wrapped_iterator it) { return pointer_trait::pointer(utf8::internal::unwrap_iterator(it)); }
     };
 
-    class invalid_utf8 : public exception {
-        uint8_t u8;
-    public:
-        invalid_utf8 (uint8_t u) : u8(u) {}
-        virtual const char* what() const throw() { return "Invalid UTF-8"; }
-        uint8_t utf8_octet() const {return u8;}
+    template <typename pointer_trait, typename wrapped_iterator, typename result_pointer>
+    struct wrapped_pointer<pointer_trait, wrapped_iterator, result_pointer, contiguous_units_tag> {
+        typedef contiguous_units_tag category;
+        typedef typename pointer_trait::unit_pointer unit_pointer;
+        static unit_pointer pointer(wrapped_iterator it) { return pointer_trait::pointer(utf8::internal::unwrap_iterator(it)); }
     };
 
-    class invalid_utf16 : public exception {
-        uint16_t u16;
-    public:
-        invalid_utf16 (uint16_t u) : u16(u) {}
-        virtual const char* what() const throw() { return "Invalid UTF-16"; }
-        uint16_t utf16_word() const {return u16;}
-    };
+#if defined(UTF8_CPP_CONTIGUOUS_ITERATOR_CONCEPT)
+    template <typename wrapped_iterator>
+    using wrapped_pointer_type = std::add_pointer_t<std::remove_reference_t<std::iter_reference_t<wrapped_iterator> > >;
 
-    class not_enough_room : public exception {
-    public:
-        virtual const char* what() const throw() { return "Not enough space"; }
+    template <typename wrapped_iterator>
+        requires (std::contiguous_iterator<wrapped_iterator> && !std::is_pointer_v<wrapped_iterator>)
+    struct contiguous_octets<wrapped_iterator> :
+        wrapped_pointer<contiguous_octets<wrapped_pointer_type<wrapped_iterator> >, wrapped_iterator, const uint8_t*> {};
+
+    template <typename wrapped_iterator>
+        requires (std::contiguous_iterator<wrapped_iterator> && !std::is_pointer_v<wrapped_iterator>)
+    struct contiguous_u16<wrapped_iterator> :
+        wrapped_pointer<contiguous_u16<wrapped_pointer_type<wrapped_iterator> >, wrapped_iterator, uint16_t*> {};
+
+    template <typename wrapped_iterator>
+        requires (std::contiguous_iterator<wrapped_iterator> && !std::is_pointer_v<wrapped_iterator>)
+    struct contiguous_u32<wrapped_iterator> :
+        wrapped_pointer<contiguous_u32<wrapped_pointer_type<wrapped_iterator> >, wrapped_iterator, uint32_t*> {};
+#elif defined(__GLIBCXX__)
+    template <typename pointer_type, typename container>
+    struct contiguous_octets<__gnu_cxx::__normal_iterator<pointer_type, container> > :
+        wrapped_pointer<contiguous_octets<pointer_type>, __gnu_cxx::__normal_iterator<pointer_type, container>, const uint8_t*> {};
+
+    template <typename pointer_type, typename container>
+    struct contiguous_u16<__gnu_cxx::__normal_iterator<pointer_type, container> > :
+        wrapped_pointer<contiguous_u16<pointer_type>, __gnu_cxx::__normal_iterator<pointer_type, container>, uint16_t*> {};
+
+    template <typename pointer_type, typename container>
+    struct contiguous_u32<__gnu_cxx::__normal_iterator<pointer_type, container> > :
+        wrapped_pointer<contiguous_u32<pointer_type>, __gnu_cxx::__normal_iterator<pointer_type, container>, uint32_t*> {};
+#elif defined(_LIBCPP_VERSION)
+    template <typename pointer_type>
+    struct contiguous_octets<std::__wrap_iter<pointer_type> > :
+        wrapped_pointer<contiguous_octets<pointer_type>, std::__wrap_iter<pointer_type>, const uint8_t*> {};
+
+    template <typename pointer_type>
+    struct contiguous_u16<std::__wrap_iter<pointer_type> > :
+        wrapped_pointer<contiguous_u16<pointer_type>, std::__wrap_iter<pointer_type>, uint16_t*> {};
+
+    template <typename pointer_type>
+    struct contiguous_u32<std::__wrap_iter<pointer_type> > :
+        wrapped_pointer<contiguous_u32<pointer_type>, std::__wrap_iter<pointer_type>, uint32_t*> {};
+#endif
+
+} // namespace internal
+
+    /// Output iterator that writes into the fixed buffer [first, last). Writes that do not
+    /// fit are dropped and make status() NOT_ENOUGH_ROOM, so an algorithm can run to the end
+    /// without throwing or touching memory past last. The code point that does not fit is
+    /// dropped whole, so the contents always end with a complete one: units of one octet
+    /// are taken to be UTF-8, of two UTF-16 and of four UTF-32. Copies share nothing: use
+    /// the one the algorithm returns.
+    template <typename unit_type>
+    class span_sink {
+        unit_type* first;
+        unit_type* next;
+        unit_type* last;
+        bool overflow;
+
+        static bool continues_code_point(unit_type unit)
+        {
+            if (sizeof(unit_type) == 1)
+                return utf8::internal::is_trail(unit);
+            return sizeof(unit_type) == 2 && utf8::internal::is_trail_surrogate(utf8::internal::mask16(unit));
+        }
+        /// dropped is the first unit that does not fit; the units of its code point that
+        /// did fit are taken back
+        void drop(unit_type dropped)
+        {
+            overflow = true;
+            if (!continues_code_point(dropped))
+                return;
+            while (next != first && continues_code_point(next[-1]))
+                --next;
+            if (next != first)
+                --next;
+        }
+
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end, std::random_access_iterator_tag)
+        {
+            if (overflow)
+                return;
+            const std::ptrdiff_t count = end - start;
+            if (count > last - next) {
+                const input_iterator fitting_end = start + (last - next);
+                next = std::copy(start, fitting_end, next);
+                drop(static_cast<unit_type>(*fitting_end));
+                return;
+            }
+            next = std::copy(start, end, next);
+        }
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end, std::input_iterator_tag)
+        {
+            for (; start != end && !overflow; ++start)
+                *this = *start;
+        }
+      public:
+        typedef std::output_iterator_tag iterator_category;
+        typedef void value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef void reference;
+
+        /// A template so that span_sink(first, 0) is not ambiguous
+        template <typename last_unit_type>
+        span_sink (unit_type* first, last_unit_type* last) : first(first), next(first), last(last), overflow(false) {}
+        span_sink (unit_type* first, std::size_t size) : first(first), next(first), last(first + size), overflow(false) {}
+
+        span_sink& operator * () { return *this; }
+        span_sink& operator ++ () { return *this; }
+        span_sink& operator ++ (int) { return *this; }
+        span_sink& operator = (unit_type unit)
+        {
+            if (overflow)
+                return *this;
+            if (next != last)
+                *next++ = unit;
+            else
+                drop(unit);
+            return *this;
+        }
+
+        /// Writes a whole run at once
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end)
+        {
+            append(start, end, typename std::iterator_traits<input_iterator>::iterator_category());
+        }
+
+        internal::utf_error status () const { return overflow ? internal::NOT_ENOUGH_ROOM : internal::UTF8_OK; }
+        unit_type* data () const { return first; }
+        unit_type* end () const { return next; }
+        std::size_t size () const { return static_cast<std::size_t>(next - first); }
     };
 
-    /// The library API - functions intended to be called by the users
+    /// Output iterator that appends to a container such as std::string, std::vector or
+    /// std::pmr::string, with runs appended in one insert instead of an element at a time.
+    /// The container is grown by expected_size up front.
+    template <typename container_type>
+    class append_sink {
+        container_type* container;
+      public:
+        typedef std::output_iterator_tag iterator_category;
+        typedef void value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef void reference;
 
-    template <typename octet_iterator>
-    octet_iterator append(uint32_t cp, octet_iterator result)
-    {
-        if (!utf8::internal::is_code_point_valid(cp))
-            throw invalid_code_point(cp);
+        explicit append_sink (container_type& container, std::size_t expected_size = 0) : container(&container)
+        {
+            if (expected_size != 0)
+                container.reserve(container.size() + expected_size);
+        }
 
-        if (cp < 0x80)                        // one octet
-            *(result++) = static_cast<uint8_t>(cp);
-        else if (cp < 0x800) {                // two octets
-            *(result++) = static_cast<uint8_t>((cp >> 6)            | 0xc0);
-            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+        append_sink& operator * () { return *this; }
+        append_sink& operator ++ () { return *this; }
+        append_sink& operator ++ (int) { return *this; }
+        append_sink& operator = (typename container_type::value_type unit)
+        {
+            container->push_back(unit);
+            return *this;
         }
-        else if (cp < 0x10000) {              // three octets
-            *(result++) = static_cast<uint8_t>((cp >> 12)           | 0xe0);
-            *(result++) = static_cast<uint8_t>(((cp >> 6) & 0x3f)   | 0x80);
-            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end)
+        {
+            append(start, end, typename std::iterator_traits<input_iterator>::iterator_category());
         }
-        else {                                // four octets
-            *(result++) = static_cast<uint8_t>((cp >> 18)           | 0xf0);
-            *(result++) = static_cast<uint8_t>(((cp >> 12) & 0x3f)  | 0x80);
-            *(result++) = static_cast<uint8_t>(((cp >> 6) & 0x3f)   | 0x80);
-            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+
+      private:
+        // Not insert: std::string copies ranges of other iterator types to a temporary first.
+        // Short runs are cheaper to push back.
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end, std::random_access_iterator_tag)
+        {
+            if (end - start <= 16) {
+                append(start, end, std::input_iterator_tag());
+                return;
+            }
+            const std::size_t size = container->size();
+            container->resize(size + static_cast<std::size_t>(end - start));
+            std::copy(start, end, container->begin() + static_cast<typename container_type::difference_type>(size));
         }
-        return result;
+        template <typename input_iterator>
+        void append(input_iterator start, input_iterator end, std::input_iterator_tag)
+        {
+            for (; start != end; ++start)
+                container->push_back(*start);
+        }
+    };
+
+    template <typename container_type>
+    inline append_sink<container_type> append_to(container_type& container, std::size_t expected_size = 0)
+    {
+        return append_sink<container_type>(container, expected_size);
     }
 
-    template <typename octet_iterator, typename output_iterator>
-    output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out, uint32_t replacement)
+#if UTF8_CPP_CPLUSPLUS >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+    /// append_sink for strings allocated from a std::pmr::memory_resource (say a
+    /// std::pmr::monotonic_buffer_resource per request)
+    typedef append_sink<std::pmr::string> pmr_string_sink;
+#endif
+#endif
+
+namespace internal
+{
+    // Output iterator categories: the sinks above take whole runs, everything else is
+    // written an element at a time
+    struct element_output_tag {};
+    struct run_output_tag {};
+
+    template <typename output_iterator>
+    struct output_runs {
+        typedef element_output_tag category;
+    };
+
+    template <typename unit_type>
+    struct output_runs<span_sink<unit_type> > {
+        typedef run_output_tag category;
+    };
+
+    template <typename container_type>
+    struct output_runs<append_sink<container_type> > {
+        typedef run_output_tag category;
+    };
+
+    template <typename input_iterator, typename output_iterator>
+    inline output_iterator write_run(input_iterator start, input_iterator end, output_iterator out, element_output_tag)
     {
-        while (start != end) {
-            octet_iterator sequence_start = start;
-            internal::utf_error err_code = utf8::internal::validate_next(start, end);
-            switch (err_code) {
-                case internal::UTF8_OK :
-                    for (octet_iterator it = sequence_start; it != start; ++it)
-                        *out++ = *it;
-                    break;
-                case internal::NOT_ENOUGH_ROOM:
-                    throw not_enough_room();
-                case internal::INVALID_LEAD:
-                    out = utf8::append (replacement, out);
-                    ++start;
-                    break;
-                case internal::INCOMPLETE_SEQUENCE:
-                case internal::OVERLONG_SEQUENCE:
-                case internal::INVALID_CODE_POINT:
-                    out = utf8::append (replacement, out);
-                    ++start;
-                    // just one replacement mark for the sequence
-                    while (start != end && utf8::internal::is_trail(*start))
-                        ++start;
-                    break;
-            }
-        }
+        return std::copy(start, end, out);
+    }
+
+    template <typename input_iterator, typename output_iterator>
+    inline output_iterator write_run(input_iterator start, input_iterator end, output_iterator out, run_output_tag)
+    {
+        out.append(start, end);
         return out;
     }
 
-    template <typename octet_iterator, typename output_iterator>
-    inline output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out)
+    /// Writes the run [start, end) to out. The algorithms write runs of octets or code units
+    /// through this, so that the sinks get them in one piece.
+    template <typename input_iterator, typename output_iterator>
+    inline output_iterator write_run(input_iterator start, input_iterator end, output_iterator out)
     {
-        static const uint32_t replacement_marker = utf8::internal::mask16(0xfffd);
-        return utf8::replace_invalid(start, end, out, replacement_marker);
+        return utf8::internal::write_run(start, end, out, typename output_runs<output_iterator>::category());
     }
 
-    template <typename octet_iterator>
-    uint32_t next(octet_iterator& it, octet_iterator end)
+    /// Kernels working on contiguous octets. Every kernel has a portable scalar version;
+    /// the vectorized versions are selected at run time (see simd_kernels below).
+    namespace scalar
     {
+        // Mask with the high bit set in each octet of a machine word
+        const std::size_t ASCII_WORD_MASK = ~std::size_t(0) / 0xff * 0x80;
+
+        inline bool is_ascii_word(const uint8_t* p)
+        {
+            std::size_t word;
+            std::memcpy(&word, p, sizeof(word));
+            return (word & ASCII_WORD_MASK) == 0;
+        }
+
+        inline const uint8_t* find_non_ascii(const uint8_t* start, const uint8_t* end)
+        {
+            while (end - start >= static_cast<std::ptrdiff_t>(sizeof(std::size_t)) && is_ascii_word(start))
+                start += sizeof(std::size_t);
+            while (start != end && *start < 0x80)
+                ++start;
+            return start;
+        }
+
+        /// Widens the run of ASCII octets at start; returns the end of the run
+        template <typename unit_type>
+        inline const uint8_t* widen_ascii(const uint8_t* start, const uint8_t* end, unit_type* out)
+        {
+            const uint8_t* ascii_end = find_non_ascii(start, end);
+            while (start != ascii_end)
+                *out++ = *start++;
+            return start;
+        }
+
+        inline const uint8_t* widen_ascii16(const uint8_t* start, const uint8_t* end, uint16_t* out)
+        {
+            return widen_ascii(start, end, out);
+        }
+
+        inline const uint8_t* widen_ascii32(const uint8_t* start, const uint8_t* end, uint32_t* out)
+        {
+            return widen_ascii(start, end, out);
+        }
+
+        /// Encodes the run of valid UTF-16 at start; returns the end of the run and leaves out
+        /// past the octets written (at most 3 per code unit). The run ends at a surrogate that
+        /// is not part of a pair, which includes a lead surrogate at end - 1.
+        inline const uint16_t* encode_utf16(const uint16_t* start, const uint16_t* end, uint8_t*& out)
+        {
+            for (; start != end; ++start) {
+                const uint16_t cp = *start;
+                if (cp < 0x80)
+                    *out++ = static_cast<uint8_t>(cp);
+                else if (cp < 0x800) {
+                    *out++ = static_cast<uint8_t>((cp >> 6)          | 0xc0);
+                    *out++ = static_cast<uint8_t>((cp & 0x3f)        | 0x80);
+                }
+                else if (utf8::internal::is_surrogate(cp)) {
+                    if (!utf8::internal::is_lead_surrogate(cp) || end - start < 2 || !utf8::internal::is_trail_surrogate(start[1]))
+                        break;
+                    const uint32_t pair = (static_cast<uint32_t>(cp) << 10) + *++start + SURROGATE_OFFSET;
+                    *out++ = static_cast<uint8_t>((pair >> 18)           | 0xf0);
+                    *out++ = static_cast<uint8_t>(((pair >> 12) & 0x3f)  | 0x80);
+                    *out++ = static_cast<uint8_t>(((pair >> 6) & 0x3f)   | 0x80);
+                    *out++ = static_cast<uint8_t>((pair & 0x3f)          | 0x80);
+                }
+                else {
+                    *out++ = static_cast<uint8_t>((cp >> 12)         | 0xe0);
+                    *out++ = static_cast<uint8_t>(((cp >> 6) & 0x3f) | 0x80);
+                    *out++ = static_cast<uint8_t>((cp & 0x3f)        | 0x80);
+                }
+            }
+            return start;
+        }
+
+        /// Encodes the run of valid code points at start; returns the end of the run and leaves
+        /// out past the octets written (at most 4 per code point)
+        inline const uint32_t* encode_utf32(const uint32_t* start, const uint32_t* end, uint8_t*& out)
+        {
+            for (; start != end; ++start) {
+                const uint32_t cp = *start;
+                if (cp < 0x80)
+                    *out++ = static_cast<uint8_t>(cp);
+                else if (cp < 0x800) {
+                    *out++ = static_cast<uint8_t>((cp >> 6)           | 0xc0);
+                    *out++ = static_cast<uint8_t>((cp & 0x3f)         | 0x80);
+                }
+                else if (cp < 0x10000) {
+                    if (utf8::internal::is_surrogate(cp))
+                        break;
+                    *out++ = static_cast<uint8_t>((cp >> 12)          | 0xe0);
+                    *out++ = static_cast<uint8_t>(((cp >> 6) & 0x3f)  | 0x80);
+                    *out++ = static_cast<uint8_t>((cp & 0x3f)         | 0x80);
+                }
+                else if (cp <= CODE_POINT_MAX) {
+                    *out++ = static_cast<uint8_t>((cp >> 18)          | 0xf0);
+                    *out++ = static_cast<uint8_t>(((cp >> 12) & 0x3f) | 0x80);
+                    *out++ = static_cast<uint8_t>(((cp >> 6) & 0x3f)  | 0x80);
+                    *out++ = static_cast<uint8_t>((cp & 0x3f)         | 0x80);
+                }
+                else
+                    break;
+            }
+            return start;
+        }
+
+        /// Number of octets utf16to8 writes for valid UTF-16: each unit of a surrogate pair
+        /// counts 2
+        inline std::size_t count_utf8_from16(const uint16_t* start, const uint16_t* end)
+        {
+            std::size_t octets = 0;
+            for (; start != end; ++start)
+                octets += 1 + (*start >= 0x80) + (*start >= 0x800) - utf8::internal::is_surrogate(*start);
+            return octets;
+        }
+
+        /// Number of octets utf32to8 writes for valid code points
+        inline std::size_t count_utf8_from32(const uint32_t* start, const uint32_t* end)
+        {
+            std::size_t octets = 0;
+            for (; start != end; ++start)
+                octets += 1 + (*start >= 0x80) + (*start >= 0x800) + (*start >= 0x10000);
+            return octets;
+        }
+
+        /// Converts valid UTF-8 to UTF-16 the way unchecked::next decodes it, and returns where
+        /// it stopped: at end, or past it if an invalid lead octet claims more octets than are
+        /// left before end
+        inline const uint8_t* decode_utf16(const uint8_t* start, const uint8_t* end, uint16_t*& out)
+        {
+            while (start < end) {
+                uint32_t cp = *start;
+                if (cp < 0x80) {
+                    *out++ = static_cast<uint16_t>(cp);
+                    ++start;
+                    continue;
+                }
+                const int length = static_cast<int>(utf8::internal::sequence_length(start));
+                cp &= decoder_tables<void>::lead_mask[length];
+                for (int i = 1; i < length; ++i)
+                    cp = (cp << 6) | (*++start & 0x3f);
+                ++start;
+                if (cp > 0xffff) {
+                    *out++ = static_cast<uint16_t>((cp >> 10)   + internal::LEAD_OFFSET);
+                    *out++ = static_cast<uint16_t>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
+                }
+                else
+                    *out++ = static_cast<uint16_t>(cp);
+            }
+            return start;
+        }
+
+        /// Number of UTF-16 code units needed for valid UTF-8: one for each lead octet and
+        /// one more for each 4 octet sequence
+        inline std::size_t count_utf16(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t units = 0;
+            for (; start != end; ++start)
+                units += !utf8::internal::is_trail(*start) + (*start >= 0xf0);
+            return units;
+        }
+
+        /// Number of code points in valid UTF-8: the number of octets that are not trail octets
+        inline std::size_t count_code_points(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t count = 0;
+            for (; start != end; ++start)
+                count += !utf8::internal::is_trail(*start);
+            return count;
+        }
+
+        /// Skips n code points of valid UTF-8 and returns the start of the next one, or end.
+        /// n is decreased by the number of code points skipped.
+        inline const uint8_t* skip_code_points(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; start != end; ++start) {
+                if (!utf8::internal::is_trail(*start)) {
+                    if (n == 0)
+                        return start;
+                    --n;
+                }
+            }
+            return end;
+        }
+
+        /// Moves back from end over n code points of valid UTF-8 and returns the start of the
+        /// last one, or start. n is decreased by the number of code points skipped.
+        inline const uint8_t* skip_code_points_back(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            while (n != 0 && end - start >= static_cast<std::ptrdiff_t>(sizeof(std::size_t))) {
+                std::size_t word;
+                std::memcpy(&word, end - sizeof(word), sizeof(word));
+                // The high bit of the octets that are not 10xxxxxx, summed up by the multiplication
+                const std::size_t leads = ((~word | (word << 1)) & ASCII_WORD_MASK) >> 7;
+                const std::size_t count = (leads * (~std::size_t(0) / 0xff)) >> (8 * (sizeof(std::size_t) - 1));
+                if (count >= n)
+                    break;
+                n -= count;
+                end -= sizeof(word);
+            }
+            while (n != 0 && end != start)
+                if (!utf8::internal::is_trail(*--end))
+                    --n;
+            return end;
+        }
+
+        inline const uint8_t* find_invalid(const uint8_t* start, const uint8_t* end)
+        {
+            const uint8_t* result = start;
+            while (result != end) {
+                if (end - result >= static_cast<std::ptrdiff_t>(sizeof(std::size_t)) && is_ascii_word(result)) {
+                    result += sizeof(std::size_t);
+                    continue;
+                }
+                uint32_t ignored;
+                if (utf8::internal::decode_next(result, end, ignored) != UTF8_OK)
+                    return result;
+            }
+            return result;
+        }
+
+        inline uint8_t* encode_latin1(const uint8_t* start, const uint8_t* end, uint8_t* out)
+        {
+            for (; start != end; ++start) {
+                const uint8_t octet = *start;
+                if (octet < 0x80)
+                    *out++ = octet;
+                else {
+                    *out++ = static_cast<uint8_t>(0xc0 | (octet >> 6));
+                    *out++ = static_cast<uint8_t>(0x80 | (octet & 0x3f));
+                }
+            }
+            return out;
+        }
+
+        inline bool is_latin1_pair(const uint8_t* start, const uint8_t* end)
+        {
+            return (*start & 0xfe) == 0xc2 && end - start >= 2 && utf8::internal::is_trail(start[1]);
+        }
+
+        /// Decodes ASCII and the 2-octet sequences of U+0080..U+00FF; returns where it stopped
+        inline const uint8_t* decode_latin1(const uint8_t* start, const uint8_t* end, uint8_t*& out)
+        {
+            uint8_t* it = out;
+            while (start != end) {
+                if (end - start >= static_cast<std::ptrdiff_t>(sizeof(std::size_t)) && is_ascii_word(start)) {
+                    std::memcpy(it, start, sizeof(std::size_t));
+                    start += sizeof(std::size_t);
+                    it += sizeof(std::size_t);
+                }
+                else if (*start < 0x80)
+                    *it++ = *start++;
+                else if (is_latin1_pair(start, end)) {
+                    *it++ = static_cast<uint8_t>(((start[0] & 0x03) << 6) | (start[1] & 0x3f));
+                    start += 2;
+                }
+                else
+                    break;
+            }
+            out = it;
+            return start;
+        }
+
+        /// The first octet that does not start ASCII or a sequence of U+0080..U+00FF
+        inline const uint8_t* find_non_latin1(const uint8_t* start, const uint8_t* end)
+        {
+            while (start != end) {
+                if (end - start >= static_cast<std::ptrdiff_t>(sizeof(std::size_t)) && is_ascii_word(start))
+                    start += sizeof(std::size_t);
+                else if (*start < 0x80)
+                    ++start;
+                else if (is_latin1_pair(start, end))
+                    start += 2;
+                else
+                    break;
+            }
+            return start;
+        }
+
+        inline uint8_t fold_ascii(uint8_t octet)
+        {
+            return static_cast<unsigned>(octet - 'A') < 26 ? static_cast<uint8_t>(octet | 0x20) : octet;
+        }
+
+        /// The first octet of [a, a_end) that differs from the octet at the same offset from b,
+        /// with ASCII letters compared without case
+        inline const uint8_t* mismatch_ascii_icase(const uint8_t* a, const uint8_t* a_end, const uint8_t* b)
+        {
+            for (; a != a_end; ++a, ++b)
+                if (fold_ascii(*a) != fold_ascii(*b))
+                    break;
+            return a;
+        }
+
+        /// The first occurrence of [needle, needle_end), which is not empty, in [start, end)
+        /// with ASCII letters compared without case; end if there is none
+        inline const uint8_t* find_ascii_icase(const uint8_t* start, const uint8_t* end,
+                                               const uint8_t* needle, const uint8_t* needle_end)
+        {
+            const std::ptrdiff_t length = needle_end - needle;
+            const uint8_t first = fold_ascii(*needle);
+            for (; end - start >= length; ++start)
+                if (fold_ascii(*start) == first && mismatch_ascii_icase(start + 1, start + length, needle + 1) == start + length)
+                    return start;
+            return end;
+        }
+    } // namespace utf8::internal::scalar
+
+    // The vectorized validator is the "lookup" algorithm by Keiser and Lemire: three 16-entry
+    // tables indexed by the nibbles of each octet and of its predecessor classify every
+    // two-octet pair, and the 3rd/4th octets of long sequences are checked separately.
+    // A block only tells us that there is an error somewhere in it, so the exact position
+    // is always found by rescanning with validate_next from the last sequence boundary.
+    template <typename T>
+    struct simd_tables {
+        static const uint8_t byte_1_high[16];
+        static const uint8_t byte_1_low[16];
+        static const uint8_t byte_2_high[16];
+        // Lead octets in the last 3 positions of a 16/32/64 octet block that need more
+        // octets than are left in the block; use the last 16/32/64 entries
+        static const uint8_t incomplete_max[64];
+    };
+
+    enum simd_error_bits {
+        TOO_SHORT      = 1 << 0, // 11______ 0_______ or 11______ 11______
+        TOO_LONG       = 1 << 1, // 0_______ 10______
+        OVERLONG_3     = 1 << 2, // 11100000 100_____
+        TOO_LARGE      = 1 << 3, // 11110100 1001____ and above
+        SURROGATE      = 1 << 4, // 11101101 101_____
+        OVERLONG_2     = 1 << 5, // 1100000_ 10______
+        TOO_LARGE_1000 = 1 << 6, // 11110101 1000____ and above
+        OVERLONG_4     = 1 << 6, // 11110000 1000____
+        TWO_CONTS      = 1 << 7, // 10______ 10______
+        CARRY          = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+
+    template <typename T>
+    const uint8_t simd_tables<T>::byte_1_high[16] = {
+        // 0_______ ________ <ASCII in byte 1>
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        // 10______ ________ <continuation in byte 1>
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        // 1100____ ________ <two byte lead in byte 1>
+        TOO_SHORT | OVERLONG_2,
+        // 1101____ ________ <two byte lead in byte 1>
+        TOO_SHORT,
+        // 1110____ ________ <three byte lead in byte 1>
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        // 1111____ ________ <four+ byte lead in byte 1>
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+    };
+
+    template <typename T>
+    const uint8_t simd_tables<T>::byte_1_low[16] = {
+        // ____0000 ________
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        // ____0001 ________
+        CARRY | OVERLONG_2,
+        // ____001_ ________
+        CARRY, CARRY,
+        // ____0100 ________
+        CARRY | TOO_LARGE,
+        // ____0101 ________ and ____011_ ________
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        // ____1___ ________
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        // ____1101 ________
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000
+    };
+
+    template <typename T>
+    const uint8_t simd_tables<T>::byte_2_high[16] = {
+        // ________ 0_______ <ASCII in byte 2>
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        // ________ 1000____
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        // ________ 1001____
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        // ________ 101_____
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        // ________ 11______
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+
+    template <typename T>
+    const uint8_t simd_tables<T>::incomplete_max[64] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+    };
+
+    /// Returns the start of the sequence that contains the octet before p, or p itself if
+    /// that octet completes a single octet sequence. [start, p) must be valid apart from
+    /// a possibly truncated sequence at its end.
+    inline const uint8_t* sequence_boundary(const uint8_t* start, const uint8_t* p)
+    {
+        const uint8_t* boundary = p;
+        while (boundary != start && p - boundary < 3 && utf8::internal::is_trail(*(boundary - 1)))
+            --boundary;
+        if (boundary != start && *(boundary - 1) >= 0xc0)
+            --boundary;
+        return boundary;
+    }
+
+#if defined(UTF8_CPP_X86)
+    namespace sse42
+    {
+        UTF8_CPP_TARGET_SSE42
+        inline __m128i load_table(const uint8_t* table)
+        {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i*>(table));
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* find_non_ascii(const uint8_t* start, const uint8_t* end)
+        {
+            for (; end - start >= 16; start += 16) {
+                const int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start)));
+                if (mask != 0)
+                    return start + __builtin_ctz(mask);
+            }
+            return scalar::find_non_ascii(start, end);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* widen_ascii16(const uint8_t* start, const uint8_t* end, uint16_t* out)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            for (; end - start >= 16; start += 16, out += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) != 0)
+                    break;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(input, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(input, zero));
+            }
+            return scalar::widen_ascii16(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* widen_ascii32(const uint8_t* start, const uint8_t* end, uint32_t* out)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            for (; end - start >= 16; start += 16, out += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) != 0)
+                    break;
+                const __m128i low = _mm_unpacklo_epi8(input, zero);
+                const __m128i high = _mm_unpackhi_epi8(input, zero);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi16(low, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(low, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpacklo_epi16(high, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm_unpackhi_epi16(high, zero));
+            }
+            return scalar::widen_ascii32(start, end, out);
+        }
+
+        /// Shuffles that pack 8 code units below 0x800, each held as its lead (or ASCII) octet
+        /// in the low byte and its trail octet in the high byte, into 1 or 2 octets each.
+        /// Indexed by the mask of the units that are ASCII.
+        struct pack_tables {
+            uint8_t shuffle[256][16];
+            uint8_t length[256];
+
+            pack_tables()
+            {
+                for (int mask = 0; mask < 256; ++mask) {
+                    int length_so_far = 0;
+                    for (int unit = 0; unit < 8; ++unit) {
+                        shuffle[mask][length_so_far++] = static_cast<uint8_t>(2 * unit);
+                        if (!(mask & (1 << unit)))
+                            shuffle[mask][length_so_far++] = static_cast<uint8_t>(2 * unit + 1);
+                    }
+                    length[mask] = static_cast<uint8_t>(length_so_far);
+                    while (length_so_far < 16)
+                        shuffle[mask][length_so_far++] = 0x80;
+                }
+            }
+        };
+
+        inline const pack_tables& utf16_pack_tables()
+        {
+            static const pack_tables tables;
+            return tables;
+        }
+
+        /// Writes 8 code units below 0x800 as 1 or 2 octets each (16 octets are stored)
+        UTF8_CPP_TARGET_SSE42
+        inline void pack_short_units(__m128i input, uint8_t*& out, const pack_tables& tables)
+        {
+            const __m128i lead = _mm_or_si128(_mm_srli_epi16(input, 6), _mm_set1_epi16(0xc0));
+            const __m128i trail = _mm_or_si128(_mm_and_si128(input, _mm_set1_epi16(0x3f)), _mm_set1_epi16(0x80));
+            const __m128i ascii = _mm_cmplt_epi16(input, _mm_set1_epi16(0x80));
+            const __m128i units = _mm_blendv_epi8(_mm_or_si128(lead, _mm_slli_epi16(trail, 8)), input, ascii);
+            const int mask = _mm_movemask_epi8(_mm_packs_epi16(ascii, _mm_setzero_si128()));
+            const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[mask]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(units, shuffle));
+            out += tables.length[mask];
+        }
+
+        /// Writes 8 code units that are not surrogates if their lengths are all 1, all 1 or 2,
+        /// or all 3 octets (up to 24 octets are stored); returns false, writing nothing, otherwise
+        UTF8_CPP_TARGET_SSE42
+        inline bool encode_bmp8(__m128i input, uint8_t*& out, const pack_tables& tables)
+        {
+            if (_mm_testz_si128(input, _mm_set1_epi16(short(0xff80)))) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(input, input));
+                out += 8;
+                return true;
+            }
+            if (_mm_testz_si128(input, _mm_set1_epi16(short(0xf800)))) {
+                pack_short_units(input, out, tables);
+                return true;
+            }
+            const __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(input, _mm_set1_epi16(short(0xf800))),
+                                                       _mm_set1_epi16(short(0xd800)));
+            // Below 0x800 as unsigned: the block mixes lengths
+            const __m128i short_units = _mm_cmplt_epi16(_mm_xor_si128(input, _mm_set1_epi16(short(0x8000))),
+                                                        _mm_set1_epi16(short(0x8800)));
+            const __m128i other = _mm_or_si128(surrogates, short_units);
+            if (!_mm_testz_si128(other, other))
+                return false;
+            // All 3 octets: lead and first trail in one lane, second trail in another
+            const __m128i lead = _mm_or_si128(_mm_srli_epi16(input, 12), _mm_set1_epi16(0xe0));
+            const __m128i trail1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(input, 6), _mm_set1_epi16(0x3f)),
+                                                _mm_set1_epi16(0x80));
+            const __m128i trail2 = _mm_or_si128(_mm_and_si128(input, _mm_set1_epi16(0x3f)), _mm_set1_epi16(0x80));
+            const __m128i first_two = _mm_or_si128(lead, _mm_slli_epi16(trail1, 8));
+            const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            const __m128i low = _mm_shuffle_epi8(_mm_unpacklo_epi16(first_two, trail2), pack);
+            const __m128i high = _mm_shuffle_epi8(_mm_unpackhi_epi16(first_two, trail2), pack);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(low, _mm_slli_si128(high, 12)));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), _mm_srli_si128(high, 4));
+            out += 24;
+            return true;
+        }
+
+        /// Shuffles that pack 4 code points, each held as the octets of its sequence from the
+        /// lowest one of a 32 bit lane, into 1 to 4 octets each. Indexed by the lengths less
+        /// one, 2 bits per lane.
+        struct quad_tables {
+            uint8_t shuffle[256][16];
+            uint8_t length[256];
+
+            quad_tables()
+            {
+                for (int index = 0; index < 256; ++index) {
+                    int length_so_far = 0;
+                    for (int lane = 0; lane < 4; ++lane)
+                        for (int octet = 0; octet <= ((index >> (2 * lane)) & 3); ++octet)
+                            shuffle[index][length_so_far++] = static_cast<uint8_t>(4 * lane + octet);
+                    length[index] = static_cast<uint8_t>(length_so_far);
+                    while (length_so_far < 16)
+                        shuffle[index][length_so_far++] = 0x80;
+                }
+            }
+        };
+
+        inline const quad_tables& utf32_quad_tables()
+        {
+            static const quad_tables tables;
+            return tables;
+        }
+
+        /// Writes 4 code points of any lengths (16 octets are stored); returns false, writing
+        /// nothing, if one of them is not valid
+        UTF8_CPP_TARGET_SSE42
+        inline bool encode_quad(__m128i input, uint8_t*& out, const quad_tables& tables)
+        {
+            const __m128i too_large = _mm_cmpeq_epi32(_mm_max_epu32(input, _mm_set1_epi32(0x110000)), input);
+            const __m128i surrogates = _mm_cmpeq_epi32(_mm_and_si128(input, _mm_set1_epi32(int(0xfffff800))),
+                                                       _mm_set1_epi32(0xd800));
+            const __m128i invalid = _mm_or_si128(too_large, surrogates);
+            if (!_mm_testz_si128(invalid, invalid))
+                return false;
+            const __m128i payload = _mm_set1_epi32(0x3f);
+            const __m128i trail = _mm_set1_epi32(0x80);
+            const __m128i trail0 = _mm_or_si128(_mm_and_si128(input, payload), trail);
+            const __m128i trail1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(input, 6), payload), trail);
+            const __m128i trail2 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(input, 12), payload), trail);
+            const __m128i two = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(input, 6), _mm_set1_epi32(0xc0)),
+                                             _mm_slli_epi32(trail0, 8));
+            const __m128i three = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(input, 12), _mm_set1_epi32(0xe0)),
+                                               _mm_or_si128(_mm_slli_epi32(trail1, 8), _mm_slli_epi32(trail0, 16)));
+            const __m128i four = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(input, 18), _mm_set1_epi32(0xf0)),
+                                              _mm_or_si128(_mm_slli_epi32(trail2, 8),
+                                                           _mm_or_si128(_mm_slli_epi32(trail1, 16), _mm_slli_epi32(trail0, 24))));
+            // The code points are valid, so signed compares work
+            const __m128i two_or_more = _mm_cmpgt_epi32(input, _mm_set1_epi32(0x7f));
+            const __m128i three_or_more = _mm_cmpgt_epi32(input, _mm_set1_epi32(0x7ff));
+            const __m128i four_octets = _mm_cmpgt_epi32(input, _mm_set1_epi32(0xffff));
+            __m128i octets = _mm_blendv_epi8(input, two, two_or_more);
+            octets = _mm_blendv_epi8(octets, three, three_or_more);
+            octets = _mm_blendv_epi8(octets, four, four_octets);
+            // The lengths less one, gathered from the low octet of each lane
+            const __m128i lengths = _mm_sub_epi32(_mm_setzero_si128(),
+                                                  _mm_add_epi32(two_or_more, _mm_add_epi32(three_or_more, four_octets)));
+            const uint32_t packed = static_cast<uint32_t>(_mm_cvtsi128_si32(
+                _mm_shuffle_epi8(lengths, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1))));
+            const uint32_t index = (packed & 0x3) | ((packed >> 6) & 0xc) | ((packed >> 12) & 0x30) | ((packed >> 18) & 0xc0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(octets, load_table(tables.shuffle[index])));
+            out += tables.length[index];
+            return true;
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint16_t* encode_utf16(const uint16_t* start, const uint16_t* end, uint8_t*& out)
+        {
+            const pack_tables& tables = utf16_pack_tables();
+            const quad_tables& quads = utf32_quad_tables();
+            while (end - start >= 8) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (encode_bmp8(input, out, tables)) {
+                    start += 8;
+                    continue;
+                }
+                // Mixed lengths are encoded as code points, 4 at a time
+                const __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(input, _mm_set1_epi16(short(0xf800))),
+                                                           _mm_set1_epi16(short(0xd800)));
+                if (_mm_testz_si128(surrogates, surrogates)) {
+                    encode_quad(_mm_cvtepu16_epi32(input), out, quads);
+                    encode_quad(_mm_cvtepu16_epi32(_mm_srli_si128(input, 8)), out, quads);
+                    start += 8;
+                    continue;
+                }
+                // A pair that starts in the last lane is finished with the code unit after the block
+                const uint16_t* block_end = start + 8;
+                const uint16_t* stop = scalar::encode_utf16(start, end - start > 8 ? block_end + 1 : block_end, out);
+                if (stop < block_end)
+                    return stop;
+                start = stop;
+            }
+            return scalar::encode_utf16(start, end, out);
+        }
+
+        /// Blocks in the BMP take the paths of encode_utf16; the others are encoded by lanes of 4
+        UTF8_CPP_TARGET_SSE42
+        inline const uint32_t* encode_utf32(const uint32_t* start, const uint32_t* end, uint8_t*& out)
+        {
+            const pack_tables& tables = utf16_pack_tables();
+            const quad_tables& quads = utf32_quad_tables();
+            for (; end - start >= 8; start += 8) {
+                const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start + 4));
+                if (_mm_testz_si128(_mm_or_si128(low, high), _mm_set1_epi32(int(0xffff0000))) &&
+                        encode_bmp8(_mm_packus_epi32(low, high), out, tables))
+                    continue;
+                if (!encode_quad(low, out, quads))
+                    break;
+                if (!encode_quad(high, out, quads)) {
+                    start += 4;
+                    break;
+                }
+            }
+            return scalar::encode_utf32(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline std::size_t count_utf8_from16(const uint16_t* start, const uint16_t* end)
+        {
+            std::size_t octets = 0;
+            const __m128i zero = _mm_setzero_si128();
+            for (; end - start >= 8; start += 8) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                const __m128i high_bits = _mm_and_si128(input, _mm_set1_epi16(short(0xf800)));
+                // 3 octets per unit, less one for each unit below 0x80, below 0x800 or a surrogate
+                const int below_0x80 = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(input, _mm_set1_epi16(short(0xff80))), zero));
+                const int below_0x800 = _mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, zero));
+                const int surrogates = _mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, _mm_set1_epi16(short(0xd800))));
+                octets += 24 - static_cast<std::size_t>(__builtin_popcount(below_0x80) + __builtin_popcount(below_0x800) +
+                                                        __builtin_popcount(surrogates)) / 2;
+            }
+            return octets + scalar::count_utf8_from16(start, end);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline std::size_t count_utf8_from32(const uint32_t* start, const uint32_t* end)
+        {
+            std::size_t octets = 0;
+            const __m128i zero = _mm_setzero_si128();
+            for (; end - start >= 4; start += 4) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                // 4 octets per code point, less one for each of the limits it is below
+                const int below_0x80 = _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpeq_epi32(_mm_and_si128(input, _mm_set1_epi32(int(0xffffff80))), zero)));
+                const int below_0x800 = _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpeq_epi32(_mm_and_si128(input, _mm_set1_epi32(int(0xfffff800))), zero)));
+                const int below_0x10000 = _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpeq_epi32(_mm_and_si128(input, _mm_set1_epi32(int(0xffff0000))), zero)));
+                octets += 16 - static_cast<std::size_t>(__builtin_popcount(below_0x80) + __builtin_popcount(below_0x800) +
+                                                        __builtin_popcount(below_0x10000));
+            }
+            return octets + scalar::count_utf8_from32(start, end);
+        }
+
+        // decode_utf16 looks at the first 12 octets of a block through the mask of the octets
+        // that end a code point. If the first 6 code points have 1 or 2 octets, they are
+        // shuffled into 16 bit lanes (first octet high, last octet low); otherwise, if the
+        // first 4 have up to 3 octets, into 32 bit lanes (last octet lowest). Blocks with
+        // 4 octet sequences in them are decoded one code point at a time.
+        enum decode_kind { DECODE_SIX_SHORT, DECODE_FOUR, DECODE_SCALAR };
+
+        struct decode_tables {
+            uint8_t kind[4096];
+            uint8_t consumed[4096];
+            uint8_t shuffle_index[4096];
+            uint8_t shuffle[256][16];
+
+            decode_tables()
+            {
+                int shuffles = 0;
+                for (int mask = 0; mask < 4096; ++mask) {
+                    int lengths[12];
+                    int count = 0;
+                    for (int i = 0, first = 0; i < 12; ++i)
+                        if (mask & (1 << i)) {
+                            lengths[count++] = i - first + 1;
+                            first = i + 1;
+                        }
+                    uint8_t lanes[16];
+                    std::memset(lanes, 0x80, sizeof(lanes));
+                    int octets = 0;
+                    if (count >= 6 && std::max(std::max(std::max(lengths[0], lengths[1]), std::max(lengths[2], lengths[3])),
+                                               std::max(lengths[4], lengths[5])) <= 2) {
+                        kind[mask] = DECODE_SIX_SHORT;
+                        for (int k = 0; k < 6; octets += lengths[k++]) {
+                            lanes[2 * k] = static_cast<uint8_t>(octets + lengths[k] - 1);
+                            if (lengths[k] == 2)
+                                lanes[2 * k + 1] = static_cast<uint8_t>(octets);
+                        }
+                    }
+                    else if (count >= 4 && std::max(std::max(lengths[0], lengths[1]), std::max(lengths[2], lengths[3])) <= 3) {
+                        kind[mask] = DECODE_FOUR;
+                        for (int k = 0; k < 4; octets += lengths[k++])
+                            for (int i = 0; i < lengths[k]; ++i)
+                                lanes[4 * k + i] = static_cast<uint8_t>(octets + lengths[k] - 1 - i);
+                    }
+                    else {
+                        kind[mask] = DECODE_SCALAR;
+                        for (int k = 0; k < count; ++k)
+                            octets += lengths[k];
+                    }
+                    consumed[mask] = static_cast<uint8_t>(octets);
+                    int index = 0;
+                    while (index < shuffles && std::memcmp(shuffle[index], lanes, sizeof(lanes)) != 0)
+                        ++index;
+                    if (index == shuffles)
+                        std::memcpy(shuffle[shuffles++], lanes, sizeof(lanes));
+                    shuffle_index[mask] = static_cast<uint8_t>(index);
+                }
+            }
+        };
+
+        inline const decode_tables& utf8_decode_tables()
+        {
+            static const decode_tables tables;
+            return tables;
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* decode_utf16(const uint8_t* start, const uint8_t* end, uint16_t*& out)
+        {
+            const decode_tables& tables = utf8_decode_tables();
+            const __m128i zero = _mm_setzero_si128();
+            // Stores write up to 8 code units past the ones decoded; with 64 octets left there
+            // are at least 16 more code units to come
+            while (end - start >= 64) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                const unsigned non_ascii = static_cast<unsigned>(_mm_movemask_epi8(input));
+                if ((non_ascii & 0xff) == 0) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(input, zero));
+                    if (non_ascii == 0) {
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(input, zero));
+                        start += 16;
+                        out += 16;
+                    }
+                    else {
+                        start += 8;
+                        out += 8;
+                    }
+                    continue;
+                }
+                const unsigned trails = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(char(0xc0)))));
+                const unsigned ends = (~trails >> 1) & 0xfff;
+                const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[tables.shuffle_index[ends]]));
+                const __m128i lanes = _mm_shuffle_epi8(input, shuffle);
+                switch (tables.kind[ends]) {
+                    case DECODE_SIX_SHORT: {
+                        const __m128i units = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(lanes, 2), _mm_set1_epi16(0x7c0)),
+                                                           _mm_and_si128(lanes, _mm_set1_epi16(0x7f)));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), units);
+                        out += 6;
+                        break;
+                    }
+                    case DECODE_FOUR: {
+                        const __m128i code_points = _mm_or_si128(_mm_and_si128(lanes, _mm_set1_epi32(0x7f)),
+                            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xfc0)),
+                                         _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xf000))));
+                        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi32(code_points, code_points));
+                        out += 4;
+                        break;
+                    }
+                    default:
+                        if (tables.consumed[ends] == 0)
+                            return scalar::decode_utf16(start, end, out);
+                        // Invalid input can take the last sequence past the octets counted
+                        start = scalar::decode_utf16(start, start + tables.consumed[ends], out);
+                        continue;
+                }
+                start += tables.consumed[ends];
+            }
+            return scalar::decode_utf16(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline std::size_t horizontal_sum(__m128i counts)
+        {
+            const __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+            return static_cast<std::size_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline std::size_t count_utf16(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t units = 0;
+            while (end - start >= 16) {
+                // Per octet counters of trail octets and 4 octet leads; flushed before they overflow
+                __m128i trails = _mm_setzero_si128();
+                __m128i long_leads = _mm_setzero_si128();
+                for (int i = 0; i < 255 && end - start >= 16; ++i, start += 16) {
+                    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                    trails = _mm_sub_epi8(trails, _mm_cmplt_epi8(input, _mm_set1_epi8(char(0xc0))));
+                    long_leads = _mm_sub_epi8(long_leads, _mm_cmpeq_epi8(_mm_max_epu8(input, _mm_set1_epi8(char(0xf0))), input));
+                    units += 16;
+                }
+                units = units - horizontal_sum(trails) + horizontal_sum(long_leads);
+            }
+            return units + scalar::count_utf16(start, end);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline std::size_t count_code_points(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t count = 0;
+            while (end - start >= 64) {
+                __m128i trails = _mm_setzero_si128();
+                for (int i = 0; i < 63 && end - start >= 64; ++i, start += 64) {
+                    const __m128i limit = _mm_set1_epi8(char(0xc0));
+                    trails = _mm_sub_epi8(trails, _mm_cmplt_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start)), limit));
+                    trails = _mm_sub_epi8(trails, _mm_cmplt_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start + 16)), limit));
+                    trails = _mm_sub_epi8(trails, _mm_cmplt_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start + 32)), limit));
+                    trails = _mm_sub_epi8(trails, _mm_cmplt_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start + 48)), limit));
+                    count += 64;
+                }
+                count -= horizontal_sum(trails);
+            }
+            return count + scalar::count_code_points(start, end);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* skip_code_points(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; end - start >= 16; start += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                const unsigned leads = ~_mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(char(0xc0)))) & 0xffffu;
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcount(leads));
+                if (count > n)
+                    break;
+                n -= count;
+            }
+            return scalar::skip_code_points(start, end, n);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* skip_code_points_back(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; n != 0 && end - start >= 16; end -= 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(end - 16));
+                const unsigned leads = ~_mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(char(0xc0)))) & 0xffffu;
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcount(leads));
+                if (count >= n)
+                    break;
+                n -= count;
+            }
+            return scalar::skip_code_points_back(start, end, n);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline __m128i check_block(__m128i input, __m128i prev_input)
+        {
+            const __m128i nibble = _mm_set1_epi8(0x0f);
+            const __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+            const __m128i byte_1_high = _mm_shuffle_epi8(load_table(simd_tables<void>::byte_1_high),
+                                                         _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+            const __m128i byte_1_low = _mm_shuffle_epi8(load_table(simd_tables<void>::byte_1_low),
+                                                        _mm_and_si128(prev1, nibble));
+            const __m128i byte_2_high = _mm_shuffle_epi8(load_table(simd_tables<void>::byte_2_high),
+                                                         _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+            const __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+            // Third and fourth octets of 3 and 4 octet sequences must be continuations
+            const __m128i is_third = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 14), _mm_set1_epi8(char(0xe0 - 0x80)));
+            const __m128i is_fourth = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 13), _mm_set1_epi8(char(0xf0 - 0x80)));
+            const __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8(char(0x80)));
+            return _mm_xor_si128(must_be_continuation, special_cases);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* find_invalid(const uint8_t* start, const uint8_t* end)
+        {
+            const __m128i incomplete_max = load_table(simd_tables<void>::incomplete_max + 48);
+            __m128i prev_input = _mm_setzero_si128();
+            __m128i prev_incomplete = _mm_setzero_si128();
+            const uint8_t* p = start;
+            for (; end - p >= 64; p += 64) {
+                const __m128i in0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                const __m128i in1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+                const __m128i in2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+                const __m128i in3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48));
+                __m128i error;
+                if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(in0, in1), _mm_or_si128(in2, in3))) == 0) {
+                    // All ASCII: only a sequence left open by the previous block can fail
+                    error = prev_incomplete;
+                    prev_incomplete = _mm_setzero_si128();
+                }
+                else {
+                    error = _mm_or_si128(_mm_or_si128(check_block(in0, prev_input), check_block(in1, in0)),
+                                         _mm_or_si128(check_block(in2, in1), check_block(in3, in2)));
+                    prev_incomplete = _mm_subs_epu8(in3, incomplete_max);
+                }
+                if (!_mm_testz_si128(error, error))
+                    break;
+                prev_input = in3;
+            }
+            return scalar::find_invalid(sequence_boundary(start, p), end);
+        }
+
+        /// Stores up to 16 octets past the end of the output
+        UTF8_CPP_TARGET_SSE42
+        inline uint8_t* encode_latin1(const uint8_t* start, const uint8_t* end, uint8_t* out)
+        {
+            const pack_tables& tables = utf16_pack_tables();
+            for (; end - start >= 16; start += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) == 0) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), input);
+                    out += 16;
+                    continue;
+                }
+                pack_short_units(_mm_unpacklo_epi8(input, _mm_setzero_si128()), out, tables);
+                pack_short_units(_mm_unpackhi_epi8(input, _mm_setzero_si128()), out, tables);
+            }
+            return scalar::encode_latin1(start, end, out);
+        }
+
+        /// Shuffles that move the octets of 8 lanes that are in the mask to the front
+        struct compact_tables {
+            uint8_t shuffle[256][16];
+
+            compact_tables()
+            {
+                for (int mask = 0; mask < 256; ++mask) {
+                    int length = 0;
+                    for (int lane = 0; lane < 8; ++lane)
+                        if (mask & (1 << lane))
+                            shuffle[mask][length++] = static_cast<uint8_t>(lane);
+                    while (length < 16)
+                        shuffle[mask][length++] = 0x80;
+                }
+            }
+        };
+
+        inline const compact_tables& octet_compact_tables()
+        {
+            static const compact_tables tables;
+            return tables;
+        }
+
+        /// Classifies a block of 16 octets that starts at a sequence boundary. Returns the
+        /// mask of lanes to consume (a lead in the last lane is left for the next block), or
+        /// 0 if the block has octets other than ASCII and U+0080..U+00FF sequences.
+        UTF8_CPP_TARGET_SSE42
+        inline int latin1_lanes(__m128i input, __m128i& lead_lanes, int& trails)
+        {
+            lead_lanes = _mm_cmpeq_epi8(_mm_and_si128(input, _mm_set1_epi8(char(0xfe))), _mm_set1_epi8(char(0xc2)));
+            const int leads = _mm_movemask_epi8(lead_lanes);
+            trails = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(input, _mm_set1_epi8(char(0xc0))),
+                                                      _mm_set1_epi8(char(0x80))));
+            const int lanes = (leads & 0x8000) ? 0x7fff : 0xffff;
+            if ((leads | trails) != _mm_movemask_epi8(input) || trails != (((leads & lanes) << 1) & 0xffff))
+                return 0;
+            return lanes;
+        }
+
+        /// Stores up to 16 octets past the end of the output
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* decode_latin1(const uint8_t* start, const uint8_t* end, uint8_t*& out)
+        {
+            const compact_tables& tables = octet_compact_tables();
+            uint8_t* it = out;
+            while (end - start >= 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) == 0) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(it), input);
+                    start += 16;
+                    it += 16;
+                    continue;
+                }
+                __m128i lead_lanes;
+                int trails;
+                const int lanes = latin1_lanes(input, lead_lanes, trails);
+                if (lanes == 0)
+                    break;
+                // Each lead takes the payload of the trail in the next lane
+                const __m128i decoded = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(input, _mm_set1_epi8(0x03)), 6),
+                                                     _mm_and_si128(_mm_srli_si128(input, 1), _mm_set1_epi8(0x3f)));
+                const __m128i octets = _mm_blendv_epi8(input, decoded, lead_lanes);
+                const int keep = ~trails & lanes;
+                const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[keep & 0xff]));
+                const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffle[keep >> 8]));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(it), _mm_shuffle_epi8(octets, low));
+                it += _mm_popcnt_u32(keep & 0xff);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(it), _mm_shuffle_epi8(_mm_srli_si128(octets, 8), high));
+                it += _mm_popcnt_u32(keep >> 8);
+                start += lanes == 0xffff ? 16 : 15;
+            }
+            out = it;
+            return scalar::decode_latin1(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* find_non_latin1(const uint8_t* start, const uint8_t* end)
+        {
+            while (end - start >= 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) == 0) {
+                    start += 16;
+                    continue;
+                }
+                __m128i lead_lanes;
+                int trails;
+                const int lanes = latin1_lanes(input, lead_lanes, trails);
+                if (lanes == 0)
+                    break;
+                start += lanes == 0xffff ? 16 : 15;
+            }
+            return scalar::find_non_latin1(start, end);
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline __m128i fold_ascii(__m128i input)
+        {
+            // Signed compares, so octets from 0x80 up are never letters
+            const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(input, _mm_set1_epi8(0x40)),
+                                                _mm_cmplt_epi8(input, _mm_set1_epi8(0x5b)));
+            return _mm_or_si128(input, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        }
+
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* mismatch_ascii_icase(const uint8_t* a, const uint8_t* a_end, const uint8_t* b)
+        {
+            for (; a_end - a >= 16; a += 16, b += 16) {
+                const __m128i equal = _mm_cmpeq_epi8(fold_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a))),
+                                                     fold_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b))));
+                const int mask = _mm_movemask_epi8(equal) ^ 0xffff;
+                if (mask != 0)
+                    return a + __builtin_ctz(mask);
+            }
+            return scalar::mismatch_ascii_icase(a, a_end, b);
+        }
+
+        /// Candidates are the positions where both the first and the last octet of the needle
+        /// match, 16 at a time; only those are compared in full
+        UTF8_CPP_TARGET_SSE42
+        inline const uint8_t* find_ascii_icase(const uint8_t* start, const uint8_t* end,
+                                               const uint8_t* needle, const uint8_t* needle_end)
+        {
+            const std::ptrdiff_t length = needle_end - needle;
+            const __m128i first = _mm_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[0])));
+            const __m128i last = _mm_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[length - 1])));
+            for (; end - start >= length + 15; start += 16) {
+                const __m128i at_first = _mm_cmpeq_epi8(first, fold_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start))));
+                const __m128i at_last = _mm_cmpeq_epi8(last,
+                    fold_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(start + length - 1))));
+                for (int mask = _mm_movemask_epi8(_mm_and_si128(at_first, at_last)); mask != 0; mask &= mask - 1) {
+                    const uint8_t* candidate = start + __builtin_ctz(mask);
+                    if (length <= 2 || mismatch_ascii_icase(candidate + 1, candidate + length - 1, needle + 1) == candidate + length - 1)
+                        return candidate;
+                }
+            }
+            return scalar::find_ascii_icase(start, end, needle, needle_end);
+        }
+    } // namespace utf8::internal::sse42
+
+    namespace avx2
+    {
+        UTF8_CPP_TARGET_AVX2
+        inline __m256i load_table(const uint8_t* table)
+        {
+            return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* find_non_ascii(const uint8_t* start, const uint8_t* end)
+        {
+            for (; end - start >= 32; start += 32) {
+                const int mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(start)));
+                if (mask != 0)
+                    return start + __builtin_ctz(mask);
+            }
+            return sse42::find_non_ascii(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* widen_ascii16(const uint8_t* start, const uint8_t* end, uint16_t* out)
+        {
+            for (; end - start >= 32; start += 32, out += 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start));
+                if (_mm256_movemask_epi8(input) != 0)
+                    break;
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(input)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(input, 1)));
+            }
+            return sse42::widen_ascii16(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* widen_ascii32(const uint8_t* start, const uint8_t* end, uint32_t* out)
+        {
+            for (; end - start >= 16; start += 16, out += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) != 0)
+                    break;
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_cvtepu8_epi32(input));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(input, 8)));
+            }
+            return scalar::widen_ascii32(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline std::size_t horizontal_sum(__m256i counts)
+        {
+            const __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+            const __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+            return static_cast<std::size_t>(_mm_cvtsi128_si32(halves) + _mm_extract_epi16(halves, 4));
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline std::size_t count_utf16(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t units = 0;
+            while (end - start >= 32) {
+                __m256i trails = _mm256_setzero_si256();
+                __m256i long_leads = _mm256_setzero_si256();
+                for (int i = 0; i < 255 && end - start >= 32; ++i, start += 32) {
+                    const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start));
+                    trails = _mm256_sub_epi8(trails, _mm256_cmpgt_epi8(_mm256_set1_epi8(char(0xc0)), input));
+                    long_leads = _mm256_sub_epi8(long_leads, _mm256_cmpeq_epi8(_mm256_max_epu8(input, _mm256_set1_epi8(char(0xf0))), input));
+                    units += 32;
+                }
+                units = units - horizontal_sum(trails) + horizontal_sum(long_leads);
+            }
+            return units + scalar::count_utf16(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline std::size_t count_code_points(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t count = 0;
+            while (end - start >= 64) {
+                __m256i trails = _mm256_setzero_si256();
+                for (int i = 0; i < 127 && end - start >= 64; ++i, start += 64) {
+                    const __m256i limit = _mm256_set1_epi8(char(0xc0));
+                    trails = _mm256_sub_epi8(trails, _mm256_cmpgt_epi8(limit, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start))));
+                    trails = _mm256_sub_epi8(trails, _mm256_cmpgt_epi8(limit, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start + 32))));
+                    count += 64;
+                }
+                count -= horizontal_sum(trails);
+            }
+            return count + scalar::count_code_points(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* skip_code_points(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; end - start >= 32; start += 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start));
+                const unsigned leads = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(char(0xc0)), input)));
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcount(leads));
+                if (count > n)
+                    break;
+                n -= count;
+            }
+            return sse42::skip_code_points(start, end, n);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* skip_code_points_back(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; n != 0 && end - start >= 32; end -= 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(end - 32));
+                const unsigned leads = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(char(0xc0)), input)));
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcount(leads));
+                if (count >= n)
+                    break;
+                n -= count;
+            }
+            return sse42::skip_code_points_back(start, end, n);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline __m256i check_block(__m256i input, __m256i prev_input)
+        {
+            const __m256i nibble = _mm256_set1_epi8(0x0f);
+            // Last 16 octets of the previous block followed by the first 16 of this one
+            const __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+            const __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+            const __m256i byte_1_high = _mm256_shuffle_epi8(load_table(simd_tables<void>::byte_1_high),
+                                                            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            const __m256i byte_1_low = _mm256_shuffle_epi8(load_table(simd_tables<void>::byte_1_low),
+                                                           _mm256_and_si256(prev1, nibble));
+            const __m256i byte_2_high = _mm256_shuffle_epi8(load_table(simd_tables<void>::byte_2_high),
+                                                            _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+            const __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+            const __m256i is_third = _mm256_subs_epu8(_mm256_alignr_epi8(input, shifted, 14), _mm256_set1_epi8(char(0xe0 - 0x80)));
+            const __m256i is_fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, shifted, 13), _mm256_set1_epi8(char(0xf0 - 0x80)));
+            const __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8(char(0x80)));
+            return _mm256_xor_si256(must_be_continuation, special_cases);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* find_invalid(const uint8_t* start, const uint8_t* end)
+        {
+            const __m256i incomplete_max = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(simd_tables<void>::incomplete_max + 32));
+            __m256i prev_input = _mm256_setzero_si256();
+            __m256i prev_incomplete = _mm256_setzero_si256();
+            const uint8_t* p = start;
+            for (; end - p >= 64; p += 64) {
+                const __m256i in0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                const __m256i in1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+                __m256i error;
+                if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0) {
+                    error = prev_incomplete;
+                    prev_incomplete = _mm256_setzero_si256();
+                }
+                else {
+                    error = _mm256_or_si256(check_block(in0, prev_input), check_block(in1, in0));
+                    prev_incomplete = _mm256_subs_epu8(in1, incomplete_max);
+                }
+                if (!_mm256_testz_si256(error, error))
+                    break;
+                prev_input = in1;
+            }
+            return scalar::find_invalid(sequence_boundary(start, p), end);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline __m256i fold_ascii(__m256i input)
+        {
+            const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(input, _mm256_set1_epi8(0x40)),
+                                                   _mm256_cmpgt_epi8(_mm256_set1_epi8(0x5b), input));
+            return _mm256_or_si256(input, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* mismatch_ascii_icase(const uint8_t* a, const uint8_t* a_end, const uint8_t* b)
+        {
+            for (; a_end - a >= 32; a += 32, b += 32) {
+                const __m256i equal = _mm256_cmpeq_epi8(fold_ascii(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a))),
+                                                        fold_ascii(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b))));
+                const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(equal));
+                if (mask != 0)
+                    return a + __builtin_ctz(mask);
+            }
+            return sse42::mismatch_ascii_icase(a, a_end, b);
+        }
+
+        UTF8_CPP_TARGET_AVX2
+        inline const uint8_t* find_ascii_icase(const uint8_t* start, const uint8_t* end,
+                                               const uint8_t* needle, const uint8_t* needle_end)
+        {
+            const std::ptrdiff_t length = needle_end - needle;
+            const __m256i first = _mm256_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[0])));
+            const __m256i last = _mm256_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[length - 1])));
+            for (; end - start >= length + 31; start += 32) {
+                const __m256i at_first = _mm256_cmpeq_epi8(first,
+                    fold_ascii(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(start))));
+                const __m256i at_last = _mm256_cmpeq_epi8(last,
+                    fold_ascii(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(start + length - 1))));
+                for (unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(at_first, at_last)));
+                        mask != 0; mask &= mask - 1) {
+                    const uint8_t* candidate = start + __builtin_ctz(mask);
+                    if (length <= 2 || mismatch_ascii_icase(candidate + 1, candidate + length - 1, needle + 1) == candidate + length - 1)
+                        return candidate;
+                }
+            }
+            return sse42::find_ascii_icase(start, end, needle, needle_end);
+        }
+    } // namespace utf8::internal::avx2
+
+    // AVX-512BW kernels work on 64 octets at a time with mask registers; the others are
+    // taken from avx2
+    namespace avx512
+    {
+        UTF8_CPP_TARGET_AVX512
+        inline __m512i load(const uint8_t* p)
+        {
+            return _mm512_loadu_si512(reinterpret_cast<const void*>(p));
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline __m512i load_table(const uint8_t* table)
+        {
+            // The maskz forms: GCC warns about the undefined source of the plain ones
+            return _mm512_maskz_broadcast_i32x4(__mmask16(0xffff), _mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+        }
+
+        // Octets that are not trail octets, as signed octets greater than 0xbf
+        UTF8_CPP_TARGET_AVX512
+        inline __mmask64 non_trails(__m512i input)
+        {
+            return _mm512_cmpgt_epi8_mask(input, _mm512_set1_epi8(char(0xbf)));
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* find_non_ascii(const uint8_t* start, const uint8_t* end)
+        {
+            for (; end - start >= 64; start += 64) {
+                const __mmask64 mask = _mm512_movepi8_mask(load(start));
+                if (mask != 0)
+                    return start + __builtin_ctzll(mask);
+            }
+            return avx2::find_non_ascii(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* widen_ascii16(const uint8_t* start, const uint8_t* end, uint16_t* out)
+        {
+            for (; end - start >= 32; start += 32, out += 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(start));
+                if (_mm256_movemask_epi8(input) != 0)
+                    break;
+                _mm512_storeu_si512(reinterpret_cast<void*>(out), _mm512_cvtepu8_epi16(input));
+            }
+            return avx2::widen_ascii16(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* widen_ascii32(const uint8_t* start, const uint8_t* end, uint32_t* out)
+        {
+            for (; end - start >= 16; start += 16, out += 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(start));
+                if (_mm_movemask_epi8(input) != 0)
+                    break;
+                _mm512_storeu_si512(reinterpret_cast<void*>(out), _mm512_maskz_cvtepu8_epi32(__mmask16(0xffff), input));
+            }
+            return scalar::widen_ascii32(start, end, out);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline std::size_t count_utf16(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t units = 0;
+            for (; end - start >= 64; start += 64) {
+                const __m512i input = load(start);
+                units += static_cast<std::size_t>(__builtin_popcountll(non_trails(input)) +
+                    __builtin_popcountll(_mm512_cmpge_epu8_mask(input, _mm512_set1_epi8(char(0xf0)))));
+            }
+            return units + avx2::count_utf16(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline std::size_t count_code_points(const uint8_t* start, const uint8_t* end)
+        {
+            std::size_t count = 0;
+            for (; end - start >= 64; start += 64)
+                count += static_cast<std::size_t>(__builtin_popcountll(non_trails(load(start))));
+            return count + avx2::count_code_points(start, end);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* skip_code_points(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; end - start >= 64; start += 64) {
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcountll(non_trails(load(start))));
+                if (count > n)
+                    break;
+                n -= count;
+            }
+            return avx2::skip_code_points(start, end, n);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* skip_code_points_back(const uint8_t* start, const uint8_t* end, std::size_t& n)
+        {
+            for (; n != 0 && end - start >= 64; end -= 64) {
+                const std::size_t count = static_cast<std::size_t>(__builtin_popcountll(non_trails(load(end - 64))));
+                if (count >= n)
+                    break;
+                n -= count;
+            }
+            return avx2::skip_code_points_back(start, end, n);
+        }
+
+        /// avx2::check_block on 64 octets
+        UTF8_CPP_TARGET_AVX512
+        inline __m512i check_block(__m512i input, __m512i prev_input)
+        {
+            const __m512i nibble = _mm512_set1_epi8(0x0f);
+            // Last 16 octets of the previous block followed by the first 48 of this one
+            const __m512i shifted = _mm512_permutex2var_epi64(prev_input, _mm512_setr_epi64(6, 7, 8, 9, 10, 11, 12, 13), input);
+            const __m512i prev1 = _mm512_alignr_epi8(input, shifted, 15);
+            const __m512i byte_1_high = _mm512_shuffle_epi8(load_table(simd_tables<void>::byte_1_high),
+                                                            _mm512_and_si512(_mm512_srli_epi16(prev1, 4), nibble));
+            const __m512i byte_1_low = _mm512_shuffle_epi8(load_table(simd_tables<void>::byte_1_low),
+                                                           _mm512_and_si512(prev1, nibble));
+            const __m512i byte_2_high = _mm512_shuffle_epi8(load_table(simd_tables<void>::byte_2_high),
+                                                            _mm512_and_si512(_mm512_srli_epi16(input, 4), nibble));
+            const __m512i special_cases = _mm512_and_si512(_mm512_and_si512(byte_1_high, byte_1_low), byte_2_high);
+            const __m512i is_third = _mm512_subs_epu8(_mm512_alignr_epi8(input, shifted, 14), _mm512_set1_epi8(char(0xe0 - 0x80)));
+            const __m512i is_fourth = _mm512_subs_epu8(_mm512_alignr_epi8(input, shifted, 13), _mm512_set1_epi8(char(0xf0 - 0x80)));
+            const __m512i must_be_continuation = _mm512_and_si512(_mm512_or_si512(is_third, is_fourth), _mm512_set1_epi8(char(0x80)));
+            return _mm512_xor_si512(must_be_continuation, special_cases);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* find_invalid(const uint8_t* start, const uint8_t* end)
+        {
+            const __m512i incomplete_max = load(simd_tables<void>::incomplete_max);
+            __m512i prev_input = _mm512_setzero_si512();
+            __m512i prev_incomplete = _mm512_setzero_si512();
+            const uint8_t* p = start;
+            for (; end - p >= 64; p += 64) {
+                const __m512i input = load(p);
+                __m512i error;
+                if (_mm512_movepi8_mask(input) == 0) {
+                    error = prev_incomplete;
+                    prev_incomplete = _mm512_setzero_si512();
+                }
+                else {
+                    error = check_block(input, prev_input);
+                    prev_incomplete = _mm512_subs_epu8(input, incomplete_max);
+                }
+                if (_mm512_test_epi8_mask(error, error) != 0)
+                    break;
+                prev_input = input;
+            }
+            return scalar::find_invalid(sequence_boundary(start, p), end);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline __m512i fold_ascii(__m512i input)
+        {
+            const __mmask64 upper = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(input, _mm512_set1_epi8('A')), _mm512_set1_epi8(26));
+            return _mm512_mask_add_epi8(input, upper, input, _mm512_set1_epi8(0x20));
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* mismatch_ascii_icase(const uint8_t* a, const uint8_t* a_end, const uint8_t* b)
+        {
+            for (; a_end - a >= 64; a += 64, b += 64) {
+                const __mmask64 mask = _mm512_cmpneq_epi8_mask(fold_ascii(load(a)), fold_ascii(load(b)));
+                if (mask != 0)
+                    return a + __builtin_ctzll(mask);
+            }
+            return avx2::mismatch_ascii_icase(a, a_end, b);
+        }
+
+        UTF8_CPP_TARGET_AVX512
+        inline const uint8_t* find_ascii_icase(const uint8_t* start, const uint8_t* end,
+                                               const uint8_t* needle, const uint8_t* needle_end)
+        {
+            const std::ptrdiff_t length = needle_end - needle;
+            const __m512i first = _mm512_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[0])));
+            const __m512i last = _mm512_set1_epi8(static_cast<char>(scalar::fold_ascii(needle[length - 1])));
+            for (; end - start >= length + 63; start += 64) {
+                __mmask64 mask = _mm512_cmpeq_epi8_mask(first, fold_ascii(load(start))) &
+                                 _mm512_cmpeq_epi8_mask(last, fold_ascii(load(start + length - 1)));
+                for (; mask != 0; mask &= mask - 1) {
+                    const uint8_t* candidate = start + __builtin_ctzll(mask);
+                    if (length <= 2 || mismatch_ascii_icase(candidate + 1, candidate + length - 1, needle + 1) == candidate + length - 1)
+                        return candidate;
+                }
+            }
+            return avx2::find_ascii_icase(start, end, needle, needle_end);
+        }
+    } // namespace utf8::internal::avx512
+#endif // UTF8_CPP_X86
+
+#if defined(UTF8_CPP_NEON)
+    namespace neon
+    {
+        inline const uint8_t* find_non_ascii(const uint8_t* start, const uint8_t* end)
+        {
+            for (; end - start >= 16; start += 16)
+                if (vmaxvq_u8(vld1q_u8(start)) >= 0x80)
+                    break;
+            return scalar::find_non_ascii(start, end);
+        }
+
+        inline uint8x16_t check_block(uint8x16_t input, uint8x16_t prev_input)
+        {
+            const uint8x16_t nibble = vdupq_n_u8(0x0f);
+            const uint8x16_t prev1 = vextq_u8(prev_input, input, 15);
+            const uint8x16_t byte_1_high = vqtbl1q_u8(vld1q_u8(simd_tables<void>::byte_1_high), vshrq_n_u8(prev1, 4));
+            const uint8x16_t byte_1_low = vqtbl1q_u8(vld1q_u8(simd_tables<void>::byte_1_low), vandq_u8(prev1, nibble));
+            const uint8x16_t byte_2_high = vqtbl1q_u8(vld1q_u8(simd_tables<void>::byte_2_high), vshrq_n_u8(input, 4));
+            const uint8x16_t special_cases = vandq_u8(vandq_u8(byte_1_high, byte_1_low), byte_2_high);
+            // Third and fourth octets of 3 and 4 octet sequences must be continuations
+            const uint8x16_t is_third = vqsubq_u8(vextq_u8(prev_input, input, 14), vdupq_n_u8(0xe0 - 0x80));
+            const uint8x16_t is_fourth = vqsubq_u8(vextq_u8(prev_input, input, 13), vdupq_n_u8(0xf0 - 0x80));
+            const uint8x16_t must_be_continuation = vandq_u8(vorrq_u8(is_third, is_fourth), vdupq_n_u8(0x80));
+            return veorq_u8(must_be_continuation, special_cases);
+        }
+
+        inline const uint8_t* find_invalid(const uint8_t* start, const uint8_t* end)
+        {
+            const uint8x16_t incomplete_max = vld1q_u8(simd_tables<void>::incomplete_max + 48);
+            uint8x16_t prev_input = vdupq_n_u8(0);
+            uint8x16_t prev_incomplete = vdupq_n_u8(0);
+            const uint8_t* p = start;
+            for (; end - p >= 64; p += 64) {
+                const uint8x16_t in0 = vld1q_u8(p);
+                const uint8x16_t in1 = vld1q_u8(p + 16);
+                const uint8x16_t in2 = vld1q_u8(p + 32);
+                const uint8x16_t in3 = vld1q_u8(p + 48);
+                uint8x16_t error;
+                if (vmaxvq_u8(vorrq_u8(vorrq_u8(in0, in1), vorrq_u8(in2, in3))) < 0x80) {
+                    // All ASCII: only a sequence left open by the previous block can fail
+                    error = prev_incomplete;
+                    prev_incomplete = vdupq_n_u8(0);
+                }
+                else {
+                    error = vorrq_u8(vorrq_u8(check_block(in0, prev_input), check_block(in1, in0)),
+                                     vorrq_u8(check_block(in2, in1), check_block(in3, in2)));
+                    prev_incomplete = vqsubq_u8(in3, incomplete_max);
+                }
+                if (vmaxvq_u8(error) != 0)
+                    break;
+                prev_input = in3;
+            }
+            return scalar::find_invalid(sequence_boundary(start, p), end);
+        }
+    } // namespace utf8::internal::neon
+#endif // UTF8_CPP_NEON
+
+    /// Instruction sets the kernels are built for, from the portable ones up
+    enum simd_tier { SIMD_SCALAR, SIMD_SSE42, SIMD_AVX2, SIMD_AVX512, SIMD_NEON };
+
+    /// The set of kernels used for contiguous octets, chosen once for the running CPU
+    struct simd_kernels {
+        simd_tier tier;
+        const uint8_t* (*find_invalid)(const uint8_t*, const uint8_t*);
+        const uint8_t* (*find_non_ascii)(const uint8_t*, const uint8_t*);
+        const uint8_t* (*widen_ascii16)(const uint8_t*, const uint8_t*, uint16_t*);
+        const uint8_t* (*widen_ascii32)(const uint8_t*, const uint8_t*, uint32_t*);
+        const uint16_t* (*encode_utf16)(const uint16_t*, const uint16_t*, uint8_t*&);
+        const uint32_t* (*encode_utf32)(const uint32_t*, const uint32_t*, uint8_t*&);
+        const uint8_t* (*decode_utf16)(const uint8_t*, const uint8_t*, uint16_t*&);
+        std::size_t (*count_utf16)(const uint8_t*, const uint8_t*);
+        std::size_t (*count_code_points)(const uint8_t*, const uint8_t*);
+        std::size_t (*count_utf8_from16)(const uint16_t*, const uint16_t*);
+        std::size_t (*count_utf8_from32)(const uint32_t*, const uint32_t*);
+        const uint8_t* (*skip_code_points)(const uint8_t*, const uint8_t*, std::size_t&);
+        const uint8_t* (*skip_code_points_back)(const uint8_t*, const uint8_t*, std::size_t&);
+        uint8_t* (*encode_latin1)(const uint8_t*, const uint8_t*, uint8_t*);
+        const uint8_t* (*decode_latin1)(const uint8_t*, const uint8_t*, uint8_t*&);
+        const uint8_t* (*find_non_latin1)(const uint8_t*, const uint8_t*);
+        const uint8_t* (*mismatch_ascii_icase)(const uint8_t*, const uint8_t*, const uint8_t*);
+        const uint8_t* (*find_ascii_icase)(const uint8_t*, const uint8_t*, const uint8_t*, const uint8_t*);
+    };
+
+    inline bool simd_tier_supported(simd_tier tier)
+    {
+        switch (tier) {
+            case SIMD_SCALAR:
+                return true;
+#if defined(UTF8_CPP_X86)
+            case SIMD_SSE42:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+            case SIMD_AVX2:
+                return simd_tier_supported(SIMD_SSE42) && __builtin_cpu_supports("avx2");
+            case SIMD_AVX512:
+                return simd_tier_supported(SIMD_AVX2) && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#elif defined(UTF8_CPP_NEON)
+            case SIMD_NEON:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /// The best supported tier that is not above limit
+    inline simd_tier best_simd_tier(simd_tier limit)
+    {
+        for (int tier = limit; tier != SIMD_SCALAR; --tier)
+            if (simd_tier_supported(simd_tier(tier)))
+                return simd_tier(tier);
+        return SIMD_SCALAR;
+    }
+
+    inline const char* simd_tier_name(simd_tier tier)
+    {
+        static const char* const names[] = {"scalar", "sse4.2", "avx2", "avx512", "neon"};
+        return names[tier];
+    }
+
+    /// Sets tier to the one with the given name and returns true if it is compiled in for
+    /// this architecture; returns false for any other name, and for NULL
+    inline bool simd_tier_named(const char* name, simd_tier& tier)
+    {
+        if (name == NULL)
+            return false;
+        for (int named = SIMD_SCALAR; named <= SIMD_NEON; ++named) {
+            if (std::strcmp(name, simd_tier_name(simd_tier(named))) != 0)
+                continue;
+#if defined(UTF8_CPP_X86)
+            if (named == SIMD_NEON)
+                return false;
+#elif defined(UTF8_CPP_NEON)
+            if (named != SIMD_SCALAR && named != SIMD_NEON)
+                return false;
+#else
+            if (named != SIMD_SCALAR)
+                return false;
+#endif
+            tier = simd_tier(named);
+            return true;
+        }
+        return false;
+    }
+
+    /// The kernels of a supported tier
+    inline simd_kernels simd_kernels_for(simd_tier tier)
+    {
+        simd_kernels kernels;
+        kernels.tier = tier;
+        kernels.find_invalid = scalar::find_invalid;
+        kernels.find_non_ascii = scalar::find_non_ascii;
+        kernels.widen_ascii16 = scalar::widen_ascii16;
+        kernels.widen_ascii32 = scalar::widen_ascii32;
+        kernels.encode_utf16 = scalar::encode_utf16;
+        kernels.encode_utf32 = scalar::encode_utf32;
+        kernels.decode_utf16 = scalar::decode_utf16;
+        kernels.count_utf16 = scalar::count_utf16;
+        kernels.count_code_points = scalar::count_code_points;
+        kernels.count_utf8_from16 = scalar::count_utf8_from16;
+        kernels.count_utf8_from32 = scalar::count_utf8_from32;
+        kernels.skip_code_points = scalar::skip_code_points;
+        kernels.skip_code_points_back = scalar::skip_code_points_back;
+        kernels.encode_latin1 = scalar::encode_latin1;
+        kernels.decode_latin1 = scalar::decode_latin1;
+        kernels.find_non_latin1 = scalar::find_non_latin1;
+        kernels.mismatch_ascii_icase = scalar::mismatch_ascii_icase;
+        kernels.find_ascii_icase = scalar::find_ascii_icase;
+#if defined(UTF8_CPP_X86)
+        if (tier == SIMD_AVX2 || tier == SIMD_AVX512) {
+            kernels.find_invalid = avx2::find_invalid;
+            kernels.find_non_ascii = avx2::find_non_ascii;
+            kernels.widen_ascii16 = avx2::widen_ascii16;
+            kernels.widen_ascii32 = avx2::widen_ascii32;
+            kernels.encode_utf16 = sse42::encode_utf16; // no wider version
+            kernels.encode_utf32 = sse42::encode_utf32; // no wider version
+            kernels.decode_utf16 = sse42::decode_utf16; // no wider version
+            kernels.count_utf16 = avx2::count_utf16;
+            kernels.count_code_points = avx2::count_code_points;
+            kernels.count_utf8_from16 = sse42::count_utf8_from16; // no wider version
+            kernels.count_utf8_from32 = sse42::count_utf8_from32; // no wider version
+            kernels.skip_code_points = avx2::skip_code_points;
+            kernels.skip_code_points_back = avx2::skip_code_points_back;
+            kernels.encode_latin1 = sse42::encode_latin1; // no wider version
+            kernels.decode_latin1 = sse42::decode_latin1; // no wider version
+            kernels.find_non_latin1 = sse42::find_non_latin1; // no wider version
+            kernels.mismatch_ascii_icase = avx2::mismatch_ascii_icase;
+            kernels.find_ascii_icase = avx2::find_ascii_icase;
+        }
+        if (tier == SIMD_AVX512) {
+            kernels.find_invalid = avx512::find_invalid;
+            kernels.find_non_ascii = avx512::find_non_ascii;
+            kernels.widen_ascii16 = avx512::widen_ascii16;
+            kernels.widen_ascii32 = avx512::widen_ascii32;
+            kernels.count_utf16 = avx512::count_utf16;
+            kernels.count_code_points = avx512::count_code_points;
+            kernels.skip_code_points = avx512::skip_code_points;
+            kernels.skip_code_points_back = avx512::skip_code_points_back;
+            kernels.mismatch_ascii_icase = avx512::mismatch_ascii_icase;
+            kernels.find_ascii_icase = avx512::find_ascii_icase;
+        }
+        else if (tier == SIMD_SSE42) {
+            kernels.find_invalid = sse42::find_invalid;
+            kernels.find_non_ascii = sse42::find_non_ascii;
+            kernels.widen_ascii16 = sse42::widen_ascii16;
+            kernels.widen_ascii32 = sse42::widen_ascii32;
+            kernels.encode_utf16 = sse42::encode_utf16;
+            kernels.encode_utf32 = sse42::encode_utf32;
+            kernels.decode_utf16 = sse42::decode_utf16;
+            kernels.count_utf16 = sse42::count_utf16;
+            kernels.count_code_points = sse42::count_code_points;
+            kernels.count_utf8_from16 = sse42::count_utf8_from16;
+            kernels.count_utf8_from32 = sse42::count_utf8_from32;
+            kernels.skip_code_points = sse42::skip_code_points;
+            kernels.skip_code_points_back = sse42::skip_code_points_back;
+            kernels.encode_latin1 = sse42::encode_latin1;
+            kernels.decode_latin1 = sse42::decode_latin1;
+            kernels.find_non_latin1 = sse42::find_non_latin1;
+            kernels.mismatch_ascii_icase = sse42::mismatch_ascii_icase;
+            kernels.find_ascii_icase = sse42::find_ascii_icase;
+        }
+#elif defined(UTF8_CPP_NEON)
+        if (tier == SIMD_NEON) {
+            kernels.find_invalid = neon::find_invalid;
+            kernels.find_non_ascii = neon::find_non_ascii;
+        }
+#endif
+        return kernels;
+    }
+
+    /// The kernels of a supported tier, built once and never changed afterwards
+    inline const simd_kernels& simd_kernels_of(simd_tier tier)
+    {
+#if defined(UTF8_CPP_X86)
+        static const simd_kernels tables[] = {simd_kernels_for(SIMD_SCALAR), simd_kernels_for(SIMD_SSE42),
+                                              simd_kernels_for(SIMD_AVX2), simd_kernels_for(SIMD_AVX512)};
+        return tables[tier];
+#elif defined(UTF8_CPP_NEON)
+        static const simd_kernels scalar_kernels = simd_kernels_for(SIMD_SCALAR);
+        static const simd_kernels neon_kernels = simd_kernels_for(SIMD_NEON);
+        return tier == SIMD_NEON ? neon_kernels : scalar_kernels;
+#else
+        static const simd_kernels scalar_kernels = simd_kernels_for(SIMD_SCALAR);
+        (void)tier;
+        return scalar_kernels;
+#endif
+    }
+
+    /// The best tier the CPU supports, capped at the one named by UTF8_CPP_SIMD in the
+    /// environment ("scalar", "sse4.2", "avx2", "avx512" or "neon"). Any other value is ignored.
+    inline simd_tier default_simd_tier()
+    {
+        simd_tier limit = SIMD_NEON;
+        simd_tier_named(std::getenv("UTF8_CPP_SIMD"), limit);
+        return best_simd_tier(limit);
+    }
+
+    /// The kernels in use, set to those of default_simd_tier on the first call. Once set it
+    /// only ever points to one of the tables of simd_kernels_of, and it is read and written
+    /// atomically, so use_simd_tier can switch it while other threads run the algorithms.
+    inline const simd_kernels*& simd_kernels_in_use()
+    {
+        static const simd_kernels* kernels = &simd_kernels_of(default_simd_tier());
+        return kernels;
+    }
+
+    inline const simd_kernels& active_simd_kernels()
+    {
+#if defined(UTF8_CPP_X86) || defined(UTF8_CPP_NEON)
+        return *__atomic_load_n(&simd_kernels_in_use(), __ATOMIC_ACQUIRE);
+#else
+        return *simd_kernels_in_use();
+#endif
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR octet_iterator find_invalid(octet_iterator start, octet_iterator end, generic_octets_tag)
+    {
+        octet_iterator result = start;
+        while (result != end) {
+            uint32_t cp = 0;
+            utf8::internal::utf_error err_code = utf8::internal::validate_next(result, end, cp);
+            if (err_code != internal::UTF8_OK)
+                return result;
+            UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+        }
+        return result;
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR octet_iterator find_invalid(octet_iterator start, octet_iterator end, contiguous_octets_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return utf8::internal::find_invalid(start, end, generic_octets_tag());
+        if (start == end)
+            return end;
+        const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* invalid = active_simd_kernels().find_invalid(first, first + (end - start));
+        UTF8_CPP_STAT(utf8::internal::count_fast_path(static_cast<std::size_t>(invalid - first),
+                                                      active_simd_kernels().count_code_points(first, invalid)));
+        return start + (invalid - first);
+    }
+
+    /// The end of the valid octets at start, found with the vectorized validator if the
+    /// input is contiguous; start itself otherwise
+    template <typename octet_iterator>
+    inline octet_iterator find_valid_end(octet_iterator start, octet_iterator, generic_octets_tag)
+    {
+        return start;
+    }
+
+    template <typename octet_iterator>
+    inline octet_iterator find_valid_end(octet_iterator start, octet_iterator end, contiguous_octets_tag)
+    {
+        return utf8::internal::find_invalid(start, end, contiguous_octets_tag());
+    }
+
+    template <typename octet_iterator>
+    inline octet_iterator find_valid_end(octet_iterator start, octet_iterator end)
+    {
+        return utf8::internal::find_valid_end(start, end, typename contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Returns the end of the run of ASCII octets at start. Generic iterators do not look
+    /// ahead, so for them the run is always empty and the callers decode octet by octet.
+    template <typename octet_iterator>
+    inline octet_iterator find_non_ascii(octet_iterator start, octet_iterator, generic_octets_tag)
+    {
+        return start;
+    }
+
+    template <typename octet_iterator>
+    inline octet_iterator find_non_ascii(octet_iterator start, octet_iterator end, contiguous_octets_tag)
+    {
+        if (start == end || utf8::internal::mask8(*start) >= 0x80)
+            return start;
+        const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* non_ascii = active_simd_kernels().find_non_ascii(first, first + (end - start));
+        return start + (non_ascii - first);
+    }
+
+    template <typename octet_iterator>
+    inline octet_iterator find_non_ascii(octet_iterator start, octet_iterator end)
+    {
+        return utf8::internal::find_non_ascii(start, end, typename contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Writes the run of ASCII octets at start as code units and returns the end of the run.
+    /// Conversions between pointers use the vectorized kernels.
+    template <typename octet_iterator, typename unit_iterator, typename unit_category>
+    inline octet_iterator widen_ascii(octet_iterator start, octet_iterator, unit_iterator&,
+                                      generic_octets_tag, unit_category)
+    {
+        return start;
+    }
+
+    template <typename octet_iterator, typename unit_iterator, typename unit_category>
+    inline octet_iterator widen_ascii(octet_iterator start, octet_iterator end, unit_iterator& result,
+                                      contiguous_octets_tag, unit_category)
+    {
+        const octet_iterator ascii_end = utf8::internal::find_non_ascii(start, end);
+        if (ascii_end != start) {
+            const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+            result = utf8::internal::write_run(first, first + (ascii_end - start), result);
+        }
+        return ascii_end;
+    }
+
+    template <typename unit_trait, typename octet_iterator, typename unit_iterator, typename kernel>
+    inline octet_iterator widen_ascii(octet_iterator start, octet_iterator end, unit_iterator& result, kernel widen)
+    {
+        if (start == end || utf8::internal::mask8(*start) >= 0x80)
+            return start;
+        const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* ascii_end = widen(first, first + (end - start), unit_trait::pointer(result));
+        result += ascii_end - first;
+        return start + (ascii_end - first);
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator, typename octet_category, typename unit_category>
+    inline octet_iterator widen_ascii16(octet_iterator start, octet_iterator end, u16bit_iterator& result,
+                                        octet_category octets, unit_category units)
+    {
+        return utf8::internal::widen_ascii(start, end, result, octets, units);
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator>
+    inline octet_iterator widen_ascii16(octet_iterator start, octet_iterator end, u16bit_iterator& result,
+                                        contiguous_octets_tag, contiguous_units_tag)
+    {
+        return utf8::internal::widen_ascii<contiguous_u16<u16bit_iterator> >(start, end, result,
+                                                                             active_simd_kernels().widen_ascii16);
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator>
+    inline octet_iterator widen_ascii16(octet_iterator start, octet_iterator end, u16bit_iterator& result)
+    {
+        return utf8::internal::widen_ascii16(start, end, result, typename contiguous_octets<octet_iterator>::category(),
+                                             typename contiguous_u16<u16bit_iterator>::category());
+    }
+
+    template <typename octet_iterator, typename u32bit_iterator, typename octet_category, typename unit_category>
+    inline octet_iterator widen_ascii32(octet_iterator start, octet_iterator end, u32bit_iterator& result,
+                                        octet_category octets, unit_category units)
+    {
+        return utf8::internal::widen_ascii(start, end, result, octets, units);
+    }
+
+    template <typename octet_iterator, typename u32bit_iterator>
+    inline octet_iterator widen_ascii32(octet_iterator start, octet_iterator end, u32bit_iterator& result,
+                                        contiguous_octets_tag, contiguous_units_tag)
+    {
+        return utf8::internal::widen_ascii<contiguous_u32<u32bit_iterator> >(start, end, result,
+                                                                             active_simd_kernels().widen_ascii32);
+    }
+
+    template <typename octet_iterator, typename u32bit_iterator>
+    inline octet_iterator widen_ascii32(octet_iterator start, octet_iterator end, u32bit_iterator& result)
+    {
+        return utf8::internal::widen_ascii32(start, end, result, typename contiguous_octets<octet_iterator>::category(),
+                                             typename contiguous_u32<u32bit_iterator>::category());
+    }
+
+    /// Encodes the run of valid UTF-16 at start as UTF-8 and returns the end of the run; the
+    /// caller is left with the invalid code units and pairs split by the end of a block. Like
+    /// widen_ascii, it does nothing for generic iterators.
+    template <typename u16bit_iterator, typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline u16bit_iterator encode_utf16(u16bit_iterator start, u16bit_iterator, octet_iterator&, generic_units_tag)
+    {
+        return start;
+    }
+
+    template <typename u16bit_iterator, typename octet_iterator>
+    u16bit_iterator encode_utf16_blocks(u16bit_iterator start, u16bit_iterator end, octet_iterator& result)
+    {
+        const uint16_t* const first = contiguous_u16<u16bit_iterator>::pointer(start);
+        const uint16_t* const last = first + (end - start);
+        // Runs of one or two code units are left to the caller
+        if (last - first < 3)
+            return start;
+        const uint16_t* it = first;
+        // The kernel writes up to 3 octets per code unit, so it works on blocks of a buffer.
+        // Copying them as char lets write_run become a memmove for the usual outputs. Its
+        // vector stores may run up to 16 octets past what it writes.
+        const std::ptrdiff_t BLOCK = 256;
+        uint8_t buffer[3 * BLOCK + 16];
+        while (it != last) {
+            const uint16_t* block_end = last - it > BLOCK ? it + BLOCK : last;
+            uint8_t* octets = buffer;
+            const uint16_t* run_end = active_simd_kernels().encode_utf16(it, block_end, octets);
+            result = utf8::internal::write_run(reinterpret_cast<const char*>(buffer), reinterpret_cast<const char*>(octets), result);
+            it = run_end;
+            if (run_end != block_end)
+                break;
+        }
+        return start + (it - first);
+    }
+
+    template <typename u16bit_iterator, typename octet_iterator>
+    UTF8_CPP_CONSTEXPR u16bit_iterator encode_utf16(u16bit_iterator start, u16bit_iterator end, octet_iterator& result, contiguous_units_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return start;
+        return utf8::internal::encode_utf16_blocks(start, end, result);
+    }
+
+    /// encode_utf16 for code points: encodes the run of valid code points at start
+    template <typename u32bit_iterator, typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline u32bit_iterator encode_utf32(u32bit_iterator start, u32bit_iterator, octet_iterator&, generic_units_tag)
+    {
+        return start;
+    }
+
+    template <typename u32bit_iterator, typename octet_iterator>
+    u32bit_iterator encode_utf32_blocks(u32bit_iterator start, u32bit_iterator end, octet_iterator& result)
+    {
+        const uint32_t* const first = contiguous_u32<u32bit_iterator>::pointer(start);
+        const uint32_t* const last = first + (end - start);
+        const uint32_t* it = first;
+        // Up to 4 octets per code point, as for encode_utf16_blocks
+        const std::ptrdiff_t BLOCK = 256;
+        uint8_t buffer[4 * BLOCK + 16];
+        while (it != last) {
+            const uint32_t* block_end = last - it > BLOCK ? it + BLOCK : last;
+            uint8_t* octets = buffer;
+            const uint32_t* run_end = active_simd_kernels().encode_utf32(it, block_end, octets);
+            result = utf8::internal::write_run(reinterpret_cast<const char*>(buffer), reinterpret_cast<const char*>(octets), result);
+            it = run_end;
+            if (run_end != block_end)
+                break;
+        }
+        return start + (it - first);
+    }
+
+    template <typename u32bit_iterator, typename octet_iterator>
+    UTF8_CPP_CONSTEXPR u32bit_iterator encode_utf32(u32bit_iterator start, u32bit_iterator end, octet_iterator& result, contiguous_units_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return start;
+        return utf8::internal::encode_utf32_blocks(start, end, result);
+    }
+
+#if defined(UTF8_CPP_STATS)
+    /// Counts a run of code units that encode_utf16 has converted
+    template <typename u16bit_iterator>
+    void count_utf16_run(u16bit_iterator start, u16bit_iterator end)
+    {
+        std::size_t code_points = 0, octets = 0;
+        for (; start != end; ++start) {
+            const uint16_t unit = utf8::internal::mask16(*start);
+            octets += unit < 0x80 ? 1 : unit < 0x800 || utf8::internal::is_surrogate(unit) ? 2 : 3;
+            code_points += !utf8::internal::is_trail_surrogate(unit);
+        }
+        utf8::internal::count_fast_path(octets, code_points);
+    }
+
+    /// Counts a run of code points that encode_utf32 has converted
+    template <typename u32bit_iterator>
+    void count_utf32_run(u32bit_iterator start, u32bit_iterator end)
+    {
+        std::size_t code_points = 0, octets = 0;
+        for (; start != end; ++start, ++code_points) {
+            const uint32_t cp = *start;
+            octets += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+        }
+        utf8::internal::count_fast_path(octets, code_points);
+    }
+#endif
+
+    /// Converts valid UTF-8 to UTF-16 with the vectorized kernel if the input is contiguous;
+    /// returns false, doing nothing, otherwise
+    template <typename octet_iterator, typename u16bit_iterator, typename unit_category>
+    UTF8_CPP_CONSTEXPR inline bool decode_utf16(octet_iterator, octet_iterator, u16bit_iterator&, generic_octets_tag, unit_category)
+    {
+        return false;
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator>
+    UTF8_CPP_CONSTEXPR bool decode_utf16(octet_iterator start, octet_iterator end, u16bit_iterator& result, contiguous_octets_tag, contiguous_units_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return false;
+        if (start < end) {
+            const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+            uint16_t* const out_start = contiguous_u16<u16bit_iterator>::pointer(result);
+            uint16_t* out = out_start;
+            active_simd_kernels().decode_utf16(first, first + (end - start), out);
+            result += out - out_start;
+        }
+        return true;
+    }
+
+    /// decode_utf16 for outputs that are not contiguous, through a buffer
+    template <typename octet_iterator, typename u16bit_iterator>
+    bool decode_utf16_blocks(octet_iterator start, octet_iterator end, u16bit_iterator& result)
+    {
+        if (!(start < end))
+            return true;
+        const uint8_t* it = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* const last = it + (end - start);
+        // Blocks end at code point boundaries and give at most one code unit per octet. On
+        // invalid input the last sequence of a block can run past its end, which gives one
+        // more, and the next block starts where that sequence ends.
+        const std::ptrdiff_t BLOCK = 256;
+        uint16_t buffer[BLOCK + 1];
+        while (it < last) {
+            const uint8_t* block_end = last - it > BLOCK ? it + BLOCK : last;
+            while (block_end != last && block_end != it && utf8::internal::is_trail(*block_end))
+                --block_end;
+            if (block_end == it) // only trail octets
+                block_end = it + BLOCK;
+            uint16_t* out = buffer;
+            it = active_simd_kernels().decode_utf16(it, block_end, out);
+            result = std::copy(buffer, out, result);
+        }
+        return true;
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator>
+    UTF8_CPP_CONSTEXPR bool decode_utf16(octet_iterator start, octet_iterator end, u16bit_iterator& result, contiguous_octets_tag, generic_units_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return false;
+        return utf8::internal::decode_utf16_blocks(start, end, result);
+    }
+
+    /// Converts Latin-1 to UTF-8, with the vectorized kernel if the input is contiguous
+    template <typename latin1_iterator, typename octet_iterator>
+    octet_iterator encode_latin1(latin1_iterator start, latin1_iterator end, octet_iterator result, generic_octets_tag)
+    {
+        for (; start != end; ++start) {
+            const uint8_t octet = utf8::internal::mask8(*start);
+            if (octet < 0x80)
+                *(result++) = octet;
+            else {
+                *(result++) = static_cast<uint8_t>(0xc0 | (octet >> 6));
+                *(result++) = static_cast<uint8_t>(0x80 | (octet & 0x3f));
+            }
+            UTF8_CPP_STAT(utf8::internal::count_code_point(octet));
+        }
+        return result;
+    }
+
+    template <typename latin1_iterator, typename octet_iterator>
+    octet_iterator encode_latin1(latin1_iterator start, latin1_iterator end, octet_iterator result, contiguous_octets_tag)
+    {
+        if (start == end)
+            return result;
+        const uint8_t* it = contiguous_octets<latin1_iterator>::pointer(start);
+        const uint8_t* const last = it + (end - start);
+        // Room for the kernel to store past the end of its output
+        const std::ptrdiff_t BLOCK = 256;
+        uint8_t buffer[2 * BLOCK + 16];
+        while (it != last) {
+            const uint8_t* block_end = last - it > BLOCK ? it + BLOCK : last;
+            const uint8_t* octets = active_simd_kernels().encode_latin1(it, block_end, buffer);
+            UTF8_CPP_STAT(utf8::internal::count_fast_path(static_cast<std::size_t>(octets - buffer),
+                                                          static_cast<std::size_t>(block_end - it)));
+            result = utf8::internal::write_run(reinterpret_cast<const char*>(buffer), reinterpret_cast<const char*>(octets), result);
+            it = block_end;
+        }
+        return result;
+    }
+
+    /// Converts the longest prefix of [start, end) that is ASCII and sequences of U+0080..U+00FF
+    /// to Latin-1 with the vectorized kernel and returns its end. Like widen_ascii, it does
+    /// nothing for generic iterators.
+    template <typename octet_iterator, typename latin1_iterator>
+    inline octet_iterator decode_latin1(octet_iterator start, octet_iterator, latin1_iterator&, generic_octets_tag)
+    {
+        return start;
+    }
+
+    template <typename octet_iterator, typename latin1_iterator>
+    octet_iterator decode_latin1(octet_iterator start, octet_iterator end, latin1_iterator& result, contiguous_octets_tag)
+    {
+        if (start == end)
+            return start;
+        const uint8_t* const first = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* const last = first + (end - start);
+        const std::ptrdiff_t BLOCK = 256;
+        uint8_t buffer[BLOCK + 16];
+        const uint8_t* it = first;
+        while (it != last) {
+            const uint8_t* block_end = last - it > BLOCK ? it + BLOCK : last;
+            // Blocks end between sequences
+            if (block_end != last && *(block_end - 1) >= 0xc0)
+                --block_end;
+            uint8_t* octets = buffer;
+            const uint8_t* run_end = active_simd_kernels().decode_latin1(it, block_end, octets);
+            UTF8_CPP_STAT(utf8::internal::count_fast_path(static_cast<std::size_t>(run_end - it),
+                                                          static_cast<std::size_t>(octets - buffer)));
+            result = utf8::internal::write_run(reinterpret_cast<const char*>(buffer), reinterpret_cast<const char*>(octets), result);
+            it = run_end;
+            if (run_end != block_end)
+                break;
+        }
+        return start + (it - first);
+    }
+
+    template <typename octet_iterator>
+    bool is_latin1(octet_iterator start, octet_iterator end, generic_octets_tag)
+    {
+        while (start != end) {
+            uint32_t cp = 0;
+            if (utf8::internal::validate_next(start, end, cp) != UTF8_OK || cp > 0xff)
+                return false;
+        }
+        return true;
+    }
+
+    template <typename octet_iterator>
+    bool is_latin1(octet_iterator start, octet_iterator end, contiguous_octets_tag)
+    {
+        if (start == end)
+            return true;
+        const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+        const uint8_t* last = first + (end - start);
+        return active_simd_kernels().find_non_latin1(first, last) == last;
+    }
+
+    /// Counts code points the way unchecked::next steps over them
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR typename std::iterator_traits<octet_iterator>::difference_type
+    count_code_points(octet_iterator first, octet_iterator last, generic_octets_tag)
+    {
+        typename std::iterator_traits<octet_iterator>::difference_type dist = 0;
+        for (; first < last; ++dist) {
+            typename std::iterator_traits<octet_iterator>::difference_type length = utf8::internal::sequence_length(first);
+            do
+                ++first;
+            while (--length > 0);
+        }
+        return dist;
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR typename std::iterator_traits<octet_iterator>::difference_type
+    count_code_points(octet_iterator first, octet_iterator last, contiguous_octets_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return utf8::internal::count_code_points(first, last, generic_octets_tag());
+        if (!(first < last))
+            return 0;
+        const uint8_t* start = contiguous_octets<octet_iterator>::pointer(first);
+        return static_cast<typename std::iterator_traits<octet_iterator>::difference_type>(
+            active_simd_kernels().count_code_points(start, start + (last - first)));
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline typename std::iterator_traits<octet_iterator>::difference_type
+    count_code_points(octet_iterator first, octet_iterator last)
+    {
+        return utf8::internal::count_code_points(first, last, typename contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Moves it over n code points of valid UTF-8 or up to end; returns the number of code
+    /// points that were left when end was reached
+    template <typename octet_iterator>
+    std::size_t skip_code_points(octet_iterator& it, octet_iterator end, std::size_t n, generic_octets_tag)
+    {
+        for (; it != end; ++it) {
+            if (!utf8::internal::is_trail(*it)) {
+                if (n == 0)
+                    return 0;
+                --n;
+            }
+        }
+        return n;
+    }
+
+    template <typename octet_iterator>
+    std::size_t skip_code_points(octet_iterator& it, octet_iterator end, std::size_t n, contiguous_octets_tag)
+    {
+        if (it == end)
+            return n;
+        const uint8_t* start = contiguous_octets<octet_iterator>::pointer(it);
+        it += active_simd_kernels().skip_code_points(start, start + (end - it), n) - start;
+        return n;
+    }
+
+    template <typename octet_iterator>
+    inline std::size_t skip_code_points(octet_iterator& it, octet_iterator end, std::size_t n)
+    {
+        return utf8::internal::skip_code_points(it, end, n, typename contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Validates and counts contiguous input in bulk; returns false if this is not possible
+    /// (generic iterators, or invalid input) and the caller has to decode code point by code point
+    template <typename octet_iterator, typename distance_type>
+    UTF8_CPP_CONSTEXPR inline bool count_valid_code_points(octet_iterator, octet_iterator, distance_type&, generic_octets_tag)
+    {
+        return false;
+    }
+
+    template <typename octet_iterator, typename distance_type>
+    UTF8_CPP_CONSTEXPR bool count_valid_code_points(octet_iterator first, octet_iterator last, distance_type& dist, contiguous_octets_tag)
+    {
+        if (UTF8_CPP_CONSTANT_EVALUATED())
+            return false;
+        if (!(first < last)) {
+            dist = 0;
+            return true;
+        }
+        const uint8_t* start = contiguous_octets<octet_iterator>::pointer(first);
+        const uint8_t* end = start + (last - first);
+        if (active_simd_kernels().find_invalid(start, end) != end)
+            return false;
+        dist = static_cast<distance_type>(active_simd_kernels().count_code_points(start, end));
+        return true;
+    }
+
+    template <typename octet_iterator>
+    std::size_t utf16_length(octet_iterator start, octet_iterator end, generic_octets_tag)
+    {
+        std::size_t units = 0;
+        for (; start != end; ++start)
+            units += !utf8::internal::is_trail(*start) + (utf8::internal::mask8(*start) >= 0xf0);
+        return units;
+    }
+
+    template <typename octet_iterator>
+    std::size_t utf16_length(octet_iterator start, octet_iterator end, contiguous_octets_tag)
+    {
+        if (start == end)
+            return 0;
+        const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+        return active_simd_kernels().count_utf16(first, first + (end - start));
+    }
+
+    template <typename u16bit_iterator>
+    std::size_t utf16to8_length(u16bit_iterator start, u16bit_iterator end, generic_units_tag)
+    {
+        std::size_t octets = 0;
+        for (; start != end; ++start) {
+            const uint16_t unit = utf8::internal::mask16(*start);
+            octets += 1 + (unit >= 0x80) + (unit >= 0x800) - utf8::internal::is_surrogate(unit);
+        }
+        return octets;
+    }
+
+    template <typename u16bit_iterator>
+    std::size_t utf16to8_length(u16bit_iterator start, u16bit_iterator end, contiguous_units_tag)
+    {
+        if (start == end)
+            return 0;
+        const uint16_t* first = contiguous_u16<u16bit_iterator>::pointer(start);
+        return active_simd_kernels().count_utf8_from16(first, first + (end - start));
+    }
+
+    template <typename u32bit_iterator>
+    std::size_t utf32to8_length(u32bit_iterator start, u32bit_iterator end, generic_units_tag)
+    {
+        std::size_t octets = 0;
+        for (; start != end; ++start) {
+            const uint32_t cp = *start;
+            octets += 1 + (cp >= 0x80) + (cp >= 0x800) + (cp >= 0x10000);
+        }
+        return octets;
+    }
+
+    template <typename u32bit_iterator>
+    std::size_t utf32to8_length(u32bit_iterator start, u32bit_iterator end, contiguous_units_tag)
+    {
+        if (start == end)
+            return 0;
+        const uint32_t* first = contiguous_u32<u32bit_iterator>::pointer(start);
+        return active_simd_kernels().count_utf8_from32(first, first + (end - start));
+    }
+
+} // namespace internal
+
+    /// The library API - functions intended to be called by the users
+
+    // Byte order mark
+    const uint8_t bom[] = {0xef, 0xbb, 0xbf};
+
+    // Error codes reported by the try_ functions, which do not throw
+    using internal::utf_error;
+    using internal::UTF8_OK;
+    using internal::NOT_ENOUGH_ROOM;
+    using internal::INVALID_LEAD;
+    using internal::INCOMPLETE_SEQUENCE;
+    using internal::OVERLONG_SEQUENCE;
+    using internal::INVALID_CODE_POINT;
+
+    using internal::stats;
+
+    /// The counters of the calling thread; all zero unless UTF8_CPP_STATS is defined
+    inline stats thread_stats()
+    {
+#if defined(UTF8_CPP_STATS)
+        return utf8::internal::thread_stats_record();
+#else
+        const stats none = stats();
+        return none;
+#endif
+    }
+
+    inline void reset_thread_stats()
+    {
+#if defined(UTF8_CPP_STATS)
+        const stats none = stats();
+        utf8::internal::thread_stats_record() = none;
+#endif
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline octet_iterator find_invalid(octet_iterator start, octet_iterator end)
+    {
+        return utf8::internal::find_invalid(start, end, typename utf8::internal::contiguous_octets<octet_iterator>::category());
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline bool is_valid(octet_iterator start, octet_iterator end)
+    {
+        return (utf8::find_invalid(start, end) == end);
+    }
+
+    /// The exact number of UTF-16 code units utf8to16 writes for valid UTF-8 input, so that
+    /// the output can be allocated up front. The input is not validated.
+    template <typename octet_iterator>
+    inline std::size_t utf16_length(octet_iterator start, octet_iterator end)
+    {
+        return utf8::internal::utf16_length(start, end, typename utf8::internal::contiguous_octets<octet_iterator>::category());
+    }
+
+    /// The exact number of octets utf16to8 writes for valid UTF-16 input. The input is not
+    /// validated.
+    template <typename u16bit_iterator>
+    inline std::size_t utf16to8_length(u16bit_iterator start, u16bit_iterator end)
+    {
+        return utf8::internal::utf16to8_length(start, end, typename utf8::internal::contiguous_u16<u16bit_iterator>::category());
+    }
+
+    /// The exact number of octets utf32to8 writes for valid code points. The input is not
+    /// validated.
+    template <typename u32bit_iterator>
+    inline std::size_t utf32to8_length(u32bit_iterator start, u32bit_iterator end)
+    {
+        return utf8::internal::utf32to8_length(start, end, typename utf8::internal::contiguous_u32<u32bit_iterator>::category());
+    }
+
+    /// Name of the instruction set of the kernels in use for contiguous input: "scalar",
+    /// "sse4.2", "avx2", "avx512" or "neon"
+    inline const char* active_simd_tier ()
+    {
+        return utf8::internal::simd_tier_name(utf8::internal::active_simd_kernels().tier);
+    }
+
+    /// Switches the kernels to the named tier, or to the best tier below it that the CPU
+    /// supports, and returns the name of the tier now in use. Returns NULL and leaves the
+    /// kernels as they are for any name other than those of active_simd_tier, and for the
+    /// tiers of another architecture. Algorithms already running on other threads may
+    /// finish with the kernels they started with.
+    inline const char* use_simd_tier (const char* name)
+    {
+        utf8::internal::simd_tier tier = utf8::internal::SIMD_SCALAR;
+        if (!utf8::internal::simd_tier_named(name, tier))
+            return NULL;
+#if defined(UTF8_CPP_X86) || defined(UTF8_CPP_NEON)
+        const utf8::internal::simd_kernels* kernels = &utf8::internal::simd_kernels_of(utf8::internal::best_simd_tier(tier));
+        __atomic_store_n(&utf8::internal::simd_kernels_in_use(), kernels, __ATOMIC_RELEASE);
+#endif
+        return utf8::active_simd_tier();
+    }
+
+    template <typename octet_iterator>
+    inline bool starts_with_bom (octet_iterator it, octet_iterator end)
+    {
+        return (
+            ((it != end) && (utf8::internal::mask8(*it++)) == bom[0]) &&
+            ((it != end) && (utf8::internal::mask8(*it++)) == bom[1]) &&
+            ((it != end) && (utf8::internal::mask8(*it))   == bom[2])
+           );
+    }
+    
+    //Deprecated in release 2.3 
+    template <typename octet_iterator>
+    inline bool is_bom (octet_iterator it)
+    {
+        return (
+            (utf8::internal::mask8(*it++)) == bom[0] &&
+            (utf8::internal::mask8(*it++)) == bom[1] &&
+            (utf8::internal::mask8(*it))   == bom[2]
+           );
+    }
+
+    //=============================================================================================
+    // checked
+    //=============================================================================================
+
+    // Base for the exceptions that may be thrown from the library
+    class exception : public ::std::exception {
+    };
+
+    // Exceptions that may be thrown from the library functions.
+    class invalid_code_point : public exception {
+        uint32_t cp;
+    public:
+        invalid_code_point(uint32_t cp) : cp(cp) {}
+        virtual const char* what() const throw() { return "Invalid code point"; }
+        uint32_t code_point() const {return cp;}
+    };
+
+    class invalid_utf8 : public exception {
+        uint8_t u8;
+    public:
+        invalid_utf8 (uint8_t u) : u8(u) {}
+        virtual const char* what() const throw() { return "Invalid UTF-8"; }
+        uint8_t utf8_octet() const {return u8;}
+    };
+
+    class invalid_utf16 : public exception {
+        uint16_t u16;
+    public:
+        invalid_utf16 (uint16_t u) : u16(u) {}
+        virtual const char* what() const throw() { return "Invalid UTF-16"; }
+        uint16_t utf16_word() const {return u16;}
+    };
+
+    class not_enough_room : public exception {
+    public:
+        virtual const char* what() const throw() { return "Not enough space"; }
+    };
+
+    /// The library API - functions intended to be called by the users
+
+    /// Non-throwing append: returns INVALID_CODE_POINT and leaves result as it is if cp
+    /// can not be encoded
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR utf_error try_append(uint32_t cp, octet_iterator& result)
+    {
+        if (!utf8::internal::is_code_point_valid(cp))
+            return INVALID_CODE_POINT;
+
+        if (cp < 0x80)                        // one octet
+            *(result++) = static_cast<uint8_t>(cp);
+        else if (cp < 0x800) {                // two octets
+            *(result++) = static_cast<uint8_t>((cp >> 6)            | 0xc0);
+            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+        }
+        else if (cp < 0x10000) {              // three octets
+            *(result++) = static_cast<uint8_t>((cp >> 12)           | 0xe0);
+            *(result++) = static_cast<uint8_t>(((cp >> 6) & 0x3f)   | 0x80);
+            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+        }
+        else {                                // four octets
+            *(result++) = static_cast<uint8_t>((cp >> 18)           | 0xf0);
+            *(result++) = static_cast<uint8_t>(((cp >> 12) & 0x3f)  | 0x80);
+            *(result++) = static_cast<uint8_t>(((cp >> 6) & 0x3f)   | 0x80);
+            *(result++) = static_cast<uint8_t>((cp & 0x3f)          | 0x80);
+        }
+        return UTF8_OK;
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR octet_iterator append(uint32_t cp, octet_iterator result)
+    {
+        if (utf8::try_append(cp, result) != UTF8_OK)
+            throw invalid_code_point(cp);
+        return result;
+    }
+
+namespace internal
+{
+    /// Replaces invalid sequences in [start, end) until it meets a sequence that is cut off
+    /// by end, in which case it returns NOT_ENOUGH_ROOM and leaves start at that sequence.
+    /// An invalid replacement is reported as INVALID_CODE_POINT at the first sequence that
+    /// needs it.
+    /// in_invalid_sequence carries over the trail octets of a replaced sequence: when set on
+    /// entry, leading trail octets are skipped; on return it tells whether end was reached
+    /// while skipping them.
+    template <typename octet_iterator, typename output_iterator>
+    utf_error replace_invalid_prefix(octet_iterator& start, octet_iterator end, output_iterator& out,
+                                     uint32_t replacement, bool& in_invalid_sequence)
+    {
+        if (in_invalid_sequence) {
+            while (start != end && utf8::internal::is_trail(*start))
+                ++start;
+            in_invalid_sequence = (start == end);
+        }
+        while (start != end) {
+            // Valid runs are copied as they are
+            octet_iterator valid_end = utf8::internal::find_valid_end(start, end);
+            if (valid_end != start) {
+                out = utf8::internal::write_run(start, valid_end, out);
+                start = valid_end;
+                continue;
+            }
+            octet_iterator sequence_start = start;
+            uint32_t cp = 0;
+            utf_error err_code = utf8::internal::validate_next(start, end, cp);
+            switch (err_code) {
+                case UTF8_OK :
+                    UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+                    for (octet_iterator it = sequence_start; it != start; ++it)
+                        *out++ = *it;
+                    break;
+                case NOT_ENOUGH_ROOM:
+                    return NOT_ENOUGH_ROOM;
+                case INVALID_LEAD:
+                    if (utf8::try_append(replacement, out) != UTF8_OK)
+                        return INVALID_CODE_POINT;
+                    ++start;
+                    break;
+                case INCOMPLETE_SEQUENCE:
+                case OVERLONG_SEQUENCE:
+                case INVALID_CODE_POINT:
+                    if (utf8::try_append(replacement, out) != UTF8_OK)
+                        return INVALID_CODE_POINT;
+                    ++start;
+                    // just one replacement mark for the sequence
+                    while (start != end && utf8::internal::is_trail(*start))
+                        ++start;
+                    in_invalid_sequence = (start == end);
+                    break;
+            }
+        }
+        return UTF8_OK;
+    }
+
+    /// For [start, end), a sequence that validate_next found cut off by end: NOT_ENOUGH_ROOM
+    /// if trail octets can still complete it, otherwise the error validate_next gives once
+    /// they do. Only the lead octet and the octet after it can rule that out.
+    template <typename octet_iterator>
+    utf_error truncated_sequence_error(octet_iterator start, octet_iterator end)
+    {
+        const int lead_class = decoder_tables<void>::lead[utf8::internal::mask8(*start)] >> 3;
+        const uint8_t second_min = decoder_tables<void>::second_min[lead_class];
+        const uint8_t second_max = decoder_tables<void>::second_max[lead_class];
+        if (second_min > second_max) // no second octet is allowed after this lead
+            return decoder_tables<void>::second_error[lead_class];
+        if (++start == end)
+            return NOT_ENOUGH_ROOM;
+        const uint8_t second = utf8::internal::mask8(*start);
+        if (second < second_min || second > second_max)
+            return decoder_tables<void>::second_error[lead_class];
+        return NOT_ENOUGH_ROOM;
+    }
+
+    /// The octets of a sequence that was cut off at the end of a chunk
+    class sequence_carry {
+        uint8_t octets[4];
+        std::size_t length;
+    public:
+        sequence_carry() : length(0) {}
+        bool empty() const { return length == 0; }
+        std::size_t size() const { return length; }
+        const uint8_t* begin() const { return octets; }
+        const uint8_t* end() const { return octets + length; }
+        void clear() { length = 0; }
+
+        template <typename octet_iterator>
+        void assign(octet_iterator start, octet_iterator end)
+        {
+            for (length = 0; start != end; ++start)
+                octets[length++] = utf8::internal::mask8(*start);
+        }
+
+        /// Takes the trail octets of the carried sequence from the front of the next chunk.
+        /// Returns NOT_ENOUGH_ROOM if the chunk ends before the sequence does and it can
+        /// still be completed. Otherwise the sequence is validated: on success start is moved
+        /// past the octets that were taken, on failure it is left where it was (those octets
+        /// are all trail octets).
+        template <typename octet_iterator>
+        utf_error complete(octet_iterator& start, octet_iterator end)
+        {
+            const std::size_t carried = length;
+            const std::size_t needed = static_cast<std::size_t>(utf8::internal::sequence_length(octets));
+            octet_iterator it = start;
+            // needed is at most 4; the second bound only lets GCC see that at -O3
+            while (length < needed && length < sizeof(octets) && it != end && utf8::internal::is_trail(*it))
+                octets[length++] = utf8::internal::mask8(*it++);
+            if (length < needed && it == end) {
+                const utf_error err_code = utf8::internal::truncated_sequence_error(octets, octets + length);
+                if (err_code != NOT_ENOUGH_ROOM)
+                    length = carried;
+                return err_code;
+            }
+
+            // Either the sequence has all of its octets, or the octet at it is not a trail
+            uint8_t sequence[4];
+            std::memcpy(sequence, octets, length);
+            std::size_t sequence_size = length;
+            if (length < needed)
+                sequence[sequence_size++] = utf8::internal::mask8(*it);
+            const uint8_t* sequence_it = sequence;
+            const uint8_t* const sequence_end = sequence + sequence_size;
+            const utf_error err_code = utf8::internal::validate_next(sequence_it, sequence_end);
+            if (err_code == UTF8_OK) {
+                start = it;
+            }
+            else
+                length = carried;
+            return err_code;
+        }
+    };
+} // namespace internal
+
+    /// Non-throwing replace_invalid: on failure start is left at the sequence that could not
+    /// be handled and out past the output written so far. Returns NOT_ENOUGH_ROOM if the
+    /// input ends in the middle of a sequence.
+    template <typename octet_iterator, typename output_iterator>
+    inline utf_error try_replace_invalid(octet_iterator& start, octet_iterator end, output_iterator& out, uint32_t replacement)
+    {
+        bool in_invalid_sequence = false;
+        return utf8::internal::replace_invalid_prefix(start, end, out, replacement, in_invalid_sequence);
+    }
+
+    template <typename octet_iterator, typename output_iterator>
+    inline utf_error try_replace_invalid(octet_iterator& start, octet_iterator end, output_iterator& out)
+    {
+        const uint32_t replacement_marker = utf8::internal::mask16(0xfffd);
+        return utf8::try_replace_invalid(start, end, out, replacement_marker);
+    }
+
+    template <typename octet_iterator, typename output_iterator>
+    output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out, uint32_t replacement)
+    {
+        switch (utf8::try_replace_invalid(start, end, out, replacement)) {
+            case internal::NOT_ENOUGH_ROOM:
+                throw not_enough_room();
+            case internal::INVALID_CODE_POINT:
+                throw invalid_code_point(replacement);
+            default:
+                break;
+        }
+        return out;
+    }
+
+    template <typename octet_iterator, typename output_iterator>
+    inline output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out)
+    {
+        const uint32_t replacement_marker = utf8::internal::mask16(0xfffd);
+        return utf8::replace_invalid(start, end, out, replacement_marker);
+    }
+
+namespace internal
+{
+    /// End of an invalid sequence the way replace_invalid sees it: an invalid lead octet
+    /// alone, anything else together with the trail octets that follow it
+    template <typename octet_iterator>
+    octet_iterator invalid_sequence_end(octet_iterator first, octet_iterator end, utf_error err_code)
+    {
+        ++first;
+        if (err_code != INVALID_LEAD)
+            while (first != end && utf8::internal::is_trail(*first))
+                ++first;
+        return first;
+    }
+} // namespace internal
+
+    /// Non-throwing replace_invalid_in_place: returns the error that replace_invalid_in_place
+    /// throws for, before anything is changed, and sets replaced otherwise
+    template <typename octet_container>
+    utf_error try_replace_invalid_in_place(octet_container& text, uint32_t replacement, bool& replaced)
+    {
+        typedef typename octet_container::value_type octet_type;
+        replaced = false;
+        if (text.empty())
+            return UTF8_OK;
+
+        const std::size_t size = text.size();
+        const octet_type* const start = &text[0];
+        const octet_type* const end = start + size;
+        const octet_type* const first_invalid = utf8::find_invalid(start, end);
+        if (first_invalid == end)
+            return UTF8_OK;
+
+        octet_type marker[4];
+        octet_type* marker_end = marker;
+        const bool marker_valid = utf8::try_append(replacement, marker_end) == internal::UTF8_OK;
+        const std::size_t marker_size = static_cast<std::size_t>(marker_end - marker);
+
+        // First find how far the output gets ahead of the input at most
+        std::ptrdiff_t lead = 0, max_lead = 0;
+        for (const octet_type* it = first_invalid; it != end; it = utf8::find_invalid(it, end)) {
+            const octet_type* const sequence = it;
+            const internal::utf_error err_code = utf8::internal::validate_next(it, end);
+            if (err_code == internal::NOT_ENOUGH_ROOM)
+                return NOT_ENOUGH_ROOM;
+            if (!marker_valid)
+                return INVALID_CODE_POINT;
+            it = utf8::internal::invalid_sequence_end(sequence, end, err_code);
+            lead += static_cast<std::ptrdiff_t>(marker_size) - (it - sequence);
+            max_lead = std::max(max_lead, lead);
+        }
+
+        // Then move the octets from the first invalid sequence on up by that much, so that the
+        // output never overwrites input that has not been read yet, and rewrite them in order
+        const std::size_t first = static_cast<std::size_t>(first_invalid - start);
+        const std::size_t shift = static_cast<std::size_t>(max_lead);
+        if (shift != 0) {
+            text.resize(size + shift);
+            std::memmove(&text[first + shift], &text[first], (size - first) * sizeof(octet_type));
+        }
+        octet_type* const data = &text[0];
+        octet_type* written = data + first;
+        const octet_type* read = data + first + shift;
+        const octet_type* const read_end = data + size + shift;
+        while (read != read_end) {
+            const octet_type* it = utf8::find_invalid(read, read_end);
+            std::memmove(written, read, static_cast<std::size_t>(it - read) * sizeof(octet_type));
+            written += it - read;
+            if (it == read_end)
+                break;
+            const octet_type* const sequence = it;
+            read = utf8::internal::invalid_sequence_end(sequence, read_end, utf8::internal::validate_next(it, read_end));
+            std::memcpy(written, marker, marker_size * sizeof(octet_type));
+            written += marker_size;
+        }
+        text.resize(static_cast<std::size_t>(written - data));
+        replaced = true;
+        return UTF8_OK;
+    }
+
+    /// replace_invalid for the contents of a std::string, std::vector<char> or a similar
+    /// contiguous container, done in place. Valid text is neither copied nor written to.
+    /// Otherwise the valid spans are moved together, and the container grows only as far
+    /// as the replacements need more room than the sequences they replace. Throws like
+    /// replace_invalid, but before anything is changed. Returns true if anything was replaced.
+    template <typename octet_container>
+    bool replace_invalid_in_place(octet_container& text, uint32_t replacement)
+    {
+        bool replaced = false;
+        switch (utf8::try_replace_invalid_in_place(text, replacement, replaced)) {
+            case internal::NOT_ENOUGH_ROOM:
+                throw not_enough_room();
+            case internal::INVALID_CODE_POINT:
+                throw invalid_code_point(replacement);
+            default:
+                break;
+        }
+        return replaced;
+    }
+
+    template <typename octet_container>
+    inline bool replace_invalid_in_place(octet_container& text)
+    {
+        return utf8::replace_invalid_in_place(text, utf8::internal::mask16(0xfffd));
+    }
+
+namespace internal
+{
+    /// End of the maximal subpart at first: the longest prefix of a well-formed sequence,
+    /// or just the first octet if it cannot start one (Unicode 3.9, U+FFFD substitution)
+    template <typename octet_iterator>
+    octet_iterator maximal_subpart_end(octet_iterator first, octet_iterator end)
+    {
+        const uint8_t info = decoder_tables<void>::lead[utf8::internal::mask8(*first)];
+        const int length = info & 0x7;
+        if (++first == end || length < 2)
+            return first;
+        const int lead_class = info >> 3;
+        const uint8_t second = utf8::internal::mask8(*first);
+        if (second < decoder_tables<void>::second_min[lead_class] || second > decoder_tables<void>::second_max[lead_class])
+            return first;
+        ++first;
+        for (int i = 2; i < length && first != end && utf8::internal::is_trail(*first); ++i)
+            ++first;
+        return first;
+    }
+} // namespace internal
+
+    // Replacement policies for replace_invalid_with. A policy decides how far each piece of
+    // invalid input reaches and what is written in its place:
+    //
+    //     octet_iterator invalid_end(octet_iterator first, octet_iterator end, utf_error err_code) const;
+    //     output_iterator replace(octet_iterator first, octet_iterator last, output_iterator out) const;
+    //
+    // invalid_end returns a position after first; err_code is the error validate_next gave
+    // at first, NOT_ENOUGH_ROOM for a sequence cut off by the end of the input. Any class
+    // with these members can be used, e.g. to escape or log the invalid octets.
+
+    /// One replacement per invalid sequence and its trail octets, as in replace_invalid
+    class replace_per_sequence {
+        uint32_t replacement;
+      public:
+        explicit replace_per_sequence(uint32_t replacement = 0xfffd) : replacement(replacement) {}
+        template <typename octet_iterator>
+        octet_iterator invalid_end(octet_iterator first, octet_iterator end, utf_error err_code) const
+        {
+            return utf8::internal::invalid_sequence_end(first, end, err_code);
+        }
+        template <typename octet_iterator, typename output_iterator>
+        output_iterator replace(octet_iterator, octet_iterator, output_iterator out) const
+        {
+            return utf8::append(replacement, out);
+        }
+    };
+
+    /// One replacement per invalid octet
+    class replace_per_octet {
+        uint32_t replacement;
+      public:
+        explicit replace_per_octet(uint32_t replacement = 0xfffd) : replacement(replacement) {}
+        template <typename octet_iterator>
+        octet_iterator invalid_end(octet_iterator first, octet_iterator, utf_error) const
+        {
+            return ++first;
+        }
+        template <typename octet_iterator, typename output_iterator>
+        output_iterator replace(octet_iterator, octet_iterator, output_iterator out) const
+        {
+            return utf8::append(replacement, out);
+        }
+    };
+
+    /// One replacement per maximal subpart, as the WHATWG Encoding Standard decoder does
+    class replace_maximal_subpart {
+        uint32_t replacement;
+      public:
+        explicit replace_maximal_subpart(uint32_t replacement = 0xfffd) : replacement(replacement) {}
+        template <typename octet_iterator>
+        octet_iterator invalid_end(octet_iterator first, octet_iterator end, utf_error) const
+        {
+            return utf8::internal::maximal_subpart_end(first, end);
+        }
+        template <typename octet_iterator, typename output_iterator>
+        output_iterator replace(octet_iterator, octet_iterator, output_iterator out) const
+        {
+            return utf8::append(replacement, out);
+        }
+    };
+
+    /// Invalid octets are left out
+    class drop_invalid {
+      public:
+        template <typename octet_iterator>
+        octet_iterator invalid_end(octet_iterator first, octet_iterator end, utf_error err_code) const
+        {
+            return utf8::internal::invalid_sequence_end(first, end, err_code);
+        }
+        template <typename octet_iterator, typename output_iterator>
+        output_iterator replace(octet_iterator, octet_iterator, output_iterator out) const
+        {
+            return out;
+        }
+    };
+
+    /// replace_invalid with the handling of invalid input left to policy. Unlike
+    /// replace_invalid it does not throw for input that ends in the middle of a sequence;
+    /// that sequence is passed to the policy like any other invalid one.
+    template <typename octet_iterator, typename output_iterator, typename policy_type>
+    output_iterator replace_invalid_with(octet_iterator start, octet_iterator end, output_iterator out, policy_type policy)
+    {
+        while (start != end) {
+            octet_iterator valid_end = utf8::internal::find_valid_end(start, end);
+            if (valid_end != start) {
+                out = utf8::internal::write_run(start, valid_end, out);
+                start = valid_end;
+                continue;
+            }
+            octet_iterator sequence_start = start;
+            uint32_t cp = 0;
+            const utf_error err_code = utf8::internal::validate_next(start, end, cp);
+            if (err_code == UTF8_OK) {
+                UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+                for (octet_iterator it = sequence_start; it != start; ++it)
+                    *out++ = *it;
+            }
+            else {
+                start = policy.invalid_end(sequence_start, end, err_code);
+                out = policy.replace(sequence_start, start, out);
+            }
+        }
+        return out;
+    }
+
+    /// Validates a stream of octets that arrives in chunks. A sequence split between two
+    /// chunks is carried over (at most 3 octets) instead of being reported as invalid;
+    /// only finish() treats an unfinished sequence as an error.
+    class stream_validator {
+        internal::sequence_carry carry;
+        std::size_t offset;
+        std::size_t invalid_offset;
+        bool failed;
+    public:
+        stream_validator () : offset(0), invalid_offset(0), failed(false) {}
+
+        /// Returns false as soon as the stream is known to be invalid
+        template <typename octet_iterator>
+        bool feed (octet_iterator start, octet_iterator end)
+        {
+            if (failed)
+                return false;
+            const octet_iterator chunk_start = start;
+            if (!carry.empty()) {
+                switch (carry.complete(start, end)) {
+                    case internal::UTF8_OK:
+                        break;
+                    case internal::NOT_ENOUGH_ROOM:
+                        offset += std::distance(chunk_start, end);
+                        return true;
+                    default:
+                        return fail(offset - carry.size());
+                }
+                carry.clear();
+            }
+            octet_iterator invalid = utf8::find_invalid(start, end);
+            if (invalid != end) {
+                octet_iterator sequence = invalid;
+                if (utf8::internal::validate_next(sequence, end) != internal::NOT_ENOUGH_ROOM ||
+                    utf8::internal::truncated_sequence_error(invalid, end) != internal::NOT_ENOUGH_ROOM)
+                    return fail(offset + std::distance(chunk_start, invalid));
+                carry.assign(invalid, end);
+            }
+            offset += std::distance(chunk_start, end);
+            return true;
+        }
+
+        /// Ends the stream; returns true if all of it was valid
+        bool finish ()
+        {
+            if (!failed && !carry.empty())
+                fail(offset - carry.size());
+            return !failed;
+        }
+
+        void reset () { *this = stream_validator(); }
+        bool valid () const { return !failed; }
+        /// Number of octets of an unfinished sequence at the end of the octets fed so far
+        std::size_t pending () const { return carry.size(); }
+        /// Offset in the stream of the first invalid sequence; meaningful only if !valid()
+        std::size_t invalid_position () const { return invalid_offset; }
+
+    private:
+        bool fail (std::size_t position)
+        {
+            failed = true;
+            invalid_offset = position;
+            carry.clear();
+            return false;
+        }
+    };
+
+    /// An append-only container of octets (a std::string, say) that knows whether it holds
+    /// valid UTF-8. Each append validates only the octets appended, with a sequence left
+    /// unfinished by the previous one carried over, so validity is known at any time without
+    /// rescanning the buffer.
+    template <typename octet_container>
+    class validated_buffer {
+        octet_container octets;
+        stream_validator validator;
+    public:
+        validated_buffer () {}
+        explicit validated_buffer (const octet_container& text) : octets(text)
+        {
+            validator.feed(octets.begin(), octets.end());
+        }
+
+        /// Returns false once the buffer holds octets that no further octets can make valid.
+        /// [start, end) is read twice, and must not be part of the buffer itself.
+        template <typename octet_iterator>
+        bool append (octet_iterator start, octet_iterator end)
+        {
+            const bool valid = validator.feed(start, end);
+            // Not insert: GCC 12 takes the overlap check of std::string::insert for an
+            // overlapping copy once it is inlined, and warns (-Wrestrict)
+            const std::size_t old_size = octets.size();
+            octets.resize(old_size + static_cast<std::size_t>(std::distance(start, end)));
+            std::copy(start, end, octets.begin() + static_cast<std::ptrdiff_t>(old_size));
+            return valid;
+        }
+
+        /// True if the buffer is valid UTF-8, with no sequence unfinished at its end
+        bool is_valid () const { return validator.valid() && validator.pending() == 0; }
+        /// True if the buffer is valid UTF-8 except maybe for an unfinished sequence at its end
+        bool is_valid_prefix () const { return validator.valid(); }
+        /// Length of the longest prefix that is valid and ends at a code point boundary
+        std::size_t valid_size () const
+        {
+            return validator.valid() ? octets.size() - validator.pending() : validator.invalid_position();
+        }
+
+        const octet_container& data () const { return octets; }
+        std::size_t size () const { return octets.size(); }
+
+        void clear ()
+        {
+            octets.clear();
+            validator.reset();
+        }
+    };
+
+    /// replace_invalid for a stream of octets that arrives in chunks. The output is the same
+    /// as for replace_invalid on the whole stream, except that a sequence cut off at the end
+    /// of the stream is replaced by finish() instead of throwing not_enough_room.
+    class stream_replacer {
+        internal::sequence_carry carry;
+        uint32_t replacement;
+        bool in_invalid_sequence;
+    public:
+        explicit stream_replacer (uint32_t replacement = utf8::internal::mask16(0xfffd)) :
+            replacement(replacement), in_invalid_sequence(false) {}
+
+        template <typename octet_iterator, typename output_iterator>
+        output_iterator feed (octet_iterator start, octet_iterator end, output_iterator out)
+        {
+            if (!carry.empty()) {
+                switch (carry.complete(start, end)) {
+                    case internal::UTF8_OK:
+                        out = std::copy(carry.begin(), carry.end(), out);
+                        break;
+                    case internal::NOT_ENOUGH_ROOM:
+                        return out;
+                    default:
+                        // The octets taken from this chunk are trail octets of the replaced sequence
+                        out = utf8::append(replacement, out);
+                        in_invalid_sequence = true;
+                        break;
+                }
+                carry.clear();
+            }
+            switch (utf8::internal::replace_invalid_prefix(start, end, out, replacement, in_invalid_sequence)) {
+                case internal::NOT_ENOUGH_ROOM:
+                    carry.assign(start, end);
+                    break;
+                case internal::INVALID_CODE_POINT:
+                    throw invalid_code_point(replacement);
+                default:
+                    break;
+            }
+            return out;
+        }
+
+        template <typename output_iterator>
+        output_iterator finish (output_iterator out)
+        {
+            if (!carry.empty())
+                out = utf8::append(replacement, out);
+            carry.clear();
+            in_invalid_sequence = false;
+            return out;
+        }
+    };
+
+    /// Non-throwing next: on failure it is left at the invalid sequence
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline utf_error try_next(octet_iterator& it, octet_iterator end, uint32_t& code_point)
+    {
+        return utf8::internal::validate_next(it, end, code_point);
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR uint32_t next(octet_iterator& it, octet_iterator end)
+    {
+        uint32_t cp = 0;
+        internal::utf_error err_code = utf8::internal::validate_next(it, end, cp);
+        switch (err_code) {
+            case internal::UTF8_OK :
+                break;
+            case internal::NOT_ENOUGH_ROOM :
+                throw not_enough_room();
+            case internal::INVALID_LEAD :
+            case internal::INCOMPLETE_SEQUENCE :
+            case internal::OVERLONG_SEQUENCE :
+                throw invalid_utf8(*it);
+            case internal::INVALID_CODE_POINT :
+                throw invalid_code_point(cp);
+        }
+        return cp;
+    }
+
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR uint32_t peek_next(octet_iterator it, octet_iterator end)
+    {
+        return utf8::next(it, end);
+    }
+
+    /// Non-throwing peek_next
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR inline utf_error try_peek_next(octet_iterator it, octet_iterator end, uint32_t& code_point)
+    {
+        return utf8::try_next(it, end, code_point);
+    }
+
+namespace internal
+{
+    /// Decodes the code point that ends just before it while scanning backwards. Succeeds,
+    /// moving it to the start of the sequence, only if the octets between the first lead
+    /// octet before it and it form one valid sequence; everything else (including all
+    /// errors) is left to the caller.
+    template <typename octet_iterator>
+    bool prior_valid(octet_iterator& it, octet_iterator start, uint32_t& code_point)
+    {
+        octet_iterator lead = it;
+        uint32_t cp = 0;
+        uint8_t second = 0;
+        for (int count = 1; lead != start && count <= 4; ++count) {
+            const uint8_t octet = utf8::internal::mask8(*--lead);
+            if (!utf8::internal::is_trail(octet)) {
+                const uint8_t info = decoder_tables<void>::lead[octet];
+                const int length = info & 0x7;
+                if (length != count)
+                    return false;
+                if (length > 1) {
+                    const int lead_class = info >> 3;
+                    if (second < decoder_tables<void>::second_min[lead_class] || second > decoder_tables<void>::second_max[lead_class])
+                        return false;
+                }
+                code_point = cp | ((octet & decoder_tables<void>::lead_mask[length]) << (6 * (count - 1)));
+                it = lead;
+                return true;
+            }
+            second = octet;
+            cp |= static_cast<uint32_t>(octet & 0x3f) << (6 * (count - 1));
+        }
+        return false;
+    }
+} // namespace internal
+
+    template <typename octet_iterator>
+    uint32_t prior(octet_iterator& it, octet_iterator start)
+    {
+        uint32_t cp = 0;
+        if (utf8::internal::prior_valid(it, start, cp))
+            return cp;
+
+        // can't do much if it == start
+        if (it == start)
+            throw not_enough_room();
+
+        octet_iterator end = it;
+        // Go back until we hit either a lead octet or start
+        while (utf8::internal::is_trail(*(--it)))
+            if (it == start)
+                throw invalid_utf8(*it); // error - no lead byte in the sequence
+        return utf8::peek_next(it, end);
+    }
+
+    /// Non-throwing prior: on failure it is left where it was, so that prior would throw
+    /// for it. INVALID_LEAD is also returned for trail octets that run back to start.
+    template <typename octet_iterator>
+    utf_error try_prior(octet_iterator& it, octet_iterator start, uint32_t& code_point)
+    {
+        if (utf8::internal::prior_valid(it, start, code_point))
+            return UTF8_OK;
+        if (it == start)
+            return NOT_ENOUGH_ROOM;
+        octet_iterator lead = it;
+        while (utf8::internal::is_trail(*(--lead)))
+            if (lead == start)
+                return INVALID_LEAD;
+        octet_iterator sequence = lead;
+        const utf_error err_code = utf8::internal::validate_next(sequence, it, code_point);
+        if (err_code == UTF8_OK)
+            it = lead;
+        return err_code;
+    }
+
+    /// Deprecated in versions that include "prior"
+    template <typename octet_iterator>
+    uint32_t previous(octet_iterator& it, octet_iterator pass_start)
+    {
+        octet_iterator end = it;
+        while (utf8::internal::is_trail(*(--it)))
+            if (it == pass_start)
+                throw invalid_utf8(*it); // error - no lead byte in the sequence
+        octet_iterator temp = it;
+        return utf8::next(temp, end);
+    }
+
+namespace internal
+{
+    /// Moves it back over n code points with try_prior, up to the first error
+    template <typename octet_iterator>
+    utf_error try_retreat(octet_iterator& it, std::size_t n, octet_iterator start, generic_octets_tag)
+    {
+        uint32_t cp = 0;
+        for (; n != 0; --n) {
+            const utf_error err_code = utf8::try_prior(it, start, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
+        }
+        return UTF8_OK;
+    }
+
+    /// Contiguous input is skipped in bulk by counting lead octets, and the octets skipped
+    /// are validated afterwards. Only if that fails does it go code point by code point,
+    /// to stop where try_prior fails.
+    template <typename octet_iterator>
+    utf_error try_retreat(octet_iterator& it, std::size_t n, octet_iterator start, contiguous_octets_tag)
+    {
+        if (it != start) {
+            const uint8_t* first = contiguous_octets<octet_iterator>::pointer(start);
+            const uint8_t* last = first + (it - start);
+            std::size_t left = n;
+            const uint8_t* target = active_simd_kernels().skip_code_points_back(first, last, left);
+            if (left == 0 && active_simd_kernels().find_invalid(target, last) == last) {
+                it -= last - target;
+                return UTF8_OK;
+            }
+        }
+        return utf8::internal::try_retreat(it, n, start, generic_octets_tag());
+    }
+} // namespace internal
+
+    /// Non-throwing advance: on failure it is left past the code points it could move over,
+    /// at the sequence where next would throw. A negative n does not move it; see try_retreat.
+    template <typename octet_iterator, typename distance_type>
+    utf_error try_advance (octet_iterator& it, distance_type n, octet_iterator end)
+    {
+        uint32_t cp = 0;
+        for (distance_type i = 0; i < n; ++i) {
+            const utf_error err_code = utf8::try_next(it, end, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
+        }
+        return UTF8_OK;
+    }
+
+    template <typename octet_iterator, typename distance_type>
+    void advance (octet_iterator& it, distance_type n, octet_iterator end)
+    {
+        if (utf8::try_advance(it, n, end) != UTF8_OK)
+            utf8::next(it, end); // throws the exception for the code point it stopped at
+    }
+
+    /// Non-throwing retreat: on failure it is left before the code points it could move back
+    /// over, at the sequence where prior would throw
+    template <typename octet_iterator, typename distance_type>
+    utf_error try_retreat (octet_iterator& it, distance_type n, octet_iterator start)
+    {
+        if (!(distance_type(0) < n))
+            return UTF8_OK;
+        return utf8::internal::try_retreat(it, static_cast<std::size_t>(n), start,
+                                           typename utf8::internal::contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Moves it back over n code points, not past start, as n calls of prior would
+    template <typename octet_iterator, typename distance_type>
+    void retreat (octet_iterator& it, distance_type n, octet_iterator start)
+    {
+        if (utf8::try_retreat(it, n, start) != UTF8_OK)
+            utf8::prior(it, start); // throws the exception for the code point it stopped at
+    }
+
+    /// Non-throwing distance: on failure first is left at the invalid sequence and dist is
+    /// the number of code points before it
+    template <typename octet_iterator>
+    UTF8_CPP_CONSTEXPR utf_error try_distance (octet_iterator& first, octet_iterator last,
+                                               typename std::iterator_traits<octet_iterator>::difference_type& dist)
+    {
+        if (utf8::internal::count_valid_code_points(first, last, dist,
+                typename utf8::internal::contiguous_octets<octet_iterator>::category())) {
+            first = last;
+            return UTF8_OK;
+        }
         uint32_t cp = 0;
-        internal::utf_error err_code = utf8::internal::validate_next(it, end, cp);
-        switch (err_code) {
-            case internal::UTF8_OK :
-                break;
-            case internal::NOT_ENOUGH_ROOM :
-                throw not_enough_room();
-            case internal::INVALID_LEAD :
-            case internal::INCOMPLETE_SEQUENCE :
-            case internal::OVERLONG_SEQUENCE :
-                throw invalid_utf8(*it);
-            case internal::INVALID_CODE_POINT :
-                throw invalid_code_point(cp);
+        for (dist = 0; first < last; ++dist) {
+            const utf_error err_code = utf8::try_next(first, last, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
         }
-        return cp;
+        return UTF8_OK;
     }
 
     template <typename octet_iterator>
-    uint32_t peek_next(octet_iterator it, octet_iterator end)
+    UTF8_CPP_CONSTEXPR typename std::iterator_traits<octet_iterator>::difference_type
+    distance (octet_iterator first, octet_iterator last)
     {
-        return utf8::next(it, end);
+        typename std::iterator_traits<octet_iterator>::difference_type dist = 0;
+        if (utf8::try_distance(first, last, dist) != UTF8_OK)
+            utf8::next(first, last); // throws the exception for the invalid sequence at first
+        return dist;
     }
 
+    /// The end of the longest prefix of [start, end) that has at most max_bytes octets and
+    /// does not cut a sequence in two. Only the octets around the cut are read (up to 3
+    /// before it), so the prefix is not validated, but a valid range gives a valid prefix.
     template <typename octet_iterator>
-    uint32_t prior(octet_iterator& it, octet_iterator start)
+    octet_iterator truncate_to_bytes (octet_iterator start, octet_iterator end, std::size_t max_bytes)
     {
-        // can't do much if it == start
-        if (it == start)
-            throw not_enough_room();
-
-        octet_iterator end = it;
-        // Go back until we hit either a lead octet or start
-        while (utf8::internal::is_trail(*(--it)))
-            if (it == start)
-                throw invalid_utf8(*it); // error - no lead byte in the sequence
-        return utf8::peek_next(it, end);
+        if (static_cast<std::size_t>(end - start) <= max_bytes)
+            return end;
+        const octet_iterator cut = start + static_cast<typename std::iterator_traits<octet_iterator>::difference_type>(max_bytes);
+        octet_iterator lead = cut;
+        for (int count = 0; count < 3 && lead != start && utf8::internal::is_trail(*lead); ++count)
+            --lead;
+        // A sequence that starts before the cut and runs past it is left out whole
+        if (lead != cut && !utf8::internal::is_trail(*lead) && utf8::internal::sequence_length(lead) > cut - lead)
+            return lead;
+        return cut;
     }
 
-    /// Deprecated in versions that include "prior"
-    template <typename octet_iterator>
-    uint32_t previous(octet_iterator& it, octet_iterator pass_start)
+namespace internal
+{
+    /// Code points that join the code point before them in an extended grapheme cluster:
+    /// Grapheme_Extend (Mn, Me and Other_Grapheme_Extend), the zero width joiner and the
+    /// emoji modifiers, as ranges [first, last]. Generated from Unicode 14.0.
+    struct extend_range {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    template <typename T>
+    struct extend_tables {
+        static const extend_range ranges[354];
+    };
+
+    template <typename T>
+    const extend_range extend_tables<T>::ranges[354] = {
+        {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+        {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+        {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711},
+        {0x0730, 0x074a}, {0x07a6, 0x07b0}, {0x07eb, 0x07f3}, {0x07fd, 0x07fd}, {0x0816, 0x0819},
+        {0x081b, 0x0823}, {0x0825, 0x0827}, {0x0829, 0x082d}, {0x0859, 0x085b}, {0x0898, 0x089f},
+        {0x08ca, 0x08e1}, {0x08e3, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948},
+        {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09bc, 0x09bc},
+        {0x09be, 0x09be}, {0x09c1, 0x09c4}, {0x09cd, 0x09cd}, {0x09d7, 0x09d7}, {0x09e2, 0x09e3},
+        {0x09fe, 0x09fe}, {0x0a01, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a42}, {0x0a47, 0x0a48},
+        {0x0a4b, 0x0a4d}, {0x0a51, 0x0a51}, {0x0a70, 0x0a71}, {0x0a75, 0x0a75}, {0x0a81, 0x0a82},
+        {0x0abc, 0x0abc}, {0x0ac1, 0x0ac5}, {0x0ac7, 0x0ac8}, {0x0acd, 0x0acd}, {0x0ae2, 0x0ae3},
+        {0x0afa, 0x0aff}, {0x0b01, 0x0b01}, {0x0b3c, 0x0b3c}, {0x0b3e, 0x0b3f}, {0x0b41, 0x0b44},
+        {0x0b4d, 0x0b4d}, {0x0b55, 0x0b57}, {0x0b62, 0x0b63}, {0x0b82, 0x0b82}, {0x0bbe, 0x0bbe},
+        {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd}, {0x0bd7, 0x0bd7}, {0x0c00, 0x0c00}, {0x0c04, 0x0c04},
+        {0x0c3c, 0x0c3c}, {0x0c3e, 0x0c40}, {0x0c46, 0x0c48}, {0x0c4a, 0x0c4d}, {0x0c55, 0x0c56},
+        {0x0c62, 0x0c63}, {0x0c81, 0x0c81}, {0x0cbc, 0x0cbc}, {0x0cbf, 0x0cbf}, {0x0cc2, 0x0cc2},
+        {0x0cc6, 0x0cc6}, {0x0ccc, 0x0ccd}, {0x0cd5, 0x0cd6}, {0x0ce2, 0x0ce3}, {0x0d00, 0x0d01},
+        {0x0d3b, 0x0d3c}, {0x0d3e, 0x0d3e}, {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d}, {0x0d57, 0x0d57},
+        {0x0d62, 0x0d63}, {0x0d81, 0x0d81}, {0x0dca, 0x0dca}, {0x0dcf, 0x0dcf}, {0x0dd2, 0x0dd4},
+        {0x0dd6, 0x0dd6}, {0x0ddf, 0x0ddf}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e},
+        {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd}, {0x0f18, 0x0f19}, {0x0f35, 0x0f35},
+        {0x0f37, 0x0f37}, {0x0f39, 0x0f39}, {0x0f71, 0x0f7e}, {0x0f80, 0x0f84}, {0x0f86, 0x0f87},
+        {0x0f8d, 0x0f97}, {0x0f99, 0x0fbc}, {0x0fc6, 0x0fc6}, {0x102d, 0x1030}, {0x1032, 0x1037},
+        {0x1039, 0x103a}, {0x103d, 0x103e}, {0x1058, 0x1059}, {0x105e, 0x1060}, {0x1071, 0x1074},
+        {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108d, 0x108d}, {0x109d, 0x109d}, {0x135d, 0x135f},
+        {0x1712, 0x1714}, {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17b4, 0x17b5},
+        {0x17b7, 0x17bd}, {0x17c6, 0x17c6}, {0x17c9, 0x17d3}, {0x17dd, 0x17dd}, {0x180b, 0x180d},
+        {0x180f, 0x180f}, {0x1885, 0x1886}, {0x18a9, 0x18a9}, {0x1920, 0x1922}, {0x1927, 0x1928},
+        {0x1932, 0x1932}, {0x1939, 0x193b}, {0x1a17, 0x1a18}, {0x1a1b, 0x1a1b}, {0x1a56, 0x1a56},
+        {0x1a58, 0x1a5e}, {0x1a60, 0x1a60}, {0x1a62, 0x1a62}, {0x1a65, 0x1a6c}, {0x1a73, 0x1a7c},
+        {0x1a7f, 0x1a7f}, {0x1ab0, 0x1ace}, {0x1b00, 0x1b03}, {0x1b34, 0x1b3a}, {0x1b3c, 0x1b3c},
+        {0x1b42, 0x1b42}, {0x1b6b, 0x1b73}, {0x1b80, 0x1b81}, {0x1ba2, 0x1ba5}, {0x1ba8, 0x1ba9},
+        {0x1bab, 0x1bad}, {0x1be6, 0x1be6}, {0x1be8, 0x1be9}, {0x1bed, 0x1bed}, {0x1bef, 0x1bf1},
+        {0x1c2c, 0x1c33}, {0x1c36, 0x1c37}, {0x1cd0, 0x1cd2}, {0x1cd4, 0x1ce0}, {0x1ce2, 0x1ce8},
+        {0x1ced, 0x1ced}, {0x1cf4, 0x1cf4}, {0x1cf8, 0x1cf9}, {0x1dc0, 0x1dff}, {0x200c, 0x200d},
+        {0x20d0, 0x20f0}, {0x2cef, 0x2cf1}, {0x2d7f, 0x2d7f}, {0x2de0, 0x2dff}, {0x302a, 0x302f},
+        {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d}, {0xa69e, 0xa69f}, {0xa6f0, 0xa6f1},
+        {0xa802, 0xa802}, {0xa806, 0xa806}, {0xa80b, 0xa80b}, {0xa825, 0xa826}, {0xa82c, 0xa82c},
+        {0xa8c4, 0xa8c5}, {0xa8e0, 0xa8f1}, {0xa8ff, 0xa8ff}, {0xa926, 0xa92d}, {0xa947, 0xa951},
+        {0xa980, 0xa982}, {0xa9b3, 0xa9b3}, {0xa9b6, 0xa9b9}, {0xa9bc, 0xa9bd}, {0xa9e5, 0xa9e5},
+        {0xaa29, 0xaa2e}, {0xaa31, 0xaa32}, {0xaa35, 0xaa36}, {0xaa43, 0xaa43}, {0xaa4c, 0xaa4c},
+        {0xaa7c, 0xaa7c}, {0xaab0, 0xaab0}, {0xaab2, 0xaab4}, {0xaab7, 0xaab8}, {0xaabe, 0xaabf},
+        {0xaac1, 0xaac1}, {0xaaec, 0xaaed}, {0xaaf6, 0xaaf6}, {0xabe5, 0xabe5}, {0xabe8, 0xabe8},
+        {0xabed, 0xabed}, {0xfb1e, 0xfb1e}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xff9e, 0xff9f},
+        {0x101fd, 0x101fd}, {0x102e0, 0x102e0}, {0x10376, 0x1037a}, {0x10a01, 0x10a03}, {0x10a05, 0x10a06},
+        {0x10a0c, 0x10a0f}, {0x10a38, 0x10a3a}, {0x10a3f, 0x10a3f}, {0x10ae5, 0x10ae6}, {0x10d24, 0x10d27},
+        {0x10eab, 0x10eac}, {0x10f46, 0x10f50}, {0x10f82, 0x10f85}, {0x11001, 0x11001}, {0x11038, 0x11046},
+        {0x11070, 0x11070}, {0x11073, 0x11074}, {0x1107f, 0x11081}, {0x110b3, 0x110b6}, {0x110b9, 0x110ba},
+        {0x110c2, 0x110c2}, {0x11100, 0x11102}, {0x11127, 0x1112b}, {0x1112d, 0x11134}, {0x11173, 0x11173},
+        {0x11180, 0x11181}, {0x111b6, 0x111be}, {0x111c9, 0x111cc}, {0x111cf, 0x111cf}, {0x1122f, 0x11231},
+        {0x11234, 0x11234}, {0x11236, 0x11237}, {0x1123e, 0x1123e}, {0x112df, 0x112df}, {0x112e3, 0x112ea},
+        {0x11300, 0x11301}, {0x1133b, 0x1133c}, {0x1133e, 0x1133e}, {0x11340, 0x11340}, {0x11357, 0x11357},
+        {0x11366, 0x1136c}, {0x11370, 0x11374}, {0x11438, 0x1143f}, {0x11442, 0x11444}, {0x11446, 0x11446},
+        {0x1145e, 0x1145e}, {0x114b0, 0x114b0}, {0x114b3, 0x114b8}, {0x114ba, 0x114ba}, {0x114bd, 0x114bd},
+        {0x114bf, 0x114c0}, {0x114c2, 0x114c3}, {0x115af, 0x115af}, {0x115b2, 0x115b5}, {0x115bc, 0x115bd},
+        {0x115bf, 0x115c0}, {0x115dc, 0x115dd}, {0x11633, 0x1163a}, {0x1163d, 0x1163d}, {0x1163f, 0x11640},
+        {0x116ab, 0x116ab}, {0x116ad, 0x116ad}, {0x116b0, 0x116b5}, {0x116b7, 0x116b7}, {0x1171d, 0x1171f},
+        {0x11722, 0x11725}, {0x11727, 0x1172b}, {0x1182f, 0x11837}, {0x11839, 0x1183a}, {0x11930, 0x11930},
+        {0x1193b, 0x1193c}, {0x1193e, 0x1193e}, {0x11943, 0x11943}, {0x119d4, 0x119d7}, {0x119da, 0x119db},
+        {0x119e0, 0x119e0}, {0x11a01, 0x11a0a}, {0x11a33, 0x11a38}, {0x11a3b, 0x11a3e}, {0x11a47, 0x11a47},
+        {0x11a51, 0x11a56}, {0x11a59, 0x11a5b}, {0x11a8a, 0x11a96}, {0x11a98, 0x11a99}, {0x11c30, 0x11c36},
+        {0x11c38, 0x11c3d}, {0x11c3f, 0x11c3f}, {0x11c92, 0x11ca7}, {0x11caa, 0x11cb0}, {0x11cb2, 0x11cb3},
+        {0x11cb5, 0x11cb6}, {0x11d31, 0x11d36}, {0x11d3a, 0x11d3a}, {0x11d3c, 0x11d3d}, {0x11d3f, 0x11d45},
+        {0x11d47, 0x11d47}, {0x11d90, 0x11d91}, {0x11d95, 0x11d95}, {0x11d97, 0x11d97}, {0x11ef3, 0x11ef4},
+        {0x16af0, 0x16af4}, {0x16b30, 0x16b36}, {0x16f4f, 0x16f4f}, {0x16f8f, 0x16f92}, {0x16fe4, 0x16fe4},
+        {0x1bc9d, 0x1bc9e}, {0x1cf00, 0x1cf2d}, {0x1cf30, 0x1cf46}, {0x1d165, 0x1d165}, {0x1d167, 0x1d169},
+        {0x1d16e, 0x1d172}, {0x1d17b, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0x1d242, 0x1d244},
+        {0x1da00, 0x1da36}, {0x1da3b, 0x1da6c}, {0x1da75, 0x1da75}, {0x1da84, 0x1da84}, {0x1da9b, 0x1da9f},
+        {0x1daa1, 0x1daaf}, {0x1e000, 0x1e006}, {0x1e008, 0x1e018}, {0x1e01b, 0x1e021}, {0x1e023, 0x1e024},
+        {0x1e026, 0x1e02a}, {0x1e130, 0x1e136}, {0x1e2ae, 0x1e2ae}, {0x1e2ec, 0x1e2ef}, {0x1e8d0, 0x1e8d6},
+        {0x1e944, 0x1e94a}, {0x1f3fb, 0x1f3ff}, {0xe0020, 0xe007f}, {0xe0100, 0xe01ef}
+    };
+
+    inline bool is_extending(uint32_t cp)
     {
-        octet_iterator end = it;
-        while (utf8::internal::is_trail(*(--it)))
-            if (it == pass_start)
-                throw invalid_utf8(*it); // error - no lead byte in the sequence
-        octet_iterator temp = it;
-        return utf8::next(temp, end);
+        if (cp < 0x300)
+            return false;
+        const extend_range* ranges = extend_tables<void>::ranges;
+        // The last range that starts at or before cp
+        std::size_t low = 0, high = sizeof(extend_tables<void>::ranges) / sizeof(ranges[0]);
+        while (low != high) {
+            const std::size_t middle = low + (high - low) / 2;
+            if (ranges[middle].first <= cp)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low != 0 && cp <= ranges[low - 1].last;
     }
 
-    template <typename octet_iterator, typename distance_type>
-    void advance (octet_iterator& it, distance_type n, octet_iterator end)
+    inline bool is_regional_indicator(uint32_t cp)
     {
-        for (distance_type i = 0; i < n; ++i)
-            utf8::next(it, end);
+        return cp >= 0x1f1e6 && cp <= 0x1f1ff;
     }
+} // namespace internal
 
+    /// truncate_to_bytes that also keeps clusters of code points whole: Grapheme_Extend code
+    /// points (combining marks, variation selectors, tags), emoji modifiers and zero width
+    /// joiners stay with the code point before them, zero width joiner sequences and flags
+    /// (pairs of regional indicators) are not split, and neither is CR LF. This is close to
+    /// extended grapheme clusters, but Hangul syllables built from jamo, SpacingMark and
+    /// Prepend code points can still be split. Looks back over the cluster that the cut
+    /// falls in, and stops at the first octets that are not valid.
     template <typename octet_iterator>
-    typename std::iterator_traits<octet_iterator>::difference_type
-    distance (octet_iterator first, octet_iterator last)
+    octet_iterator truncate_to_clusters (octet_iterator start, octet_iterator end, std::size_t max_bytes)
     {
-        typename std::iterator_traits<octet_iterator>::difference_type dist;
-        for (dist = 0; first < last; ++dist)
-            utf8::next(first, last);
-        return dist;
+        octet_iterator cut = utf8::truncate_to_bytes(start, end, max_bytes);
+        if (cut == end)
+            return cut;
+        octet_iterator after = cut;
+        uint32_t next_cp = 0;
+        if (utf8::internal::decode_next(after, end, next_cp) != internal::UTF8_OK)
+            return cut;
+        while (cut != start) {
+            octet_iterator before = cut;
+            uint32_t prior_cp = 0;
+            if (!utf8::internal::prior_valid(before, start, prior_cp))
+                return cut;
+            bool joined = utf8::internal::is_extending(next_cp) || prior_cp == 0x200d ||
+                          (prior_cp == '\r' && next_cp == '\n');
+            if (!joined && utf8::internal::is_regional_indicator(prior_cp) && utf8::internal::is_regional_indicator(next_cp)) {
+                // Regional indicators pair up from the first one in the run
+                std::size_t run = 1;
+                octet_iterator it = before;
+                uint32_t cp = 0;
+                while (utf8::internal::prior_valid(it, start, cp) && utf8::internal::is_regional_indicator(cp))
+                    ++run;
+                joined = run % 2 == 1;
+            }
+            if (!joined)
+                return cut;
+            cut = before;
+            next_cp = prior_cp;
+        }
+        return cut;
     }
 
+namespace internal
+{
+    /// try_utf16to8 that can stop between the surrogates of a pair, and that also returns the
+    /// code unit utf16to8 throws for: the unpaired surrogate, or the unit after a lead
+    /// surrogate that is not a trail surrogate. pending_lead is a lead surrogate (or 0) that
+    /// precedes start on entry, and is cleared once its trail surrogate is read. Every unit
+    /// is read once, so utf16to8 works with single-pass input iterators.
     template <typename u16bit_iterator, typename octet_iterator>
-    octet_iterator utf16to8 (u16bit_iterator start, u16bit_iterator end, octet_iterator result)
+    utf_error utf16to8_prefix (u16bit_iterator& start, u16bit_iterator end, octet_iterator& result,
+                               uint16_t& pending_lead, uint16_t& invalid_unit)
     {
-        while (start != end) {
-            uint32_t cp = utf8::internal::mask16(*start++);
+        // Work on copies: stores through result may alias the references
+        u16bit_iterator it = start;
+        octet_iterator out = result;
+        utf_error err_code = UTF8_OK;
+        uint32_t cp = 0;
+        if (pending_lead != 0 && it != end) {
+            const uint32_t trail_surrogate = utf8::internal::mask16(*it);
+            if (utf8::internal::is_trail_surrogate(trail_surrogate)) {
+                ++it;
+                const uint32_t pair = (static_cast<uint32_t>(pending_lead) << 10) + trail_surrogate + internal::SURROGATE_OFFSET;
+                utf8::try_append(pair, out); // always a valid code point
+                UTF8_CPP_STAT(utf8::internal::count_code_point(pair));
+                pending_lead = 0;
+            }
+            else {
+                cp = trail_surrogate;
+                err_code = INCOMPLETE_SEQUENCE;
+            }
+        }
+        while (err_code == UTF8_OK && it != end) {
+#if defined(UTF8_CPP_STATS)
+            const u16bit_iterator run_start = it;
+#endif
+            it = utf8::internal::encode_utf16(it, end, out, typename contiguous_u16<u16bit_iterator>::category());
+            UTF8_CPP_STAT(utf8::internal::count_utf16_run(run_start, it));
+            if (it == end)
+                break;
+            const u16bit_iterator sequence = it;
+            cp = utf8::internal::mask16(*it++);
             // Take care of surrogate pairs first
             if (utf8::internal::is_lead_surrogate(cp)) {
-                if (start != end) {
-                    uint32_t trail_surrogate = utf8::internal::mask16(*start++);
+                if (it == end)
+                    err_code = NOT_ENOUGH_ROOM;
+                else {
+                    const uint32_t trail_surrogate = utf8::internal::mask16(*it++);
                     if (utf8::internal::is_trail_surrogate(trail_surrogate))
                         cp = (cp << 10) + trail_surrogate + internal::SURROGATE_OFFSET;
-                    else
-                        throw invalid_utf16(static_cast<uint16_t>(trail_surrogate));
+                    else {
+                        cp = trail_surrogate;
+                        err_code = INCOMPLETE_SEQUENCE;
+                    }
                 }
-                else
-                    throw invalid_utf16(static_cast<uint16_t>(cp));
-
             }
             // Lone trail surrogate
             else if (utf8::internal::is_trail_surrogate(cp))
-                throw invalid_utf16(static_cast<uint16_t>(cp));
+                err_code = INVALID_LEAD;
+
+            if (err_code != UTF8_OK)
+                it = sequence;
+            else {
+                utf8::try_append(cp, out); // always a valid code point
+                UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+            }
+        }
+        if (err_code != UTF8_OK)
+            invalid_unit = static_cast<uint16_t>(cp);
+        start = it;
+        result = out;
+        return err_code;
+    }
+} // namespace internal
+
+    /// Non-throwing utf16to8: on failure start is left at the invalid code unit, or at the
+    /// lead surrogate of an invalid pair, and result past the octets written before it. A
+    /// lone trail surrogate is an INVALID_LEAD, a lead surrogate followed by anything but a
+    /// trail surrogate an INCOMPLETE_SEQUENCE, and one at the end NOT_ENOUGH_ROOM. Where
+    /// start is left is meaningful only for forward iterators.
+    template <typename u16bit_iterator, typename octet_iterator>
+    utf_error try_utf16to8 (u16bit_iterator& start, u16bit_iterator end, octet_iterator& result)
+    {
+        uint16_t pending_lead = 0, invalid_unit = 0;
+        return utf8::internal::utf16to8_prefix(start, end, result, pending_lead, invalid_unit);
+    }
+
+    template <typename u16bit_iterator, typename octet_iterator>
+    octet_iterator utf16to8 (u16bit_iterator start, u16bit_iterator end, octet_iterator result)
+    {
+        uint16_t pending_lead = 0, invalid_unit = 0;
+        if (utf8::internal::utf16to8_prefix(start, end, result, pending_lead, invalid_unit) != UTF8_OK)
+            throw invalid_utf16(invalid_unit);
+        return result;
+    }
+
+namespace internal
+{
+    /// stream_utf16to8. A template only so that finish(), which throws, is compiled only
+    /// where it is used and the rest works with -fno-exceptions.
+    template <typename T>
+    class stream_utf16to8 {
+        uint16_t pending_lead;
+
+        template <typename u16bit_iterator, typename octet_iterator>
+        utf_error feed_prefix (u16bit_iterator& start, u16bit_iterator end, octet_iterator& out, uint16_t& invalid_unit)
+        {
+            const utf_error err_code = utf8::internal::utf16to8_prefix(start, end, out, pending_lead, invalid_unit);
+            if (err_code != NOT_ENOUGH_ROOM)
+                return err_code;
+            // The chunk ends with a lead surrogate, which was its last unit
+            pending_lead = invalid_unit;
+            start = end;
+            return UTF8_OK;
+        }
+    public:
+        stream_utf16to8 () : pending_lead(0) {}
 
-            result = utf8::append(cp, result);
+        /// Non-throwing feed: on failure start is left at the invalid code unit, as for
+        /// try_utf16to8, and out past the octets written before it. A lead surrogate at the
+        /// end of the chunk is not an error.
+        template <typename u16bit_iterator, typename octet_iterator>
+        utf_error try_feed (u16bit_iterator& start, u16bit_iterator end, octet_iterator& out)
+        {
+            uint16_t invalid_unit = 0;
+            return feed_prefix(start, end, out, invalid_unit);
+        }
+
+        template <typename u16bit_iterator, typename octet_iterator>
+        octet_iterator feed (u16bit_iterator start, u16bit_iterator end, octet_iterator out)
+        {
+            uint16_t invalid_unit = 0;
+            if (feed_prefix(start, end, out, invalid_unit) != UTF8_OK)
+                throw invalid_utf16(invalid_unit);
+            return out;
+        }
+
+        /// Non-throwing finish: NOT_ENOUGH_ROOM if the stream ends with a lead surrogate
+        utf_error try_finish ()
+        {
+            const uint16_t lead = pending_lead;
+            pending_lead = 0;
+            return lead != 0 ? NOT_ENOUGH_ROOM : UTF8_OK;
+        }
+
+        /// Ends the stream; throws invalid_utf16 if it ends with a lead surrogate
+        void finish ()
+        {
+            const uint16_t lead = pending_lead;
+            if (try_finish() != UTF8_OK)
+                throw invalid_utf16(lead);
+        }
+
+        void reset () { pending_lead = 0; }
+        /// Whether the code units fed so far end with a lead surrogate
+        bool pending () const { return pending_lead != 0; }
+    };
+} // namespace internal
+
+    /// utf16to8 for a stream of code units that arrives in chunks. A surrogate pair split
+    /// between two chunks is carried over; only finish() treats a lead surrogate at the end
+    /// of the stream as an error. Invalid code units throw invalid_utf16 like utf16to8,
+    /// after the output that comes before them; the stream must be reset() to be reused.
+    /// try_feed() and try_finish() return the errors instead.
+    typedef internal::stream_utf16to8<void> stream_utf16to8;
+
+    /// Result of the convert_ functions: where they stopped reading the input and writing the
+    /// output, and the error they stopped at (UTF8_OK if they read all of the input)
+    template <typename octet_iterator, typename output_iterator>
+    struct conversion_result {
+        octet_iterator in;
+        output_iterator out;
+        utf_error error;
+        conversion_result (octet_iterator in, output_iterator out, utf_error error) : in(in), out(out), error(error) {}
+    };
+
+namespace internal
+{
+    /// Converts the valid prefix of [start, end) to UTF-16 and returns its end. Contiguous
+    /// input is validated and decoded by the kernels a block at a time, so that a block is
+    /// still in cache when it is decoded; generic input is left to the caller.
+    template <typename octet_iterator, typename u16bit_iterator>
+    inline octet_iterator decode_valid_utf16(octet_iterator start, octet_iterator, u16bit_iterator&, generic_octets_tag)
+    {
+        return start;
+    }
+
+    template <typename octet_iterator, typename u16bit_iterator>
+    octet_iterator decode_valid_utf16(octet_iterator start, octet_iterator end, u16bit_iterator& result, contiguous_octets_tag)
+    {
+        const std::ptrdiff_t BLOCK = 4096;
+        while (start != end) {
+            const octet_iterator block_end = end - start > BLOCK ? start + BLOCK : end;
+            const octet_iterator valid_end = utf8::internal::find_invalid(start, block_end, contiguous_octets_tag());
+            utf8::internal::decode_utf16(start, valid_end, result, contiguous_octets_tag(),
+                                         typename contiguous_u16<u16bit_iterator>::category());
+            // The sequence at valid_end is invalid or cut off by block_end
+            if (valid_end != block_end)
+                return valid_end;
+            start = valid_end;
+        }
+        return start;
+    }
+
+    template <typename u16bit_iterator>
+    u16bit_iterator append16(uint32_t cp, u16bit_iterator result)
+    {
+        if (cp > 0xffff) { //make a surrogate pair
+            *result++ = static_cast<uint16_t>((cp >> 10)   + internal::LEAD_OFFSET);
+            *result++ = static_cast<uint16_t>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
         }
+        else
+            *result++ = static_cast<uint16_t>(cp);
         return result;
     }
+} // namespace internal
 
+    /// Non-throwing utf8to16: on failure start is left at the invalid sequence and result
+    /// past the code units written for the input before it
     template <typename u16bit_iterator, typename octet_iterator>
-    u16bit_iterator utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result)
+    utf_error try_utf8to16 (octet_iterator& start, octet_iterator end, u16bit_iterator& result)
     {
         while (start != end) {
-            uint32_t cp = utf8::next(start, end);
-            if (cp > 0xffff) { //make a surrogate pair
-                *result++ = static_cast<uint16_t>((cp >> 10)   + internal::LEAD_OFFSET);
-                *result++ = static_cast<uint16_t>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
+            octet_iterator valid_end = utf8::internal::decode_valid_utf16(start, end, result,
+                typename internal::contiguous_octets<octet_iterator>::category());
+            if (valid_end != start) {
+                start = valid_end;
+                continue;
             }
-            else
-                *result++ = static_cast<uint16_t>(cp);
+            uint32_t cp = 0;
+            const utf_error err_code = utf8::internal::validate_next(start, end, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
+            UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+            result = utf8::internal::append16(cp, result);
         }
+        return UTF8_OK;
+    }
+
+    template <typename u16bit_iterator, typename octet_iterator>
+    u16bit_iterator utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result)
+    {
+        if (utf8::try_utf8to16(start, end, result) != UTF8_OK)
+            utf8::next(start, end); // throws the exception for the invalid sequence at start
         return result;
     }
 
+    /// Validates and converts in one pass without throwing. The output for the input before
+    /// the first invalid sequence is written; in is left at that sequence, so a sequence cut
+    /// off by end (NOT_ENOUGH_ROOM) can be completed from the next chunk of a stream.
+    template <typename u16bit_iterator, typename octet_iterator>
+    conversion_result<octet_iterator, u16bit_iterator> convert_utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result)
+    {
+        const utf_error err_code = utf8::try_utf8to16(start, end, result);
+        return conversion_result<octet_iterator, u16bit_iterator>(start, result, err_code);
+    }
+
+    /// convert_utf8to16 that goes on after invalid input: an invalid sequence, with the trail
+    /// octets after it as in replace_invalid, is converted to replacement, and so is one cut
+    /// off by end. error is the first error replaced. A replacement that is not a valid code
+    /// point stops the conversion at the first invalid sequence with INVALID_CODE_POINT.
+    template <typename u16bit_iterator, typename octet_iterator>
+    conversion_result<octet_iterator, u16bit_iterator> convert_utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result,
+                                                                          uint32_t replacement)
+    {
+        utf_error first_error = UTF8_OK;
+        for (;;) {
+            const utf_error err_code = utf8::try_utf8to16(start, end, result);
+            if (err_code == UTF8_OK)
+                break;
+            if (!utf8::internal::is_code_point_valid(replacement))
+                return conversion_result<octet_iterator, u16bit_iterator>(start, result, INVALID_CODE_POINT);
+            if (first_error == UTF8_OK)
+                first_error = err_code;
+            start = utf8::internal::invalid_sequence_end(start, end, err_code);
+            result = utf8::internal::append16(replacement, result);
+        }
+        return conversion_result<octet_iterator, u16bit_iterator>(start, result, first_error);
+    }
+
+namespace internal
+{
+    template <typename u32bit_iterator, typename octet_iterator>
+    utf_error try_utf32to8 (u32bit_iterator& start, u32bit_iterator end, octet_iterator& result, element_output_tag)
+    {
+        for (; start != end; ++start) {
+            const uint32_t cp = *start;
+            if (utf8::try_append(cp, result) != UTF8_OK)
+                return INVALID_CODE_POINT;
+            UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+        }
+        return UTF8_OK;
+    }
+
+    /// Sinks get the output in blocks encoded into a buffer
+    template <typename u32bit_iterator, typename octet_iterator>
+    utf_error try_utf32to8 (u32bit_iterator& start, u32bit_iterator end, octet_iterator& result, run_output_tag)
+    {
+        char buffer[256];
+        while (start != end) {
+            char* octets = buffer;
+            utf_error err_code = UTF8_OK;
+            for (; start != end && octets - buffer <= static_cast<std::ptrdiff_t>(sizeof(buffer)) - 4; ++start) {
+                const uint32_t cp = *start;
+                if (utf8::try_append(cp, octets) != UTF8_OK) {
+                    err_code = INVALID_CODE_POINT;
+                    break;
+                }
+                UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+            }
+            result = utf8::internal::write_run(static_cast<const char*>(buffer), static_cast<const char*>(octets), result);
+            if (err_code != UTF8_OK)
+                return err_code;
+        }
+        return UTF8_OK;
+    }
+} // namespace internal
+
+    /// Non-throwing utf32to8: on failure start is left at the invalid code point and result
+    /// past the octets written for the ones before it. Contiguous input is encoded by the
+    /// vectorized kernel up to the first invalid code point.
     template <typename octet_iterator, typename u32bit_iterator>
-    octet_iterator utf32to8 (u32bit_iterator start, u32bit_iterator end, octet_iterator result)
+    utf_error try_utf32to8 (u32bit_iterator& start, u32bit_iterator end, octet_iterator& result)
     {
-        while (start != end)
-            result = utf8::append(*(start++), result);
+#if defined(UTF8_CPP_STATS)
+        const u32bit_iterator run_start = start;
+#endif
+        start = utf8::internal::encode_utf32(start, end, result, typename internal::contiguous_u32<u32bit_iterator>::category());
+        UTF8_CPP_STAT(utf8::internal::count_utf32_run(run_start, start));
+        return utf8::internal::try_utf32to8(start, end, result, typename internal::output_runs<octet_iterator>::category());
+    }
 
+    template <typename octet_iterator, typename u32bit_iterator>
+    octet_iterator utf32to8 (u32bit_iterator start, u32bit_iterator end, octet_iterator result)
+    {
+        if (utf8::try_utf32to8(start, end, result) != UTF8_OK)
+            throw invalid_code_point(*start);
         return result;
     }
 
+    /// Non-throwing utf8to32, see try_utf8to16
+    template <typename octet_iterator, typename u32bit_iterator>
+    utf_error try_utf8to32 (octet_iterator& start, octet_iterator end, u32bit_iterator& result)
+    {
+        while (start != end) {
+            octet_iterator ascii_end = utf8::internal::widen_ascii32(start, end, result);
+            if (ascii_end != start) {
+                UTF8_CPP_STAT(utf8::internal::count_fast_path(static_cast<std::size_t>(std::distance(start, ascii_end)),
+                                                              static_cast<std::size_t>(std::distance(start, ascii_end))));
+                start = ascii_end;
+                continue;
+            }
+            uint32_t cp = 0;
+            const utf_error err_code = utf8::internal::validate_next(start, end, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
+            UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+            (*result++) = cp;
+        }
+        return UTF8_OK;
+    }
+
     template <typename octet_iterator, typename u32bit_iterator>
     u32bit_iterator utf8to32 (octet_iterator start, octet_iterator end, u32bit_iterator result)
     {
-        while (start != end)
-            (*result++) = utf8::next(start, end);
+        if (utf8::try_utf8to32(start, end, result) != UTF8_OK)
+            utf8::next(start, end); // throws the exception for the invalid sequence at start
+        return result;
+    }
+
+    /// utf8to32 that reports errors like convert_utf8to16
+    template <typename octet_iterator, typename u32bit_iterator>
+    conversion_result<octet_iterator, u32bit_iterator> convert_utf8to32 (octet_iterator start, octet_iterator end, u32bit_iterator result)
+    {
+        const utf_error err_code = utf8::try_utf8to32(start, end, result);
+        return conversion_result<octet_iterator, u32bit_iterator>(start, result, err_code);
+    }
+
+    /// utf8to32 that replaces invalid input like convert_utf8to16
+    template <typename octet_iterator, typename u32bit_iterator>
+    conversion_result<octet_iterator, u32bit_iterator> convert_utf8to32 (octet_iterator start, octet_iterator end, u32bit_iterator result,
+                                                                          uint32_t replacement)
+    {
+        utf_error first_error = UTF8_OK;
+        for (;;) {
+            const utf_error err_code = utf8::try_utf8to32(start, end, result);
+            if (err_code == UTF8_OK)
+                break;
+            if (!utf8::internal::is_code_point_valid(replacement))
+                return conversion_result<octet_iterator, u32bit_iterator>(start, result, INVALID_CODE_POINT);
+            if (first_error == UTF8_OK)
+                first_error = err_code;
+            start = utf8::internal::invalid_sequence_end(start, end, err_code);
+            (*result++) = replacement;
+        }
+        return conversion_result<octet_iterator, u32bit_iterator>(start, result, first_error);
+    }
+
+    /// Converts Latin-1 (ISO-8859-1) to UTF-8. Every octet is a code point, so it cannot fail.
+    template <typename latin1_iterator, typename octet_iterator>
+    octet_iterator latin1to8 (latin1_iterator start, latin1_iterator end, octet_iterator result)
+    {
+        return utf8::internal::encode_latin1(start, end, result, typename internal::contiguous_octets<latin1_iterator>::category());
+    }
+
+    /// Whether [start, end) is valid UTF-8 of code points up to U+00FF, i.e. whether
+    /// utf8tolatin1 succeeds on it
+    template <typename octet_iterator>
+    inline bool is_latin1 (octet_iterator start, octet_iterator end)
+    {
+        return utf8::internal::is_latin1(start, end, typename internal::contiguous_octets<octet_iterator>::category());
+    }
+
+    /// Non-throwing utf8tolatin1, see try_utf8to16. A code point above U+00FF is reported as
+    /// INVALID_CODE_POINT.
+    template <typename octet_iterator, typename latin1_iterator>
+    utf_error try_utf8tolatin1 (octet_iterator& start, octet_iterator end, latin1_iterator& result)
+    {
+        while (start != end) {
+            start = utf8::internal::decode_latin1(start, end, result, typename internal::contiguous_octets<octet_iterator>::category());
+            if (start == end)
+                break;
+            octet_iterator sequence_start = start;
+            uint32_t cp = 0;
+            const utf_error err_code = utf8::internal::validate_next(start, end, cp);
+            if (err_code != UTF8_OK)
+                return err_code;
+            if (cp > 0xff) {
+                start = sequence_start;
+                return INVALID_CODE_POINT;
+            }
+            (*result++) = static_cast<uint8_t>(cp);
+            UTF8_CPP_STAT(utf8::internal::count_code_point(cp));
+        }
+        return UTF8_OK;
+    }
 
+    /// Converts UTF-8 to Latin-1. Invalid UTF-8 throws what utf8to16 throws; a code point
+    /// above U+00FF throws invalid_code_point.
+    template <typename octet_iterator, typename latin1_iterator>
+    latin1_iterator utf8tolatin1 (octet_iterator start, octet_iterator end, latin1_iterator result)
+    {
+        if (utf8::try_utf8tolatin1(start, end, result) != UTF8_OK)
+            throw invalid_code_point(utf8::next(start, end)); // next throws for invalid UTF-8
         return result;
     }
 
     // The iterator class
     template <typename octet_iterator>
-    class iterator : public std::iterator <std::bidirectional_iterator_tag, uint32_t> {
+    class iterator {
       octet_iterator it;
       octet_iterator range_start;
       octet_iterator range_end;
       public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef uint32_t value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef uint32_t* pointer;
+      typedef uint32_t& reference;
+
       iterator () {}
       explicit iterator (const octet_iterator& octet_it,
                          const octet_iterator& range_start,
@@ -556,39 +4683,118 @@ namespace internal
           octet_iterator temp = it;
           return utf8::next(temp, range_end);
       }
-      bool operator == (const iterator& rhs) const
+      bool operator == (const iterator& rhs) const
+      {
+          if (range_start != rhs.range_start || range_end != rhs.range_end)
+              throw std::logic_error("Comparing utf-8 iterators defined with different ranges");
+          return (it == rhs.it);
+      }
+      bool operator != (const iterator& rhs) const
+      {
+          return !(operator == (rhs));
+      }
+      iterator& operator ++ ()
+      {
+          utf8::next(it, range_end);
+          return *this;
+      }
+      iterator operator ++ (int)
+      {
+          iterator temp = *this;
+          utf8::next(it, range_end);
+          return temp;
+      }
+      iterator& operator -- ()
+      {
+          utf8::prior(it, range_start);
+          return *this;
+      }
+      iterator operator -- (int)
+      {
+          iterator temp = *this;
+          utf8::prior(it, range_start);
+          return temp;
+      }
+    }; // class iterator
+
+    /// End marker for decoding_iterator: compares equal to an iterator at the end of its range
+    struct sentinel {};
+
+    /// Checked iterator that decodes each position once. The code point and the position of
+    /// the next sequence are kept, so operator* costs nothing and operator++ decodes only the
+    /// sequence it moves to; invalid input therefore throws on reaching it rather than on
+    /// dereferencing. Iterators are compared by position only. The check that both belong to
+    /// the same range is done in debug builds, see UTF8_CPP_CHECK_ITERATOR_RANGES.
+    template <typename octet_iterator>
+    class decoding_iterator {
+      octet_iterator it;
+      octet_iterator next_it;
+      octet_iterator range_start;
+      octet_iterator range_end;
+      uint32_t cp;
+      void decode ()
+      {
+          next_it = it;
+          if (next_it != range_end)
+              cp = utf8::next(next_it, range_end);
+      }
+      public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef uint32_t value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef uint32_t* pointer;
+      typedef uint32_t& reference;
+
+      decoding_iterator () : cp(0) {}
+      decoding_iterator (const octet_iterator& octet_it,
+                         const octet_iterator& range_start,
+                         const octet_iterator& range_end) :
+                         it(octet_it), range_start(range_start), range_end(range_end), cp(0)
+      {
+          if (it < range_start || it > range_end)
+              throw std::out_of_range("Invalid utf-8 iterator position");
+          decode();
+      }
+      octet_iterator base () const { return it; }
+      uint32_t operator * () const { return cp; }
+      bool operator == (const decoding_iterator& rhs) const
       {
+#if UTF8_CPP_CHECK_ITERATOR_RANGES
           if (range_start != rhs.range_start || range_end != rhs.range_end)
               throw std::logic_error("Comparing utf-8 iterators defined with different ranges");
+#endif
           return (it == rhs.it);
       }
-      bool operator != (const iterator& rhs) const
-      {
-          return !(operator == (rhs));
-      }
-      iterator& operator ++ ()
+      bool operator != (const decoding_iterator& rhs) const { return !(operator == (rhs)); }
+      bool operator == (sentinel) const { return it == range_end; }
+      bool operator != (sentinel) const { return it != range_end; }
+      friend bool operator == (sentinel, const decoding_iterator& rhs) { return rhs.it == rhs.range_end; }
+      friend bool operator != (sentinel, const decoding_iterator& rhs) { return rhs.it != rhs.range_end; }
+      decoding_iterator& operator ++ ()
       {
-          utf8::next(it, range_end);
+          it = next_it;
+          decode();
           return *this;
       }
-      iterator operator ++ (int)
+      decoding_iterator operator ++ (int)
       {
-          iterator temp = *this;
-          utf8::next(it, range_end);
+          decoding_iterator temp = *this;
+          ++(*this);
           return temp;
       }
-      iterator& operator -- ()
+      decoding_iterator& operator -- ()
       {
-          utf8::prior(it, range_start);
+          next_it = it;
+          cp = utf8::prior(it, range_start);
           return *this;
       }
-      iterator operator -- (int)
+      decoding_iterator operator -- (int)
       {
-          iterator temp = *this;
-          utf8::prior(it, range_start);
+          decoding_iterator temp = *this;
+          --(*this);
           return temp;
       }
-    }; // class iterator
+    }; // class decoding_iterator
 
     //=============================================================================================
     // unchecked
@@ -597,7 +4803,7 @@ namespace internal
     namespace unchecked 
     {
         template <typename octet_iterator>
-        octet_iterator append(uint32_t cp, octet_iterator result)
+        UTF8_CPP_CONSTEXPR octet_iterator append(uint32_t cp, octet_iterator result)
         {
             if (cp < 0x80)                        // one octet
                 *(result++) = static_cast<uint8_t>(cp);  
@@ -620,48 +4826,34 @@ namespace internal
         }
 
         template <typename octet_iterator>
-        uint32_t next(octet_iterator& it)
+        UTF8_CPP_CONSTEXPR uint32_t next(octet_iterator& it)
         {
             uint32_t cp = utf8::internal::mask8(*it);
-            typename std::iterator_traits<octet_iterator>::difference_type length = utf8::internal::sequence_length(it);
-            switch (length) {
-                case 1:
-                    break;
-                case 2:
-                    it++;
-                    cp = ((cp << 6) & 0x7ff) + ((*it) & 0x3f);
-                    break;
-                case 3:
-                    ++it; 
-                    cp = ((cp << 12) & 0xffff) + ((utf8::internal::mask8(*it) << 6) & 0xfff);
-                    ++it;
-                    cp += (*it) & 0x3f;
-                    break;
-                case 4:
-                    ++it;
-                    cp = ((cp << 18) & 0x1fffff) + ((utf8::internal::mask8(*it) << 12) & 0x3ffff);                
-                    ++it;
-                    cp += (utf8::internal::mask8(*it) << 6) & 0xfff;
-                    ++it;
-                    cp += (*it) & 0x3f; 
-                    break;
-            }
+            const int length = static_cast<int>(utf8::internal::sequence_length(it));
+            cp &= utf8::internal::decoder_tables<void>::lead_mask[length];
+            for (int i = 1; i < length; ++i)
+                cp = (cp << 6) | (utf8::internal::mask8(*++it) & 0x3f);
             ++it;
             return cp;        
         }
 
         template <typename octet_iterator>
-        uint32_t peek_next(octet_iterator it)
+        UTF8_CPP_CONSTEXPR uint32_t peek_next(octet_iterator it)
         {
             return utf8::unchecked::next(it);    
         }
 
+        /// Decodes while scanning back, so each octet is read once
         template <typename octet_iterator>
         uint32_t prior(octet_iterator& it)
         {
-            while (utf8::internal::is_trail(*(--it))) ;
-            octet_iterator temp = it;
-            return utf8::unchecked::next(temp);
+            uint32_t cp = 0;
+            int shift = 0;
+            uint8_t octet;
+            for (; utf8::internal::is_trail(octet = utf8::internal::mask8(*--it)); shift += 6)
+                cp |= static_cast<uint32_t>(octet & 0x3f) << shift;
+            const int length = static_cast<int>(utf8::internal::sequence_length(it));
+            return cp | (static_cast<uint32_t>(octet & utf8::internal::decoder_tables<void>::lead_mask[length]) << shift);
         }
 
         // Deprecated in versions that include prior, but only for the sake of consistency (see utf8::previous)
@@ -678,20 +4870,29 @@ namespace internal
                 utf8::unchecked::next(it);
         }
 
+        /// Moves it back over n code points, as n calls of prior would
+        template <typename octet_iterator, typename distance_type>
+        void retreat (octet_iterator& it, distance_type n)
+        {
+            for (distance_type i = 0; i < n; ++i)
+                utf8::unchecked::prior(it);
+        }
+
         template <typename octet_iterator>
-        typename std::iterator_traits<octet_iterator>::difference_type
+        UTF8_CPP_CONSTEXPR typename std::iterator_traits<octet_iterator>::difference_type
         distance (octet_iterator first, octet_iterator last)
         {
-            typename std::iterator_traits<octet_iterator>::difference_type dist;
-            for (dist = 0; first < last; ++dist) 
-                utf8::unchecked::next(first);
-            return dist;
+            return utf8::internal::count_code_points(first, last);
         }
 
         template <typename u16bit_iterator, typename octet_iterator>
-        octet_iterator utf16to8 (u16bit_iterator start, u16bit_iterator end, octet_iterator result)
+        UTF8_CPP_CONSTEXPR octet_iterator utf16to8 (u16bit_iterator start, u16bit_iterator end, octet_iterator result)
         {       
             while (start != end) {
+                start = utf8::internal::encode_utf16(start, end, result,
+                                                     typename utf8::internal::contiguous_u16<u16bit_iterator>::category());
+                if (start == end)
+                    break;
                 uint32_t cp = utf8::internal::mask16(*start++);
             // Take care of surrogate pairs first
                 if (utf8::internal::is_lead_surrogate(cp)) {
@@ -704,8 +4905,12 @@ namespace internal
         }
 
         template <typename u16bit_iterator, typename octet_iterator>
-        u16bit_iterator utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result)
+        UTF8_CPP_CONSTEXPR u16bit_iterator utf8to16 (octet_iterator start, octet_iterator end, u16bit_iterator result)
         {
+            if (utf8::internal::decode_utf16(start, end, result,
+                                             typename utf8::internal::contiguous_octets<octet_iterator>::category(),
+                                             typename utf8::internal::contiguous_u16<u16bit_iterator>::category()))
+                return result;
             while (start < end) {
                 uint32_t cp = utf8::unchecked::next(start);
                 if (cp > 0xffff) { //make a surrogate pair
@@ -719,16 +4924,20 @@ namespace internal
         }
 
         template <typename octet_iterator, typename u32bit_iterator>
-        octet_iterator utf32to8 (u32bit_iterator start, u32bit_iterator end, octet_iterator result)
+        UTF8_CPP_CONSTEXPR octet_iterator utf32to8 (u32bit_iterator start, u32bit_iterator end, octet_iterator result)
         {
-            while (start != end)
+            while (start != end) {
+                start = utf8::internal::encode_utf32(start, end, result,
+                                                     typename utf8::internal::contiguous_u32<u32bit_iterator>::category());
+                if (start == end)
+                    break;
                 result = utf8::unchecked::append(*(start++), result);
-
+            }
             return result;
         }
 
         template <typename octet_iterator, typename u32bit_iterator>
-        u32bit_iterator utf8to32 (octet_iterator start, octet_iterator end, u32bit_iterator result)
+        UTF8_CPP_CONSTEXPR u32bit_iterator utf8to32 (octet_iterator start, octet_iterator end, u32bit_iterator result)
         {
             while (start < end)
                 (*result++) = utf8::unchecked::next(start);
@@ -736,11 +4945,36 @@ namespace internal
             return result;
         }
 
+        /// The same as the checked version, which cannot fail
+        template <typename latin1_iterator, typename octet_iterator>
+        inline octet_iterator latin1to8 (latin1_iterator start, latin1_iterator end, octet_iterator result)
+        {
+            return utf8::latin1to8(start, end, result);
+        }
+
+        /// Code points above U+00FF are cut to their low 8 bits
+        template <typename octet_iterator, typename latin1_iterator>
+        latin1_iterator utf8tolatin1 (octet_iterator start, octet_iterator end, latin1_iterator result)
+        {
+            while (start < end) {
+                start = utf8::internal::decode_latin1(start, end, result, typename utf8::internal::contiguous_octets<octet_iterator>::category());
+                if (start < end)
+                    (*result++) = static_cast<uint8_t>(utf8::unchecked::next(start));
+            }
+            return result;
+        }
+
         // The iterator class
         template <typename octet_iterator>
-          class iterator : public std::iterator <std::bidirectional_iterator_tag, uint32_t> { 
+          class iterator {
             octet_iterator it;
             public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef uint32_t value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef uint32_t* pointer;
+            typedef uint32_t& reference;
+
             iterator () {}
             explicit iterator (const octet_iterator& octet_it): it(octet_it) {}
             // the default "big three" are OK
@@ -783,4 +5017,716 @@ namespace internal
           }; // class iterator
 
     } // namespace utf8::unchecked
+
+    //=============================================================================================
+    // case-insensitive comparison
+    //=============================================================================================
+
+namespace internal
+{
+    /// Contiguous if both iterators are
+    template <typename category1, typename category2>
+    struct both_contiguous {
+        typedef generic_octets_tag category;
+    };
+
+    template <>
+    struct both_contiguous<contiguous_octets_tag, contiguous_octets_tag> {
+        typedef contiguous_octets_tag category;
+    };
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    struct contiguous_pair :
+        both_contiguous<typename contiguous_octets<octet_iterator1>::category,
+                        typename contiguous_octets<octet_iterator2>::category> {};
+
+    struct ascii_icase_equal {
+        template <typename octet_type1, typename octet_type2>
+        bool operator () (octet_type1 a, octet_type2 b) const
+        {
+            return scalar::fold_ascii(utf8::internal::mask8(a)) == scalar::fold_ascii(utf8::internal::mask8(b));
+        }
+    };
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    bool iequals_ascii(octet_iterator1 first1, octet_iterator1 last1, octet_iterator2 first2, octet_iterator2 last2,
+                       generic_octets_tag)
+    {
+        for (; first1 != last1 && first2 != last2; ++first1, ++first2)
+            if (!ascii_icase_equal()(*first1, *first2))
+                return false;
+        return first1 == last1 && first2 == last2;
+    }
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    bool iequals_ascii(octet_iterator1 first1, octet_iterator1 last1, octet_iterator2 first2, octet_iterator2 last2,
+                       contiguous_octets_tag)
+    {
+        if (last1 - first1 != last2 - first2)
+            return false;
+        if (first1 == last1)
+            return true;
+        const uint8_t* a = contiguous_octets<octet_iterator1>::pointer(first1);
+        const uint8_t* a_end = a + (last1 - first1);
+        return active_simd_kernels().mismatch_ascii_icase(a, a_end, contiguous_octets<octet_iterator2>::pointer(first2)) == a_end;
+    }
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    octet_iterator1 find_ascii_icase(octet_iterator1 start, octet_iterator1 end, octet_iterator2 needle_start,
+                                     octet_iterator2 needle_end, generic_octets_tag)
+    {
+        return std::search(start, end, needle_start, needle_end, ascii_icase_equal());
+    }
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    octet_iterator1 find_ascii_icase(octet_iterator1 start, octet_iterator1 end, octet_iterator2 needle_start,
+                                     octet_iterator2 needle_end, contiguous_octets_tag)
+    {
+        if (needle_start == needle_end)
+            return start;
+        if (end - start < needle_end - needle_start)
+            return end;
+        const uint8_t* first = contiguous_octets<octet_iterator1>::pointer(start);
+        const uint8_t* needle = contiguous_octets<octet_iterator2>::pointer(needle_start);
+        return start + (active_simd_kernels().find_ascii_icase(first, first + (end - start), needle,
+                                                               needle + (needle_end - needle_start)) - first);
+    }
+
+    /// Code points whose simple case folding is not themselves: cp in [first, last] with
+    /// (cp - first) % stride == 0 folds to cp + delta. Generated from Unicode 14.0.
+    struct fold_range {
+        uint32_t first;
+        uint32_t last;
+        int32_t delta;
+        uint32_t stride;
+    };
+
+    template <typename T>
+    struct fold_tables {
+        static const fold_range ranges[201];
+    };
+
+    template <typename T>
+    const fold_range fold_tables<T>::ranges[201] = {
+        {0x00b5, 0x00b5, 775, 1}, {0x00c0, 0x00d6, 32, 1}, {0x00d8, 0x00de, 32, 1}, {0x0100, 0x012e, 1, 2},
+        {0x0132, 0x0136, 1, 2}, {0x0139, 0x0147, 1, 2}, {0x014a, 0x0176, 1, 2}, {0x0178, 0x0178, -121, 1},
+        {0x0179, 0x017d, 1, 2}, {0x017f, 0x017f, -268, 1}, {0x0181, 0x0181, 210, 1}, {0x0182, 0x0184, 1, 2},
+        {0x0186, 0x0186, 206, 1}, {0x0187, 0x0187, 1, 1}, {0x0189, 0x018a, 205, 1}, {0x018b, 0x018b, 1, 1},
+        {0x018e, 0x018e, 79, 1}, {0x018f, 0x018f, 202, 1}, {0x0190, 0x0190, 203, 1}, {0x0191, 0x0191, 1, 1},
+        {0x0193, 0x0193, 205, 1}, {0x0194, 0x0194, 207, 1}, {0x0196, 0x0196, 211, 1}, {0x0197, 0x0197, 209, 1},
+        {0x0198, 0x0198, 1, 1}, {0x019c, 0x019c, 211, 1}, {0x019d, 0x019d, 213, 1}, {0x019f, 0x019f, 214, 1},
+        {0x01a0, 0x01a4, 1, 2}, {0x01a6, 0x01a6, 218, 1}, {0x01a7, 0x01a7, 1, 1}, {0x01a9, 0x01a9, 218, 1},
+        {0x01ac, 0x01ac, 1, 1}, {0x01ae, 0x01ae, 218, 1}, {0x01af, 0x01af, 1, 1}, {0x01b1, 0x01b2, 217, 1},
+        {0x01b3, 0x01b5, 1, 2}, {0x01b7, 0x01b7, 219, 1}, {0x01b8, 0x01b8, 1, 1}, {0x01bc, 0x01bc, 1, 1},
+        {0x01c4, 0x01c4, 2, 1}, {0x01c5, 0x01c5, 1, 1}, {0x01c7, 0x01c7, 2, 1}, {0x01c8, 0x01c8, 1, 1},
+        {0x01ca, 0x01ca, 2, 1}, {0x01cb, 0x01db, 1, 2}, {0x01de, 0x01ee, 1, 2}, {0x01f1, 0x01f1, 2, 1},
+        {0x01f2, 0x01f4, 1, 2}, {0x01f6, 0x01f6, -97, 1}, {0x01f7, 0x01f7, -56, 1}, {0x01f8, 0x021e, 1, 2},
+        {0x0220, 0x0220, -130, 1}, {0x0222, 0x0232, 1, 2}, {0x023a, 0x023a, 10795, 1}, {0x023b, 0x023b, 1, 1},
+        {0x023d, 0x023d, -163, 1}, {0x023e, 0x023e, 10792, 1}, {0x0241, 0x0241, 1, 1}, {0x0243, 0x0243, -195, 1},
+        {0x0244, 0x0244, 69, 1}, {0x0245, 0x0245, 71, 1}, {0x0246, 0x024e, 1, 2}, {0x0345, 0x0345, 116, 1},
+        {0x0370, 0x0372, 1, 2}, {0x0376, 0x0376, 1, 1}, {0x037f, 0x037f, 116, 1}, {0x0386, 0x0386, 38, 1},
+        {0x0388, 0x038a, 37, 1}, {0x038c, 0x038c, 64, 1}, {0x038e, 0x038f, 63, 1}, {0x0391, 0x03a1, 32, 1},
+        {0x03a3, 0x03ab, 32, 1}, {0x03c2, 0x03c2, 1, 1}, {0x03cf, 0x03cf, 8, 1}, {0x03d0, 0x03d0, -30, 1},
+        {0x03d1, 0x03d1, -25, 1}, {0x03d5, 0x03d5, -15, 1}, {0x03d6, 0x03d6, -22, 1}, {0x03d8, 0x03ee, 1, 2},
+        {0x03f0, 0x03f0, -54, 1}, {0x03f1, 0x03f1, -48, 1}, {0x03f4, 0x03f4, -60, 1}, {0x03f5, 0x03f5, -64, 1},
+        {0x03f7, 0x03f7, 1, 1}, {0x03f9, 0x03f9, -7, 1}, {0x03fa, 0x03fa, 1, 1}, {0x03fd, 0x03ff, -130, 1},
+        {0x0400, 0x040f, 80, 1}, {0x0410, 0x042f, 32, 1}, {0x0460, 0x0480, 1, 2}, {0x048a, 0x04be, 1, 2},
+        {0x04c0, 0x04c0, 15, 1}, {0x04c1, 0x04cd, 1, 2}, {0x04d0, 0x052e, 1, 2}, {0x0531, 0x0556, 48, 1},
+        {0x10a0, 0x10c5, 7264, 1}, {0x10c7, 0x10c7, 7264, 1}, {0x10cd, 0x10cd, 7264, 1}, {0x13f8, 0x13fd, -8, 1},
+        {0x1c80, 0x1c80, -6222, 1}, {0x1c81, 0x1c81, -6221, 1}, {0x1c82, 0x1c82, -6212, 1}, {0x1c83, 0x1c84, -6210, 1},
+        {0x1c85, 0x1c85, -6211, 1}, {0x1c86, 0x1c86, -6204, 1}, {0x1c87, 0x1c87, -6180, 1}, {0x1c88, 0x1c88, 35267, 1},
+        {0x1c90, 0x1cba, -3008, 1}, {0x1cbd, 0x1cbf, -3008, 1}, {0x1e00, 0x1e94, 1, 2}, {0x1e9b, 0x1e9b, -58, 1},
+        {0x1e9e, 0x1e9e, -7615, 1}, {0x1ea0, 0x1efe, 1, 2}, {0x1f08, 0x1f0f, -8, 1}, {0x1f18, 0x1f1d, -8, 1},
+        {0x1f28, 0x1f2f, -8, 1}, {0x1f38, 0x1f3f, -8, 1}, {0x1f48, 0x1f4d, -8, 1}, {0x1f59, 0x1f5f, -8, 2},
+        {0x1f68, 0x1f6f, -8, 1}, {0x1f88, 0x1f8f, -8, 1}, {0x1f98, 0x1f9f, -8, 1}, {0x1fa8, 0x1faf, -8, 1},
+        {0x1fb8, 0x1fb9, -8, 1}, {0x1fba, 0x1fbb, -74, 1}, {0x1fbc, 0x1fbc, -9, 1}, {0x1fbe, 0x1fbe, -7173, 1},
+        {0x1fc8, 0x1fcb, -86, 1}, {0x1fcc, 0x1fcc, -9, 1}, {0x1fd8, 0x1fd9, -8, 1}, {0x1fda, 0x1fdb, -100, 1},
+        {0x1fe8, 0x1fe9, -8, 1}, {0x1fea, 0x1feb, -112, 1}, {0x1fec, 0x1fec, -7, 1}, {0x1ff8, 0x1ff9, -128, 1},
+        {0x1ffa, 0x1ffb, -126, 1}, {0x1ffc, 0x1ffc, -9, 1}, {0x2126, 0x2126, -7517, 1}, {0x212a, 0x212a, -8383, 1},
+        {0x212b, 0x212b, -8262, 1}, {0x2132, 0x2132, 28, 1}, {0x2160, 0x216f, 16, 1}, {0x2183, 0x2183, 1, 1},
+        {0x24b6, 0x24cf, 26, 1}, {0x2c00, 0x2c2f, 48, 1}, {0x2c60, 0x2c60, 1, 1}, {0x2c62, 0x2c62, -10743, 1},
+        {0x2c63, 0x2c63, -3814, 1}, {0x2c64, 0x2c64, -10727, 1}, {0x2c67, 0x2c6b, 1, 2}, {0x2c6d, 0x2c6d, -10780, 1},
+        {0x2c6e, 0x2c6e, -10749, 1}, {0x2c6f, 0x2c6f, -10783, 1}, {0x2c70, 0x2c70, -10782, 1}, {0x2c72, 0x2c72, 1, 1},
+        {0x2c75, 0x2c75, 1, 1}, {0x2c7e, 0x2c7f, -10815, 1}, {0x2c80, 0x2ce2, 1, 2}, {0x2ceb, 0x2ced, 1, 2},
+        {0x2cf2, 0x2cf2, 1, 1}, {0xa640, 0xa66c, 1, 2}, {0xa680, 0xa69a, 1, 2}, {0xa722, 0xa72e, 1, 2},
+        {0xa732, 0xa76e, 1, 2}, {0xa779, 0xa77b, 1, 2}, {0xa77d, 0xa77d, -35332, 1}, {0xa77e, 0xa786, 1, 2},
+        {0xa78b, 0xa78b, 1, 1}, {0xa78d, 0xa78d, -42280, 1}, {0xa790, 0xa792, 1, 2}, {0xa796, 0xa7a8, 1, 2},
+        {0xa7aa, 0xa7aa, -42308, 1}, {0xa7ab, 0xa7ab, -42319, 1}, {0xa7ac, 0xa7ac, -42315, 1}, {0xa7ad, 0xa7ad, -42305, 1},
+        {0xa7ae, 0xa7ae, -42308, 1}, {0xa7b0, 0xa7b0, -42258, 1}, {0xa7b1, 0xa7b1, -42282, 1}, {0xa7b2, 0xa7b2, -42261, 1},
+        {0xa7b3, 0xa7b3, 928, 1}, {0xa7b4, 0xa7c2, 1, 2}, {0xa7c4, 0xa7c4, -48, 1}, {0xa7c5, 0xa7c5, -42307, 1},
+        {0xa7c6, 0xa7c6, -35384, 1}, {0xa7c7, 0xa7c9, 1, 2}, {0xa7d0, 0xa7d0, 1, 1}, {0xa7d6, 0xa7d8, 1, 2},
+        {0xa7f5, 0xa7f5, 1, 1}, {0xab70, 0xabbf, -38864, 1}, {0xff21, 0xff3a, 32, 1}, {0x10400, 0x10427, 40, 1},
+        {0x104b0, 0x104d3, 40, 1}, {0x10570, 0x1057a, 39, 1}, {0x1057c, 0x1058a, 39, 1}, {0x1058c, 0x10592, 39, 1},
+        {0x10594, 0x10595, 39, 1}, {0x10c80, 0x10cb2, 64, 1}, {0x118a0, 0x118bf, 32, 1}, {0x16e40, 0x16e5f, 32, 1},
+        {0x1e900, 0x1e921, 34, 1},
+    };
+
+    /// Moves the two iterators past their common prefix, with ASCII letters compared without
+    /// case, back to the start of the sequence the first difference is in. Only contiguous
+    /// input is skipped over.
+    template <typename octet_iterator1, typename octet_iterator2>
+    inline void skip_equal_prefix(octet_iterator1&, octet_iterator1, octet_iterator2&, octet_iterator2, generic_octets_tag) {}
+
+    template <typename octet_iterator1, typename octet_iterator2>
+    void skip_equal_prefix(octet_iterator1& first1, octet_iterator1 last1, octet_iterator2& first2, octet_iterator2 last2,
+                           contiguous_octets_tag)
+    {
+        const std::ptrdiff_t length = std::min<std::ptrdiff_t>(last1 - first1, last2 - first2);
+        if (length == 0)
+            return;
+        const uint8_t* a = contiguous_octets<octet_iterator1>::pointer(first1);
+        const uint8_t* b = contiguous_octets<octet_iterator2>::pointer(first2);
+        std::ptrdiff_t equal = active_simd_kernels().mismatch_ascii_icase(a, a + length, b) - a;
+        // The prefix is the same in both, and so are its sequence boundaries
+        if (equal != length)
+            while (equal != 0 && (utf8::internal::is_trail(a[equal]) || utf8::internal::is_trail(b[equal])))
+                --equal;
+        first1 += equal;
+        first2 += equal;
+    }
+} // namespace internal
+
+    /// True if the two ranges are equal with ASCII letters compared without case. All other
+    /// octets must be the same, so nothing is decoded or validated.
+    template <typename octet_iterator1, typename octet_iterator2>
+    bool iequals_ascii (octet_iterator1 first1, octet_iterator1 last1, octet_iterator2 first2, octet_iterator2 last2)
+    {
+        return utf8::internal::iequals_ascii(first1, last1, first2, last2,
+                                             typename utf8::internal::contiguous_pair<octet_iterator1, octet_iterator2>::category());
+    }
+
+    /// The first occurrence of [needle_start, needle_end) in [start, end), like std::search,
+    /// with ASCII letters compared without case
+    template <typename octet_iterator1, typename octet_iterator2>
+    octet_iterator1 find_ascii_icase (octet_iterator1 start, octet_iterator1 end, octet_iterator2 needle_start, octet_iterator2 needle_end)
+    {
+        return utf8::internal::find_ascii_icase(start, end, needle_start, needle_end,
+                                                typename utf8::internal::contiguous_pair<octet_iterator1, octet_iterator2>::category());
+    }
+
+    /// Simple case folding of a code point: the C and S mappings of CaseFolding.txt
+    inline uint32_t fold_case (uint32_t cp)
+    {
+        if (cp < 0x80)
+            return utf8::internal::scalar::fold_ascii(static_cast<uint8_t>(cp));
+        const internal::fold_range* ranges = internal::fold_tables<void>::ranges;
+        // The last range that starts at or before cp
+        std::size_t low = 0, high = sizeof(internal::fold_tables<void>::ranges) / sizeof(ranges[0]);
+        while (low != high) {
+            const std::size_t middle = low + (high - low) / 2;
+            if (ranges[middle].first <= cp)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == 0)
+            return cp;
+        const internal::fold_range& range = ranges[low - 1];
+        if (cp > range.last || (cp - range.first) % range.stride != 0)
+            return cp;
+        return static_cast<uint32_t>(static_cast<int32_t>(cp) + range.delta);
+    }
+
+    /// Compares two ranges of valid UTF-8 by the simple case folding of their code points,
+    /// returning a negative number, 0 or a positive number like memcmp. Code points are
+    /// decoded by unchecked::next, one at a time from the first difference in the octets
+    /// that is not just ASCII case, and only until the first folded difference.
+    template <typename octet_iterator1, typename octet_iterator2>
+    int compare_folded (octet_iterator1 first1, octet_iterator1 last1, octet_iterator2 first2, octet_iterator2 last2)
+    {
+        utf8::internal::skip_equal_prefix(first1, last1, first2, last2,
+                                          typename utf8::internal::contiguous_pair<octet_iterator1, octet_iterator2>::category());
+        while (first1 != last1 && first2 != last2) {
+            const uint32_t cp1 = utf8::fold_case(utf8::unchecked::next(first1));
+            const uint32_t cp2 = utf8::fold_case(utf8::unchecked::next(first2));
+            if (cp1 != cp2)
+                return cp1 < cp2 ? -1 : 1;
+        }
+        return first1 != last1 ? 1 : first2 != last2 ? -1 : 0;
+    }
+
+    /// True if two ranges of valid UTF-8 are equal under simple case folding
+    template <typename octet_iterator1, typename octet_iterator2>
+    inline bool iequals (octet_iterator1 first1, octet_iterator1 last1, octet_iterator2 first2, octet_iterator2 last2)
+    {
+        return utf8::compare_folded(first1, last1, first2, last2) == 0;
+    }
+
+    //=============================================================================================
+    // batch
+    //=============================================================================================
+
+    /// Result of validating one string of a batch: UTF8_OK, or the error found at position,
+    /// the offset of the first invalid octet in the string (its length if it is valid)
+    struct batch_status {
+        utf_error error;
+        std::size_t position;
+    };
+
+namespace internal
+{
+    // The vectorized kernels do not pay for their setup on strings shorter than this
+    const std::size_t BATCH_SHORT_STRING = 64;
+
+    inline batch_status validate_string(const uint8_t* start, const uint8_t* end)
+    {
+        const uint8_t* invalid = static_cast<std::size_t>(end - start) < BATCH_SHORT_STRING ?
+            utf8::internal::scalar::find_invalid(start, end) : active_simd_kernels().find_invalid(start, end);
+        batch_status status;
+        status.error = UTF8_OK;
+        status.position = static_cast<std::size_t>(invalid - start);
+        if (invalid != end)
+            status.error = utf8::internal::validate_next(invalid, end);
+        return status;
+    }
+
+    template <typename offset_type>
+    bool validate_batch(const uint8_t* blob, const offset_type* offsets, std::size_t count, batch_status* results)
+    {
+        // The blob is validated as a whole, which only misses sequences that cross from
+        // one string into the next; those leave a trail octet at the start of a string.
+        // Strings with an error or such a crossing are validated again on their own.
+        const uint8_t* const blob_end = blob + offsets[count];
+        bool all_valid = true;
+        std::size_t i = 0;
+        while (i < count) {
+            const uint8_t* invalid = active_simd_kernels().find_invalid(blob + offsets[i], blob_end);
+            for (; i < count && blob + offsets[i + 1] <= invalid; ++i) {
+                const uint8_t* start = blob + offsets[i];
+                const uint8_t* end = blob + offsets[i + 1];
+                if (start != end && (utf8::internal::is_trail(*start) || (end != blob_end && utf8::internal::is_trail(*end))))
+                    results[i] = utf8::internal::validate_string(start, end);
+                else {
+                    results[i].error = UTF8_OK;
+                    results[i].position = static_cast<std::size_t>(end - start);
+                }
+                all_valid = all_valid && results[i].error == UTF8_OK;
+            }
+            if (i == count)
+                break;
+            results[i] = utf8::internal::validate_string(blob + offsets[i], blob + offsets[i + 1]);
+            all_valid = all_valid && results[i].error == UTF8_OK;
+            ++i;
+        }
+        return all_valid;
+    }
+
+    struct batch_utf16 {
+        static std::size_t length(const uint8_t* start, const uint8_t* end)
+        {
+            return static_cast<std::size_t>(end - start) < BATCH_SHORT_STRING ?
+                utf8::internal::scalar::count_utf16(start, end) : active_simd_kernels().count_utf16(start, end);
+        }
+        template <typename unit_type>
+        static unit_type* convert(const uint8_t* start, const uint8_t* end, unit_type* out)
+        {
+            // The run was validated, so the decode kernel can take it as it is
+            return utf8::unchecked::utf8to16(start, end, out);
+        }
+    };
+
+    struct batch_utf32 {
+        static std::size_t length(const uint8_t* start, const uint8_t* end)
+        {
+            return static_cast<std::size_t>(end - start) < BATCH_SHORT_STRING ?
+                utf8::internal::scalar::count_code_points(start, end) : active_simd_kernels().count_code_points(start, end);
+        }
+        template <typename unit_type>
+        static unit_type* convert(const uint8_t* start, const uint8_t* end, unit_type* out)
+        {
+            while (start != end) {
+                start = utf8::internal::widen_ascii32(start, end, out);
+                if (start != end)
+                    *out++ = utf8::unchecked::next(start);
+            }
+            return out;
+        }
+    };
+
+    template <typename encoding, typename offset_type, typename unit_type>
+    bool transcode_batch(const uint8_t* blob, const offset_type* offsets, std::size_t count,
+                         unit_type* out, offset_type* out_offsets, batch_status* results)
+    {
+        const bool all_valid = utf8::internal::validate_batch(blob, offsets, count, results);
+        // Consecutive valid strings are one contiguous run of the blob, converted in one call
+        out_offsets[0] = 0;
+        std::size_t i = 0;
+        while (i < count) {
+            if (results[i].error != UTF8_OK) {
+                out_offsets[i + 1] = out_offsets[i];
+                ++i;
+                continue;
+            }
+            std::size_t run_end = i;
+            for (; run_end < count && results[run_end].error == UTF8_OK; ++run_end)
+                out_offsets[run_end + 1] = static_cast<offset_type>(out_offsets[run_end] +
+                    encoding::length(blob + offsets[run_end], blob + offsets[run_end + 1]));
+            encoding::convert(blob + offsets[i], blob + offsets[run_end], out + out_offsets[i]);
+            i = run_end;
+        }
+        return all_valid;
+    }
+} // namespace internal
+
+    /// Validates count strings packed Arrow-style: string i is blob[offsets[i], offsets[i + 1]).
+    /// The result of each string goes to results[i]; returns true if all of them are valid.
+    template <typename octet_type, typename offset_type>
+    bool validate_batch(const octet_type* blob, const offset_type* offsets, std::size_t count, batch_status* results)
+    {
+        return utf8::internal::validate_batch(
+            utf8::internal::contiguous_octets<const octet_type*>::pointer(blob), offsets, count, results);
+    }
+
+    /// Validates count separately stored strings with data() and size(), e.g. std::string_view
+    template <typename string_type>
+    bool validate_batch(const string_type* strings, std::size_t count, batch_status* results)
+    {
+        bool all_valid = true;
+        for (std::size_t i = 0; i < count; ++i) {
+            const uint8_t* start = utf8::internal::contiguous_octets<typename string_type::const_pointer>::pointer(strings[i].data());
+            results[i] = utf8::internal::validate_string(start, start + strings[i].size());
+            all_valid = all_valid && results[i].error == UTF8_OK;
+        }
+        return all_valid;
+    }
+
+    /// utf8to16 for a packed batch. The UTF-16 of string i goes to out[out_offsets[i], out_offsets[i + 1]),
+    /// invalid strings are left empty. out must have room for utf16_length(blob + offsets[0], blob + offsets[count])
+    /// units and out_offsets for count + 1 offsets.
+    template <typename octet_type, typename offset_type, typename u16bit_type>
+    bool utf8to16_batch(const octet_type* blob, const offset_type* offsets, std::size_t count,
+                        u16bit_type* out, offset_type* out_offsets, batch_status* results)
+    {
+        return utf8::internal::transcode_batch<internal::batch_utf16>(
+            utf8::internal::contiguous_octets<const octet_type*>::pointer(blob), offsets, count, out, out_offsets, results);
+    }
+
+    /// utf8to32 for a packed batch, like utf8to16_batch. out must have room for
+    /// unchecked::distance(blob + offsets[0], blob + offsets[count]) code points.
+    template <typename octet_type, typename offset_type, typename u32bit_type>
+    bool utf8to32_batch(const octet_type* blob, const offset_type* offsets, std::size_t count,
+                        u32bit_type* out, offset_type* out_offsets, batch_status* results)
+    {
+        return utf8::internal::transcode_batch<internal::batch_utf32>(
+            utf8::internal::contiguous_octets<const octet_type*>::pointer(blob), offsets, count, out, out_offsets, results);
+    }
+
+    //=============================================================================================
+    // random access
+    //=============================================================================================
+
+    /// Index of code point positions over an immutable range of UTF-8, for repeated lookups
+    /// by code point offset. It stores the octet offset of every block_size-th code point,
+    /// so seek() costs a table lookup and a scan over less than block_size code points.
+    /// The range is validated when the index is built and must not change afterwards.
+    template <typename octet_iterator>
+    class code_point_index {
+        typedef typename std::iterator_traits<octet_iterator>::difference_type difference_type;
+        octet_iterator range_start;
+        octet_iterator range_end;
+        std::size_t block;
+        std::size_t count;
+        std::vector<difference_type> samples;
+      public:
+        class iterator;
+
+        code_point_index () : block(64), count(0) {}
+        code_point_index (octet_iterator start, octet_iterator end, std::size_t block_size = 64) :
+            range_start(start), range_end(end), block(block_size ? block_size : 1), count(0)
+        {
+            octet_iterator invalid = utf8::find_invalid(start, end);
+            if (invalid != end)
+                utf8::next(invalid, end); // throws invalid_utf8, or not_enough_room for a truncated tail
+
+            octet_iterator it = start;
+            while (it != end) {
+                samples.push_back(it - start);
+                const std::size_t left = utf8::internal::skip_code_points(it, end, block);
+                count += block - left;
+                if (left != 0 || it == end)
+                    break;
+            }
+        }
+
+        /// Number of code points in the range
+        std::size_t size () const { return count; }
+
+        /// Position of code point cp_index; range_end for cp_index >= size()
+        octet_iterator seek (std::size_t cp_index) const
+        {
+            if (cp_index >= count)
+                return range_end;
+            octet_iterator it = range_start + samples[cp_index / block];
+            utf8::internal::skip_code_points(it, range_end, cp_index % block);
+            return it;
+        }
+
+        /// Code point offset of the sequence that starts at it
+        std::size_t offset (octet_iterator it) const
+        {
+            if (it == range_end)
+                return count;
+            const difference_type octet = it - range_start;
+            const std::size_t sample = static_cast<std::size_t>(
+                std::upper_bound(samples.begin(), samples.end(), octet) - samples.begin()) - 1;
+            return sample * block +
+                static_cast<std::size_t>(utf8::internal::count_code_points(range_start + samples[sample], it));
+        }
+
+        /// Moves it, which must be at the start of a sequence, by n code points in either
+        /// direction, stopping at the start or the end of the range
+        template <typename distance_type>
+        void advance (octet_iterator& it, distance_type n) const
+        {
+            const difference_type moved = static_cast<difference_type>(offset(it)) + static_cast<difference_type>(n);
+            it = seek(moved < 0 ? 0 : static_cast<std::size_t>(moved));
+        }
+
+        iterator begin () const { return iterator(this, 0, range_start); }
+        iterator end () const { return iterator(this, count, range_end); }
+        iterator at (std::size_t cp_index) const { return iterator(this, cp_index, seek(cp_index)); }
+
+        /// Random access iterator over the code points of an indexed range
+        class iterator {
+            const code_point_index* index;
+            std::size_t position;
+            octet_iterator it;
+          public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef uint32_t value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef uint32_t* pointer;
+            typedef uint32_t& reference;
+
+            iterator () : index(0), position(0) {}
+            iterator (const code_point_index* index, std::size_t position, octet_iterator it) :
+                index(index), position(position), it(it) {}
+            octet_iterator base () const { return it; }
+            std::size_t code_point_offset () const { return position; }
+            uint32_t operator * () const
+            {
+                octet_iterator temp = it;
+                return utf8::unchecked::next(temp);
+            }
+            uint32_t operator [] (difference_type n) const { return *(*this + n); }
+            iterator& operator ++ ()
+            {
+                ::std::advance(it, utf8::internal::sequence_length(it));
+                ++position;
+                return *this;
+            }
+            iterator operator ++ (int)
+            {
+                iterator temp = *this;
+                ++(*this);
+                return temp;
+            }
+            iterator& operator -- ()
+            {
+                utf8::unchecked::prior(it);
+                --position;
+                return *this;
+            }
+            iterator operator -- (int)
+            {
+                iterator temp = *this;
+                --(*this);
+                return temp;
+            }
+            /// Stops at begin() or end() rather than leave the range
+            iterator& operator += (difference_type n)
+            {
+                const difference_type moved = static_cast<difference_type>(position) + n;
+                position = moved < 0 ? 0 : std::min(static_cast<std::size_t>(moved), index->size());
+                it = index->seek(position);
+                return *this;
+            }
+            iterator& operator -= (difference_type n) { return *this += -n; }
+            iterator operator + (difference_type n) const { iterator temp = *this; return temp += n; }
+            iterator operator - (difference_type n) const { iterator temp = *this; return temp += -n; }
+            friend iterator operator + (difference_type n, const iterator& rhs) { return rhs + n; }
+            difference_type operator - (const iterator& rhs) const
+            {
+                return static_cast<difference_type>(position) - static_cast<difference_type>(rhs.position);
+            }
+            bool operator == (const iterator& rhs) const { return position == rhs.position; }
+            bool operator != (const iterator& rhs) const { return position != rhs.position; }
+            bool operator < (const iterator& rhs) const { return position < rhs.position; }
+            bool operator > (const iterator& rhs) const { return position > rhs.position; }
+            bool operator <= (const iterator& rhs) const { return position <= rhs.position; }
+            bool operator >= (const iterator& rhs) const { return position >= rhs.position; }
+        }; // class iterator
+    }; // class code_point_index
+
+    //=============================================================================================
+    // ranges
+    //=============================================================================================
+
+    /// Lazy sequence of the code points in a range of octets, decoded by decoding_iterator.
+    /// In C++20 it is a std::ranges::view, so decode -> filter -> transform -> encode runs
+    /// in one pass without intermediate buffers (see utf8::views).
+    template <typename octet_iterator>
+    class decode_view
+#if defined(UTF8_CPP_RANGES)
+        : public std::ranges::view_interface<decode_view<octet_iterator> >
+#endif
+    {
+        octet_iterator first;
+        octet_iterator last;
+      public:
+        decode_view () : first(), last() {}
+        decode_view (octet_iterator first, octet_iterator last) : first(first), last(last) {}
+        decoding_iterator<octet_iterator> begin () const { return decoding_iterator<octet_iterator>(first, first, last); }
+        sentinel end () const { return sentinel(); }
+    };
+
+    namespace unchecked
+    {
+        /// decode_view for trusted input, decoded by unchecked::next
+        template <typename octet_iterator>
+        class decode_view
+#if defined(UTF8_CPP_RANGES)
+            : public std::ranges::view_interface<decode_view<octet_iterator> >
+#endif
+        {
+            octet_iterator first;
+            octet_iterator last;
+          public:
+            decode_view () : first(), last() {}
+            decode_view (octet_iterator first, octet_iterator last) : first(first), last(last) {}
+            iterator<octet_iterator> begin () const { return iterator<octet_iterator>(first); }
+            iterator<octet_iterator> end () const { return iterator<octet_iterator>(last); }
+        };
+    } // namespace utf8::unchecked
+
+#if defined(UTF8_CPP_RANGES)
+    /// Lazy encoding of a view of code points as UTF-8, UTF-16 or UTF-32 code units, by the
+    /// size of unit_type. Code points are encoded one at a time as the view is iterated;
+    /// invalid ones throw invalid_code_point.
+    template <typename code_point_view, typename unit_type>
+        requires std::ranges::input_range<code_point_view> && std::ranges::view<code_point_view>
+    class encode_view : public std::ranges::view_interface<encode_view<code_point_view, unit_type> > {
+        code_point_view base_view;
+      public:
+        class iterator {
+            typedef std::ranges::iterator_t<code_point_view> base_iterator;
+            typedef std::ranges::sentinel_t<code_point_view> base_sentinel;
+            base_iterator current{};
+            base_sentinel last{};
+            unit_type units[4] = {};
+            unsigned char count = 0;
+            unsigned char index = 0;
+
+            void encode ()
+            {
+                index = 0;
+                count = 0;
+                if (current == last)
+                    return;
+                const uint32_t cp = *current;
+                if constexpr (sizeof(unit_type) == 1) {
+                    count = static_cast<unsigned char>(utf8::append(cp, units) - units);
+                }
+                else {
+                    if (!utf8::internal::is_code_point_valid(cp))
+                        throw invalid_code_point(cp);
+                    if (sizeof(unit_type) == 2 && cp > 0xffff) {
+                        units[count++] = static_cast<unit_type>((cp >> 10) + internal::LEAD_OFFSET);
+                        units[count++] = static_cast<unit_type>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
+                    }
+                    else
+                        units[count++] = static_cast<unit_type>(cp);
+                }
+            }
+          public:
+            typedef std::conditional_t<std::ranges::forward_range<code_point_view>,
+                                       std::forward_iterator_tag, std::input_iterator_tag> iterator_concept;
+            typedef unit_type value_type;
+            typedef std::ptrdiff_t difference_type;
+
+            iterator () = default;
+            iterator (base_iterator current, base_sentinel last) : current(std::move(current)), last(std::move(last))
+            {
+                encode();
+            }
+            unit_type operator * () const { return units[index]; }
+            iterator& operator ++ ()
+            {
+                if (++index == count) {
+                    ++current;
+                    encode();
+                }
+                return *this;
+            }
+            iterator operator ++ (int) requires std::ranges::forward_range<code_point_view>
+            {
+                iterator temp = *this;
+                ++(*this);
+                return temp;
+            }
+            void operator ++ (int) { ++(*this); }
+            bool operator == (const iterator& rhs) const requires std::ranges::forward_range<code_point_view>
+            {
+                return current == rhs.current && index == rhs.index;
+            }
+            bool operator == (sentinel) const { return current == last; }
+        };
+
+        encode_view () = default;
+        explicit encode_view (code_point_view base) : base_view(std::move(base)) {}
+        code_point_view base () const { return base_view; }
+        iterator begin () { return iterator(std::ranges::begin(base_view), std::ranges::end(base_view)); }
+        sentinel end () const { return sentinel(); }
+    };
+
+    /// Range adaptors: text | utf8::views::decode | std::views::filter(...) | utf8::views::encode16
+    namespace views
+    {
+        template <template <typename> class view_template>
+        struct decode_adaptor {
+            template <typename octet_range>
+                requires std::ranges::borrowed_range<octet_range> && std::ranges::common_range<octet_range>
+            view_template<std::ranges::iterator_t<octet_range> > operator () (octet_range&& octets) const
+            {
+                return view_template<std::ranges::iterator_t<octet_range> >(std::ranges::begin(octets), std::ranges::end(octets));
+            }
+            template <typename octet_range>
+            friend auto operator | (octet_range&& octets, const decode_adaptor& adaptor)
+                -> decltype(adaptor(std::forward<octet_range>(octets)))
+            {
+                return adaptor(std::forward<octet_range>(octets));
+            }
+        };
+
+        template <typename unit_type>
+        struct encode_adaptor {
+            template <typename code_point_range>
+                requires std::ranges::viewable_range<code_point_range>
+            encode_view<std::views::all_t<code_point_range>, unit_type> operator () (code_point_range&& code_points) const
+            {
+                return encode_view<std::views::all_t<code_point_range>, unit_type>(std::views::all(std::forward<code_point_range>(code_points)));
+            }
+            template <typename code_point_range>
+            friend auto operator | (code_point_range&& code_points, const encode_adaptor& adaptor)
+                -> decltype(adaptor(std::forward<code_point_range>(code_points)))
+            {
+                return adaptor(std::forward<code_point_range>(code_points));
+            }
+        };
+
+        inline constexpr decode_adaptor<decode_view> decode{};
+        inline constexpr decode_adaptor<unchecked::decode_view> decode_unchecked{};
+        inline constexpr encode_adaptor<char> encode{};
+        inline constexpr encode_adaptor<char16_t> encode16{};
+        inline constexpr encode_adaptor<char32_t> encode32{};
+    } // namespace utf8::views
+#endif // UTF8_CPP_RANGES
 } // namespace utf8 
+
+#if defined(UTF8_CPP_RANGES)
+// The decode views only hold iterators into the octets
+template <typename octet_iterator>
+inline constexpr bool std::ranges::enable_borrowed_range<utf8::decode_view<octet_iterator> > = true;
+template <typename octet_iterator>
+inline constexpr bool std::ranges::enable_borrowed_range<utf8::unchecked::decode_view<octet_iterator> > = true;
+#endif
@@ -0,0 +1,221 @@
+// Copyright 2006 Nemanja Trifunovic
+// Distributed under BOOST software license version 1.0
+
+#pragma once
+
+// Memory-mapped files for the algorithms of utf8.h, so that large files are processed
+// without being read into user-space buffers first. Requires C++11 and POSIX.
+
+#include "utf8.h"
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace utf8
+{
+namespace internal
+{
+    inline std::system_error file_error(const std::string& what, const char* path)
+    {
+        return std::system_error(errno, std::generic_category(), what + " " + path);
+    }
+
+    /// writev that retries until everything is written; iov is modified
+    inline void write_all(int fd, struct iovec* iov, int count)
+    {
+        while (count != 0) {
+            ssize_t written = ::writev(fd, iov, count);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "writev");
+            }
+            for (; count != 0 && static_cast<std::size_t>(written) >= iov->iov_len; ++iov, --count)
+                written -= static_cast<ssize_t>(iov->iov_len);
+            if (count != 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= static_cast<std::size_t>(written);
+            }
+        }
+    }
+} // namespace internal
+
+    /// Read-only mapping of a whole file, advised for sequential access. begin() and end()
+    /// are const char*, so every algorithm takes its contiguous (vectorized) path on it.
+    class mapped_file {
+        const char* start;
+        std::size_t length;
+      public:
+        explicit mapped_file (const char* path) : start(nullptr), length(0)
+        {
+            const int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                throw internal::file_error("cannot open", path);
+            struct stat info;
+            if (::fstat(fd, &info) != 0) {
+                const std::system_error error = internal::file_error("cannot stat", path);
+                ::close(fd);
+                throw error;
+            }
+            length = static_cast<std::size_t>(info.st_size);
+            if (length != 0) {
+                void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    const std::system_error error = internal::file_error("cannot map", path);
+                    ::close(fd);
+                    throw error;
+                }
+#if defined(MADV_SEQUENTIAL)
+                ::madvise(mapping, length, MADV_SEQUENTIAL);
+#endif
+                start = static_cast<const char*>(mapping);
+            }
+            ::close(fd);
+        }
+        ~mapped_file ()
+        {
+            if (length != 0)
+                ::munmap(const_cast<char*>(start), length);
+        }
+        mapped_file (const mapped_file&) = delete;
+        mapped_file& operator = (const mapped_file&) = delete;
+
+        const char* data () const { return start; }
+        std::size_t size () const { return length; }
+        const char* begin () const { return start; }
+        const char* end () const { return start + length; }
+    };
+
+    /// Writable shared mapping of a file that is created (or truncated) with the given size
+    class mapped_output_file {
+        char* start;
+        std::size_t length;
+      public:
+        mapped_output_file (const char* path, std::size_t size) : start(nullptr), length(size)
+        {
+            const int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0)
+                throw internal::file_error("cannot create", path);
+            if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+                const std::system_error error = internal::file_error("cannot resize", path);
+                ::close(fd);
+                throw error;
+            }
+            if (length != 0) {
+                void* mapping = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    const std::system_error error = internal::file_error("cannot map", path);
+                    ::close(fd);
+                    throw error;
+                }
+                start = static_cast<char*>(mapping);
+            }
+            ::close(fd);
+        }
+        ~mapped_output_file ()
+        {
+            if (length != 0)
+                ::munmap(start, length);
+        }
+        mapped_output_file (const mapped_output_file&) = delete;
+        mapped_output_file& operator = (const mapped_output_file&) = delete;
+
+        char* data () const { return start; }
+        std::size_t size () const { return length; }
+    };
+
+    /// replace_invalid that writes to a file descriptor with writev. Valid spans are written
+    /// straight from the input, so nothing is copied in user space. Throws like replace_invalid,
+    /// after writing the output that comes before the error.
+    inline void replace_invalid_to_fd (const char* start, const char* end, int fd, uint32_t replacement = 0xfffd)
+    {
+        char marker[4];
+        char* marker_end = marker;
+        const bool marker_valid = utf8::try_append(replacement, marker_end) == UTF8_OK;
+
+#if defined(IOV_MAX)
+        const int max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+        const int max_iov = 16;
+#endif
+        struct iovec iov[1024];
+        int count = 0;
+        const char* it = start;
+        while (it != end) {
+            const char* invalid = utf8::find_invalid(it, end);
+            if (invalid != it) {
+                iov[count].iov_base = const_cast<char*>(it);
+                iov[count].iov_len = static_cast<std::size_t>(invalid - it);
+                ++count;
+            }
+            if (invalid != end) {
+                const char* sequence = invalid;
+                const utf_error err_code = utf8::internal::validate_next(sequence, end);
+                if (err_code == NOT_ENOUGH_ROOM || !marker_valid) {
+                    internal::write_all(fd, iov, count);
+                    if (err_code == NOT_ENOUGH_ROOM)
+                        throw not_enough_room();
+                    throw invalid_code_point(replacement);
+                }
+                iov[count].iov_base = marker;
+                iov[count].iov_len = static_cast<std::size_t>(marker_end - marker);
+                ++count;
+                invalid = utf8::internal::invalid_sequence_end(invalid, end, err_code);
+            }
+            it = invalid;
+            // Room for the next span and its replacement
+            if (count + 2 > max_iov) {
+                internal::write_all(fd, iov, count);
+                count = 0;
+            }
+        }
+        internal::write_all(fd, iov, count);
+    }
+
+    inline void replace_invalid_to_fd (const mapped_file& file, int fd, uint32_t replacement = 0xfffd)
+    {
+        utf8::replace_invalid_to_fd(file.begin(), file.end(), fd, replacement);
+    }
+
+namespace internal
+{
+    /// Invalid input throws what utf8to16/utf8to32 would, before the output file is created
+    inline void check_transcoding_input (const mapped_file& input)
+    {
+        const char* invalid = utf8::find_invalid(input.begin(), input.end());
+        if (invalid != input.end())
+            utf8::next(invalid, input.end());
+    }
+} // namespace internal
+
+    /// Converts a UTF-8 file to a file of UTF-16 code units in native byte order, writing
+    /// straight into a mapping of the output. Returns the number of code units.
+    inline std::size_t utf8to16_file (const char* input_path, const char* output_path)
+    {
+        const mapped_file input(input_path);
+        internal::check_transcoding_input(input);
+        const std::size_t units = utf8::utf16_length(input.begin(), input.end());
+        mapped_output_file output(output_path, units * sizeof(uint16_t));
+        if (units != 0)
+            utf8::utf8to16(input.begin(), input.end(), reinterpret_cast<uint16_t*>(output.data()));
+        return units;
+    }
+
+    /// Converts a UTF-8 file to a file of UTF-32 code units in native byte order
+    inline std::size_t utf8to32_file (const char* input_path, const char* output_path)
+    {
+        const mapped_file input(input_path);
+        internal::check_transcoding_input(input);
+        const std::size_t code_points = static_cast<std::size_t>(utf8::unchecked::distance(input.begin(), input.end()));
+        mapped_output_file output(output_path, code_points * sizeof(uint32_t));
+        if (code_points != 0)
+            utf8::utf8to32(input.begin(), input.end(), reinterpret_cast<uint32_t*>(output.data()));
+        return code_points;
+    }
+} // namespace utf8
@@ -0,0 +1,235 @@
+// Copyright 2006 Nemanja Trifunovic
+// Distributed under BOOST software license version 1.0
+
+#pragma once
+
+// Multi-threaded versions of the bulk algorithms for large contiguous buffers.
+// Requires C++11 and linking with the platform thread library.
+
+#include "utf8.h"
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace utf8
+{
+namespace parallel
+{
+    /// Runs tasks on plain std::threads, using the calling thread as one of the workers.
+    /// Any executor can be used instead if it has concurrency() and an operator() that calls
+    /// task(i) for every i in [0, count), possibly concurrently, and returns when all are done.
+    /// If a task throws, or a thread cannot be started, no further tasks are begun, and the
+    /// first exception is rethrown on the calling thread once all the workers have stopped.
+    class thread_executor {
+        unsigned threads;
+    public:
+        explicit thread_executor (unsigned threads = std::thread::hardware_concurrency()) :
+            threads(threads ? threads : 1) {}
+
+        unsigned concurrency () const { return threads; }
+
+        template <typename task_type>
+        void operator () (std::size_t count, const task_type& task) const
+        {
+            std::atomic<std::size_t> next(0);
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            auto fail = [&](std::exception_ptr e) {
+                next = count;
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = e;
+            };
+            auto worker = [&]() {
+                try {
+                    for (std::size_t i = next++; i < count; i = next++)
+                        task(i);
+                }
+                catch (...) {
+                    fail(std::current_exception());
+                }
+            };
+            std::vector<std::thread> workers;
+            const std::size_t extra = std::min<std::size_t>(threads, count) - (count ? 1 : 0);
+            workers.reserve(extra);
+            try {
+                for (std::size_t i = 0; i < extra; ++i)
+                    workers.emplace_back(worker);
+            }
+            catch (...) {
+                fail(std::current_exception());
+            }
+            worker();
+            for (std::thread& t : workers)
+                t.join();
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+
+namespace internal
+{
+    // Buffers smaller than this are not worth splitting
+    const std::size_t MIN_CHUNK_SIZE = 1 << 16;
+
+    /// Splits [first, last) into chunks that start at octets that are not trail octets.
+    /// UTF-8 resynchronizes at such octets, so no sequence (valid or not) spans two chunks,
+    /// except that a sequence cut off at the end of a chunk is really cut off by the first
+    /// octet of the next one.
+    template <typename executor_type>
+    std::vector<const uint8_t*> split (const uint8_t* first, const uint8_t* last, const executor_type& executor)
+    {
+        const std::size_t size = static_cast<std::size_t>(last - first);
+        std::size_t parts = std::max<std::size_t>(1, executor.concurrency()) * 4;
+        parts = std::max<std::size_t>(1, std::min(parts, size / MIN_CHUNK_SIZE));
+
+        std::vector<const uint8_t*> bounds(1, first);
+        for (std::size_t i = 1; i < parts; ++i) {
+            const uint8_t* bound = first + size / parts * i;
+            while (bound != last && utf8::internal::is_trail(*bound))
+                ++bound;
+            if (bound != last && bound > bounds.back())
+                bounds.push_back(bound);
+        }
+        bounds.push_back(last);
+        return bounds;
+    }
+
+    template <typename octet_iterator>
+    inline const uint8_t* pointer (octet_iterator it)
+    {
+        return utf8::internal::contiguous_octets<octet_iterator>::pointer(it);
+    }
+} // namespace internal
+
+    template <typename octet_iterator, typename executor_type>
+    octet_iterator find_invalid (octet_iterator start, octet_iterator end, const executor_type& executor)
+    {
+        if (start == end)
+            return end;
+        const uint8_t* first = internal::pointer(start);
+        const std::vector<const uint8_t*> bounds = internal::split(first, first + (end - start), executor);
+        const std::size_t chunks = bounds.size() - 1;
+
+        // Chunks after the first one known to be invalid need not be looked at
+        std::atomic<std::size_t> first_invalid_chunk(chunks);
+        std::vector<const uint8_t*> invalid(chunks);
+        executor(chunks, [&](std::size_t i) {
+            if (i > first_invalid_chunk.load())
+                return;
+            invalid[i] = utf8::find_invalid(bounds[i], bounds[i + 1]);
+            if (invalid[i] != bounds[i + 1]) {
+                std::size_t current = first_invalid_chunk.load();
+                while (i < current && !first_invalid_chunk.compare_exchange_weak(current, i))
+                    ;
+            }
+        });
+        const std::size_t chunk = first_invalid_chunk.load();
+        return chunk == chunks ? end : start + (invalid[chunk] - first);
+    }
+
+    template <typename octet_iterator>
+    inline octet_iterator find_invalid (octet_iterator start, octet_iterator end)
+    {
+        return utf8::parallel::find_invalid(start, end, thread_executor());
+    }
+
+    template <typename octet_iterator, typename executor_type>
+    inline bool is_valid (octet_iterator start, octet_iterator end, const executor_type& executor)
+    {
+        return utf8::parallel::find_invalid(start, end, executor) == end;
+    }
+
+    template <typename octet_iterator>
+    inline bool is_valid (octet_iterator start, octet_iterator end)
+    {
+        return utf8::parallel::is_valid(start, end, thread_executor());
+    }
+
+    /// utf8to16 into a buffer of utf16_length(start, end) code units. Invalid input is handed
+    /// to the serial utf8to16, so the exception and the output written before it are the same.
+    template <typename octet_iterator, typename u16bit_pointer, typename executor_type>
+    u16bit_pointer utf8to16 (octet_iterator start, octet_iterator end, u16bit_pointer result, const executor_type& executor)
+    {
+        if (start == end)
+            return result;
+        const uint8_t* first = internal::pointer(start);
+        const std::vector<const uint8_t*> bounds = internal::split(first, first + (end - start), executor);
+        const std::size_t chunks = bounds.size() - 1;
+
+        std::vector<std::size_t> offsets(chunks + 1, 0);
+        std::atomic<bool> valid(true);
+        executor(chunks, [&](std::size_t i) {
+            if (utf8::find_invalid(bounds[i], bounds[i + 1]) != bounds[i + 1])
+                valid = false;
+            else
+                offsets[i + 1] = utf8::utf16_length(bounds[i], bounds[i + 1]);
+        });
+        if (!valid)
+            return utf8::utf8to16(start, end, result);
+
+        for (std::size_t i = 0; i < chunks; ++i)
+            offsets[i + 1] += offsets[i];
+        executor(chunks, [&](std::size_t i) {
+            utf8::utf8to16(bounds[i], bounds[i + 1], result + offsets[i]);
+        });
+        return result + offsets[chunks];
+    }
+
+    template <typename octet_iterator, typename u16bit_pointer>
+    inline u16bit_pointer utf8to16 (octet_iterator start, octet_iterator end, u16bit_pointer result)
+    {
+        return utf8::parallel::utf8to16(start, end, result, thread_executor());
+    }
+
+    /// replace_invalid with the chunks processed concurrently into temporary buffers that
+    /// are then copied to out in order. Errors are thrown after the output that the serial
+    /// replace_invalid writes before throwing.
+    template <typename octet_iterator, typename output_iterator, typename executor_type>
+    output_iterator replace_invalid (octet_iterator start, octet_iterator end, output_iterator out,
+                                     uint32_t replacement, const executor_type& executor)
+    {
+        if (start == end)
+            return out;
+        const uint8_t* first = internal::pointer(start);
+        const std::vector<const uint8_t*> bounds = internal::split(first, first + (end - start), executor);
+        const std::size_t chunks = bounds.size() - 1;
+
+        std::vector<std::string> outputs(chunks);
+        std::vector<utf_error> errors(chunks, UTF8_OK);
+        executor(chunks, [&](std::size_t i) {
+            outputs[i].reserve(static_cast<std::size_t>(bounds[i + 1] - bounds[i]));
+            const uint8_t* it = bounds[i];
+            std::back_insert_iterator<std::string> chunk_out(outputs[i]);
+            errors[i] = utf8::try_replace_invalid(it, bounds[i + 1], chunk_out, replacement);
+            // A sequence cut off by the end of a chunk is followed by a lead or ASCII octet
+            // in the next one, so it is an incomplete sequence like anywhere else
+            if (errors[i] == NOT_ENOUGH_ROOM && i + 1 != chunks)
+                errors[i] = utf8::try_append(replacement, chunk_out) == UTF8_OK ? UTF8_OK : INVALID_CODE_POINT;
+        });
+
+        for (std::size_t i = 0; i < chunks; ++i) {
+            out = std::copy(outputs[i].begin(), outputs[i].end(), out);
+            switch (errors[i]) {
+                case NOT_ENOUGH_ROOM:
+                    throw not_enough_room();
+                case INVALID_CODE_POINT:
+                    throw invalid_code_point(replacement);
+                default:
+                    break;
+            }
+        }
+        return out;
+    }
+
+    template <typename octet_iterator, typename output_iterator>
+    inline output_iterator replace_invalid (octet_iterator start, octet_iterator end, output_iterator out)
+    {
+        return utf8::parallel::replace_invalid(start, end, out, utf8::internal::mask16(0xfffd), thread_executor());
+    }
+
+} // namespace utf8::parallel
+} // namespace utf8
@@ -0,0 +1,812 @@
+// Throughput of the utf8.h algorithms over corpora with different script mixes.
+// Usage: utf8bench [reference_text.utf8.txt] [seconds per measurement] [tiers]
+// tiers is a comma-separated list of SIMD tiers to measure ("scalar", "sse4.2", "avx2",
+// "avx512", "neon") or "all"; by default only the tier in use is measured. Every tier the
+// CPU supports is first checked against the scalar one.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "utf8.h"
+
+using namespace std;
+
+namespace {
+
+const size_t CORPUS_SIZE = 4 << 20;
+
+struct corpus {
+    string name;
+    string text;
+    bool valid;
+    size_t code_points;
+    vector<utf8::uint16_t> utf16;
+    vector<utf8::uint32_t> utf32;
+    // The text as Latin-1, if it fits
+    bool fits_latin1;
+    string latin1;
+    // The text split into short fields at sequence boundaries, for the batch functions
+    vector<size_t> field_offsets;
+};
+
+// Keeps results alive so that the measured loops are not optimized away
+volatile size_t sink;
+
+string repeat(const string& pieces_joined, const vector<size_t>& lengths, unsigned seed)
+{
+    // Pseudo-random sequence of the pieces so that branch predictors cannot learn the input
+    string text;
+    text.reserve(CORPUS_SIZE + 16);
+    vector<size_t> starts(1, 0);
+    for (size_t i = 0; i < lengths.size(); ++i)
+        starts.push_back(starts.back() + lengths[i]);
+    while (text.size() < CORPUS_SIZE) {
+        seed = seed * 1103515245u + 12345u;
+        const size_t piece = (seed >> 16) % lengths.size();
+        text.append(pieces_joined, starts[piece], lengths[piece]);
+    }
+    return text;
+}
+
+string mix(const char* const* pieces, size_t count, unsigned seed)
+{
+    string joined;
+    vector<size_t> lengths;
+    for (size_t i = 0; i < count; ++i) {
+        joined += pieces[i];
+        lengths.push_back(strlen(pieces[i]));
+    }
+    return repeat(joined, lengths, seed);
+}
+
+corpus make_corpus(const string& name, const string& text)
+{
+    corpus c;
+    c.name = name;
+    c.text = text;
+    c.valid = utf8::is_valid(text.begin(), text.end());
+    if (c.valid) {
+        utf8::utf8to16(text.begin(), text.end(), back_inserter(c.utf16));
+        utf8::utf8to32(text.begin(), text.end(), back_inserter(c.utf32));
+        c.code_points = c.utf32.size();
+    }
+    else {
+        string replaced;
+        utf8::replace_invalid(text.begin(), text.end(), back_inserter(replaced));
+        c.code_points = static_cast<size_t>(utf8::distance(replaced.begin(), replaced.end()));
+    }
+    c.fits_latin1 = utf8::is_latin1(text.begin(), text.end());
+    if (c.fits_latin1)
+        utf8::utf8tolatin1(text.begin(), text.end(), back_inserter(c.latin1));
+    for (size_t offset = 0; offset < text.size(); ) {
+        c.field_offsets.push_back(offset);
+        offset = min(offset + 32, text.size());
+        while (offset < text.size() && utf8::internal::is_trail(text[offset]))
+            ++offset;
+    }
+    c.field_offsets.push_back(text.size());
+    return c;
+}
+
+vector<corpus> make_corpora(const char* reference_path)
+{
+    vector<corpus> corpora;
+
+    const char* ascii[] = {"The quick brown fox ", "jumps over the lazy dog. ", "0123456789\n", "{\"key\": \"value\"}, "};
+    corpora.push_back(make_corpus("ascii", mix(ascii, 4, 1)));
+
+    const char* latin1[] = {"caf\xc3\xa9 ", "na\xc3\xafve ", "Stra\xc3\x9f" "e ", "a", "e", " "};
+    corpora.push_back(make_corpus("latin1", mix(latin1, 6, 2)));
+
+    const char* cjk[] = {"\xe4\xb8\xad", "\xe6\x96\x87", "\xe6\x97\xa5", "\xe6\x9c\xac", "\xed\x95\x9c", "\xe3\x81\x82", "\xe3\x80\x82"};
+    corpora.push_back(make_corpus("cjk", mix(cjk, 7, 3)));
+
+    const char* emoji[] = {"\xf0\x9f\x98\x80", "\xf0\x9f\x91\x8d", "\xf0\x9f\x8e\x89", "\xe2\x9c\x85", " ", "ok "};
+    corpora.push_back(make_corpus("emoji", mix(emoji, 6, 4)));
+
+    const char* invalid[] = {"abc", "\xc3\xa9", "\x80", "\xc3", "\xe2\x82", "\xff", "\xed\xa0\x80", "\xc0\xaf", "\xf0\x9f\x98\x80"};
+    corpora.push_back(make_corpus("invalid", mix(invalid, 9, 5)));
+
+    ifstream file(reference_path, ios::binary);
+    if (file) {
+        stringstream buffer;
+        buffer << file.rdbuf();
+        const string reference = buffer.str();
+        if (!reference.empty()) {
+            string text;
+            while (text.size() < CORPUS_SIZE)
+                text += reference;
+            corpora.push_back(make_corpus("reference", text));
+        }
+    }
+    else
+        fprintf(stderr, "%s not found, skipping the reference corpus\n", reference_path);
+
+    return corpora;
+}
+
+// Each benchmark processes the whole corpus once and returns something derived from the result
+typedef size_t (*benchmark_function)(const corpus&);
+
+size_t bench_is_valid(const corpus& c)
+{
+    return utf8::is_valid(c.text.data(), c.text.data() + c.text.size());
+}
+
+// Resumes after every error, so that invalid input is scanned to the end as well
+size_t bench_find_invalid(const corpus& c)
+{
+    const char* it = c.text.data();
+    const char* end = it + c.text.size();
+    size_t errors = 0;
+    while ((it = utf8::find_invalid(it, end)) != end) {
+        ++errors;
+        ++it;
+    }
+    return errors;
+}
+
+size_t bench_replace_invalid(const corpus& c)
+{
+    string out;
+    out.reserve(c.text.size() * 2);
+    utf8::replace_invalid(c.text.data(), c.text.data() + c.text.size(), back_inserter(out));
+    return out.size();
+}
+
+// Includes making the copy that is sanitized
+size_t bench_replace_invalid_append_sink(const corpus& c)
+{
+    string out;
+    utf8::replace_invalid(c.text.data(), c.text.data() + c.text.size(), utf8::append_to(out, c.text.size()));
+    return out.size();
+}
+
+size_t bench_replace_invalid_in_place(const corpus& c)
+{
+    string text = c.text;
+    utf8::replace_invalid_in_place(text);
+    return text.size();
+}
+
+size_t bench_replace_maximal_subpart(const corpus& c)
+{
+    string out;
+    out.reserve(c.text.size() * 2);
+    utf8::replace_invalid_with(c.text.data(), c.text.data() + c.text.size(), back_inserter(out),
+                               utf8::replace_maximal_subpart());
+    return out.size();
+}
+
+size_t bench_is_valid_fields(const corpus& c)
+{
+    size_t valid = 0;
+    for (size_t i = 0; i + 1 < c.field_offsets.size(); ++i)
+        valid += utf8::is_valid(c.text.data() + c.field_offsets[i], c.text.data() + c.field_offsets[i + 1]);
+    return valid;
+}
+
+size_t bench_validate_batch(const corpus& c)
+{
+    vector<utf8::batch_status> results(c.field_offsets.size() - 1);
+    return utf8::validate_batch(c.text.data(), &c.field_offsets[0], results.size(), &results[0]);
+}
+
+size_t bench_next(const corpus& c)
+{
+    const char* it = c.text.data();
+    const char* end = it + c.text.size();
+    size_t sum = 0;
+    while (it != end)
+        sum += utf8::next(it, end);
+    return sum;
+}
+
+size_t bench_unchecked_next(const corpus& c)
+{
+    const char* it = c.text.data();
+    const char* end = it + c.text.size();
+    size_t sum = 0;
+    while (it != end)
+        sum += utf8::unchecked::next(it);
+    return sum;
+}
+
+size_t bench_prior(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* it = start + c.text.size();
+    size_t sum = 0;
+    while (it != start)
+        sum += utf8::prior(it, start);
+    return sum;
+}
+
+size_t bench_unchecked_prior(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* it = start + c.text.size();
+    size_t sum = 0;
+    while (it != start)
+        sum += utf8::unchecked::prior(it);
+    return sum;
+}
+
+size_t bench_retreat(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* it = start + c.text.size();
+    utf8::retreat(it, utf8::unchecked::distance(start, it), start);
+    return static_cast<size_t>(it - start);
+}
+
+size_t bench_distance(const corpus& c)
+{
+    return static_cast<size_t>(utf8::distance(c.text.data(), c.text.data() + c.text.size()));
+}
+
+size_t bench_unchecked_distance(const corpus& c)
+{
+    return static_cast<size_t>(utf8::unchecked::distance(c.text.data(), c.text.data() + c.text.size()));
+}
+
+size_t bench_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(c.utf16.size());
+    return static_cast<size_t>(utf8::utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0]) - &out[0]);
+}
+
+size_t bench_utf8to16_back_inserter(const corpus& c)
+{
+    vector<utf8::uint16_t> out;
+    utf8::utf8to16(c.text.data(), c.text.data() + c.text.size(), back_inserter(out));
+    return out.size();
+}
+
+// The output has room for replacing every octet
+size_t bench_convert_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(c.text.size());
+    return static_cast<size_t>(utf8::convert_utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0], 0xfffd).out - &out[0]);
+}
+
+// The two passes that convert_utf8to16 replaces for valid input
+size_t bench_is_valid_unchecked_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(c.utf16.size());
+    if (!utf8::is_valid(c.text.data(), c.text.data() + c.text.size()))
+        return 0;
+    return static_cast<size_t>(utf8::unchecked::utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0]) - &out[0]);
+}
+
+size_t bench_utf16to8(const corpus& c)
+{
+    string out(c.text.size(), '\0');
+    return static_cast<size_t>(utf8::utf16to8(c.utf16.begin(), c.utf16.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_utf16to8_length(const corpus& c)
+{
+    return utf8::utf16to8_length(c.utf16.begin(), c.utf16.end());
+}
+
+size_t bench_stream_utf16to8(const corpus& c)
+{
+    // An odd chunk size, so that some surrogate pairs are split between chunks
+    const size_t CHUNK = 4093;
+    string out(c.text.size(), '\0');
+    char* it = &out[0];
+    utf8::stream_utf16to8 stream;
+    for (size_t i = 0; i < c.utf16.size(); i += CHUNK)
+        it = stream.feed(c.utf16.begin() + i, c.utf16.begin() + min(c.utf16.size(), i + CHUNK), it);
+    stream.finish();
+    return static_cast<size_t>(it - &out[0]);
+}
+
+size_t bench_utf8to32(const corpus& c)
+{
+    vector<utf8::uint32_t> out(c.utf32.size());
+    return static_cast<size_t>(utf8::utf8to32(c.text.data(), c.text.data() + c.text.size(), &out[0]) - &out[0]);
+}
+
+size_t bench_convert_utf8to32(const corpus& c)
+{
+    vector<utf8::uint32_t> out(c.text.size());
+    return static_cast<size_t>(utf8::convert_utf8to32(c.text.data(), c.text.data() + c.text.size(), &out[0], 0xfffd).out - &out[0]);
+}
+
+size_t bench_utf32to8(const corpus& c)
+{
+    string out(c.text.size(), '\0');
+    return static_cast<size_t>(utf8::utf32to8(c.utf32.begin(), c.utf32.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_utf32to8_length(const corpus& c)
+{
+    return utf8::utf32to8_length(c.utf32.begin(), c.utf32.end());
+}
+
+size_t bench_utf32to8_append_sink(const corpus& c)
+{
+    string out;
+    utf8::utf32to8(c.utf32.begin(), c.utf32.end(), utf8::append_to(out, c.text.size()));
+    return out.size();
+}
+
+size_t bench_latin1to8(const corpus& c)
+{
+    string out(c.text.size(), '\0');
+    return static_cast<size_t>(utf8::latin1to8(c.latin1.begin(), c.latin1.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_latin1to8_via_utf32(const corpus& c)
+{
+    vector<utf8::uint32_t> widened(c.latin1.begin(), c.latin1.end());
+    for (size_t i = 0; i < widened.size(); ++i)
+        widened[i] &= 0xff;
+    string out(c.text.size(), '\0');
+    return static_cast<size_t>(utf8::utf32to8(widened.begin(), widened.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_utf8tolatin1(const corpus& c)
+{
+    string out(c.latin1.size(), '\0');
+    return static_cast<size_t>(utf8::utf8tolatin1(c.text.begin(), c.text.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_is_latin1(const corpus& c)
+{
+    return utf8::is_latin1(c.text.begin(), c.text.end());
+}
+
+// The text compared with itself, which is the worst case: nothing differs
+size_t bench_iequals_ascii(const corpus& c)
+{
+    return utf8::iequals_ascii(c.text.begin(), c.text.end(), c.text.begin(), c.text.end());
+}
+
+// A needle that is not in any corpus, so that the whole text is searched
+size_t bench_find_ascii_icase(const corpus& c)
+{
+    const string needle = "Xq#Needle";
+    return static_cast<size_t>(utf8::find_ascii_icase(c.text.begin(), c.text.end(), needle.begin(), needle.end()) - c.text.begin());
+}
+
+size_t bench_compare_folded(const corpus& c)
+{
+    return static_cast<size_t>(utf8::compare_folded(c.text.begin(), c.text.end(), c.text.begin(), c.text.end()));
+}
+
+// What compare_folded replaces: both sides decoded and folded in full
+size_t bench_utf8to32_fold_compare(const corpus& c)
+{
+    vector<utf8::uint32_t> a, b;
+    utf8::utf8to32(c.text.begin(), c.text.end(), back_inserter(a));
+    utf8::utf8to32(c.text.begin(), c.text.end(), back_inserter(b));
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = utf8::fold_case(a[i]);
+        b[i] = utf8::fold_case(b[i]);
+    }
+    return a == b;
+}
+
+size_t bench_unchecked_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(c.utf16.size());
+    return static_cast<size_t>(utf8::unchecked::utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0]) - &out[0]);
+}
+
+size_t bench_unchecked_utf16to8(const corpus& c)
+{
+    string out(c.text.size(), '\0');
+    return static_cast<size_t>(utf8::unchecked::utf16to8(c.utf16.begin(), c.utf16.end(), &out[0]) - &out[0]);
+}
+
+size_t bench_unchecked_utf8to32(const corpus& c)
+{
+    vector<utf8::uint32_t> out(c.utf32.size());
+    return static_cast<size_t>(utf8::unchecked::utf8to32(c.text.data(), c.text.data() + c.text.size(), &out[0]) - &out[0]);
+}
+
+size_t bench_iterator(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* end = start + c.text.size();
+    utf8::iterator<const char*> it(start, start, end), last(end, start, end);
+    size_t sum = 0;
+    for (; it != last; ++it)
+        sum += *it;
+    return sum;
+}
+
+size_t bench_decoding_iterator(const corpus& c)
+{
+    const char* start = c.text.data();
+    utf8::decoding_iterator<const char*> it(start, start, start + c.text.size());
+    size_t sum = 0;
+    for (; it != utf8::sentinel(); ++it)
+        sum += *it;
+    return sum;
+}
+
+size_t bench_unchecked_iterator(const corpus& c)
+{
+    const char* start = c.text.data();
+    utf8::unchecked::iterator<const char*> it(start), last(start + c.text.size());
+    size_t sum = 0;
+    for (; it != last; ++it)
+        sum += *it;
+    return sum;
+}
+
+struct benchmark {
+    const char* name;
+    benchmark_function function;
+    bool needs_valid_input;
+    bool needs_latin1_input;
+};
+
+const benchmark benchmarks[] = {
+    {"is_valid", bench_is_valid, true, false},
+    {"find_invalid", bench_find_invalid, false, false},
+    {"is_valid 32 octet fields", bench_is_valid_fields, false, false},
+    {"validate_batch", bench_validate_batch, false, false},
+    {"replace_invalid", bench_replace_invalid, false, false},
+    {"replace_invalid append_sink", bench_replace_invalid_append_sink, false, false},
+    {"replace_invalid_in_place", bench_replace_invalid_in_place, false, false},
+    {"replace maximal subpart", bench_replace_maximal_subpart, false, false},
+    {"next", bench_next, true, false},
+    {"unchecked::next", bench_unchecked_next, true, false},
+    {"prior", bench_prior, true, false},
+    {"unchecked::prior", bench_unchecked_prior, true, false},
+    {"retreat", bench_retreat, true, false},
+    {"distance", bench_distance, true, false},
+    {"unchecked::distance", bench_unchecked_distance, true, false},
+    {"utf8to16", bench_utf8to16, true, false},
+    {"utf8to16 back_inserter", bench_utf8to16_back_inserter, true, false},
+    {"unchecked::utf8to16", bench_unchecked_utf8to16, true, false},
+    {"convert_utf8to16", bench_convert_utf8to16, false, false},
+    {"is_valid + unchecked 8to16", bench_is_valid_unchecked_utf8to16, true, false},
+    {"utf16to8", bench_utf16to8, true, false},
+    {"utf16to8_length", bench_utf16to8_length, true, false},
+    {"stream_utf16to8 4093 units", bench_stream_utf16to8, true, false},
+    {"unchecked::utf16to8", bench_unchecked_utf16to8, true, false},
+    {"utf8to32", bench_utf8to32, true, false},
+    {"unchecked::utf8to32", bench_unchecked_utf8to32, true, false},
+    {"convert_utf8to32", bench_convert_utf8to32, false, false},
+    {"utf32to8", bench_utf32to8, true, false},
+    {"utf32to8_length", bench_utf32to8_length, true, false},
+    {"utf32to8 append_sink", bench_utf32to8_append_sink, true, false},
+    {"latin1to8", bench_latin1to8, true, true},
+    {"latin1to8 via utf32to8", bench_latin1to8_via_utf32, true, true},
+    {"utf8tolatin1", bench_utf8tolatin1, true, true},
+    {"is_latin1", bench_is_latin1, true, true},
+    {"iequals_ascii", bench_iequals_ascii, false, false},
+    {"find_ascii_icase", bench_find_ascii_icase, false, false},
+    {"compare_folded", bench_compare_folded, true, false},
+    {"utf8to32 + fold_case compare", bench_utf8to32_fold_compare, true, false},
+    {"iterator", bench_iterator, true, false},
+    {"decoding_iterator", bench_decoding_iterator, true, false},
+    {"unchecked::iterator", bench_unchecked_iterator, true, false}
+};
+
+// Checks of the kernels of every tier. Each returns a checksum of the output of an algorithm,
+// which must not depend on the tier.
+typedef size_t (*check_function)(const corpus&);
+
+template <typename T>
+size_t checksum(const T* start, const T* end)
+{
+    size_t hash = 14695981039346656037ull;
+    for (; start != end; ++start)
+        hash = (hash ^ static_cast<size_t>(*start)) * 1099511628211ull;
+    return hash;
+}
+
+// The offsets of all errors found by decoding one sequence at a time, which uses no
+// kernels at all; find_invalid must find the same ones
+size_t check_validate_next(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* end = start + c.text.size();
+    vector<size_t> errors;
+    for (const char* it = start; it != end; ) {
+        const char* sequence = it;
+        if (utf8::internal::validate_next(sequence, end) != utf8::internal::UTF8_OK) {
+            errors.push_back(static_cast<size_t>(it - start));
+            ++it;
+        }
+        else
+            it = sequence;
+    }
+    return checksum(errors.data(), errors.data() + errors.size());
+}
+
+size_t check_find_invalid(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* end = start + c.text.size();
+    vector<size_t> errors;
+    for (const char* it = start; (it = utf8::find_invalid(it, end)) != end; ++it)
+        errors.push_back(static_cast<size_t>(it - start));
+    return checksum(errors.data(), errors.data() + errors.size());
+}
+
+size_t check_replace_invalid(const corpus& c)
+{
+    string out;
+    utf8::replace_invalid(c.text.begin(), c.text.end(), back_inserter(out));
+    return checksum(out.data(), out.data() + out.size());
+}
+
+size_t check_convert_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(c.text.size() + 1);
+    const utf8::uint16_t* last = utf8::convert_utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0], 0xfffd).out;
+    return checksum(&out[0], last);
+}
+
+size_t check_convert_utf8to32(const corpus& c)
+{
+    vector<utf8::uint32_t> out(c.text.size() + 1);
+    const utf8::uint32_t* last = utf8::convert_utf8to32(c.text.data(), c.text.data() + c.text.size(), &out[0], 0xfffd).out;
+    return checksum(&out[0], last);
+}
+
+size_t check_is_latin1(const corpus& c)
+{
+    return utf8::is_latin1(c.text.data(), c.text.data() + c.text.size());
+}
+
+// Searches for pieces of the text itself, with the case of the ASCII letters changed
+size_t check_find_ascii_icase(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* end = start + c.text.size();
+    size_t hash = 0;
+    for (size_t offset = 1; offset < c.text.size(); offset = offset * 3 + 7) {
+        string needle = c.text.substr(offset, 1 + offset % 13);
+        for (size_t i = 0; i < needle.size(); i += 2)
+            if ((needle[i] | 0x20) >= 'a' && (needle[i] | 0x20) <= 'z')
+                needle[i] ^= 0x20;
+        const char* found = utf8::find_ascii_icase(start, end, needle.data(), needle.data() + needle.size());
+        hash = hash * 31 + static_cast<size_t>(found - start);
+        hash = hash * 31 + utf8::iequals_ascii(start + offset, start + offset + needle.size(), needle.begin(), needle.end());
+    }
+    return hash;
+}
+
+// The checks below need valid input
+size_t check_distance(const corpus& c)
+{
+    const char* start = c.text.data();
+    const char* end = start + c.text.size();
+    size_t hash = static_cast<size_t>(utf8::distance(start, end));
+    // advance over every length from a few starting points, forwards and backwards
+    for (size_t n = 1; n < c.code_points; n = n * 2 + 1) {
+        const char* it = start;
+        utf8::advance(it, n, end);
+        hash = hash * 31 + static_cast<size_t>(it - start);
+        utf8::retreat(it, n / 2, start);
+        hash = hash * 31 + static_cast<size_t>(it - start);
+    }
+    return hash;
+}
+
+size_t check_utf8to16(const corpus& c)
+{
+    vector<utf8::uint16_t> out(utf8::utf16_length(c.text.data(), c.text.data() + c.text.size()));
+    if (!out.empty())
+        utf8::utf8to16(c.text.data(), c.text.data() + c.text.size(), &out[0]);
+    return checksum(out.data(), out.data() + out.size());
+}
+
+size_t check_utf8to32(const corpus& c)
+{
+    vector<utf8::uint32_t> out(c.code_points);
+    if (!out.empty())
+        utf8::utf8to32(c.text.data(), c.text.data() + c.text.size(), &out[0]);
+    return checksum(out.data(), out.data() + out.size());
+}
+
+size_t check_utf16to8(const corpus& c)
+{
+    string out(utf8::utf16to8_length(c.utf16.begin(), c.utf16.end()), '\0');
+    const char* last = utf8::utf16to8(c.utf16.data(), c.utf16.data() + c.utf16.size(), &out[0]);
+    return checksum(out.data(), last) + static_cast<size_t>(last - out.data());
+}
+
+size_t check_utf32to8(const corpus& c)
+{
+    string out(utf8::utf32to8_length(c.utf32.begin(), c.utf32.end()), '\0');
+    const char* last = utf8::utf32to8(c.utf32.data(), c.utf32.data() + c.utf32.size(), &out[0]);
+    return checksum(out.data(), last) + static_cast<size_t>(last - out.data());
+}
+
+size_t check_latin1(const corpus& c)
+{
+    string out(c.text.size(), '\0');
+    const char* last = utf8::latin1to8(c.latin1.data(), c.latin1.data() + c.latin1.size(), &out[0]);
+    string back(c.latin1.size(), '\0');
+    const char* back_last = utf8::utf8tolatin1(c.text.data(), c.text.data() + c.text.size(), &back[0]);
+    return checksum(out.data(), last) * 31 + checksum(back.data(), back_last);
+}
+
+struct check {
+    const char* name;
+    check_function function;
+    bool needs_valid_input;
+    bool needs_latin1_input;
+};
+
+const check checks[] = {
+    {"find_invalid", check_find_invalid, false, false},
+    {"replace_invalid", check_replace_invalid, false, false},
+    {"convert_utf8to16", check_convert_utf8to16, false, false},
+    {"convert_utf8to32", check_convert_utf8to32, false, false},
+    {"is_latin1", check_is_latin1, false, false},
+    {"find_ascii_icase", check_find_ascii_icase, false, false},
+    {"distance", check_distance, true, false},
+    {"utf8to16", check_utf8to16, true, false},
+    {"utf8to32", check_utf8to32, true, false},
+    {"utf16to8", check_utf16to8, true, false},
+    {"utf32to8", check_utf32to8, true, false},
+    {"latin1", check_latin1, true, true}
+};
+
+// Copies of the valid corpora with an octet changed every few hundred octets, so that
+// errors fall at every position within the vectors of the kernels
+vector<corpus> make_damaged_corpora(const vector<corpus>& corpora)
+{
+    vector<corpus> damaged;
+    unsigned seed = 6;
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        if (!corpora[i].valid)
+            continue;
+        string text = corpora[i].text;
+        for (size_t offset = 0; offset < text.size(); ) {
+            seed = seed * 1103515245u + 12345u;
+            offset += (seed >> 16) % 512;
+            if (offset < text.size())
+                text[offset] = static_cast<char>(seed >> 8);
+        }
+        damaged.push_back(make_corpus(corpora[i].name + "~", text));
+    }
+    return damaged;
+}
+
+const char* const tier_names[] = {"scalar", "sse4.2", "avx2", "avx512", "neon"};
+
+// The tiers the CPU supports
+vector<string> supported_tiers()
+{
+    const string initial = utf8::active_simd_tier();
+    vector<string> tiers;
+    for (size_t i = 0; i < sizeof(tier_names) / sizeof(tier_names[0]); ++i) {
+        const char* const tier = utf8::use_simd_tier(tier_names[i]);
+        if (tier != NULL && tier_names[i] == string(tier))
+            tiers.push_back(tier_names[i]);
+    }
+    utf8::use_simd_tier(initial.c_str());
+    return tiers;
+}
+
+// A kernel that disagrees with the others can make an algorithm throw, which is reported
+// as a result like any other
+size_t run_check(check_function function, const corpus& c)
+{
+    try {
+        return function(c);
+    }
+    catch (const exception&) {
+        return static_cast<size_t>(-1);
+    }
+}
+
+// Runs every check under every tier and compares the results with those of the scalar tier,
+// and find_invalid with validate_next. Returns the number of differences.
+size_t check_tiers(const vector<corpus>& corpora, const vector<string>& tiers)
+{
+    const string initial = utf8::active_simd_tier();
+    size_t differences = 0;
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        const corpus& c = corpora[i];
+        const size_t reference = check_validate_next(c);
+        for (size_t j = 0; j < sizeof(checks) / sizeof(checks[0]); ++j) {
+            const check& k = checks[j];
+            if ((k.needs_valid_input && !c.valid) || (k.needs_latin1_input && !c.fits_latin1))
+                continue;
+            utf8::use_simd_tier("scalar");
+            const size_t expected = run_check(k.function, c);
+            for (size_t t = 0; t < tiers.size(); ++t) {
+                utf8::use_simd_tier(tiers[t].c_str());
+                const size_t result = run_check(k.function, c);
+                const bool differs = result != expected || (k.function == check_find_invalid && result != reference);
+                if (differs) {
+                    fprintf(stderr, "%s: %s differs from the scalar version on %s\n", tiers[t].c_str(), k.name, c.name.c_str());
+                    ++differences;
+                }
+            }
+        }
+    }
+    utf8::use_simd_tier(initial.c_str());
+    return differences;
+}
+
+vector<string> split_tiers(const string& list)
+{
+    vector<string> tiers;
+    for (size_t start = 0; start <= list.size(); ) {
+        const size_t comma = min(list.find(',', start), list.size());
+        tiers.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return tiers;
+}
+
+// Best time of one pass, in seconds, over at least min_seconds of repetitions
+double measure(benchmark_function function, const corpus& c, double min_seconds)
+{
+    typedef chrono::steady_clock clock;
+    double best = 0;
+    const clock::time_point started = clock::now();
+    do {
+        const clock::time_point start = clock::now();
+        sink = function(c);
+        const double elapsed = chrono::duration<double>(clock::now() - start).count();
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    } while (chrono::duration<double>(clock::now() - started).count() < min_seconds);
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const char* reference_path = argc > 1 ? argv[1] : "reference_text.utf8.txt";
+    const double min_seconds = argc > 2 ? atof(argv[2]) : 0.25;
+
+    // The corpora are prepared with the scalar kernels, which the others are checked against
+    const string initial = utf8::active_simd_tier();
+    utf8::use_simd_tier("scalar");
+    const vector<corpus> corpora = make_corpora(reference_path);
+    vector<corpus> checked = make_damaged_corpora(corpora);
+    checked.insert(checked.begin(), corpora.begin(), corpora.end());
+    utf8::use_simd_tier(initial.c_str());
+
+    const vector<string> supported = supported_tiers();
+    if (check_tiers(checked, supported) != 0)
+        return 1;
+
+    vector<string> tiers(1, initial);
+    if (argc > 3)
+        tiers = string(argv[3]) == "all" ? supported : split_tiers(argv[3]);
+    for (size_t t = 0; t < tiers.size(); ++t)
+        if (find(supported.begin(), supported.end(), tiers[t]) == supported.end()) {
+            fprintf(stderr, "%s is not supported here\n", tiers[t].c_str());
+            return 1;
+        }
+
+    printf("%-10s %-26s %-7s %10s %10s\n", "corpus", "algorithm", "tier", "MB/s", "Mcp/s");
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        const corpus& c = corpora[i];
+        for (size_t j = 0; j < sizeof(benchmarks) / sizeof(benchmarks[0]); ++j) {
+            const benchmark& b = benchmarks[j];
+            if ((b.needs_valid_input && !c.valid) || (b.needs_latin1_input && !c.fits_latin1))
+                continue;
+            for (size_t t = 0; t < tiers.size(); ++t) {
+                utf8::use_simd_tier(tiers[t].c_str());
+                const double seconds = measure(b.function, c, min_seconds);
+                printf("%-10s %-26s %-7s %10.1f %10.1f\n", c.name.c_str(), b.name, tiers[t].c_str(),
+                       c.text.size() / seconds / 1e6, c.code_points / seconds / 1e6);
+            }
+        }
+    }
+}
@@ -0,0 +1,2494 @@
+// Known-answer and edge-case tests for utf8.h, utf8_parallel.h and utf8_mmap.h. Every test
+// runs once for each SIMD tier the CPU supports; the inputs are long enough to reach the
+// vectorized kernels. Failed checks are printed, and the exit status is 1 if any failed.
+// Built as C++11, as C++20 for the range views, and with UTF8_CPP_STATS for the counters.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "utf8.h"
+#include "utf8_parallel.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define UTF8_TESTS_MMAP
+    #include "utf8_mmap.h"
+#endif
+
+using namespace std;
+
+namespace {
+
+int failures = 0;
+
+void check(bool passed, const char* condition, const char* file, int line)
+{
+    if (passed)
+        return;
+    ++failures;
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, condition);
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+// The check only for the first failure in a loop, so that one bug does not print thousands
+#define CHECK_ONCE(condition, failed) \
+    do { if (!(failed) && !(condition)) { (failed) = true; check(false, #condition, __FILE__, __LINE__); } } while (0)
+
+// Valid text of every sequence length, some of it long enough for the vector kernels
+vector<string> valid_texts()
+{
+    vector<string> texts;
+    texts.push_back("");
+    texts.push_back("plain ASCII");
+    texts.push_back("\xc3\xa9t\xc3\xa9");                                   // été
+    texts.push_back("\xe2\x82\xac\xe4\xb8\xad\xed\x9f\xbf\xef\xbf\xbf");     // € 中 U+D7FF U+FFFF
+    texts.push_back("\xf0\x90\x80\x80\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf");     // U+10000 😀 U+10FFFF
+    string mixed;
+    const char* const pieces[] = {"abcdefgh", "\xd0\x96", "\xe0\xa4\x95", "\xf0\x9f\x98\x80", "\xc2\x80", " "};
+    for (unsigned i = 0; mixed.size() < 300; ++i)
+        mixed += pieces[(i * 7 + i / 3) % 6];
+    texts.push_back(mixed);
+    texts.push_back(string(200, 'a') + "\xe2\x82\xac" + string(70, 'b'));
+    return texts;
+}
+
+// An invalid text and the offset of its first invalid sequence
+struct invalid_text {
+    string text;
+    size_t offset;
+    invalid_text(const string& text_, size_t offset_) : text(text_), offset(offset_) {}
+};
+
+// Invalid text, with the errors at the start, in the middle and at the end
+vector<invalid_text> invalid_texts()
+{
+    const char* const errors[] = {
+        "\x80",                 // trail octet without a lead
+        "\xbf\xbf",
+        "\xc0\xaf",             // overlong
+        "\xe0\x80\xaf",
+        "\xf0\x80\x80\xaf",
+        "\xed\xa0\x80",         // surrogate
+        "\xf4\x90\x80\x80",     // above U+10FFFF
+        "\xf8\x88\x80\x80\x80", // five octets
+        "\xff",
+        "\xc3",                 // lead without its trail octets
+        "\xe2\x82",
+        "\xf0\x9f\x98",
+        "\xe2\x82z",
+        "\xf0\x9f\x98\xc3\xa9",
+    };
+    vector<invalid_text> texts;
+    for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); ++i) {
+        const string error = errors[i];
+        texts.push_back(invalid_text(error, 0));
+        texts.push_back(invalid_text("ab" + error + "cd", 2));
+        texts.push_back(invalid_text(string(100, 'x') + "\xc3\xa9" + error + string(90, 'y'), 102));
+        texts.push_back(invalid_text(string(130, 'x') + error, 130));        // at the end: maybe a truncated tail
+        texts.push_back(invalid_text(error + string(130, 'x') + error, 0));
+    }
+    return texts;
+}
+
+vector<string> all_texts()
+{
+    vector<string> texts = valid_texts();
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i)
+        texts.push_back(invalid[i].text);
+    return texts;
+}
+
+// Offsets of the code points of valid text, and its size
+vector<size_t> boundaries(const string& text)
+{
+    vector<size_t> result;
+    for (size_t i = 0; i < text.size(); ++i)
+        if (!utf8::internal::is_trail(text[i]))
+            result.push_back(i);
+    result.push_back(text.size());
+    return result;
+}
+
+//=================================================================================================
+// validation
+//=================================================================================================
+
+size_t invalid_offset(const string& text)
+{
+    const char* const first = text.data();
+    return static_cast<size_t>(utf8::find_invalid(first, first + text.size()) - first);
+}
+
+size_t generic_invalid_offset(const string& text)
+{
+    const list<char> octets(text.begin(), text.end());
+    return static_cast<size_t>(distance(octets.begin(), utf8::find_invalid(octets.begin(), octets.end())));
+}
+
+void test_find_invalid()
+{
+    const vector<string> valid = valid_texts();
+    for (size_t i = 0; i < valid.size(); ++i) {
+        const char* const first = valid[i].data();
+        CHECK(invalid_offset(valid[i]) == valid[i].size());
+        CHECK(generic_invalid_offset(valid[i]) == valid[i].size());
+        CHECK(utf8::is_valid(first, first + valid[i].size()));
+    }
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const char* const first = invalid[i].text.data();
+        CHECK(invalid_offset(invalid[i].text) == invalid[i].offset);
+        CHECK(generic_invalid_offset(invalid[i].text) == invalid[i].offset);
+        CHECK(!utf8::is_valid(first, first + invalid[i].text.size()));
+    }
+
+    // An error at every code point boundary of text that spans several 64 octet blocks,
+    // and the text cut off at every octet
+    const string text = valid[5] + valid[5];
+    const vector<size_t> starts = boundaries(text);
+    bool failed = false;
+    for (size_t i = 0; i < starts.size(); ++i) {
+        string broken = text;
+        broken.insert(starts[i], "\xc0\x80");
+        CHECK_ONCE(invalid_offset(broken) == starts[i], failed);
+        broken = text;
+        broken.insert(starts[i], "\xed\xbf\xbf");
+        CHECK_ONCE(invalid_offset(broken) == starts[i], failed);
+    }
+    for (size_t size = 0, boundary = 0; size <= text.size(); ++size) {
+        if (!utf8::internal::is_trail(size < text.size() ? text[size] : 0))
+            boundary = size;
+        CHECK_ONCE(invalid_offset(text.substr(0, size)) == boundary, failed);
+    }
+}
+
+// validate_next worked out from the bit patterns rather than the lead octet table
+utf8::utf_error reference_next(const string& sequence, size_t& length, utf8::uint32_t& cp)
+{
+    const unsigned char lead = static_cast<unsigned char>(sequence[0]);
+    length = lead < 0x80 ? 1 : lead < 0xc0 ? 0 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : lead < 0xf8 ? 4 : 0;
+    if (length == 0)
+        return utf8::INVALID_LEAD;
+    cp = length == 1 ? lead : lead & (0x7f >> length);
+    for (size_t i = 1; i < length; ++i) {
+        if (i == sequence.size())
+            return utf8::NOT_ENOUGH_ROOM;
+        if ((static_cast<unsigned char>(sequence[i]) & 0xc0) != 0x80)
+            return utf8::INCOMPLETE_SEQUENCE;
+        cp = (cp << 6) | (static_cast<unsigned char>(sequence[i]) & 0x3f);
+    }
+    const utf8::uint32_t smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (cp < smallest[length])
+        return utf8::OVERLONG_SEQUENCE;
+    if ((cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+        return utf8::INVALID_CODE_POINT;
+    return utf8::UTF8_OK;
+}
+
+void test_validate_next()
+{
+    // Every lead and second octet, followed by the smallest and the largest trail octet,
+    // a non-trail octet, or nothing
+    const char* const tails[] = {"\x80\x80", "\xbf\xbf", "\x80" "a", ""};
+    bool failed = false;
+    for (int lead = 0; lead < 256; ++lead)
+        for (int second = 0; second < 256; ++second)
+            for (size_t t = 0; t < sizeof(tails) / sizeof(tails[0]); ++t) {
+                const string sequence = string(1, char(lead)) + char(second) + tails[t];
+                size_t length = 0;
+                utf8::uint32_t expected_cp = 0, cp = 0;
+                const utf8::utf_error expected = reference_next(sequence, length, expected_cp);
+                const char* it = sequence.data();
+                const utf8::utf_error err = utf8::internal::validate_next(it, it + sequence.size(), cp);
+                CHECK_ONCE(err == expected, failed);
+                CHECK_ONCE(it == sequence.data() + (err == utf8::UTF8_OK ? length : 0), failed);
+                CHECK_ONCE(err != utf8::UTF8_OK || cp == expected_cp, failed);
+                it = sequence.data();
+                if (err == utf8::UTF8_OK)
+                    CHECK_ONCE(utf8::unchecked::next(it) == expected_cp && it == sequence.data() + length, failed);
+            }
+}
+
+//=================================================================================================
+// conversion
+//=================================================================================================
+
+typedef vector<utf8::uint16_t> utf16_string;
+typedef vector<utf8::uint32_t> utf32_string;
+
+const string REPLACEMENT_UTF8 = "\xef\xbf\xbd";
+
+string replaced(const string& text)
+{
+    string result;
+    const char* const first = text.data();
+    utf8::replace_invalid(first, first + text.size(), back_inserter(result));
+    return result;
+}
+
+// replace_invalid with the replacement for a sequence cut off at the end of the input that
+// it throws for; the 'z' only ends such a sequence
+string replaced_whole(const string& text)
+{
+    string result = replaced(text + "z");
+    result.erase(result.size() - 1);
+    return result;
+}
+
+utf16_string to_utf16(const string& text)
+{
+    utf16_string result;
+    const char* const first = text.data();
+    utf8::utf8to16(first, first + text.size(), back_inserter(result));
+    return result;
+}
+
+utf32_string to_utf32(const string& text)
+{
+    utf32_string result;
+    const char* const first = text.data();
+    utf8::utf8to32(first, first + text.size(), back_inserter(result));
+    return result;
+}
+
+// Valid text long enough for the counters of the vector kernels to be flushed several times
+string long_text()
+{
+    const vector<string> texts = valid_texts();
+    string text;
+    while (text.size() < 40000)
+        for (size_t i = 0; i < texts.size(); ++i)
+            text += texts[i];
+    return text;
+}
+
+void test_ascii_runs()
+{
+    // Runs of ASCII copied in bulk give what the octet by octet generic path gives
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string input = texts[i] + "z";
+        const list<char> octets(input.begin(), input.end());
+        string generic;
+        utf8::replace_invalid(octets.begin(), octets.end(), back_inserter(generic));
+        CHECK(replaced(input) == generic);
+    }
+    const vector<string> valid = valid_texts();
+    for (size_t i = 0; i < valid.size(); ++i) {
+        const list<char> octets(valid[i].begin(), valid[i].end());
+        utf16_string utf16;
+        utf8::utf8to16(octets.begin(), octets.end(), back_inserter(utf16));
+        CHECK(to_utf16(valid[i]) == utf16);
+        utf32_string utf32;
+        utf8::utf8to32(octets.begin(), octets.end(), back_inserter(utf32));
+        CHECK(to_utf32(valid[i]) == utf32);
+    }
+
+    const string run(100, 'r');
+    CHECK(replaced(run + "\xff" + run + "\xe2\x82" "a") == run + REPLACEMENT_UTF8 + run + REPLACEMENT_UTF8 + "a");
+    const utf8::uint16_t expected16[] = {'a', 0x20ac, 0xd83d, 0xde00, 'b'};
+    CHECK(to_utf16("a\xe2\x82\xac\xf0\x9f\x98\x80" "b") == utf16_string(expected16, expected16 + 5));
+    const utf8::uint32_t expected32[] = {'a', 0x20ac, 0x1f600, 'b'};
+    CHECK(to_utf32("a\xe2\x82\xac\xf0\x9f\x98\x80" "b") == utf32_string(expected32, expected32 + 4));
+    bool threw = false;
+    try {
+        to_utf16(run + "\xc3(");
+    }
+    catch (const utf8::invalid_utf8&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+void test_replace_invalid_in_place()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        // Replacements shorter than, as long as and longer than the sequences they replace
+        const utf8::uint32_t replacements[] = {'?', 0xe9, 0xfffd, 0x1f600};
+        for (size_t r = 0; r < sizeof(replacements) / sizeof(replacements[0]); ++r) {
+            const string input = texts[i] + "z";
+            string expected;
+            utf8::replace_invalid(input.begin(), input.end(), back_inserter(expected), replacements[r]);
+            string text = input;
+            const bool was_replaced = utf8::replace_invalid_in_place(text, replacements[r]);
+            CHECK(text == expected);
+            CHECK(was_replaced == !utf8::is_valid(input.begin(), input.end()));
+        }
+        vector<char> octets(texts[i].begin(), texts[i].end());
+        octets.push_back('z');
+        utf8::replace_invalid_in_place(octets);
+        CHECK(string(octets.begin(), octets.end()) == replaced(texts[i] + "z"));
+    }
+
+    // Every octet invalid, so that the output gets far ahead of the input, and invalid octets
+    // between long valid runs
+    string all_invalid(1000, '\xff');
+    CHECK(utf8::replace_invalid_in_place(all_invalid, 0x1f600));
+    string expected;
+    for (size_t i = 0; i < 1000; ++i)
+        expected += "\xf0\x9f\x98\x80";
+    CHECK(all_invalid == expected);
+    const string run(100, 'a');
+    string sparse = run + "\xff" + run + "\xe2\x82" + run + "\xc0\x80\x80" + run;
+    CHECK(utf8::replace_invalid_in_place(sparse, '?'));
+    CHECK(sparse == run + "?" + run + "?" + run + "?" + run);
+
+    // Errors are reported before anything is changed
+    string truncated = "abc\xe2\x82";
+    bool was_replaced = true;
+    CHECK(utf8::try_replace_invalid_in_place(truncated, 0xfffd, was_replaced) == utf8::NOT_ENOUGH_ROOM);
+    CHECK(truncated == "abc\xe2\x82");
+    CHECK(!was_replaced);
+    string invalid = "a\xff" "b";
+    CHECK(utf8::try_replace_invalid_in_place(invalid, 0xd800, was_replaced) == utf8::INVALID_CODE_POINT);
+    CHECK(invalid == "a\xff" "b");
+    bool threw = false;
+    try {
+        utf8::replace_invalid_in_place(truncated);
+    }
+    catch (const utf8::not_enough_room&) {
+        threw = true;
+    }
+    CHECK(threw && truncated == "abc\xe2\x82");
+}
+
+string replaced_with_maximal_subparts(const string& text)
+{
+    string result;
+    utf8::replace_invalid_with(text.begin(), text.end(), back_inserter(result), utf8::replace_maximal_subpart());
+    return result;
+}
+
+string repeat_replacement(size_t count)
+{
+    string result;
+    for (size_t i = 0; i < count; ++i)
+        result += REPLACEMENT_UTF8;
+    return result;
+}
+
+void test_maximal_subparts()
+{
+    // Tables 3-8 to 3-11 of the Unicode Standard (section 3.9), which the WHATWG Encoding
+    // Standard decoder follows
+    CHECK(replaced_with_maximal_subparts("\x61\xf1\x80\x80\xe1\x80\xc2\x62\x80\x63\x80\xbf\x64") ==
+          "a" + repeat_replacement(3) + "b" + REPLACEMENT_UTF8 + "c" + repeat_replacement(2) + "d");
+    CHECK(replaced_with_maximal_subparts("\xc0\xaf\xe0\x80\xbf\xf0\x81\x82\x41") == repeat_replacement(8) + "A");
+    CHECK(replaced_with_maximal_subparts("\xed\xa0\x80\xed\xbf\xbf\xed\xaf\x41") == repeat_replacement(8) + "A");
+    CHECK(replaced_with_maximal_subparts("\xf4\x91\x92\x93\xff\x41\x80\xbf\x42") ==
+          repeat_replacement(5) + "A" + repeat_replacement(2) + "B");
+    CHECK(replaced_with_maximal_subparts("\xe1\x80\xe2\xf0\x91\x92\xf1\xbf\x41") == repeat_replacement(4) + "A");
+    // A truncated sequence at the end is one maximal subpart
+    CHECK(replaced_with_maximal_subparts("ok\xf0\x9f\x98") == "ok" + REPLACEMENT_UTF8);
+    CHECK(replaced_with_maximal_subparts("\xf0\x9f") == REPLACEMENT_UTF8);
+    CHECK(replaced_with_maximal_subparts("\xe0\xa0") == REPLACEMENT_UTF8);
+    CHECK(replaced_with_maximal_subparts("\xe0\x9f") == repeat_replacement(2));
+    // Long valid runs around the errors go through the vector kernels
+    const string run(100, 'r');
+    CHECK(replaced_with_maximal_subparts(run + "\xe1\x80\xe2" + run) == run + repeat_replacement(2) + run);
+}
+
+void test_replacement_policies()
+{
+    const string text = "a\xf1\x80\x80\xe1\x80\xc2" "b\x80\xbf" "c\xf0\x9f\x98";
+    string out;
+    utf8::replace_invalid_with(text.begin(), text.end(), back_inserter(out), utf8::replace_per_sequence('?'));
+    CHECK(out == "a???b??c?");
+    out.clear();
+    utf8::replace_invalid_with(text.begin(), text.end(), back_inserter(out), utf8::replace_per_octet('?'));
+    CHECK(out == "a??????b??c???");
+    out.clear();
+    utf8::replace_invalid_with(text.begin(), text.end(), back_inserter(out), utf8::drop_invalid());
+    CHECK(out == "abc");
+
+    // One replacement per sequence is what replace_invalid writes
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        string with_policy;
+        utf8::replace_invalid_with(texts[i].begin(), texts[i].end(), back_inserter(with_policy), utf8::replace_per_sequence());
+        CHECK(with_policy == replaced_whole(texts[i]));
+        string dropped;
+        utf8::replace_invalid_with(texts[i].begin(), texts[i].end(), back_inserter(dropped), utf8::drop_invalid());
+        CHECK(utf8::is_valid(dropped.begin(), dropped.end()));
+        string per_octet;
+        utf8::replace_invalid_with(texts[i].begin(), texts[i].end(), back_inserter(per_octet), utf8::replace_per_octet(0));
+        CHECK(per_octet.size() == texts[i].size());
+    }
+}
+
+
+inline bool is_contiguous(utf8::internal::contiguous_octets_tag) { return true; }
+inline bool is_contiguous(utf8::internal::generic_octets_tag) { return false; }
+inline bool is_contiguous(utf8::internal::contiguous_units_tag) { return true; }
+inline bool is_contiguous(utf8::internal::generic_units_tag) { return false; }
+
+void test_container_iterators()
+{
+    using utf8::internal::contiguous_octets;
+    using utf8::internal::contiguous_u16;
+    using utf8::internal::contiguous_u32;
+    CHECK(is_contiguous(contiguous_octets<string::iterator>::category()));
+    CHECK(is_contiguous(contiguous_octets<string::const_iterator>::category()));
+    CHECK(is_contiguous(contiguous_octets<vector<char>::const_iterator>::category()));
+    CHECK(is_contiguous(contiguous_octets<vector<unsigned char>::iterator>::category()));
+    CHECK(!is_contiguous(contiguous_octets<vector<int>::iterator>::category()));
+    CHECK(!is_contiguous(contiguous_octets<deque<char>::iterator>::category()));
+    CHECK(!is_contiguous(contiguous_octets<list<char>::iterator>::category()));
+    CHECK(is_contiguous(contiguous_u16<vector<utf8::uint16_t>::iterator>::category()));
+    CHECK(is_contiguous(contiguous_u16<utf16_string::iterator>::category()));
+    CHECK(!is_contiguous(contiguous_u16<vector<utf8::uint32_t>::iterator>::category()));
+    CHECK(is_contiguous(contiguous_u32<vector<char32_t>::iterator>::category()));
+    CHECK(!is_contiguous(contiguous_u32<vector<char>::iterator>::category()));
+
+    // Container iterators give what pointers give
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        CHECK(utf8::find_invalid(text.begin(), text.end()) - text.begin() == utf8::find_invalid(first, last) - first);
+        if (!utf8::is_valid(first, last))
+            continue;
+        CHECK(utf8::distance(text.begin(), text.end()) == utf8::distance(first, last));
+        utf16_string out16(utf8::utf16_length(text.begin(), text.end()), 0);
+        CHECK(utf8::utf8to16(text.begin(), text.end(), out16.begin()) == out16.end());
+        CHECK(out16 == to_utf16(text));
+        vector<utf8::uint32_t> out32(to_utf32(text).size());
+        CHECK(utf8::utf8to32(text.begin(), text.end(), out32.begin()) == out32.end());
+        CHECK(utf32_string(out32.begin(), out32.end()) == to_utf32(text));
+    }
+}
+
+utf16_string units(const char16_t* text)
+{
+    utf16_string result;
+    for (; *text; ++text)
+        result.push_back(static_cast<utf8::uint16_t>(*text));
+    return result;
+}
+
+list<utf8::uint16_t>::const_iterator generic_tail(const list<utf8::uint16_t>& units, size_t offset)
+{
+    list<utf8::uint16_t>::const_iterator it = units.begin();
+    advance(it, offset);
+    return it;
+}
+
+// UTF-16 with runs of every encoded length, long enough for the encode kernel, compared
+// with the result for a generic iterator
+void test_utf16_runs()
+{
+    const char16_t* const pieces[] = {u"abcdefgh", u"\u00e9\u00e8\u00ea\u00eb\u0430\u0431\u0432\u0433",
+                                      u"\u4e2d\u6587\u4e2d\u6587\u4e2d\u6587\u4e2d\u6587",
+                                      u"a\u00e9\u4e2d", u"\U0001f600", u"\uffff\ue000\u0800\u07ff\u007f"};
+    utf16_string text;
+    unsigned seed = 1;
+    while (text.size() < 4000) {
+        seed = seed * 1103515245u + 12345u;
+        const utf16_string piece = units(pieces[(seed >> 16) % 6]);
+        text.insert(text.end(), piece.begin(), piece.end());
+    }
+    const list<utf8::uint16_t> generic(text.begin(), text.end());
+    string expected;
+    utf8::utf16to8(generic.begin(), generic.end(), back_inserter(expected));
+    CHECK(to_utf16(expected) == text);
+    bool failed = false;
+    for (size_t offset = 0; offset < 40; ++offset) {
+        const utf8::uint16_t* const first = &text[0] + offset;
+        const utf8::uint16_t* const last = &text[0] + text.size();
+        string out;
+        utf8::utf16to8(first, last, back_inserter(out));
+        string expected_tail;
+        utf8::utf16to8(generic_tail(generic, offset), generic.end(), back_inserter(expected_tail));
+        CHECK_ONCE(out == expected_tail, failed);
+        vector<char16_t> chars(first, last);
+        string from_chars;
+        utf8::utf16to8(chars.begin(), chars.end(), back_inserter(from_chars));
+        CHECK_ONCE(from_chars == expected_tail, failed);
+    }
+
+    // A surrogate right after a long run stops the kernel there
+    utf16_string broken = text;
+    broken[3001] = 0xdc00;
+    const utf8::uint16_t* start = &broken[0];
+    string out;
+    back_insert_iterator<string> out_it(out);
+    const utf8::utf_error err_code = utf8::try_utf16to8(start, start + broken.size(), out_it);
+    CHECK(err_code == utf8::INVALID_LEAD || err_code == utf8::INCOMPLETE_SEQUENCE);
+    CHECK(to_utf16(out) == utf16_string(broken.begin(), broken.begin() + (start - &broken[0])));
+}
+
+// UTF-32 with every encoded length in blocks of one length and of mixed lengths, compared
+// with the result for a generic iterator
+void test_utf32_runs()
+{
+    const char32_t* const pieces[] = {U"abcdefgh", U"\u00e9\u00e8\u00ea\u00eb\u0430\u0431\u0432\u0433",
+                                      U"\u4e2d\u6587\u4e2d\u6587\u4e2d\u6587\u4e2d\u6587",
+                                      U"a\u00e9\u4e2d\U0001f600", U"\U0001f600\U00010000\U0010ffff",
+                                      U"\uffff\u0800\u07ff\u007f\u0080\ud7ff"};
+    utf32_string text;
+    unsigned seed = 3;
+    while (text.size() < 4000) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char32_t* cp = pieces[(seed >> 16) % 6]; *cp != 0; ++cp)
+            text.push_back(*cp);
+    }
+    const list<utf8::uint32_t> generic(text.begin(), text.end());
+    string expected;
+    utf8::utf32to8(generic.begin(), generic.end(), back_inserter(expected));
+    CHECK(to_utf32(expected) == text);
+    const utf16_string text16 = to_utf16(expected);
+    CHECK(utf8::utf32to8_length(generic.begin(), generic.end()) == expected.size());
+    const list<utf8::uint16_t> generic16(text16.begin(), text16.end());
+    CHECK(utf8::utf16to8_length(generic16.begin(), generic16.end()) == expected.size());
+
+    bool failed = false;
+    for (size_t offset = 0; offset < 40; ++offset) {
+        const utf8::uint32_t* const first = &text[0] + offset;
+        const utf8::uint32_t* const last = &text[0] + text.size();
+        const string expected_tail = expected.substr(boundaries(expected)[offset]);
+        string out;
+        utf8::utf32to8(first, last, back_inserter(out));
+        CHECK_ONCE(out == expected_tail, failed);
+        string unchecked_out;
+        utf8::unchecked::utf32to8(first, last, back_inserter(unchecked_out));
+        CHECK_ONCE(unchecked_out == expected_tail, failed);
+        const vector<char32_t> chars(first, last);
+        string from_chars;
+        utf8::utf32to8(chars.begin(), chars.end(), back_inserter(from_chars));
+        CHECK_ONCE(from_chars == expected_tail, failed);
+        CHECK_ONCE(utf8::utf32to8_length(first, last) == expected_tail.size(), failed);
+        CHECK_ONCE(utf8::utf32to8_length(chars.begin(), chars.end()) == expected_tail.size(), failed);
+
+        // UTF-16 of the same text, with surrogate pairs for the kernel
+        const utf16_string tail16 = to_utf16(expected_tail);
+        string out16;
+        utf8::utf16to8(tail16.begin(), tail16.end(), back_inserter(out16));
+        CHECK_ONCE(out16 == expected_tail, failed);
+        CHECK_ONCE(utf8::utf16to8_length(tail16.begin(), tail16.end()) == expected_tail.size(), failed);
+    }
+
+    // An invalid code point stops the kernel there
+    const utf8::uint32_t bad[] = {0xd800, 0xdfff, 0x110000, 0xffffffff};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        utf32_string broken = text;
+        broken[2001 + i] = bad[i];
+        const utf8::uint32_t* start = &broken[0];
+        string out;
+        back_insert_iterator<string> out_it(out);
+        CHECK(utf8::try_utf32to8(start, start + broken.size(), out_it) == utf8::INVALID_CODE_POINT);
+        CHECK(start == &broken[0] + 2001 + i);
+        CHECK(out == expected.substr(0, boundaries(expected)[2001 + i]));
+        utf8::uint32_t thrown = 0;
+        string discarded;
+        try { utf8::utf32to8(broken.begin(), broken.end(), back_inserter(discarded)); }
+        catch (const utf8::invalid_code_point& e) { thrown = e.code_point(); }
+        CHECK(thrown == bad[i]);
+    }
+
+    // A lone surrogate among surrogate pairs stops utf16to8 there
+    utf16_string broken16 = text16;
+    size_t pair = 3000;
+    while (!utf8::internal::is_lead_surrogate(broken16[pair]))
+        ++pair;
+    broken16[pair + 1] = 'x';
+    const utf8::uint16_t* start16 = &broken16[0];
+    string out;
+    back_insert_iterator<string> out_it(out);
+    CHECK(utf8::try_utf16to8(start16, start16 + broken16.size(), out_it) == utf8::INCOMPLETE_SEQUENCE);
+    CHECK(start16 == &broken16[0] + pair);
+    CHECK(to_utf16(out) == utf16_string(broken16.begin(), broken16.begin() + static_cast<ptrdiff_t>(pair)));
+}
+
+// Latin-1 of every octet value in runs of different lengths, so that the kernels see
+// ASCII, two-octet sequences and mixed blocks at every alignment
+string latin1_text()
+{
+    string text;
+    unsigned seed = 7;
+    while (text.size() < 3000) {
+        seed = seed * 1103515245u + 12345u;
+        const unsigned run = 1 + (seed >> 16) % 40;
+        const bool high = (seed >> 24) % 2 != 0;
+        for (unsigned i = 0; i < run; ++i)
+            text += static_cast<char>(high ? 0x80 + (text.size() * 37) % 128 : (text.size() * 13) % 128);
+    }
+    for (unsigned octet = 0; octet < 256; ++octet)
+        text += static_cast<char>(octet);
+    return text;
+}
+
+void test_latin1()
+{
+    const string latin1 = latin1_text();
+    utf32_string widened;
+    for (size_t i = 0; i < latin1.size(); ++i)
+        widened.push_back(static_cast<unsigned char>(latin1[i]));
+    string expected;
+    utf8::utf32to8(widened.begin(), widened.end(), back_inserter(expected));
+
+    bool failed = false;
+    for (size_t offset = 0; offset < 40; ++offset) {
+        const string text = latin1.substr(offset);
+        const list<char> generic_text(text.begin(), text.end());
+        string out;
+        utf8::latin1to8(text.data(), text.data() + text.size(), back_inserter(out));
+        string generic_out;
+        utf8::latin1to8(generic_text.begin(), generic_text.end(), back_inserter(generic_out));
+        CHECK_ONCE(out == generic_out && utf8::is_valid(out.begin(), out.end()), failed);
+        CHECK_ONCE(to_utf32(out) == utf32_string(widened.begin() + static_cast<ptrdiff_t>(offset), widened.end()), failed);
+        string unchecked_out;
+        utf8::unchecked::latin1to8(text.begin(), text.end(), back_inserter(unchecked_out));
+        CHECK_ONCE(unchecked_out == out, failed);
+
+        // and back
+        string back;
+        utf8::utf8tolatin1(out.data(), out.data() + out.size(), back_inserter(back));
+        CHECK_ONCE(back == text, failed);
+        const list<char> generic_out8(out.begin(), out.end());
+        string generic_back;
+        utf8::utf8tolatin1(generic_out8.begin(), generic_out8.end(), back_inserter(generic_back));
+        CHECK_ONCE(generic_back == text, failed);
+        string unchecked_back;
+        utf8::unchecked::utf8tolatin1(out.data(), out.data() + out.size(), back_inserter(unchecked_back));
+        CHECK_ONCE(unchecked_back == text, failed);
+        CHECK_ONCE(utf8::is_latin1(out.data(), out.data() + out.size()), failed);
+        CHECK_ONCE(utf8::is_latin1(generic_out8.begin(), generic_out8.end()), failed);
+    }
+
+    // A code point above U+00FF at different places in a Latin-1 text
+    const size_t offsets[] = {0, 5, 15, 16, 31, 100, 1000};
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        const size_t offset = offsets[i];
+        const string prefix = expected.substr(0, boundaries(expected)[offset]);
+        const string text = prefix + "\xe2\x82\xac" + expected.substr(prefix.size());
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        CHECK(!utf8::is_latin1(first, last));
+        utf8::uint32_t thrown = 0;
+        string discarded;
+        try { utf8::utf8tolatin1(first, last, back_inserter(discarded)); }
+        catch (const utf8::invalid_code_point& e) { thrown = e.code_point(); }
+        CHECK(thrown == 0x20ac);
+        const char* start = first;
+        string out;
+        back_insert_iterator<string> out_it(out);
+        CHECK(utf8::try_utf8tolatin1(start, last, out_it) == utf8::INVALID_CODE_POINT);
+        CHECK(start == first + prefix.size());
+        CHECK(out == latin1.substr(0, offset));
+    }
+
+    // Invalid UTF-8 throws what next throws
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const string& text = invalid[i].text;
+        const char* at_error = text.data() + invalid[i].offset;
+        string expected_error, thrown;
+        try { utf8::next(at_error, text.data() + text.size()); }
+        catch (const utf8::exception& e) { expected_error = e.what(); }
+        string out;
+        try { utf8::utf8tolatin1(text.begin(), text.end(), back_inserter(out)); }
+        catch (const utf8::exception& e) { thrown = e.what(); }
+        CHECK(!expected_error.empty() && thrown == expected_error);
+        CHECK(!utf8::is_latin1(text.begin(), text.end()));
+    }
+}
+
+//=================================================================================================
+// iterators
+//=================================================================================================
+
+void test_decoding_iterator()
+{
+    typedef utf8::decoding_iterator<string::const_iterator> iterator;
+    const vector<string> texts = valid_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const utf32_string code_points = to_utf32(text);
+        const iterator first(text.begin(), text.begin(), text.end());
+        const iterator last(text.end(), text.begin(), text.end());
+        CHECK(utf32_string(first, last) == code_points);
+        utf32_string forward;
+        for (iterator it = first; it != utf8::sentinel(); ++it)
+            forward.push_back(*it);
+        CHECK(forward == code_points);
+        utf32_string backward;
+        for (iterator it = last; it != first; )
+            backward.push_back(*--it);
+        CHECK(utf32_string(backward.rbegin(), backward.rend()) == code_points);
+        CHECK(iterator(text.begin(), text.begin(), text.end()) == first);
+        CHECK(utf8::sentinel() == last && (first == utf8::sentinel()) == text.empty());
+    }
+
+    // Invalid input throws when the iterator reaches it
+    const string invalid = "ab\xff";
+    iterator it(invalid.begin(), invalid.begin(), invalid.end());
+    ++it;
+    bool threw = false;
+    try {
+        ++it;
+    }
+    catch (const utf8::invalid_utf8&) {
+        threw = true;
+    }
+    CHECK(threw);
+#if UTF8_CPP_CHECK_ITERATOR_RANGES
+    threw = false;
+    try {
+        (void)(it == iterator(invalid.begin(), invalid.begin(), invalid.begin() + 1));
+    }
+    catch (const std::logic_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+#endif
+}
+
+//=================================================================================================
+// streams
+//=================================================================================================
+
+// The text fed in two chunks split at every offset, and an octet at a time
+vector<vector<string> > chunkings(const string& text)
+{
+    vector<vector<string> > result;
+    for (size_t split = 0; split <= text.size(); ++split) {
+        vector<string> chunks;
+        chunks.push_back(text.substr(0, split));
+        chunks.push_back(text.substr(split));
+        result.push_back(chunks);
+    }
+    vector<string> octets;
+    for (size_t i = 0; i < text.size(); ++i)
+        octets.push_back(text.substr(i, 1));
+    result.push_back(octets);
+    return result;
+}
+
+// Truncated sequences that no trail octets can complete: overlong, surrogate, above U+10FFFF.
+// Without their last octet they still can be.
+const char* const never_valid_prefixes[] = {"\xc0", "\xc1", "\xe0\x80", "\xe0\x9f", "\xed\xa0",
+                                            "\xf0\x8f", "\xf4\x90", "\xf5", "\xf7"};
+
+void test_stream_validator()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const bool valid = invalid_offset(texts[i]) == texts[i].size();
+        const vector<vector<string> > chunked = chunkings(texts[i]);
+        bool failed = false;
+        for (size_t c = 0; c < chunked.size(); ++c) {
+            utf8::stream_validator validator;
+            bool all_fed = true;
+            for (size_t k = 0; k < chunked[c].size(); ++k)
+                all_fed = validator.feed(chunked[c][k].begin(), chunked[c][k].end()) && all_fed;
+            CHECK_ONCE(!all_fed || validator.valid(), failed);
+            CHECK_ONCE(validator.finish() == valid, failed);
+            if (!valid)
+                CHECK_ONCE(validator.invalid_position() == invalid_offset(texts[i]), failed);
+        }
+    }
+
+    // A prefix that cannot be completed fails in the chunk that brings its last octet,
+    // wherever the chunks are split
+    for (size_t i = 0; i < sizeof(never_valid_prefixes) / sizeof(never_valid_prefixes[0]); ++i) {
+        const string text = "ab" + string(never_valid_prefixes[i]);
+        const vector<vector<string> > chunked = chunkings(text);
+        bool failed = false;
+        for (size_t c = 0; c < chunked.size(); ++c) {
+            utf8::stream_validator validator;
+            size_t fed = 0;
+            for (size_t k = 0; k < chunked[c].size(); ++k) {
+                fed += chunked[c][k].size();
+                CHECK_ONCE(validator.feed(chunked[c][k].begin(), chunked[c][k].end()) == (fed < text.size()), failed);
+            }
+            CHECK_ONCE(!validator.valid() && validator.pending() == 0, failed);
+            CHECK_ONCE(validator.invalid_position() == 2, failed);
+        }
+    }
+
+    utf8::stream_validator validator;
+    const string euro = "\xe2\x82\xac";
+    CHECK(validator.feed(euro.begin(), euro.begin() + 2));
+    CHECK(validator.pending() == 2);
+    CHECK(validator.feed(euro.begin() + 2, euro.end()));
+    CHECK(validator.pending() == 0);
+    CHECK(validator.feed(euro.begin(), euro.begin() + 1));
+    CHECK(!validator.finish());
+    CHECK(validator.invalid_position() == 3);
+    validator.reset();
+    CHECK(validator.valid() && validator.finish());
+}
+
+void test_validated_buffer()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const bool valid = invalid_offset(texts[i]) == texts[i].size();
+        const vector<vector<string> > chunked = chunkings(texts[i]);
+        bool failed = false;
+        for (size_t c = 0; c < chunked.size(); ++c) {
+            utf8::validated_buffer<string> buffer;
+            for (size_t k = 0; k < chunked[c].size(); ++k)
+                buffer.append(chunked[c][k].begin(), chunked[c][k].end());
+            CHECK_ONCE(buffer.data() == texts[i], failed);
+            CHECK_ONCE(buffer.is_valid() == valid, failed);
+            if (!valid)
+                CHECK_ONCE(buffer.valid_size() == invalid_offset(texts[i]), failed);
+        }
+    }
+
+    // A prefix that cannot be completed is rejected even when its octets arrive separately
+    for (size_t i = 0; i < sizeof(never_valid_prefixes) / sizeof(never_valid_prefixes[0]); ++i) {
+        const string prefix = never_valid_prefixes[i];
+        utf8::validated_buffer<string> whole(string("ab"));
+        CHECK(!whole.append(prefix.begin(), prefix.end()));
+        CHECK(!whole.is_valid_prefix() && whole.valid_size() == 2);
+        utf8::validated_buffer<string> split(string("ab"));
+        for (size_t k = 0; k < prefix.size(); ++k)
+            CHECK(split.append(prefix.begin() + k, prefix.begin() + k + 1) == (k + 1 < prefix.size()));
+        CHECK(!split.is_valid_prefix() && split.valid_size() == 2);
+    }
+
+    utf8::validated_buffer<string> buffer(string("ab\xf0\x9f"));
+    CHECK(!buffer.is_valid() && buffer.is_valid_prefix() && buffer.valid_size() == 2);
+    const string rest = "\x98\x80";
+    CHECK(buffer.append(rest.begin(), rest.end()));
+    CHECK(buffer.is_valid() && buffer.valid_size() == 6);
+    const string bad = "\xc3(";
+    CHECK(!buffer.append(bad.begin(), bad.end()));
+    CHECK(!buffer.is_valid_prefix() && buffer.valid_size() == 6);
+    buffer.clear();
+    CHECK(buffer.is_valid() && buffer.size() == 0);
+}
+
+void test_stream_replacer()
+{
+    vector<string> texts = all_texts();
+    for (size_t i = 0; i < sizeof(never_valid_prefixes) / sizeof(never_valid_prefixes[0]); ++i)
+        texts.push_back("ab" + string(never_valid_prefixes[i]) + "\x80" "cd");
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string expected = replaced_whole(texts[i]);
+        const vector<vector<string> > chunked = chunkings(texts[i]);
+        bool failed = false;
+        for (size_t c = 0; c < chunked.size(); ++c) {
+            utf8::stream_replacer replacer;
+            string out;
+            for (size_t k = 0; k < chunked[c].size(); ++k)
+                replacer.feed(chunked[c][k].begin(), chunked[c][k].end(), back_inserter(out));
+            replacer.finish(back_inserter(out));
+            CHECK_ONCE(out == expected, failed);
+        }
+    }
+
+    utf8::stream_replacer replacer('?');
+    string out;
+    const string text = "a\xe2\x82";
+    replacer.feed(text.begin(), text.end(), back_inserter(out));
+    CHECK(out == "a");
+    replacer.finish(back_inserter(out));
+    CHECK(out == "a?");
+}
+
+void test_stream_utf16to8()
+{
+    vector<utf16_string> inputs;
+    inputs.push_back(units(u"plain"));
+    inputs.push_back(units(u"été € \U0001f600\U0010ffff"));
+    utf16_string long_text = units(u"中文 text \U0001f600 ");
+    for (int i = 0; i < 5; ++i)
+        long_text.insert(long_text.end(), long_text.begin(), long_text.end());
+    inputs.push_back(long_text);
+    const utf8::uint16_t lone_lead[] = {'a', 0xd83d, 'b'};
+    const utf8::uint16_t lone_trail[] = {'a', 0xde00, 'b'};
+    const utf8::uint16_t final_lead[] = {'a', 'b', 0xd83d};
+    const utf8::uint16_t two_leads[] = {0xd83d, 0xd83d, 0xde00};
+    inputs.push_back(utf16_string(lone_lead, lone_lead + 3));
+    inputs.push_back(utf16_string(lone_trail, lone_trail + 3));
+    inputs.push_back(utf16_string(final_lead, final_lead + 3));
+    inputs.push_back(utf16_string(two_leads, two_leads + 3));
+    utf16_string long_invalid = long_text;
+    long_invalid.insert(long_invalid.begin() + 150, 0xdc00);
+    inputs.push_back(long_invalid);
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const utf16_string& input = inputs[i];
+        string expected;
+        utf16_string::const_iterator whole_it = input.begin();
+        back_insert_iterator<string> expected_out(expected);
+        const utf8::utf_error expected_error = utf8::try_utf16to8(whole_it, input.end(), expected_out);
+        bool failed = false;
+        for (size_t split = 0; split <= input.size(); ++split) {
+            utf8::stream_utf16to8 stream;
+            string out;
+            back_insert_iterator<string> out_it(out);
+            utf16_string::const_iterator first = input.begin();
+            utf16_string::const_iterator middle = input.begin() + static_cast<std::ptrdiff_t>(split);
+            utf8::utf_error error = stream.try_feed(first, middle, out_it);
+            if (error == utf8::UTF8_OK) {
+                utf16_string::const_iterator second = middle;
+                error = stream.try_feed(second, input.end(), out_it);
+            }
+            if (error == utf8::UTF8_OK)
+                error = stream.try_finish();
+            CHECK_ONCE(error == expected_error, failed);
+            CHECK_ONCE(out == expected, failed);
+
+            // The throwing interface gives the same output and throws for the same input
+            utf8::stream_utf16to8 throwing;
+            string thrown_out;
+            bool threw = false;
+            try {
+                throwing.feed(input.begin(), middle, back_inserter(thrown_out));
+                throwing.feed(middle, input.end(), back_inserter(thrown_out));
+                throwing.finish();
+            }
+            catch (const utf8::invalid_utf16&) {
+                threw = true;
+            }
+            CHECK_ONCE(threw == (expected_error != utf8::UTF8_OK), failed);
+            CHECK_ONCE(thrown_out == expected, failed);
+        }
+    }
+
+    // A failed feed leaves start at the invalid unit, and feed throws for that unit, also
+    // when it follows a lead surrogate carried from the previous chunk
+    const utf8::uint16_t carried[] = {'a', 0xd83d, 'b', 'c'};
+    utf8::stream_utf16to8 failing;
+    string failed_out;
+    back_insert_iterator<string> failed_it(failed_out);
+    const utf8::uint16_t* start = carried;
+    CHECK(failing.try_feed(start, carried + 2, failed_it) == utf8::UTF8_OK && start == carried + 2);
+    start = carried + 2;
+    CHECK(failing.try_feed(start, carried + 4, failed_it) == utf8::INCOMPLETE_SEQUENCE);
+    CHECK(start == carried + 2 && failed_out == "a");
+    utf8::stream_utf16to8 throwing;
+    utf8::uint16_t thrown_unit = 0;
+    try {
+        throwing.feed(carried, carried + 2, back_inserter(failed_out));
+        throwing.feed(carried + 2, carried + 4, back_inserter(failed_out));
+    }
+    catch (const utf8::invalid_utf16& e) {
+        thrown_unit = e.utf16_word();
+    }
+    CHECK(thrown_unit == 'b');
+
+    utf8::stream_utf16to8 stream;
+    string out;
+    const utf8::uint16_t pair[] = {0xd83d, 0xde00};
+    stream.feed(pair, pair + 1, back_inserter(out));
+    CHECK(stream.pending() && out.empty());
+    stream.feed(pair + 1, pair + 2, back_inserter(out));
+    CHECK(!stream.pending() && out == "\xf0\x9f\x98\x80");
+    stream.finish();
+}
+
+//=================================================================================================
+// sinks
+//=================================================================================================
+
+// The contents of a span_sink after overflow are the longest prefix of whole code points
+template <typename unit_type>
+bool is_code_point_prefix(const vector<unit_type>& full, const unit_type* data, size_t size)
+{
+    if (size > full.size() || !equal(data, data + size, full.begin()))
+        return false;
+    if (size == full.size())
+        return true;
+    const utf8::uint32_t next = static_cast<utf8::uint32_t>(full[size]);
+    if (sizeof(unit_type) == 1)
+        return !utf8::internal::is_trail(next);
+    return sizeof(unit_type) != 2 || !utf8::internal::is_trail_surrogate(next);
+}
+
+void test_span_sink()
+{
+    const vector<string> texts = valid_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const utf16_string utf16 = to_utf16(text);
+        const utf32_string utf32 = to_utf32(text);
+        const vector<char> utf8_units(text.begin(), text.end());
+        bool failed = false;
+        for (size_t size = 0; size <= utf16.size() + 1; ++size) {
+            vector<utf8::uint16_t> buffer16(size + 1, 0x5a5a);
+            const utf8::span_sink<utf8::uint16_t> sink16 = utf8::utf8to16(text.begin(), text.end(),
+                                                                          utf8::span_sink<utf8::uint16_t>(&buffer16[0], size));
+            CHECK_ONCE((sink16.status() == utf8::internal::UTF8_OK) == (size >= utf16.size()), failed);
+            CHECK_ONCE(is_code_point_prefix(utf16, sink16.data(), sink16.size()), failed);
+            CHECK_ONCE(buffer16[size] == 0x5a5a, failed);
+        }
+        for (size_t size = 0; size <= text.size() + 1; ++size) {
+            // Written in runs from UTF-16 and UTF-32, and an octet at a time by replace_invalid
+            vector<char> buffer8(size + 1, 'Z');
+            const utf8::span_sink<char> from16 = utf8::utf16to8(utf16.begin(), utf16.end(), utf8::span_sink<char>(&buffer8[0], size));
+            CHECK_ONCE((from16.status() == utf8::internal::UTF8_OK) == (size >= text.size()), failed);
+            CHECK_ONCE(is_code_point_prefix(utf8_units, from16.data(), from16.size()), failed);
+            CHECK_ONCE(buffer8[size] == 'Z', failed);
+            const utf8::span_sink<char> from32 = utf8::utf32to8(utf32.begin(), utf32.end(), utf8::span_sink<char>(&buffer8[0], size));
+            CHECK_ONCE(is_code_point_prefix(utf8_units, from32.data(), from32.size()), failed);
+            const utf8::span_sink<char> copied = utf8::replace_invalid(text.begin(), text.end(), utf8::span_sink<char>(&buffer8[0], size));
+            CHECK_ONCE(is_code_point_prefix(utf8_units, copied.data(), copied.size()), failed);
+            CHECK_ONCE(buffer8[size] == 'Z', failed);
+        }
+        for (size_t size = 0; size <= utf32.size(); ++size) {
+            vector<utf8::uint32_t> buffer32(size + 1);
+            utf8::uint32_t* const first = &buffer32[0];
+            const utf8::span_sink<utf8::uint32_t> sink32 = utf8::utf8to32(text.begin(), text.end(),
+                                                                          utf8::span_sink<utf8::uint32_t>(first, first + size));
+            CHECK_ONCE((sink32.status() == utf8::internal::UTF8_OK) == (size == utf32.size()), failed);
+            CHECK_ONCE(is_code_point_prefix(utf32, sink32.data(), sink32.size()), failed);
+        }
+    }
+
+    // A sink of size 0 takes nothing
+    char none[1] = {'Z'};
+    utf8::span_sink<char> empty(none, 0);
+    *empty++ = 'a';
+    CHECK(empty.status() == utf8::internal::NOT_ENOUGH_ROOM && empty.size() == 0 && none[0] == 'Z');
+}
+
+void test_append_sink()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string input = texts[i] + "z";
+        string out;
+        utf8::replace_invalid(input.begin(), input.end(), utf8::append_to(out, input.size()));
+        CHECK(out == replaced(input));
+        if (!utf8::is_valid(texts[i].begin(), texts[i].end()))
+            continue;
+        utf16_string utf16;
+        utf8::utf8to16(texts[i].begin(), texts[i].end(), utf8::append_to(utf16));
+        CHECK(utf16 == to_utf16(texts[i]));
+        string back;
+        utf8::utf16to8(utf16.begin(), utf16.end(), utf8::append_to(back));
+        CHECK(back == texts[i]);
+    }
+    string text = "keep ";
+    const string more = "\xc3\xa9t\xc3\xa9";
+    utf8::replace_invalid(more.begin(), more.end(), utf8::append_to(text));
+    CHECK(text == "keep \xc3\xa9t\xc3\xa9");
+}
+
+//=================================================================================================
+// non-throwing API
+//=================================================================================================
+
+// A single-pass input iterator over UTF-16 that fails a check when a copy is read after
+// another copy has moved on
+class single_pass_iterator {
+    const utf8::uint16_t* position;
+    const utf8::uint16_t** frontier;
+public:
+    typedef input_iterator_tag iterator_category;
+    typedef utf8::uint16_t value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const utf8::uint16_t* pointer;
+    typedef const utf8::uint16_t& reference;
+
+    single_pass_iterator(const utf8::uint16_t* position_, const utf8::uint16_t** frontier_)
+        : position(position_), frontier(frontier_) {}
+    reference operator*() const
+    {
+        CHECK(position == *frontier);
+        return *position;
+    }
+    single_pass_iterator& operator++()
+    {
+        CHECK(position == *frontier);
+        *frontier = ++position;
+        return *this;
+    }
+    // What *it++ reads, as for istreambuf_iterator
+    struct proxy {
+        utf8::uint16_t unit;
+        utf8::uint16_t operator*() const { return unit; }
+    };
+    proxy operator++(int)
+    {
+        const proxy previous = {**this};
+        ++*this;
+        return previous;
+    }
+    bool operator==(const single_pass_iterator& other) const { return position == other.position; }
+    bool operator!=(const single_pass_iterator& other) const { return position != other.position; }
+};
+
+void test_try_api()
+{
+    // try_next returns the error next throws for, and leaves the iterator where it was
+    const char* const inputs[] = {"\x80", "\xff", "\xe2\x82z", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82", "\xe2\x82\xac"};
+    const utf8::utf_error errors[] = {utf8::INVALID_LEAD, utf8::INVALID_LEAD, utf8::INCOMPLETE_SEQUENCE, utf8::OVERLONG_SEQUENCE,
+                                      utf8::INVALID_CODE_POINT, utf8::INVALID_CODE_POINT, utf8::NOT_ENOUGH_ROOM, utf8::UTF8_OK};
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+        const string input = inputs[i];
+        string::const_iterator it = input.begin();
+        utf8::uint32_t cp = 0;
+        CHECK(utf8::try_peek_next(it, input.end(), cp) == errors[i] && it == input.begin());
+        CHECK(utf8::try_next(it, input.end(), cp) == errors[i]);
+        CHECK(it == (errors[i] == utf8::UTF8_OK ? input.end() : input.begin()));
+    }
+
+    // The conversions stop at the first error with the output for the input before it
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const string& text = invalid[i].text;
+        const string valid_prefix = text.substr(0, invalid[i].offset);
+        const char* first = text.data();
+        utf8::uint32_t cp = 0;
+        const char* at_error = first + invalid[i].offset;
+        const utf8::utf_error expected = utf8::try_next(at_error, first + text.size(), cp);
+        utf16_string utf16;
+        back_insert_iterator<utf16_string> out16(utf16);
+        CHECK(utf8::try_utf8to16(first, first + text.size(), out16) == expected);
+        CHECK(first == text.data() + invalid[i].offset && utf16 == to_utf16(valid_prefix));
+        first = text.data();
+        utf32_string utf32;
+        back_insert_iterator<utf32_string> out32(utf32);
+        CHECK(utf8::try_utf8to32(first, first + text.size(), out32) == expected);
+        CHECK(first == text.data() + invalid[i].offset && utf32 == to_utf32(valid_prefix));
+        first = text.data();
+        typename iterator_traits<const char*>::difference_type dist = -1;
+        CHECK(utf8::try_distance(first, first + text.size(), dist) == expected);
+        CHECK(first == text.data() + invalid[i].offset && dist == static_cast<ptrdiff_t>(utf32.size()));
+    }
+
+    string out;
+    back_insert_iterator<string> out_it(out);
+    const string truncated = "ab\xff" "c\xe2\x82";
+    string::const_iterator it = truncated.begin();
+    CHECK(utf8::try_replace_invalid(it, truncated.end(), out_it) == utf8::NOT_ENOUGH_ROOM);
+    CHECK(it == truncated.begin() + 4 && out == "ab" + REPLACEMENT_UTF8 + "c");
+    it = truncated.begin();
+    out.clear();
+    CHECK(utf8::try_replace_invalid(it, truncated.end(), out_it, 0xd800) == utf8::INVALID_CODE_POINT);
+    CHECK(it == truncated.begin() + 2 && out == "ab");
+    char octets[4] = {'Z', 'Z', 'Z', 'Z'};
+    char* octet_it = octets;
+    CHECK(utf8::try_append(0x110000, octet_it) == utf8::INVALID_CODE_POINT && octet_it == octets && octets[0] == 'Z');
+    CHECK(utf8::try_append(0x20ac, octet_it) == utf8::UTF8_OK && octet_it == octets + 3);
+
+    // Moving over code points
+    const string text = "a\xe2\x82\xac\xf0\x9f\x98\x80" "b\xff";
+    it = text.begin();
+    CHECK(utf8::try_advance(it, 3, text.end()) == utf8::UTF8_OK && it == text.begin() + 8);
+    CHECK(utf8::try_advance(it, 3, text.end()) == utf8::INVALID_LEAD && it == text.begin() + 9);
+    utf8::uint32_t cp = 0;
+    it = text.begin() + 8;
+    CHECK(utf8::try_prior(it, text.begin(), cp) == utf8::UTF8_OK && it == text.begin() + 4 && cp == 0x1f600);
+    CHECK(utf8::try_prior(it, text.begin(), cp) == utf8::UTF8_OK && it == text.begin() + 1 && cp == 0x20ac);
+    it = text.begin();
+    CHECK(utf8::try_prior(it, text.begin(), cp) == utf8::NOT_ENOUGH_ROOM && it == text.begin());
+    const string trail_only = "\x82\xac";
+    it = trail_only.end();
+    CHECK(utf8::try_prior(it, trail_only.begin(), cp) == utf8::INVALID_LEAD && it == trail_only.end());
+    it = text.begin() + 3;
+    CHECK(utf8::try_prior(it, text.begin(), cp) == utf8::NOT_ENOUGH_ROOM && it == text.begin() + 3);
+
+    // UTF-16 and UTF-32 errors
+    const utf8::uint16_t lone_trail[] = {'a', 0xde00, 'b'};
+    const utf8::uint16_t unpaired_lead[] = {'a', 0xd83d, 'b'};
+    const utf8::uint16_t final_lead[] = {'a', 'b', 0xd83d};
+    const utf8::uint16_t* const units[] = {lone_trail, unpaired_lead, final_lead};
+    const utf8::utf_error utf16_errors[] = {utf8::INVALID_LEAD, utf8::INCOMPLETE_SEQUENCE, utf8::NOT_ENOUGH_ROOM};
+    const size_t utf16_offsets[] = {1, 1, 2};
+    const utf8::uint16_t thrown_units[] = {0xde00, 'b', 0xd83d};
+    for (size_t i = 0; i < 3; ++i) {
+        const utf8::uint16_t* start = units[i];
+        out.clear();
+        CHECK(utf8::try_utf16to8(start, units[i] + 3, out_it) == utf16_errors[i]);
+        CHECK(start == units[i] + utf16_offsets[i] && out == string(units[i], units[i] + utf16_offsets[i]));
+        // The throwing version reads every unit once
+        const utf8::uint16_t* frontier = units[i];
+        bool threw = false;
+        try {
+            utf8::utf16to8(single_pass_iterator(units[i], &frontier), single_pass_iterator(units[i] + 3, &frontier), back_inserter(out));
+        }
+        catch (const utf8::invalid_utf16& e) {
+            threw = e.utf16_word() == thrown_units[i];
+        }
+        CHECK(threw);
+    }
+    const utf8::uint32_t code_points[] = {'a', 0x1f600, 0xd800, 'b'};
+    const utf8::uint32_t* start32 = code_points;
+    out.clear();
+    CHECK(utf8::try_utf32to8(start32, code_points + 4, out_it) == utf8::INVALID_CODE_POINT);
+    CHECK(start32 == code_points + 2 && out == "a\xf0\x9f\x98\x80");
+}
+
+void test_pointer_conversions()
+{
+    vector<string> texts = valid_texts();
+    texts.push_back(long_text());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        const list<char> octets(text.begin(), text.end());
+        const utf16_string expected16 = to_utf16(text);
+        const utf32_string expected32 = to_utf32(text);
+        CHECK(utf8::utf16_length(first, last) == expected16.size());
+        CHECK(utf8::utf16_length(octets.begin(), octets.end()) == expected16.size());
+
+        // Written through pointers, without running past the exact length
+        utf16_string out16(expected16.size() + 1, 0x5a5a);
+        CHECK(utf8::utf8to16(first, last, &out16[0]) == &out16[0] + expected16.size());
+        CHECK(out16.back() == 0x5a5a && utf16_string(out16.begin(), out16.end() - 1) == expected16);
+        utf32_string out32(expected32.size() + 1, 0x5a5a5a5a);
+        CHECK(utf8::utf8to32(first, last, &out32[0]) == &out32[0] + expected32.size());
+        CHECK(out32.back() == 0x5a5a5a5a && utf32_string(out32.begin(), out32.end() - 1) == expected32);
+        vector<char16_t> out_char16(expected16.size() + 1);
+        CHECK(utf8::utf8to16(first, last, &out_char16[0]) == &out_char16[0] + expected16.size());
+        CHECK(equal(expected16.begin(), expected16.end(), out_char16.begin()));
+        vector<char32_t> out_char32(expected32.size() + 1);
+        CHECK(utf8::utf8to32(first, last, &out_char32[0]) == &out_char32[0] + expected32.size());
+        CHECK(equal(expected32.begin(), expected32.end(), out_char32.begin()));
+    }
+
+    // An error after a long ASCII run still stops the conversion there
+    const string invalid = string(100, 'a') + "\xc3(";
+    utf16_string out16(invalid.size());
+    const char* first = invalid.data();
+    utf8::uint16_t* result = &out16[0];
+    CHECK(utf8::try_utf8to16(first, first + invalid.size(), result) == utf8::INCOMPLETE_SEQUENCE);
+    CHECK(first == invalid.data() + 100 && result == &out16[0] + 100 && out16[99] == 'a');
+}
+
+// UTF-16 by way of a generic iterator, which decodes one sequence at a time
+utf16_string generic_utf16(const string& text)
+{
+    const list<char> octets(text.begin(), text.end());
+    utf16_string result;
+    utf8::utf8to16(octets.begin(), octets.end(), back_inserter(result));
+    return result;
+}
+
+void test_convert()
+{
+    // Valid text of several blocks of the fused conversion, with a sequence across the end
+    // of the first one
+    string blocks;
+    const char* const pieces[] = {"abc", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80"};
+    for (unsigned i = 0; blocks.size() < 4090; ++i)
+        blocks += pieces[(i * 5 + i / 7) % 4];
+    blocks.append(4094 - blocks.size(), 'a');
+    blocks += "\xf0\x9f\x98\x80";
+    for (unsigned i = 0; blocks.size() < 3 * 4096; ++i)
+        blocks += pieces[(i * 5 + i / 7) % 4];
+    vector<string> valid = valid_texts();
+    valid.push_back(long_text());
+    valid.push_back(blocks);
+    for (size_t i = 0; i < valid.size(); ++i) {
+        const string& text = valid[i];
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        const utf16_string expected16 = generic_utf16(text);
+        utf16_string out16(expected16.size() + 1);
+        const utf8::conversion_result<const char*, utf8::uint16_t*> result16 = utf8::convert_utf8to16(first, last, &out16[0]);
+        CHECK(result16.error == utf8::UTF8_OK && result16.in == last && result16.out == &out16[0] + expected16.size());
+        CHECK(equal(expected16.begin(), expected16.end(), out16.begin()));
+        utf32_string out32;
+        CHECK(utf8::convert_utf8to32(first, last, back_inserter(out32), 0xfffd).error == utf8::UTF8_OK);
+        CHECK(out32 == to_utf32(text));
+    }
+
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const string text = invalid[i].text;
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        const char* at_error = first + invalid[i].offset;
+        utf8::uint32_t cp = 0;
+        const utf8::utf_error expected_error = utf8::try_next(at_error, last, cp);
+        const string prefix = text.substr(0, invalid[i].offset);
+
+        // Stopping at the first error
+        utf16_string out16;
+        const utf8::conversion_result<const char*, back_insert_iterator<utf16_string> > stopped16 =
+            utf8::convert_utf8to16(first, last, back_inserter(out16));
+        CHECK(stopped16.error == expected_error && stopped16.in == first + invalid[i].offset);
+        CHECK(out16 == generic_utf16(prefix));
+        utf32_string out32;
+        const utf8::conversion_result<const char*, back_insert_iterator<utf32_string> > stopped32 =
+            utf8::convert_utf8to32(first, last, back_inserter(out32));
+        CHECK(stopped32.error == expected_error && stopped32.in == first + invalid[i].offset);
+        CHECK(out32 == to_utf32(prefix));
+
+        // Replacing, as replace_invalid does, including a sequence cut off at the end
+        const string replaced_text = replaced_whole(text);
+        utf16_string replaced16;
+        const utf8::conversion_result<const char*, back_insert_iterator<utf16_string> > replacing16 =
+            utf8::convert_utf8to16(first, last, back_inserter(replaced16), 0xfffd);
+        CHECK(replacing16.error == expected_error && replacing16.in == last);
+        CHECK(replaced16 == generic_utf16(replaced_text));
+        utf32_string replaced32;
+        const list<char> octets(text.begin(), text.end());
+        CHECK(utf8::convert_utf8to32(octets.begin(), octets.end(), back_inserter(replaced32), 0xfffd).error == expected_error);
+        CHECK(replaced32 == to_utf32(replaced_text));
+
+        // A replacement that is not a code point stops at the first error
+        utf16_string not_replaced;
+        const utf8::conversion_result<const char*, back_insert_iterator<utf16_string> > rejected =
+            utf8::convert_utf8to16(first, last, back_inserter(not_replaced), 0xd800);
+        CHECK(rejected.error == utf8::INVALID_CODE_POINT && rejected.in == first + invalid[i].offset);
+        CHECK(not_replaced == generic_utf16(prefix));
+    }
+
+    // An error in a later block
+    const string late = blocks + "\xff" + blocks;
+    utf16_string out16;
+    const char* start = late.data();
+    back_insert_iterator<utf16_string> out_it(out16);
+    CHECK(utf8::try_utf8to16(start, late.data() + late.size(), out_it) == utf8::INVALID_LEAD);
+    CHECK(start == late.data() + blocks.size() && out16 == generic_utf16(blocks));
+}
+
+void test_unchecked_conversions()
+{
+    vector<string> texts = valid_texts();
+    texts.push_back(long_text());
+    bool failed = false;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const utf16_string expected16 = to_utf16(text);
+        // Every start offset, into a buffer of exactly the output size and a back_inserter
+        for (size_t offset = 0; offset < 20 && offset < text.size(); ++offset) {
+            if (utf8::internal::is_trail(text[offset]))
+                continue;
+            const char* const first = text.data() + offset;
+            const char* const last = text.data() + text.size();
+            const utf16_string tail = to_utf16(text.substr(offset));
+            utf16_string out(tail.size() + 1, 0x5a5a);
+            CHECK_ONCE(utf8::unchecked::utf8to16(first, last, &out[0]) == &out[0] + tail.size(), failed);
+            CHECK_ONCE(out.back() == 0x5a5a && utf16_string(out.begin(), out.end() - 1) == tail, failed);
+            utf16_string inserted;
+            utf8::unchecked::utf8to16(first, last, back_inserter(inserted));
+            CHECK_ONCE(inserted == tail, failed);
+        }
+        string back(text.size() + 1, 'Z');
+        const utf8::uint16_t* const units = expected16.empty() ? NULL : &expected16[0];
+        CHECK(utf8::unchecked::utf16to8(units, units + expected16.size(), &back[0]) == &back[0] + text.size());
+        CHECK(back == text + "Z");
+        string inserted;
+        utf8::unchecked::utf16to8(expected16.begin(), expected16.end(), back_inserter(inserted));
+        CHECK(inserted == text);
+    }
+
+    // Invalid input gives unspecified code units, but the decoder keeps to the input and to
+    // one code unit per octet of output. The octets after the input are padding for leads
+    // that claim more octets than are left, which unchecked::next reads as it always has.
+    vector<string> garbage;
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i)
+        garbage.push_back(invalid[i].text);
+    string damaged = long_text().substr(0, 5000);
+    const char bad_octets[] = {'\x80', '\xbf', '\xc3', '\xe2', '\xf0', '\xf4', '\xff'};
+    for (size_t i = 0; i < damaged.size(); i += 37)
+        damaged[i] = bad_octets[i % sizeof(bad_octets)];
+    garbage.push_back(damaged);
+    string noise;
+    for (unsigned seed = 1; noise.size() < 5000; seed = seed * 1103515245u + 12345u)
+        noise += static_cast<char>(seed >> 16);
+    garbage.push_back(noise);
+    for (size_t i = 0; i < garbage.size(); ++i) {
+        const string padded = garbage[i] + "aaaa";
+        const char* const first = padded.data();
+        const char* const last = first + garbage[i].size();
+        utf16_string out(garbage[i].size(), 0);
+        CHECK_ONCE(utf8::unchecked::utf8to16(first, last, &out[0]) <= &out[0] + out.size(), failed);
+        utf16_string inserted;
+        utf8::unchecked::utf8to16(first, last, back_inserter(inserted));
+        CHECK_ONCE(inserted.size() <= garbage[i].size(), failed);
+    }
+    // Trail octets alone are one code unit each, with no lead octet to end a block at
+    const string trails(300, '\x80');
+    utf16_string inserted;
+    utf8::unchecked::utf8to16(trails.begin(), trails.end(), back_inserter(inserted));
+    CHECK(inserted == utf16_string(300, 0x80));
+}
+
+void test_distance()
+{
+    vector<string> texts = valid_texts();
+    texts.push_back(long_text());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const deque<char> octets(text.begin(), text.end()); // distance needs operator<
+        const ptrdiff_t expected = static_cast<ptrdiff_t>(to_utf32(text).size());
+        CHECK(utf8::distance(text.data(), text.data() + text.size()) == expected);
+        CHECK(utf8::distance(text.begin(), text.end()) == expected);
+        CHECK(utf8::distance(octets.begin(), octets.end()) == expected);
+        CHECK(utf8::unchecked::distance(text.data(), text.data() + text.size()) == expected);
+        CHECK(utf8::unchecked::distance(octets.begin(), octets.end()) == expected);
+        if (i + 1 == texts.size())
+            continue; // every prefix of the long text would take too long
+        const vector<size_t> ends = boundaries(text);
+        for (size_t j = 0; j < ends.size(); ++j)
+            CHECK(utf8::distance(text.data(), text.data() + ends[j]) ==
+                  static_cast<ptrdiff_t>(to_utf32(text.substr(0, ends[j])).size()));
+    }
+
+    // Invalid input throws the exception the code point loop throws
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const string text = invalid[i].text + long_text();
+        const char* at_error = text.data() + invalid[i].offset;
+        string expected, thrown;
+        try { utf8::next(at_error, text.data() + text.size()); }
+        catch (const utf8::exception& e) { expected = e.what(); }
+        try { utf8::distance(text.data(), text.data() + text.size()); }
+        catch (const utf8::exception& e) { thrown = e.what(); }
+        CHECK(!expected.empty() && thrown == expected);
+    }
+}
+
+void test_code_point_index()
+{
+    const vector<string> texts = valid_texts();
+    const size_t block_sizes[] = {1, 3, 64};
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const utf32_string code_points = to_utf32(text);
+        for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); ++b) {
+            const utf8::code_point_index<string::const_iterator> index(text.begin(), text.end(), block_sizes[b]);
+            CHECK(index.size() == code_points.size());
+            bool failed = false;
+            string::const_iterator expected = text.begin();
+            for (size_t cp = 0; cp <= code_points.size(); ++cp) {
+                CHECK_ONCE(index.seek(cp) == expected, failed);
+                CHECK_ONCE(index.offset(expected) == cp, failed);
+                if (cp < code_points.size()) {
+                    CHECK_ONCE(*index.at(cp) == code_points[cp], failed);
+                    CHECK_ONCE(index.begin()[static_cast<std::ptrdiff_t>(cp)] == code_points[cp], failed);
+                    utf8::next(expected, text.end());
+                }
+            }
+            CHECK(index.seek(code_points.size() + 10) == text.end());
+            CHECK(utf32_string(index.begin(), index.end()) == code_points);
+            CHECK(index.end() - index.begin() == static_cast<std::ptrdiff_t>(code_points.size()));
+            if (code_points.size() >= 4) {
+                utf8::code_point_index<string::const_iterator>::iterator it = index.end();
+                it -= 3;
+                CHECK(*it == code_points[code_points.size() - 3]);
+                --it;
+                CHECK(*it == code_points[code_points.size() - 4]);
+                CHECK(it.code_point_offset() == code_points.size() - 4);
+                string::const_iterator position = it.base();
+                index.advance(position, 2);
+                CHECK(position == (it + 2).base());
+                index.advance(position, -3);
+                CHECK(position == (it - 1).base());
+            }
+            // Moving past either end of the range stops there
+            string::const_iterator position = text.begin();
+            if (!code_points.empty())
+                utf8::next(position, text.end());
+            index.advance(position, -2);
+            CHECK(position == text.begin());
+            index.advance(position, -static_cast<std::ptrdiff_t>(code_points.size()) - 5);
+            CHECK(position == text.begin());
+            index.advance(position, static_cast<std::ptrdiff_t>(code_points.size()) + 5);
+            CHECK(position == text.end());
+            utf8::code_point_index<string::const_iterator>::iterator first = index.begin() - 1;
+            CHECK(first == index.begin() && first.base() == text.begin() && first.code_point_offset() == 0);
+            first += -static_cast<std::ptrdiff_t>(code_points.size()) - 5;
+            CHECK(first == index.begin() && first.base() == text.begin());
+            utf8::code_point_index<string::const_iterator>::iterator last = index.end() + 2;
+            CHECK(last == index.end() && last.base() == text.end() && last - index.begin() == static_cast<std::ptrdiff_t>(code_points.size()));
+        }
+    }
+    // The constructor throws what next throws at the first invalid sequence
+    const string invalid = string(100, 'a') + "\xff";
+    bool threw = false;
+    try {
+        utf8::code_point_index<string::const_iterator> index(invalid.begin(), invalid.end());
+    }
+    catch (const utf8::invalid_utf8& e) {
+        threw = e.utf8_octet() == 0xff;
+    }
+    CHECK(threw);
+    const string truncated = string(100, 'a') + "\xe2\x82";
+    threw = false;
+    try {
+        utf8::code_point_index<string::const_iterator> index(truncated.begin(), truncated.end());
+    }
+    catch (const utf8::not_enough_room&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// prior as it was before the backward scan: back to the lead octet, then next from there
+template <typename octet_iterator>
+string reference_prior(octet_iterator& it, octet_iterator start, utf8::uint32_t& cp)
+{
+    if (it == start)
+        return utf8::not_enough_room().what();
+    octet_iterator end = it;
+    while (utf8::internal::is_trail(*(--it)))
+        if (it == start)
+            return utf8::invalid_utf8(static_cast<utf8::uint8_t>(*it)).what();
+    octet_iterator lead = it;
+    try { cp = utf8::next(lead, end); }
+    catch (const utf8::exception& e) { return e.what(); }
+    return string();
+}
+
+// Checks prior and try_prior at every position of text against reference_prior
+template <typename octet_iterator>
+bool prior_matches(octet_iterator first, octet_iterator last)
+{
+    for (octet_iterator position = last; ; --position) {
+        octet_iterator expected = position, it = position, try_it = position;
+        utf8::uint32_t expected_cp = 0, cp = 0, try_cp = 0;
+        const string expected_error = reference_prior(expected, first, expected_cp);
+        string error;
+        try { cp = utf8::prior(it, first); }
+        catch (const utf8::exception& e) { error = e.what(); }
+        if (error != expected_error || it != expected || (error.empty() && cp != expected_cp))
+            return false;
+        const utf8::internal::utf_error err_code = utf8::try_prior(try_it, first, try_cp);
+        if ((err_code == utf8::internal::UTF8_OK) != error.empty())
+            return false;
+        if (err_code == utf8::internal::UTF8_OK ? try_it != expected || try_cp != expected_cp : try_it != position)
+            return false;
+        if (position == first)
+            return true;
+    }
+}
+
+void test_prior_advance()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const list<char> octets(text.begin(), text.end());
+        CHECK(prior_matches(text.data(), text.data() + text.size()));
+        CHECK(prior_matches(octets.begin(), octets.end()));
+    }
+
+    vector<string> valid = valid_texts();
+    valid.push_back(long_text());
+    for (size_t i = 0; i < valid.size(); ++i) {
+        const string& text = valid[i];
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        const utf32_string code_points = to_utf32(text);
+        const vector<size_t> ends = boundaries(text);
+        const list<char> octets(text.begin(), text.end());
+
+        // unchecked::prior decodes the same code points back to front
+        bool failed = false;
+        const char* it = last;
+        for (size_t cp = code_points.size(); cp-- > 0; )
+            CHECK_ONCE(utf8::unchecked::prior(it) == code_points[cp] && it == first + ends[cp], failed);
+        CHECK(it == first);
+
+        // retreat lands where the forward advance would, for every count
+        const size_t counts[] = {0, 1, 2, 3, 7, 8, 9, 31, 32, 33, 100, code_points.size()};
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            if (counts[c] > code_points.size())
+                continue;
+            const size_t n = counts[c];
+            const char* expected = first + ends[code_points.size() - n];
+            const char* checked = last;
+            utf8::retreat(checked, n, first);
+            CHECK(checked == expected);
+            const char* tried = last;
+            CHECK(utf8::try_retreat(tried, n, first) == utf8::internal::UTF8_OK && tried == expected);
+            const char* unchecked = last;
+            utf8::unchecked::retreat(unchecked, n);
+            CHECK(unchecked == expected);
+            list<char>::const_iterator generic = octets.end();
+            utf8::retreat(generic, n, octets.begin());
+            CHECK(distance(octets.begin(), generic) == expected - first);
+        }
+        if (!code_points.empty()) {
+            const char* past = last;
+            CHECK(utf8::try_retreat(past, code_points.size() + 1, first) == utf8::internal::NOT_ENOUGH_ROOM);
+            CHECK(past == first);
+        }
+
+        // A negative count moves nothing, also next to the start of the range
+        const char* const middle = first + ends[code_points.empty() ? 0 : 1];
+        const char* moved = middle;
+        utf8::advance(moved, -3, last);
+        CHECK(moved == middle);
+        CHECK(utf8::try_advance(moved, -3, last) == utf8::internal::UTF8_OK && moved == middle);
+        utf8::retreat(moved, -3, first);
+        CHECK(moved == middle);
+        utf8::unchecked::advance(moved, -3);
+        utf8::unchecked::retreat(moved, -3);
+        CHECK(moved == middle);
+    }
+
+    // An invalid sequence in the range skipped back throws what prior throws where it stops
+    const vector<invalid_text> invalid = invalid_texts();
+    for (size_t i = 0; i < invalid.size(); ++i) {
+        const string text = invalid[i].text + long_text();
+        const char* const first = text.data();
+        const size_t n = text.size();
+        string expected, thrown;
+        const char* it = first + text.size();
+        try { for (;;) utf8::prior(it, first); }
+        catch (const utf8::exception& e) { expected = e.what(); }
+        it = first + text.size();
+        try { utf8::retreat(it, n, first); }
+        catch (const utf8::exception& e) { thrown = e.what(); }
+        CHECK(!expected.empty() && thrown == expected);
+        const char* tried = first + text.size();
+        CHECK(utf8::try_retreat(tried, n, first) != utf8::internal::UTF8_OK);
+    }
+}
+
+//=================================================================================================
+// truncation
+//=================================================================================================
+
+void test_truncate()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const bool valid = utf8::is_valid(text.begin(), text.end());
+        bool failed = false;
+        for (size_t max_bytes = 0; max_bytes <= text.size() + 1; ++max_bytes) {
+            const string::const_iterator cut = utf8::truncate_to_bytes(text.begin(), text.end(), max_bytes);
+            CHECK_ONCE(static_cast<size_t>(cut - text.begin()) <= max_bytes, failed);
+            if (!valid)
+                continue;
+            // The longest prefix that fits and does not split a code point
+            CHECK_ONCE(cut == text.end() || !utf8::internal::is_trail(*cut), failed);
+            CHECK_ONCE(cut == text.end() || static_cast<size_t>(cut - text.begin()) + utf8::internal::sequence_length(cut) > max_bytes, failed);
+            const string::const_iterator cluster_cut = utf8::truncate_to_clusters(text.begin(), text.end(), max_bytes);
+            CHECK_ONCE(cluster_cut <= cut && utf8::is_valid(text.begin(), cluster_cut), failed);
+        }
+    }
+
+    // Clusters: base letters with nonspacing marks (Thai, Bengali, Latin), an emoji with a
+    // skin tone modifier and a zero width joiner sequence, a flag, and CR LF
+    const char* const clusters[] = {
+        "\xe0\xb8\x81\xe0\xb9\x88",                                      // ก่
+        "\xe0\xa6\x95\xe0\xa7\x81",                                      // কু
+        "e\xcc\x81\xcc\xa3",
+        "\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd",                              // 👍🏽
+        "\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb",                  // 👩‍💻
+        "\xf0\x9f\x87\xab\xf0\x9f\x87\xb7",                              // 🇫🇷
+        "\r\n",
+    };
+    for (size_t i = 0; i < sizeof(clusters) / sizeof(clusters[0]); ++i) {
+        const string cluster = clusters[i];
+        const string text = "ab" + cluster + "cd";
+        for (size_t max_bytes = 2; max_bytes < 2 + cluster.size(); ++max_bytes)
+            CHECK(utf8::truncate_to_clusters(text.begin(), text.end(), max_bytes) == text.begin() + 2);
+        CHECK(utf8::truncate_to_clusters(text.begin(), text.end(), 2 + cluster.size()) == text.begin() + 2 + static_cast<std::ptrdiff_t>(cluster.size()));
+    }
+    // Flags pair up from the first regional indicator of a run
+    const string flags = "\xf0\x9f\x87\xab\xf0\x9f\x87\xb7\xf0\x9f\x87\xa9\xf0\x9f\x87\xaa";
+    CHECK(utf8::truncate_to_clusters(flags.begin(), flags.end(), 12) == flags.begin() + 8);
+    CHECK(utf8::truncate_to_clusters(flags.begin(), flags.end(), 8) == flags.begin() + 8);
+    // Two base letters are two clusters
+    const string letters = "\xe0\xb8\x81\xe0\xb8\x82";
+    CHECK(utf8::truncate_to_clusters(letters.begin(), letters.end(), 3) == letters.begin() + 3);
+
+    // The ends of the Grapheme_Extend table
+    CHECK(!utf8::internal::is_extending(0x2ff) && utf8::internal::is_extending(0x300));
+    CHECK(utf8::internal::is_extending(0x36f) && !utf8::internal::is_extending(0x370));
+    CHECK(utf8::internal::is_extending(0x200d) && utf8::internal::is_extending(0x1f3ff));
+    CHECK(utf8::internal::is_extending(0xe01ef) && !utf8::internal::is_extending(0xe01f0));
+    CHECK(!utf8::internal::is_extending('a') && !utf8::internal::is_extending(0x10ffff));
+}
+
+//=================================================================================================
+// case folding
+//=================================================================================================
+
+char ascii_upper(char c)
+{
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+bool ascii_iequal(char a, char b)
+{
+    return ascii_upper(a) == ascii_upper(b);
+}
+
+string ascii_uppercased(const string& text)
+{
+    string upper = text;
+    transform(upper.begin(), upper.end(), upper.begin(), ascii_upper);
+    return upper;
+}
+
+int sign(int value)
+{
+    return value < 0 ? -1 : value > 0 ? 1 : 0;
+}
+
+// iequals_ascii and find_ascii_icase, on pointers and on generic iterators, against the
+// standard algorithms with a case-insensitive predicate
+void test_ascii_icase()
+{
+    const vector<string> texts = all_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const string upper = ascii_uppercased(text);
+        const list<char> generic(upper.begin(), upper.end());
+        bool failed = false;
+        CHECK_ONCE(utf8::iequals_ascii(text.begin(), text.end(), upper.begin(), upper.end()), failed);
+        CHECK_ONCE(utf8::iequals_ascii(text.begin(), text.end(), generic.begin(), generic.end()), failed);
+        if (!text.empty())
+            CHECK_ONCE(!utf8::iequals_ascii(text.begin(), text.end() - 1, upper.begin(), upper.end()), failed);
+        for (size_t offset = 0; offset < text.size(); offset += 7) {
+            string changed = upper;
+            changed[offset] = static_cast<char>(changed[offset] ^ 0x01);
+            CHECK_ONCE(!utf8::iequals_ascii(text.begin(), text.end(), changed.begin(), changed.end()), failed);
+        }
+        // Needles of every length up to 3, then longer, taken from the text with the case changed
+        for (size_t offset = 0; offset < text.size(); offset += 5) {
+            for (size_t length = 0; length <= 33 && offset + length <= text.size(); length += length < 3 ? 1 : 10) {
+                const string needle = upper.substr(offset, length);
+                const string::const_iterator expected = search(text.begin(), text.end(), needle.begin(), needle.end(), ascii_iequal);
+                CHECK_ONCE(utf8::find_ascii_icase(text.begin(), text.end(), needle.begin(), needle.end()) == expected, failed);
+                const list<char> generic_needle(needle.begin(), needle.end());
+                CHECK_ONCE(utf8::find_ascii_icase(generic.begin(), generic.end(), generic_needle.begin(), generic_needle.end()) ==
+                           search(generic.begin(), generic.end(), needle.begin(), needle.end(), ascii_iequal), failed);
+            }
+        }
+    }
+
+    // A needle found only at the very end, past many candidates for its first octet
+    const string haystack = string(200, 'a') + "aB";
+    const string needle = "Ab";
+    CHECK(utf8::find_ascii_icase(haystack.begin(), haystack.end(), needle.begin(), needle.end()) == haystack.begin() + 200);
+    const string late = "ax";
+    CHECK(utf8::find_ascii_icase(haystack.begin(), haystack.end(), late.begin(), late.end()) == haystack.end());
+    const string tail = string(100, 'A') + "AB";
+    CHECK(utf8::find_ascii_icase(haystack.begin(), haystack.end(), tail.begin(), tail.end()) == haystack.begin() + 100);
+    // Only the letters fold: '@' and '`' sit next to 'A' and 'a' but are not letters
+    const string symbols = "@[`{";
+    const string shifted = "`{@[";
+    CHECK(!utf8::iequals_ascii(symbols.begin(), symbols.end(), shifted.begin(), shifted.end()));
+    CHECK(!utf8::iequals_ascii(symbols.begin(), symbols.begin() + 1, shifted.begin(), shifted.begin() + 1));
+}
+
+void test_case_folding()
+{
+    // Simple case folding: C mappings, S mappings, and no F or T mappings
+    CHECK(utf8::fold_case('A') == 'a' && utf8::fold_case('a') == 'a' && utf8::fold_case('@') == '@');
+    CHECK(utf8::fold_case(0xc0) == 0xe0 && utf8::fold_case(0xd7) == 0xd7 && utf8::fold_case(0xdf) == 0xdf);
+    CHECK(utf8::fold_case(0x100) == 0x101 && utf8::fold_case(0x101) == 0x101);
+    CHECK(utf8::fold_case(0x130) == 0x130);
+    CHECK(utf8::fold_case(0x391) == 0x3b1 && utf8::fold_case(0x3c2) == 0x3c3 && utf8::fold_case(0x3a3) == 0x3c3);
+    CHECK(utf8::fold_case(0x410) == 0x430 && utf8::fold_case(0x400) == 0x450);
+    CHECK(utf8::fold_case(0x1e9e) == 0xdf && utf8::fold_case(0x1f88) == 0x1f80);
+    CHECK(utf8::fold_case(0x212a) == 'k' && utf8::fold_case(0x2126) == 0x3c9);
+    CHECK(utf8::fold_case(0x10400) == 0x10428 && utf8::fold_case(0x1e921) == 0x1e943);
+    CHECK(utf8::fold_case(0x4e00) == 0x4e00 && utf8::fold_case(0x10ffff) == 0x10ffff);
+
+    // Equal after folding, with the difference in ASCII letters, in other letters, and in
+    // the trail octet of a two-octet sequence, each after a prefix long enough for the kernels
+    const string prefix = long_text();
+    const char* const equal_pairs[][2] = {
+        {"Hello", "hELLO"},
+        {"\xc3\xa9t\xc3\xa9", "\xc3\x89T\xc3\x89"},                       // été, ÉTÉ
+        {"\xcf\x83\xce\xaf\xcf\x83\xcf\x85\xcf\x86\xce\xbf\xcf\x82",      // σίσυφος
+         "\xce\xa3\xce\x8a\xce\xa3\xce\xa5\xce\xa6\xce\x9f\xce\xa3"},     // ΣΊΣΥΦΟΣ
+        {"\xe2\x84\xaa" "elvin", "kelvin"},                               // Kelvin sign
+        {"\xf0\x90\x90\x80", "\xf0\x90\x90\xa8"},                         // Deseret 𐐀, 𐐨
+    };
+    for (size_t i = 0; i < sizeof(equal_pairs) / sizeof(equal_pairs[0]); ++i) {
+        const string a = prefix + equal_pairs[i][0];
+        const string b = ascii_uppercased(prefix) + equal_pairs[i][1];
+        CHECK(utf8::compare_folded(a.begin(), a.end(), b.begin(), b.end()) == 0);
+        CHECK(utf8::iequals(b.begin(), b.end(), a.begin(), a.end()));
+        const list<char> generic(b.begin(), b.end());
+        CHECK(utf8::iequals(a.begin(), a.end(), generic.begin(), generic.end()));
+    }
+
+    // Ordered by the first folded code point that differs, then by length
+    const char* const ordered_pairs[][2] = {
+        {"a", "B"},
+        {"STRASSE", "Stra\xc3\x9f" "e"},                                  // simple folding keeps ß
+        {"\xc3\xa9", "\xc3\x8a"},                                         // é before Ê
+        {"abc", "ABCD"},
+        {"", "a"},
+        {"z", "\xc3\xa0"},
+    };
+    for (size_t i = 0; i < sizeof(ordered_pairs) / sizeof(ordered_pairs[0]); ++i) {
+        const string a = prefix + ordered_pairs[i][0];
+        const string b = prefix + ordered_pairs[i][1];
+        const list<char> generic_a(a.begin(), a.end());
+        const list<char> generic_b(b.begin(), b.end());
+        CHECK(utf8::compare_folded(a.begin(), a.end(), b.begin(), b.end()) < 0);
+        CHECK(utf8::compare_folded(b.begin(), b.end(), a.begin(), a.end()) > 0);
+        CHECK(sign(utf8::compare_folded(generic_a.begin(), generic_a.end(), generic_b.begin(), generic_b.end())) == -1);
+        CHECK(!utf8::iequals(a.begin(), a.end(), b.begin(), b.end()));
+    }
+}
+
+//=================================================================================================
+// batches
+//=================================================================================================
+
+void test_batch()
+{
+    const vector<string> texts = all_texts();
+    string blob;
+    vector<unsigned> offsets(1, 0);
+    for (size_t i = 0; i < texts.size(); ++i) {
+        blob += texts[i];
+        offsets.push_back(static_cast<unsigned>(blob.size()));
+    }
+    const size_t count = texts.size();
+    vector<utf8::batch_status> results(count);
+    const bool all_valid = utf8::validate_batch(blob.data(), &offsets[0], count, &results[0]);
+    CHECK(!all_valid);
+    bool failed = false;
+    for (size_t i = 0; i < count; ++i) {
+        const bool valid = utf8::is_valid(texts[i].begin(), texts[i].end());
+        CHECK_ONCE((results[i].error == utf8::UTF8_OK) == valid, failed);
+        CHECK_ONCE(results[i].position == invalid_offset(texts[i]), failed);
+    }
+
+    vector<string> strings(texts.begin(), texts.end());
+    vector<utf8::batch_status> separate(count);
+    CHECK(!utf8::validate_batch(&strings[0], count, &separate[0]));
+    for (size_t i = 0; i < count; ++i)
+        CHECK_ONCE(separate[i].error == results[i].error && separate[i].position == results[i].position, failed);
+
+    vector<utf8::uint16_t> out16(blob.size() + 1);
+    vector<utf8::uint32_t> out32(blob.size() + 1);
+    vector<unsigned> offsets16(count + 1), offsets32(count + 1);
+    utf8::utf8to16_batch(blob.data(), &offsets[0], count, &out16[0], &offsets16[0], &results[0]);
+    utf8::utf8to32_batch(blob.data(), &offsets[0], count, &out32[0], &offsets32[0], &results[0]);
+    for (size_t i = 0; i < count; ++i) {
+        const bool valid = utf8::is_valid(texts[i].begin(), texts[i].end());
+        const utf16_string expected16 = valid ? to_utf16(texts[i]) : utf16_string();
+        const utf32_string expected32 = valid ? to_utf32(texts[i]) : utf32_string();
+        CHECK_ONCE(utf16_string(out16.begin() + offsets16[i], out16.begin() + offsets16[i + 1]) == expected16, failed);
+        CHECK_ONCE(utf32_string(out32.begin() + offsets32[i], out32.begin() + offsets32[i + 1]) == expected32, failed);
+    }
+
+    // A sequence that crosses from one string into the next is invalid in both
+    const string crossing = "ab\xe2\x82\xac" "cd";
+    const unsigned crossing_offsets[] = {0, 3, 7};
+    utf8::batch_status crossing_results[2];
+    CHECK(!utf8::validate_batch(crossing.data(), crossing_offsets, 2, crossing_results));
+    CHECK(crossing_results[0].error == utf8::NOT_ENOUGH_ROOM && crossing_results[0].position == 2);
+    CHECK(crossing_results[1].error == utf8::INVALID_LEAD && crossing_results[1].position == 0);
+}
+
+//=================================================================================================
+// parallel
+//=================================================================================================
+
+// Pseudo-random valid text of 1.5 MiB, large enough to be split across threads
+string large_text(unsigned seed)
+{
+    const char* const pieces[] = {"abcdefghijklmnop", "\xd0\x9f\xd1\x80\xd0\xb8", "\xe4\xb8\xad\xe6\x96\x87",
+                                  "\xf0\x9f\x98\x80", "\xe0\xa4\x95\xe0\xa5\x81", "\n"};
+    string text;
+    while (text.size() < (3 << 20) / 2) {
+        seed = seed * 1103515245u + 12345u;
+        text += pieces[(seed >> 16) % 6];
+    }
+    return text;
+}
+
+
+void test_parallel()
+{
+    const utf8::parallel::thread_executor executor(4);
+    const string valid = large_text(1);
+    vector<string> texts(1, valid);
+    // Errors in the middle, next to where chunks are split, and at the end
+    string invalid = valid;
+    invalid[invalid.size() / 2] = '\xff';
+    texts.push_back(invalid);
+    string split_sequence = valid;
+    for (size_t i = 1; i < 40; ++i)
+        split_sequence[split_sequence.size() / 40 * i] = '\xe2';
+    texts.push_back(split_sequence);
+    texts.push_back(valid + "\xf0\x9f\x98");
+    texts.push_back(valid.substr(0, 1000));
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const char* const first = text.data();
+        const char* const last = first + text.size();
+        CHECK(utf8::parallel::find_invalid(first, last, executor) == utf8::find_invalid(first, last));
+        CHECK(utf8::parallel::is_valid(first, last, executor) == utf8::is_valid(first, last));
+
+        string serial, parallel;
+        bool serial_threw = false, parallel_threw = false;
+        try {
+            utf8::replace_invalid(first, last, back_inserter(serial));
+        }
+        catch (const utf8::not_enough_room&) {
+            serial_threw = true;
+        }
+        try {
+            utf8::parallel::replace_invalid(first, last, back_inserter(parallel), 0xfffd, executor);
+        }
+        catch (const utf8::not_enough_room&) {
+            parallel_threw = true;
+        }
+        CHECK(serial_threw == parallel_threw);
+        CHECK(serial == parallel);
+
+        if (!utf8::is_valid(first, last)) {
+            vector<utf8::uint16_t> out(text.size());
+            bool threw = false;
+            try {
+                utf8::parallel::utf8to16(first, last, &out[0], executor);
+            }
+            catch (const utf8::exception&) {
+                threw = true;
+            }
+            CHECK(threw);
+            continue;
+        }
+        vector<utf8::uint16_t> out(utf8::utf16_length(first, last) + 1, 0x5a5a);
+        utf8::uint16_t* const end = utf8::parallel::utf8to16(first, last, &out[0], executor);
+        CHECK(end == &out[0] + out.size() - 1 && out.back() == 0x5a5a);
+        out.pop_back();
+        CHECK(out == to_utf16(text));
+    }
+
+    // Exceptions in the tasks reach the caller after all the workers have stopped
+    bool threw = false;
+    try {
+        executor(1000, [](size_t i) {
+            if (i == 500)
+                throw runtime_error("task");
+        });
+    }
+    catch (const runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+
+//=================================================================================================
+// ranges
+//=================================================================================================
+
+// decode_view in any language mode, as a plain begin/end range
+void test_decode_view()
+{
+    const vector<string> texts = valid_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        const utf8::decode_view<string::const_iterator> checked(text.begin(), text.end());
+        utf32_string decoded;
+        for (utf8::decoding_iterator<string::const_iterator> it = checked.begin(); it != checked.end(); ++it)
+            decoded.push_back(*it);
+        CHECK(decoded == to_utf32(text));
+        const utf8::unchecked::decode_view<string::const_iterator> unchecked(text.begin(), text.end());
+        CHECK(utf32_string(unchecked.begin(), unchecked.end()) == decoded);
+    }
+}
+
+#if defined(UTF8_CPP_RANGES)
+void test_views()
+{
+    const vector<string> texts = valid_texts();
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const string& text = texts[i];
+        utf32_string decoded;
+        for (utf8::uint32_t cp : text | utf8::views::decode)
+            decoded.push_back(cp);
+        CHECK(decoded == to_utf32(text));
+        utf32_string unchecked;
+        for (utf8::uint32_t cp : text | utf8::views::decode_unchecked)
+            unchecked.push_back(cp);
+        CHECK(unchecked == decoded);
+
+        utf16_string encoded16;
+        for (char16_t unit : text | utf8::views::decode | utf8::views::encode16)
+            encoded16.push_back(unit);
+        CHECK(encoded16 == to_utf16(text));
+        string encoded;
+        for (char unit : text | utf8::views::decode | utf8::views::encode)
+            encoded += unit;
+        CHECK(encoded == text);
+        utf32_string encoded32;
+        for (char32_t unit : decoded | utf8::views::encode32)
+            encoded32.push_back(unit);
+        CHECK(encoded32 == decoded);
+    }
+
+    // Composed with the standard views in one pass
+    const string text = "a\xc3\xa9" "b\xe2\x82\xac";
+    string ascii_dropped;
+    for (char unit : text | utf8::views::decode | std::views::filter([](utf8::uint32_t cp) { return cp >= 0x80; }) | utf8::views::encode)
+        ascii_dropped += unit;
+    CHECK(ascii_dropped == "\xc3\xa9\xe2\x82\xac");
+
+    // Invalid input throws on reaching it
+    const string invalid = "ab\xff";
+    bool threw = false;
+    size_t decoded = 0;
+    try {
+        for (utf8::uint32_t cp : invalid | utf8::views::decode) {
+            (void)cp;
+            ++decoded;
+        }
+    }
+    catch (const utf8::invalid_utf8&) {
+        threw = true;
+    }
+    CHECK(threw && decoded == 2);
+    const utf8::uint32_t surrogate[] = {'a', 0xd800};
+    threw = false;
+    try {
+        for (char unit : surrogate | utf8::views::encode)
+            (void)unit;
+    }
+    catch (const utf8::invalid_code_point&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+#endif
+
+//=================================================================================================
+// memory-mapped files
+//=================================================================================================
+
+#if defined(UTF8_TESTS_MMAP)
+struct temporary_file {
+    string path;
+    explicit temporary_file(const string& contents)
+    {
+        char name[] = "/tmp/utf8testsXXXXXX";
+        const int fd = ::mkstemp(name);
+        path = name;
+        if (fd >= 0) {
+            if (::write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+                path.clear();
+            ::close(fd);
+        }
+    }
+    ~temporary_file() { ::unlink(path.c_str()); }
+};
+
+string read_file(const string& path)
+{
+    utf8::mapped_file file(path.c_str());
+    return string(file.begin(), file.end());
+}
+
+template <typename unit_type>
+vector<unit_type> read_units(const string& path)
+{
+    const string octets = read_file(path);
+    vector<unit_type> result(octets.size() / sizeof(unit_type));
+    if (!result.empty())
+        memcpy(&result[0], octets.data(), result.size() * sizeof(unit_type));
+    return result;
+}
+
+void test_mmap()
+{
+    const string valid = valid_texts()[5];
+    const string texts[] = {string(), valid, valid + "\xff" + valid};
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i) {
+        const temporary_file input(texts[i]);
+        CHECK(!input.path.empty());
+        CHECK(read_file(input.path) == texts[i]);
+        const temporary_file output("");
+        {
+            const utf8::mapped_file file(input.path.c_str());
+            const int fd = ::open(output.path.c_str(), O_WRONLY | O_TRUNC);
+            utf8::replace_invalid_to_fd(file, fd);
+            ::close(fd);
+        }
+        CHECK(read_file(output.path) == replaced(texts[i]));
+        if (!utf8::is_valid(texts[i].begin(), texts[i].end())) {
+            bool threw = false;
+            try {
+                utf8::utf8to16_file(input.path.c_str(), output.path.c_str());
+            }
+            catch (const utf8::invalid_utf8&) {
+                threw = true;
+            }
+            CHECK(threw);
+            continue;
+        }
+        CHECK(utf8::utf8to16_file(input.path.c_str(), output.path.c_str()) == to_utf16(texts[i]).size());
+        CHECK(read_units<utf8::uint16_t>(output.path) == to_utf16(texts[i]));
+        CHECK(utf8::utf8to32_file(input.path.c_str(), output.path.c_str()) == to_utf32(texts[i]).size());
+        CHECK(read_units<utf8::uint32_t>(output.path) == to_utf32(texts[i]));
+    }
+
+    // A file that ends in the middle of a sequence throws what next throws for it
+    const temporary_file truncated(valid + "\xe2\x82");
+    const temporary_file output("");
+    bool threw = false;
+    try {
+        utf8::utf8to32_file(truncated.path.c_str(), output.path.c_str());
+    }
+    catch (const utf8::not_enough_room&) {
+        threw = true;
+    }
+    CHECK(threw);
+    threw = false;
+    try {
+        utf8::mapped_file missing("/nonexistent/utf8tests");
+    }
+    catch (const system_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+#endif
+
+//=================================================================================================
+// constant evaluation
+//=================================================================================================
+
+#if UTF8_CPP_CPLUSPLUS >= 201402L
+// A forward iterator that can be used in constant expressions. It takes the generic paths,
+// so it needs no support for telling constant evaluation apart.
+struct constant_iterator {
+    typedef forward_iterator_tag iterator_category;
+    typedef char value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const char* pointer;
+    typedef const char& reference;
+
+    const char* position;
+
+    constexpr explicit constant_iterator(const char* position_) : position(position_) {}
+    constexpr const char& operator*() const { return *position; }
+    constexpr constant_iterator& operator++() { ++position; return *this; }
+    constexpr constant_iterator operator++(int) { constant_iterator old = *this; ++position; return old; }
+    constexpr bool operator==(const constant_iterator& other) const { return position == other.position; }
+    constexpr bool operator!=(const constant_iterator& other) const { return position != other.position; }
+    constexpr bool operator<(const constant_iterator& other) const { return position < other.position; }
+};
+
+template <size_t size>
+constexpr constant_iterator constant_end(const char (&text)[size])
+{
+    return constant_iterator(text + size - 1);
+}
+
+constexpr const char constant_text[] = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";   // a é € 😀
+constexpr const char constant_overlong[] = "ab\xc0\xaf";
+
+template <typename octet_iterator>
+constexpr utf8::uint32_t code_point_at(octet_iterator it, octet_iterator end, int index)
+{
+    for (; index > 0; --index)
+        utf8::next(it, end);
+    return utf8::peek_next(it, end);
+}
+
+constexpr utf8::internal::utf_error first_error(constant_iterator it, constant_iterator end)
+{
+    utf8::uint32_t cp = 0;
+    utf8::internal::utf_error err_code = utf8::internal::UTF8_OK;
+    while (err_code == utf8::internal::UTF8_OK && it != end)
+        err_code = utf8::try_next(it, end, cp);
+    return err_code;
+}
+
+constexpr ptrdiff_t valid_prefix_length(constant_iterator it, constant_iterator end)
+{
+    ptrdiff_t dist = 0;
+    utf8::try_distance(it, end, dist);
+    return dist;
+}
+
+// Encodes cp with append or try_append and compares the result with expected
+constexpr bool appends(utf8::uint32_t cp, const char* expected, bool checked)
+{
+    char octets[5] = {};
+    char* out = octets;
+    if (checked)
+        out = utf8::append(cp, out);
+    else if (utf8::try_append(cp, out) != utf8::internal::UTF8_OK)
+        return false;
+    for (const char* it = octets; it != out; ++it, ++expected)
+        if (*it != *expected)
+            return false;
+    return *expected == 0;
+}
+
+constexpr bool try_append_rejects(utf8::uint32_t cp)
+{
+    char octets[4] = {};
+    char* out = octets;
+    return utf8::try_append(cp, out) == utf8::internal::INVALID_CODE_POINT && out == octets;
+}
+
+// UTF-8 to UTF-16 or UTF-32 and back with the unchecked conversions
+template <typename unit_type>
+constexpr bool round_trips(constant_iterator start, constant_iterator end)
+{
+    unit_type units[8] = {};
+    char octets[16] = {};
+    unit_type* units_end = units;
+    char* octets_end = octets;
+    if (sizeof(unit_type) == 2) {
+        units_end = utf8::unchecked::utf8to16(start, end, units);
+        octets_end = utf8::unchecked::utf16to8(units, units_end, octets);
+    }
+    else {
+        units_end = utf8::unchecked::utf8to32(start, end, units);
+        octets_end = utf8::unchecked::utf32to8(units, units_end, octets);
+    }
+    if (units_end - units != (sizeof(unit_type) == 2 ? 5 : 4))
+        return false;
+    for (const char* it = octets; it != octets_end; ++it, ++start)
+        if (start == end || *it != *start)
+            return false;
+    return start == end;
+}
+
+static_assert(code_point_at(constant_iterator(constant_text), constant_end(constant_text), 2) == 0x20ac, "next");
+static_assert(code_point_at(constant_iterator(constant_text), constant_end(constant_text), 3) == 0x1f600, "next");
+static_assert(utf8::is_valid(constant_iterator(constant_text), constant_end(constant_text)), "is_valid");
+static_assert(!utf8::is_valid(constant_iterator(constant_overlong), constant_end(constant_overlong)), "is_valid");
+static_assert(utf8::find_invalid(constant_iterator(constant_overlong), constant_end(constant_overlong)).position ==
+              constant_overlong + 2, "find_invalid");
+static_assert(utf8::distance(constant_iterator(constant_text), constant_end(constant_text)) == 4, "distance");
+static_assert(utf8::unchecked::distance(constant_iterator(constant_text), constant_end(constant_text)) == 4,
+              "unchecked::distance");
+static_assert(first_error(constant_iterator(constant_text), constant_end(constant_text)) == utf8::internal::UTF8_OK,
+              "try_next");
+static_assert(first_error(constant_iterator(constant_overlong), constant_end(constant_overlong)) ==
+              utf8::internal::OVERLONG_SEQUENCE, "try_next");
+static_assert(valid_prefix_length(constant_iterator(constant_overlong), constant_end(constant_overlong)) == 2,
+              "try_distance");
+static_assert(appends(0x20ac, "\xe2\x82\xac", true) && appends(0x1f600, "\xf0\x9f\x98\x80", false), "append");
+static_assert(try_append_rejects(0xd800) && try_append_rejects(0x110000), "try_append");
+static_assert(round_trips<char16_t>(constant_iterator(constant_text), constant_end(constant_text)), "utf8to16");
+static_assert(round_trips<char32_t>(constant_iterator(constant_text), constant_end(constant_text)), "utf8to32");
+
+#if UTF8_CPP_CPLUSPLUS >= 202002L
+// Pointers take the contiguous overloads, which step aside in constant evaluation
+static_assert(code_point_at(constant_text, constant_text + sizeof(constant_text) - 1, 3) == 0x1f600, "next");
+static_assert(utf8::is_valid(constant_text, constant_text + sizeof(constant_text) - 1), "is_valid");
+static_assert(utf8::find_invalid(constant_overlong, constant_overlong + sizeof(constant_overlong) - 1) ==
+              constant_overlong + 2, "find_invalid");
+static_assert(utf8::distance(constant_text, constant_text + sizeof(constant_text) - 1) == 4, "distance");
+#endif
+#endif
+
+//=================================================================================================
+// SIMD tiers
+//=================================================================================================
+
+void validate_while_tiers_switch(const string* text, bool* always_valid)
+{
+    for (int i = 0; i < 200; ++i)
+        *always_valid = utf8::is_valid(text->data(), text->data() + text->size()) && *always_valid;
+}
+
+void test_simd_tiers()
+{
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    const char* const highest = "neon";
+    const char* const foreign = "avx2";
+#else
+    const char* const highest = "avx512";
+    const char* const foreign = "neon";
+#endif
+    const string initial = utf8::active_simd_tier();
+    CHECK(utf8::use_simd_tier("scalar") == string("scalar"));
+    CHECK(utf8::active_simd_tier() == string("scalar"));
+    // Unknown names and other architectures leave the tier as it is
+    CHECK(utf8::use_simd_tier(NULL) == NULL);
+    CHECK(utf8::use_simd_tier("avx") == NULL);
+    CHECK(utf8::use_simd_tier(foreign) == NULL);
+    CHECK(utf8::active_simd_tier() == string("scalar"));
+    // A tier the CPU lacks falls back to the best one below it
+    const char* const best = utf8::use_simd_tier(highest);
+    CHECK(best != NULL && best == string(utf8::active_simd_tier()));
+
+    // Switching tiers while another thread uses the kernels
+    const string text = long_text();
+    bool always_valid = true;
+    thread validating(validate_while_tiers_switch, &text, &always_valid);
+    for (int i = 0; i < 1000; ++i)
+        utf8::use_simd_tier(i % 2 == 0 ? "scalar" : highest);
+    validating.join();
+    CHECK(always_valid);
+    utf8::use_simd_tier(initial.c_str());
+}
+
+//=================================================================================================
+// statistics
+//=================================================================================================
+
+#if defined(UTF8_CPP_STATS)
+bool stats_are(size_t octets, size_t code_points)
+{
+    const utf8::stats counted = utf8::thread_stats();
+    return counted.octets == octets && counted.code_points == code_points &&
+           counted.fast_path_octets <= counted.octets;
+}
+
+void count_in_other_thread(utf8::stats* counted)
+{
+    const string text = "\xc3\xa9t\xc3\xa9";
+    utf8::find_invalid(text.begin(), text.end());
+    *counted = utf8::thread_stats();
+}
+
+void test_stats()
+{
+    const string text = long_text();
+    const char* const first = text.data();
+    const char* const last = first + text.size();
+    const size_t code_points = to_utf32(text).size();
+    const list<char> octets(text.begin(), text.end());
+
+    utf8::reset_thread_stats();
+    CHECK(stats_are(0, 0));
+    CHECK(utf8::find_invalid(first, last) == last);
+    CHECK(stats_are(text.size(), code_points));
+    CHECK(utf8::thread_stats().fast_path_octets == text.size());
+
+    // Octet by octet for generic iterators
+    utf8::reset_thread_stats();
+    utf8::find_invalid(octets.begin(), octets.end());
+    CHECK(stats_are(text.size(), code_points));
+    CHECK(utf8::thread_stats().fast_path_octets == 0);
+
+    utf8::reset_thread_stats();
+    string replaced_text;
+    utf8::replace_invalid(first, last, back_inserter(replaced_text));
+    CHECK(stats_are(text.size(), code_points));
+
+    utf8::reset_thread_stats();
+    const utf16_string utf16 = to_utf16(text);
+    CHECK(stats_are(text.size(), code_points));
+    utf8::reset_thread_stats();
+    utf16_string generic16;
+    utf8::utf8to16(octets.begin(), octets.end(), back_inserter(generic16));
+    CHECK(stats_are(text.size(), code_points));
+    utf8::reset_thread_stats();
+    const utf32_string utf32 = to_utf32(text);
+    CHECK(stats_are(text.size(), code_points));
+
+    // The output of the conversions to UTF-8
+    utf8::reset_thread_stats();
+    string from16;
+    utf8::utf16to8(utf16.begin(), utf16.end(), back_inserter(from16));
+    CHECK(stats_are(text.size(), code_points));
+    utf8::reset_thread_stats();
+    string from32;
+    utf8::utf32to8(utf32.begin(), utf32.end(), back_inserter(from32));
+    CHECK(stats_are(text.size(), code_points));
+
+    // The unchecked algorithms do not count
+    utf8::reset_thread_stats();
+    utf32_string unchecked32;
+    utf8::unchecked::utf8to32(first, last, back_inserter(unchecked32));
+    CHECK(stats_are(0, 0));
+
+    // Failures of validate_next by utf_error
+    utf8::reset_thread_stats();
+    const char* const errors[] = {"\xff", "\xe2\x82", "\xe2\x82z", "\xc0\xaf", "\xed\xa0\x80", "\xc3"};
+    for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); ++i) {
+        const char* it = errors[i];
+        utf8::uint32_t cp = 0;
+        utf8::try_next(it, errors[i] + strlen(errors[i]), cp);
+    }
+    const utf8::stats counted = utf8::thread_stats();
+    CHECK(counted.errors[utf8::UTF8_OK] == 0);
+    CHECK(counted.errors[utf8::NOT_ENOUGH_ROOM] == 2);
+    CHECK(counted.errors[utf8::INVALID_LEAD] == 1);
+    CHECK(counted.errors[utf8::INCOMPLETE_SEQUENCE] == 1);
+    CHECK(counted.errors[utf8::OVERLONG_SEQUENCE] == 1);
+    CHECK(counted.errors[utf8::INVALID_CODE_POINT] == 1);
+    CHECK(stats_are(0, 0));
+
+    // Each thread has its own counters
+    utf8::stats other;
+    thread worker(count_in_other_thread, &other);
+    worker.join();
+    CHECK(other.octets == 5 && other.code_points == 3);
+    CHECK(utf8::thread_stats().octets == 0);
+}
+#endif
+
+void run_tests()
+{
+    test_find_invalid();
+    test_validate_next();
+    test_ascii_runs();
+    test_pointer_conversions();
+    test_convert();
+    test_unchecked_conversions();
+    test_replace_invalid_in_place();
+    test_maximal_subparts();
+    test_replacement_policies();
+    test_container_iterators();
+    test_utf16_runs();
+    test_utf32_runs();
+    test_latin1();
+    test_decoding_iterator();
+    test_distance();
+    test_code_point_index();
+    test_prior_advance();
+    test_truncate();
+    test_ascii_icase();
+    test_case_folding();
+    test_batch();
+    test_parallel();
+#if defined(UTF8_TESTS_MMAP)
+    test_mmap();
+#endif
+    test_decode_view();
+#if defined(UTF8_CPP_RANGES)
+    test_views();
+#endif
+    test_stream_validator();
+    test_validated_buffer();
+    test_stream_replacer();
+    test_stream_utf16to8();
+    test_span_sink();
+    test_append_sink();
+    test_try_api();
+    test_simd_tiers();
+#if defined(UTF8_CPP_STATS)
+    test_stats();
+#endif
+}
+
+} // namespace
+
+int main()
+{
+    const char* const tier_names[] = {"scalar", "sse4.2", "avx2", "avx512", "neon"};
+    const string initial = utf8::active_simd_tier();
+    for (size_t i = 0; i < sizeof(tier_names) / sizeof(tier_names[0]); ++i) {
+        const char* const tier = utf8::use_simd_tier(tier_names[i]);
+        if (tier == NULL || strcmp(tier, tier_names[i]) != 0)
+            continue;
+        const int failures_before = failures;
+        run_tests();
+        printf("%-8s %s\n", tier, failures == failures_before ? "passed" : "FAILED");
+    }
+    utf8::use_simd_tier(initial.c_str());
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}